@@ -0,0 +1,62 @@
+/**
+ * \file audio_pipeline.h
+ * \brief Conversion and encoding of the PCM stream of the VM.
+ *
+ * A pipeline lives as long as the audio session: its resampler, sample
+ * buffer and output frame are allocated once, for the largest chunk the
+ * socket can return, and reused for every chunk. The chunks do not need to
+ * hold whole samples, the bytes of an incomplete one are kept for the next
+ * chunk.
+ *
+ * The S16LE samples of the VM are not decoded, they take the shortest path
+ * to the format of the encoder. At the rate of the VM, they are converted to
+ * floats with the kernels of pcm_convert.h, or copied as is for an S16
+ * encoder, straight into the frame of the encoder; the samples which do not
+ * fill a frame wait in it for the next chunk. An S16 encoder of frames of any
+ * size (PCM) encodes them in place, without a copy. swr only resamples the
+ * other rates.
+ */
+#ifndef __AUDIO_PIPELINE_H_
+#define __AUDIO_PIPELINE_H_
+
+#include <libavcodec/avcodec.h>    // for AVCodecContext
+#include <libavformat/avformat.h>  // for AVFormatContext, AVStream
+
+/** \brief Sample rate of the PCM stream of the VM */
+#define AUDIO_IN_RATE 44100
+/** \brief Number of channels of the PCM stream of the VM */
+#define AUDIO_IN_CHANNELS 2
+/** \brief Bytes of a sample of every channel of the PCM stream of the VM */
+#define AUDIO_BLOCK_ALIGN (AUDIO_IN_CHANNELS * 2)
+/** \brief Max size of a chunk given to audio_pipeline_push() */
+#define AUDIO_CHUNK_SIZE 65536
+/** \brief Default samples per frame of the encoders without a frame size */
+#define AUDIO_FRAME_SAMPLES 1024
+
+struct audio_pipeline;
+
+/** \brief Allocate the pipeline of a session
+ * \param oc Output of the encoded packets, whose header is written
+ * \param st Stream of the packets in oc
+ * \param enc Opened encoder
+ * \param frame_samples Samples per frame of an encoder without a frame size,
+ * 0 for AUDIO_FRAME_SAMPLES
+ * \returns The pipeline, NULL on failure
+ */
+struct audio_pipeline* audio_pipeline_new(AVFormatContext* oc, AVStream* st,
+                                          AVCodecContext* enc, int frame_samples);
+
+/** \brief Convert and encode a chunk of S16LE samples
+ * \param data The chunk, from the socket
+ * \param size Size of the chunk, at most AUDIO_CHUNK_SIZE bytes
+ * \returns 0 on success, a negative AVERROR on failure
+ */
+int audio_pipeline_push(struct audio_pipeline* p, const uint8_t* data, int size);
+
+/** \brief Encode the last partial frame, and the packets delayed by the encoder */
+int audio_pipeline_flush(struct audio_pipeline* p);
+
+/** \brief Free a pipeline, the encoder and the output stay open */
+void audio_pipeline_free(struct audio_pipeline* p);
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * \file audio_sink.h
+ * \brief Outputs of the PCM stream of the VM, encoded or raw.
+ *
+ * A sink takes the S16LE stereo samples of the VM, one period of the jitter
+ * buffer at a time, and writes them as soon as a frame of the encoder is
+ * full: the encoders are opened for frames of AUDIO_SINK_FRAME_MS and the
+ * muxers flush every packet.
+ *
+ * - AUDIO_SINK_FFM feeds an ffserver feed with Vorbis, for the FFmpeg
+ *   releases that still ship ffserver.
+ * - AUDIO_SINK_OGG writes Opus in Ogg pages of a single frame, to a file or
+ *   any URL of FFmpeg (udp://, tcp://...).
+ * - AUDIO_SINK_RTP sends Opus over RTP, whose SDP describes the session.
+ * - AUDIO_SINK_PCM sends the samples of the VM as is to a Unix domain socket,
+ *   without any encoder. When no one listens, the samples are dropped and the
+ *   socket is connected again every AUDIO_SINK_RETRY_MS.
+ * - AUDIO_SINK_FILE writes a file in the format of its extension (.wav,
+ *   .opus, .ogg, .mka...), with the default codec of that format.
+ */
+#ifndef __AUDIO_SINK_H_
+#define __AUDIO_SINK_H_
+
+#include <stdint.h>  // for uint8_t
+
+/** \brief Default duration of the frames of the encoders, in ms */
+#define AUDIO_SINK_FRAME_MS 20
+/** \brief Default bitrate of the encoders, in kb/s */
+#define AUDIO_SINK_BITRATE 64
+/** \brief Time between two connections to the socket of a PCM sink, in ms */
+#define AUDIO_SINK_RETRY_MS 1000
+
+/** \brief Backend of a sink */
+enum audio_sink_type
+{
+    AUDIO_SINK_FFM,
+    AUDIO_SINK_OGG,
+    AUDIO_SINK_RTP,
+    AUDIO_SINK_PCM,
+    AUDIO_SINK_FILE,
+};
+
+/** \brief Settings of a sink */
+struct audio_sink_config
+{
+    int type;
+    /** Destination, the default one of the type if NULL or empty */
+    const char* url;
+    /** Encoder, the default one of the type if NULL or empty */
+    const char* codec;
+    /** Bitrate of the encoder, in kb/s */
+    int bitrate;
+    /** Duration of the frames of the encoder, in ms */
+    int frame_ms;
+    /** File where the SDP of an RTP sink is written, may be NULL */
+    const char* sdp_file;
+};
+
+struct audio_sink;
+
+/** \brief Parse a sink name (ffm, ogg, rtp, pcm or file), -1 if unknown */
+int audio_sink_from_name(const char* name);
+
+/** \brief Name of a sink type, for logging */
+const char* audio_sink_name(int type);
+
+/** \brief Default destination of a sink type */
+const char* audio_sink_default_url(int type);
+
+/** \brief Open a sink and write its header
+ * \returns The sink, NULL on failure
+ */
+struct audio_sink* audio_sink_open(const struct audio_sink_config* config);
+
+/** \brief Write samples of the VM
+ * \param data S16LE stereo samples at AUDIO_IN_RATE
+ * \param size Size of the samples, at most AUDIO_CHUNK_SIZE bytes, whole samples for
+ * AUDIO_SINK_PCM
+ * \returns 0 on success, a negative AVERROR if the sink cannot go on
+ */
+int audio_sink_write(struct audio_sink* sink, const uint8_t* data, int size);
+
+/** \brief Write the samples still in the encoder and the trailer, and free the sink
+ * \returns 0 on success, a negative AVERROR on failure
+ */
+int audio_sink_close(struct audio_sink* sink);
+
+#endif
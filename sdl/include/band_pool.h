@@ -0,0 +1,45 @@
+/**
+ * \file band_pool.h
+ * \brief Small pool of threads processing the horizontal bands of an image.
+ *
+ * band_pool_run() splits the rows of an image into one band per thread of
+ * the pool and returns once every band is processed. The calling thread
+ * processes the first band itself, so a pool of one thread runs the function
+ * inline, without any synchronization.
+ */
+#ifndef __BAND_POOL_H_
+#define __BAND_POOL_H_
+
+/** \brief Max number of threads of a pool */
+#define BAND_POOL_MAX 16
+/** \brief Max number of threads picked by default, conversions do not scale further */
+#define BAND_POOL_DEFAULT_MAX 4
+
+/** \brief Process the rows [y0, y1) of an image */
+typedef void (*band_fn)(void* arg, int y0, int y1);
+
+struct band_pool;
+
+/** \brief Start a pool
+ * \param threads Number of threads, the caller included; 0 for one per core,
+ * up to BAND_POOL_DEFAULT_MAX
+ * \returns The pool, NULL on failure
+ */
+struct band_pool* band_pool_new(int threads);
+
+/** \brief Number of threads of a pool, the caller included */
+int band_pool_threads(const struct band_pool* pool);
+
+/** \brief Run fn on every band of rows rows, and wait for all of them
+ * \param pool The pool, used by a single caller at a time
+ * \param fn Function called once per non-empty band
+ * \param arg Argument of fn
+ * \param rows Number of rows of the image
+ * \param align The first row of each band is a multiple of align
+ */
+void band_pool_run(struct band_pool* pool, band_fn fn, void* arg, int rows, int align);
+
+/** \brief Stop the threads of a pool and free it */
+void band_pool_free(struct band_pool* pool);
+
+#endif
@@ -0,0 +1,63 @@
+/**
+ * \file byte_ring.h
+ * \brief Lock-free single-producer single-consumer ring of bytes.
+ *
+ * The buffer of a ring is allocated once. The producer and the consumer each
+ * own one end of it and never wait for each other: when the ring is full, a
+ * write is dropped as a whole, so that a producer reading a socket keeps
+ * reading it whatever the consumer does. Writes are never split, the
+ * consumer gets every record of the stream or none of it, whole samples for
+ * instance.
+ *
+ * byte_ring_stats() reports the bytes written and dropped, and the high
+ * water mark of the ring, to size it.
+ */
+#ifndef __BYTE_RING_H_
+#define __BYTE_RING_H_
+
+#include <stdint.h>  // for uint8_t, uint64_t
+
+/** \brief Counters of a ring */
+struct byte_ring_stats
+{
+    int capacity;
+    /** Bytes queued now, and the most queued at once */
+    int level;
+    int high_water;
+    uint64_t written_bytes;
+    /** Writes dropped because the ring was full, and their bytes */
+    uint64_t drops;
+    uint64_t dropped_bytes;
+};
+
+struct byte_ring;
+
+/** \brief Allocate a ring
+ * \param capacity Size of the ring, in bytes
+ * \returns The ring, NULL on failure
+ */
+struct byte_ring* byte_ring_new(int capacity);
+
+/** \brief Queue bytes, from the producer
+ * \returns 0 if the bytes are queued, -1 if they are dropped because the ring is full
+ */
+int byte_ring_write(struct byte_ring* ring, const uint8_t* data, int size);
+
+/** \brief Tell the consumer that nothing more is written, from the producer */
+void byte_ring_close(struct byte_ring* ring);
+
+/** \brief Take queued bytes, from the consumer
+ * \returns The number of bytes copied to out, up to size, 0 if the ring is empty
+ */
+int byte_ring_read(struct byte_ring* ring, uint8_t* out, int size);
+
+/** \brief Check if the ring is closed and every byte of it read, from the consumer */
+int byte_ring_eof(struct byte_ring* ring);
+
+/** \brief Get the counters of a ring, from any thread */
+void byte_ring_stats(struct byte_ring* ring, struct byte_ring_stats* stats);
+
+/** \brief Free a ring, once both threads are done with it */
+void byte_ring_free(struct byte_ring* ring);
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * \file change_detect.h
+ * \brief Detection of the changes of a window between two captures of a recording.
+ *
+ * Two methods are available:
+ *  - hash: every capture is cut into tiles of CHANGE_TILE x CHANGE_TILE
+ *    pixels, and a capture is a change if the hash of one of its tiles
+ *    differs from the previous capture. The window is still grabbed on each
+ *    tick, but unchanged frames are neither converted nor encoded.
+ *  - damage: the X server reports the areas drawn in the window (XDamage
+ *    extension, if found at build time), and the window is not even grabbed
+ *    while nothing was drawn. Content drawn by direct rendering clients may
+ *    not be reported by every X server.
+ */
+#ifndef __CHANGE_DETECT_H_
+#define __CHANGE_DETECT_H_
+
+#include <X11/Xlib.h>  // for Display, Drawable, XImage
+#include <stdint.h>    // for uint64_t
+
+#ifdef HAVE_XDAMAGE
+#include <X11/extensions/Xdamage.h>  // for Damage
+#endif
+
+/** \brief Side of the tiles compared by the hash method, in pixels */
+#define CHANGE_TILE 64
+
+/** \brief Detection methods */
+enum change_mode
+{
+    /** Every capture is a change */
+    CHANGE_NONE,
+    /** Compare the hashes of the tiles of the captures */
+    CHANGE_HASH,
+    /** Ask the X server whether the window was drawn */
+    CHANGE_DAMAGE
+};
+
+/** \brief State of the detection for one window */
+struct change_detect
+{
+    int mode;
+    Display* display;
+    Drawable drawable;
+    /** Number of tiles of the window */
+    int tiles_x;
+    int tiles_y;
+    /** Hash of each tile in the last capture */
+    uint64_t* hashes;
+    /** Hashes of the row of tiles being computed */
+    uint64_t* row;
+    /** Set until the first capture */
+    int first;
+    /** Number of tiles which changed in the last capture */
+    int changed_tiles;
+#ifdef HAVE_XDAMAGE
+    Damage damage;
+    int damage_event;
+#endif
+};
+
+/** \brief Parse a method name (none, hash, damage), -1 if unknown */
+int change_mode_from_name(const char* name);
+
+/** \brief Name of a method, for logging */
+const char* change_mode_name(int mode);
+
+/** \brief Prepare the detection of the changes of a window
+ *
+ * Falls back to the hash method if damage is not supported.
+ * \returns 0 on success, -1 on failure
+ */
+int change_detect_init(struct change_detect* cd, int mode, Display* display, Drawable drawable,
+                       int width, int height);
+
+/** \brief Whether the window may have changed since the last call, before grabbing it
+ *
+ * Always true except for the damage method.
+ */
+int change_detect_pending(struct change_detect* cd);
+
+/** \brief Whether a capture differs from the previous one
+ *
+ * Always true except for the hash method, which remembers the tiles of \p image.
+ */
+int change_detect_image(struct change_detect* cd, XImage* image);
+
+/** \brief Release the resources of the detection */
+void change_detect_destroy(struct change_detect* cd);
+
+#endif
@@ -11,6 +11,13 @@
  */
 char* configvar_string(char* varname);
 
+/** \brief Get the value of an optional config variable from the env
+ * \param varname Name of the env variable
+ * \param def Value to use if the variable is unset or empty
+ * \returns A buffer containing the variable, or \p def
+ */
+char* configvar_string_default(char* varname, char* def);
+
 /** \brief Get the value of a integer config variable from the env
  * \param varname Name of the env variable
  * \returns The value of the variable
@@ -24,4 +31,11 @@ int configvar_int(char* varname);
  */
 int configvar_bool(char* varname);
 
+/** \brief Get the value of an optional integer config variable from the env
+ * \param varname Name of the env variable
+ * \param def Value to use if the variable is unset or empty
+ * \returns The value of the variable, or \p def
+ */
+int configvar_int_default(char* varname, int def);
+
 #endif
@@ -0,0 +1,123 @@
+/**
+ * \file frame_ring.h
+ * \brief Bounded queue of pre-allocated AVFrames between two stages of the recorder.
+ *
+ * A ring owns a fixed set of frames, allocated once, which cycle between a
+ * producer and a consumer thread:
+ *
+ *     producer: frame_ring_acquire() -> fill -> frame_ring_publish()
+ *     consumer: frame_ring_pop() -> use -> frame_ring_release()
+ *
+ * Free and published frames are kept in two lock-free queues; the threads
+ * only sleep (on a semaphore) when they have nothing to do. When every frame
+ * is in use, the producer either waits for the consumer (FRAME_RING_BLOCK)
+ * or takes back the oldest published frame (FRAME_RING_DROP_OLDEST), so that
+ * a slow consumer never stalls it.
+ *
+ * The buffers of the frames come from a pool and are reference counted: a
+ * consumer, or an encoder, may keep a reference to a frame after releasing
+ * it. frame_ring_make_writable() then gives the frame another buffer of the
+ * pool instead of copying it, and the buffer returns to the pool with its
+ * last reference. Once the pool holds as many buffers as the frames in
+ * flight, the ring allocates nothing more; frame_ring_allocations() counts
+ * the buffers actually allocated.
+ */
+#ifndef __FRAME_RING_H_
+#define __FRAME_RING_H_
+
+#include <libavutil/frame.h>   // for AVFrame
+#include <libavutil/pixfmt.h>  // for AVPixelFormat
+#include <stdint.h>            // for uint64_t
+
+/** \brief Max number of frames in a ring */
+#define FRAME_RING_MAX 64
+
+/** \brief What the producer does when every frame of the ring is in use */
+enum frame_ring_policy
+{
+    /** Wait for the consumer to release a frame */
+    FRAME_RING_BLOCK,
+    /** Reuse the oldest frame not yet consumed, and count it as dropped */
+    FRAME_RING_DROP_OLDEST
+};
+
+struct frame_ring;
+
+/** \brief Parse a policy name (block, drop), -1 if unknown */
+int frame_ring_policy_from_name(const char* name);
+
+/** \brief Name of a policy, for logging */
+const char* frame_ring_policy_name(int policy);
+
+/** \brief Allocate a ring and its frames
+ * \param name Name of the ring, for logging
+ * \param size Number of frames, from 2 to FRAME_RING_MAX
+ * \param policy enum frame_ring_policy
+ * \param format Pixel format of the frames
+ * \param width Width of the frames
+ * \param height Height of the frames
+ * \returns The ring, NULL on failure
+ */
+struct frame_ring* frame_ring_new(const char* name, int size, int policy,
+                                  enum AVPixelFormat format, int width, int height);
+
+/** \brief Take a frame to fill, for the producer
+ *
+ * Waits, or drops the oldest published frame, according to the policy.
+ * \returns The frame, NULL if the ring is closed
+ */
+AVFrame* frame_ring_acquire(struct frame_ring* ring);
+
+/** \brief Make sure a frame acquired by the producer can be overwritten
+ *
+ * Gives the frame a buffer of the pool if its buffer is still referenced
+ * elsewhere, or if its size is not the size of the ring. The content of the
+ * frame, and its other fields, are then lost.
+ * \returns 0 on success, a negative AVERROR on failure
+ */
+int frame_ring_make_writable(struct frame_ring* ring, AVFrame* frame);
+
+/** \brief Change the size of the frames, for the producer
+ *
+ * The frames get buffers of the new size from frame_ring_make_writable();
+ * the buffers of the old size are freed with their last reference. This is
+ * for a ring whose consumer follows the size of each frame, like the snapshot
+ * encoder: a video encoder has a fixed size, so its recording restarts with
+ * new rings instead.
+ * \returns 0 on success, -1 on failure
+ */
+int frame_ring_resize(struct frame_ring* ring, int width, int height);
+
+/** \brief Hand a frame filled by the producer to the consumer */
+void frame_ring_publish(struct frame_ring* ring, AVFrame* frame);
+
+/** \brief Wait for the next published frame, for the consumer
+ * \returns The oldest published frame, NULL once the ring is closed and empty
+ */
+AVFrame* frame_ring_pop(struct frame_ring* ring);
+
+/** \brief Give a frame used by the consumer back to the producer */
+void frame_ring_release(struct frame_ring* ring, AVFrame* frame);
+
+/** \brief Signal the end of the stream
+ *
+ * The consumer still gets the frames published before, then NULL.
+ */
+void frame_ring_close(struct frame_ring* ring);
+
+/** \brief Number of published frames dropped by the producer */
+uint64_t frame_ring_dropped(const struct frame_ring* ring);
+
+/** \brief Number of times the producer had to wait for a free frame */
+uint64_t frame_ring_waits(const struct frame_ring* ring);
+
+/** \brief Number of frame buffers allocated by a ring, those of its frames included */
+uint64_t frame_ring_allocations(const struct frame_ring* ring);
+
+/** \brief Number of frame buffers allocated by every ring of the process */
+uint64_t frame_ring_total_allocations(void);
+
+/** \brief Log the counters of a ring and free it with its frames */
+void frame_ring_free(struct frame_ring* ring);
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * \file gl_capture.h
+ * \brief Capture files of the OpenGL streams, for offline replay.
+ *
+ * A capture file holds both directions of one relayed connection. It starts
+ * with a gl_capture_header, followed by records made of a gl_capture_record
+ * and the bytes of one read. All the integers are in host byte order.
+ */
+#ifndef __GL_CAPTURE_H_
+#define __GL_CAPTURE_H_
+
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint32_t, uint64_t
+#include <stdio.h>   // for FILE
+
+/** \brief Magic string at the start of a capture file */
+#define GL_CAPTURE_MAGIC "AICGLCAP"
+/** \brief Version of the capture format */
+#define GL_CAPTURE_VERSION 1
+/** \brief Size of the stdio buffer of a capture file */
+#define GL_CAPTURE_BUFFER_SIZE (1024 * 1024)
+
+/** \brief Direction of a captured read */
+enum gl_capture_direction
+{
+    /** Read from the VM, written to the render libs */
+    GL_CAPTURE_TO_RENDER,
+    /** Read from the render libs, written to the VM */
+    GL_CAPTURE_TO_VM
+};
+
+/** \brief Header of a capture file */
+struct gl_capture_header
+{
+    /** GL_CAPTURE_MAGIC, without the terminating nul */
+    char magic[8];
+    /** GL_CAPTURE_VERSION */
+    uint32_t version;
+    /** Reserved, 0 */
+    uint32_t flags;
+};
+
+/** \brief Header of one captured read */
+struct gl_capture_record
+{
+    /** CLOCK_MONOTONIC time of the read, shared by the files of one session */
+    uint64_t timestamp_ns;
+    /** enum gl_capture_direction */
+    uint32_t direction;
+    /** Number of bytes following the record header */
+    uint32_t length;
+};
+
+/** \brief Open a new capture file
+ * \param dir Directory of the capture files
+ * \param reactor Relay thread of the connection
+ * \param conn Number of the connection in its relay thread
+ * \returns The open file, NULL on failure
+ */
+FILE* gl_capture_open(const char* dir, int reactor, unsigned int conn);
+
+/** \brief Append one read to a capture file
+ * \returns 0 on success, -1 on failure
+ */
+int gl_capture_write(FILE* f, int direction, const char* data, size_t len, uint64_t timestamp_ns);
+
+/** \brief Check the header of a capture file open for reading
+ * \returns 0 if the file is a capture file, -1 otherwise
+ */
+int gl_capture_check(FILE* f);
+
+/** \brief Read the next record header of a capture file
+ * \returns 1 if a record was read, 0 at the end of the file, -1 on failure
+ */
+int gl_capture_next(FILE* f, struct gl_capture_record* record);
+
+#endif
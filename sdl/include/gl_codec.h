@@ -0,0 +1,97 @@
+/**
+ * \file gl_codec.h
+ * \brief Framed compression of the OpenGL streams between the VM and the player.
+ *
+ * On a compressed connection, both directions of the VM leg carry a sequence
+ * of frames: a gl_codec_header followed by comp_len bytes. Each frame holds at
+ * most GL_CODEC_FRAME_SIZE bytes of the GLES stream, compressed independently
+ * with LZ4; frames that do not shrink are stored as is (comp_len == raw_len).
+ * The leg between the relay and the render libs stays uncompressed.
+ *
+ * The codec is negotiated on MAIN_PORT, right after OPENGL_START_COMMAND
+ * (see host_gl.h).
+ */
+#ifndef __GL_CODEC_H_
+#define __GL_CODEC_H_
+
+#include <stddef.h>     // for size_t
+#include <stdint.h>     // for uint32_t, uint64_t
+#include <sys/types.h>  // for ssize_t
+
+/** \brief Max number of bytes of the GLES stream in one frame */
+#define GL_CODEC_FRAME_SIZE (64 * 1024)
+/** \brief Size of the buffer of compressed bytes read from the VM, per connection */
+#define GL_CODEC_INPUT_SIZE (256 * 1024)
+
+/** \brief Compression of a connection */
+enum gl_codec
+{
+    /** Plain GLES stream */
+    GL_CODEC_NONE,
+    /** LZ4 frames */
+    GL_CODEC_LZ4
+};
+
+/** \brief Header of a frame, in network byte order */
+struct gl_codec_header
+{
+    /** Number of bytes of the GLES stream, in [1, GL_CODEC_FRAME_SIZE] */
+    uint32_t raw_len;
+    /** Number of bytes following the header, in [1, raw_len] */
+    uint32_t comp_len;
+};
+
+/** \brief State of the decoding of the frames read from one socket */
+struct gl_decoder
+{
+    /** Compressed bytes read from the socket */
+    char in[GL_CODEC_INPUT_SIZE];
+    /** Number of bytes in the input buffer */
+    size_t in_len;
+    /** Offset of the first input byte not decoded yet */
+    size_t in_off;
+    /** Time of the read of the input buffer */
+    uint64_t read_ns;
+    /** Frame split across two reads, reassembled before decoding */
+    char frame[sizeof(struct gl_codec_header) + GL_CODEC_FRAME_SIZE];
+    /** Number of bytes of the reassembled frame */
+    size_t frame_len;
+};
+
+/** \brief Parse a codec name ("none" or "lz4")
+ * \returns The codec, GL_CODEC_NONE if the name is unknown
+ */
+int gl_codec_from_name(const char* name);
+
+/** \brief Name of a codec, for logging */
+const char* gl_codec_name(int codec);
+
+/** \brief Check if the player was built with a codec
+ * \returns 1 if \p codec can be used, 0 otherwise
+ */
+int gl_codec_available(int codec);
+
+/** \brief Max size of the frames encoding \p len bytes */
+size_t gl_codec_encode_bound(size_t len);
+
+/** \brief Split \p len bytes into frames and compress them
+ * \param out Buffer of at least gl_codec_encode_bound(len) bytes
+ * \returns The number of bytes written to \p out
+ */
+size_t gl_codec_encode(const char* in, size_t len, char* out);
+
+/** \brief Allocate the state of a new decoding */
+struct gl_decoder* gl_decoder_new(void);
+
+/** \brief Decode the frames of the input buffer
+ * \param d The decoder, whose input buffer holds in_len - in_off undecoded bytes
+ * \param out Output buffer, at least GL_CODEC_FRAME_SIZE bytes
+ * \param out_cap Size of the output buffer
+ * \returns The number of bytes written to \p out, -1 if the stream is corrupted
+ *
+ * Decoding stops when the input is exhausted or when the next frame does not
+ * fit in the output buffer; the remaining bytes are decoded by the next call.
+ */
+ssize_t gl_decode(struct gl_decoder* d, char* out, size_t out_cap);
+
+#endif
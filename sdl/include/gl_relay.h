@@ -0,0 +1,139 @@
+/**
+ * \file gl_relay.h
+ * \brief Event-driven byte relay between the VM and the local render libs.
+ *
+ * A small, fixed set of relay threads owns every OpenGL connection. Each
+ * thread waits on an epoll set in edge-triggered mode and shares a single
+ * read buffer between all its connections, so the number of threads and the
+ * memory used stay the same whatever the number of GL streams opened by the
+ * guest.
+ */
+#ifndef __GL_RELAY_H_
+#define __GL_RELAY_H_
+
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint64_t
+#include <stdio.h>   // for FILE
+
+#include "gl_codec.h"
+#include "gl_stats.h"
+
+/** \brief Default number of relay threads */
+#define GL_RELAY_THREADS 1
+/** \brief Max number of relay threads */
+#define GL_RELAY_MAX_THREADS 16
+/** \brief Max number of events handled per epoll_wait() call */
+#define GL_RELAY_MAX_EVENTS 64
+/** \brief Capacity requested for the pipes of the splice mode */
+#define GL_RELAY_PIPE_SIZE (1024 * 1024)
+
+/** \brief How bytes are moved between the two ends of a connection */
+enum gl_relay_mode
+{
+    /** read() into the relay buffer, then write() to the peer */
+    GL_RELAY_COPY,
+    /** splice() through a pipe, the bytes never reach userspace */
+    GL_RELAY_SPLICE
+};
+
+struct conn_duo;
+struct gl_reactor;
+
+/** \brief One end of a relayed connection */
+struct conn_end
+{
+    /** Socket of this end */
+    int fd;
+    /** Bytes read from the peer which this end did not accept yet */
+    char* pending;
+    /** Size of the pending buffer */
+    size_t pending_len;
+    /** Offset of the first byte of pending not written yet */
+    size_t pending_off;
+    /** Pipe holding the bytes read from the peer (splice mode) */
+    int pipe[2];
+    /** Number of bytes in the pipe not written yet */
+    size_t pipe_len;
+    /** Set when reads are paused until the peer drains its pending bytes */
+    int stalled;
+    /** Time of the read of the pending bytes */
+    uint64_t pending_read_ns;
+    /** Time the pending bytes were first refused */
+    uint64_t stall_since_ns;
+    /** Decoding of the frames read from this end, NULL if it is not compressed */
+    struct gl_decoder* decoder;
+    /** Counters of the bytes read from this end */
+    struct gl_dir_stats stats;
+    /** The other end of the connection */
+    struct conn_end* peer;
+    /** The connection this end belongs to */
+    struct conn_duo* duo;
+};
+
+/** \brief Data structure to hold the two connections */
+struct conn_duo
+{
+    /** End connected to the render libs locally */
+    struct conn_end local;
+    /** End connected to the VM */
+    struct conn_end host;
+    /** Relay thread owning the connection */
+    struct gl_reactor* reactor;
+    /** Copy mode of the connection (enum gl_relay_mode) */
+    int mode;
+    /** Compression of the host end (enum gl_codec) */
+    int codec;
+    /** Number of the connection, for logging */
+    unsigned int id;
+    /** Capture file of both directions, NULL if not capturing */
+    FILE* capture;
+    /** Previous open connection of the relay thread */
+    struct conn_duo* prev;
+    /** Next open connection of the relay thread */
+    struct conn_duo* next;
+    /** Set once the sockets are closed, the struct is freed after the event batch */
+    int closed;
+    /** Next closed connection waiting to be freed */
+    struct conn_duo* next_closed;
+};
+
+/** \brief Start the relay threads
+ * \param nthreads Number of relay threads (clamped to [1, GL_RELAY_MAX_THREADS])
+ * \param mode Copy mode of new connections (enum gl_relay_mode)
+ * \param stats_interval Seconds between two logs of the counters, 0 to disable
+ * \returns 0 on success, -1 if no thread could be started
+ *
+ * In splice mode, a connection falls back to the copy mode if its pipes
+ * cannot be created or if the kernel refuses to splice its sockets.
+ *
+ * On SIGUSR1, every relay thread logs its counters along with the counters
+ * of each of its open connections.
+ */
+int gl_relay_start(int nthreads, int mode, int stats_interval);
+
+/** \brief Capture the streams of the new connections to a directory
+ * \param dir Directory of the capture files (see gl_capture.h), NULL to disable
+ *
+ * Must be called before gl_relay_start(). The bytes have to go through
+ * userspace to be captured, so captured connections use the copy mode.
+ */
+void gl_relay_set_capture_dir(const char* dir);
+
+/** \brief Parse a copy mode name ("copy" or "splice")
+ * \returns The mode, GL_RELAY_COPY if the name is unknown
+ */
+int gl_relay_mode_from_name(const char* name);
+
+/** \brief Hand a new pair of connected sockets to a relay thread
+ * \param local_socket Socket connected to the render libs
+ * \param host_socket Socket connected to the VM
+ * \param codec Compression of the host socket (enum gl_codec, see gl_codec.h)
+ * \returns 0 on success, -1 on failure (both sockets are closed)
+ *
+ * The sockets are switched to non-blocking mode and belong to the relay
+ * from then on. Compressed connections use the copy mode, as their bytes
+ * have to be transformed in userspace.
+ */
+int gl_relay_add(int local_socket, int host_socket, int codec);
+
+#endif
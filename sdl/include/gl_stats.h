@@ -0,0 +1,79 @@
+/**
+ * \file gl_stats.h
+ * \brief Throughput and latency counters of the OpenGL relay.
+ *
+ * Counters are owned by the relay thread of the connection they describe:
+ * they are plain integers updated without locks or atomics, and they are
+ * only read by that same thread when it logs them.
+ */
+#ifndef __GL_STATS_H_
+#define __GL_STATS_H_
+
+#include <stdint.h>  // for uint64_t
+#include <time.h>    // for clock_gettime, CLOCK_MONOTONIC
+
+/** \brief Number of read size buckets, bucket i counts reads of [2^i, 2^(i+1)) bytes */
+#define GL_STATS_BUCKETS 24
+
+/** \brief Counters of one direction of a connection */
+struct gl_dir_stats
+{
+    /** Bytes read from the source */
+    uint64_t bytes;
+    /** Number of reads */
+    uint64_t reads;
+    /** Histogram of the read sizes (log2 buckets) */
+    uint64_t read_sizes[GL_STATS_BUCKETS];
+    /** Number of reads the destination did not accept at once */
+    uint64_t stalls;
+    /** Time spent waiting for the destination to accept stalled reads */
+    uint64_t stall_ns;
+    /** Number of reads fully written to the destination */
+    uint64_t delivered;
+    /** Total time between a read and the write of its last byte */
+    uint64_t latency_ns;
+    /** Max time between a read and the write of its last byte */
+    uint64_t latency_max_ns;
+    /** Bytes after compression or decompression, 0 if the connection is not compressed */
+    uint64_t coded_bytes;
+};
+
+/** \brief Monotonic timestamp in nanoseconds */
+static inline uint64_t gl_stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** \brief Account for one read of \p size bytes */
+static inline void gl_stats_read(struct gl_dir_stats* stats, uint64_t size)
+{
+    int bucket = 63 - __builtin_clzll(size | 1);
+    if (bucket >= GL_STATS_BUCKETS)
+        bucket = GL_STATS_BUCKETS - 1;
+    stats->bytes += size;
+    stats->reads++;
+    stats->read_sizes[bucket]++;
+}
+
+/** \brief Account for the last byte of a read written at \p now */
+static inline void gl_stats_delivered(struct gl_dir_stats* stats, uint64_t read_ns, uint64_t now)
+{
+    uint64_t latency = now - read_ns;
+    stats->delivered++;
+    stats->latency_ns += latency;
+    if (latency > stats->latency_max_ns)
+        stats->latency_max_ns = latency;
+}
+
+/** \brief Add the counters of \p from to \p to */
+void gl_stats_merge(struct gl_dir_stats* to, const struct gl_dir_stats* from);
+
+/** \brief Log the counters of one direction
+ * \param prefix Text identifying the direction in the log
+ * \param stats The counters
+ */
+void gl_stats_log(const char* prefix, const struct gl_dir_stats* stats);
+
+#endif
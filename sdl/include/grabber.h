@@ -9,13 +9,15 @@
 #ifndef __GRABBER_H_
 #define __GRABBER_H_
 
-#include <libavformat/avformat.h>  // for AVStream
+#include <libavcodec/avcodec.h>    // for AVCodecContext
+#include <libavformat/avformat.h>  // for AVOutputFormat
 #include <libavutil/frame.h>       // for AVFrame
 #include <libswscale/swscale.h>    // for SWS_BICUBIC
 #include <pthread.h>               // for pthread_mutex_t, pthread_cond_t
 #include <stdint.h>                // for uint8_t
 #include <X11/Xlib.h>
 #include "buffer_sizes.h"          // for BUF_SIZE
+#include "record_profile.h"        // for record_profile
 #include "socket.h"                // for socket_t
 
 /** \brief Port open on the VM */
@@ -23,23 +25,15 @@
 
 /** \brief Frames to record per second */
 #define STREAM_DURATION 60.0
-/** \brief FPS of the stream */
+/** \brief Default FPS of the stream */
 #define STREAM_FRAME_RATE 60
+/** \brief Max FPS of the stream */
+#define STREAM_FRAME_RATE_MAX 120
 /** \brief Pixel format of the stream (yuv420p) */
 #define STREAM_PIX_FMT AV_PIX_FMT_YUV420P
 
 #define SCALE_FLAGS SWS_BICUBIC
 
-//// ################################################################################
-#define CLIP(X) ((X) > 255 ? 255 : (X) < 0 ? 0 : X)
-
-// RGB -> YUV
-#define RGB2Y(R, G, B) CLIP(((66 * (R) + 129 * (G) + 25 * (B) + 128) >> 8) + 16)
-#define RGB2U(R, G, B) CLIP(((-38 * (R) -74 * (G) + 112 * (B) + 128) >> 8) + 128)
-#define RGB2V(R, G, B) CLIP(((112 * (R) -94 * (G) -18 * (B) + 128) >> 8) + 128)
-
-//// ################################################################################
-
 /**
  * \brief Shared structure between recv thread and grabber thread
  */
@@ -61,20 +55,33 @@ typedef struct thread_args
 {
     pthread_mutex_t mtx;
     char record_filename[BUF_SIZE];
+    /** Encoder settings of the recording */
+    struct record_profile profile;
 } s_thread_args;
 
+/** \brief Queue a snapshot of the window, written by the snapshot worker
+ *
+ * The extension of the file name gives its format (bmp, png, jpg), the
+ * AIC_PLAYER_SNAP_FORMAT extension is added if it has none.
+ */
 void grab_snapshot(char* snap_filename);
 
-/** \brief A wrapper around a single output AVStream */
+/** \brief Queue a burst of count snapshots, taken every interval_ms */
+void grab_snapshot_burst(const char* snap_filename, int count, int interval_ms);
+
+/** \brief A wrapper around the video encoder of a recording */
 typedef struct OutputStream
 {
-    AVStream* st;
+    /* encoder, independent from the outputs of its packets */
+    AVCodecContext* enc;
 
     /* pts of the next frame that will be generated */
     int64_t next_pts;
+    /* frames per second targeted by the capture, and time base of the stream */
+    int frame_rate;
     int samples_count;
 
-    AVFrame* frame;
+    /* YUV420P picture converted to the codec pixel format, if needed */
     AVFrame* tmp_frame;
 
     float t, tincr, tincr2;
@@ -90,6 +97,25 @@ typedef struct OutputStream
 */
 int ffmpeg_grabber(void* arg);
 
+/** \brief Start the background recording of the last AIC_PLAYER_REPLAY_SECONDS seconds
+ *
+ * Does nothing if AIC_PLAYER_REPLAY_SECONDS is not set. The recordingPayload
+ * messages with a file name starting with "replay" save the buffer to that file.
+ * A rotation empties the buffer and restarts the recording at the new size.
+ */
+void grabber_start_replay(void);
+
+/** \brief Start the live stream of the window to AIC_PLAYER_STREAM_URL
+ *
+ * Does nothing if AIC_PLAYER_STREAM_URL is not set. The stream is restarted
+ * whenever its reader leaves, until the end of the player, and at the new size
+ * of the window after a rotation.
+ */
+void grabber_start_stream(void);
+
+/** \brief Capture the window to a BGR24 image
+ * \returns The image, reused by the next call
+ */
 unsigned char* xgrabber();
 
 /**
@@ -105,6 +131,15 @@ void* grab_handler_amqp(void* args);
  */
 void grabber_set_path_results(char* results);
 
+/** \brief Set the size of the window after a rotation
+ *
+ * The next recordings have this size, and the next snapshots get frames of
+ * this size from their pool. The replay recording and the live stream restart
+ * at this size. The other recordings in progress keep their size, and only
+ * capture the part of the window inside it.
+ */
+void grabber_resize(int width, int height);
+
 /** \brief Set the static X display pointer
  * \param display the X display pointer
  */
@@ -10,16 +10,19 @@
 /** \brief Port used for OpenGL marshalling transfer */
 #define OPENGL_DATA_PORT 22468
 
-/** \brief Data structure to hold the two connections */
-struct conn_duo
-{
-    /** Socket connected to the render libs locally */
-    int local_socket;
-    /** Socket connected to the VM */
-    int host_socket;
-};
-
-/** \brief Max size of opengl reads */
+/** \brief Default number of connections kept dialled ahead of the VM requests */
+#define GL_POOL_SIZE 1
+/** \brief Max number of connections kept dialled ahead of the VM requests */
+#define GL_POOL_MAX_SIZE 16
+/** \brief First delay before dialling again after a failed connect() */
+#define GL_DIAL_MIN_BACKOFF_MS 100
+/** \brief Max delay before dialling again after a failed connect() */
+#define GL_DIAL_MAX_BACKOFF_MS 5000
+
+/** \brief Size of the address of the render libs returned by initOpenGLRenderer() */
+#define GL_RENDER_ADDR_SIZE 256
+
+/** \brief Max size of opengl reads (one buffer per relay thread) */
 #define BUFF_SIZE (4 * 1024 * 1024)
 
 /** \brief Command sent to initiate the remote graphics exchange */
@@ -28,6 +31,12 @@ struct conn_duo
 #define OPENGL_PING 1002
 /** \brief Reply to make tell the VM we’re still alive */
 #define OPENGL_PONG 1003
+/** \brief Command offering to compress the data connections, followed by an enum gl_codec */
+#define OPENGL_CODEC_OFFER 1004
+/** \brief Reply of the VM to OPENGL_CODEC_OFFER, followed by the codec it accepts */
+#define OPENGL_CODEC_ACK 1005
+/** \brief Delay after which the VM is assumed not to support compression */
+#define GL_CODEC_HANDSHAKE_TIMEOUT_MS 2000
 
 /** \brief Manage the remote OpenGL to the VM
  * \param arg Virtual Machine IP (char*)
@@ -38,7 +47,31 @@ struct conn_duo
  * AOSP on the DATA_PORT, with proxies on both ends in
  * order to listen() on the VM side and not on the Player
  * side.
+ *
+ * The connections are handed to the relay threads (see gl_relay.h), whose
+ * number is read from AIC_PLAYER_GL_RELAY_THREADS and copy mode from
+ * AIC_PLAYER_GL_RELAY_MODE.
+ *
+ * AIC_PLAYER_GL_POOL_SIZE pairs of connections (VM side and render side)
+ * are kept dialled and relayed ahead of time; each time the VM takes one
+ * for a new GL context, another pair is dialled in the background.
+ *
+ * When AIC_PLAYER_GL_COMPRESSION names a codec (see gl_codec.h), it is
+ * offered to the VM with OPENGL_CODEC_OFFER right after OPENGL_START_COMMAND.
+ * The data connections are compressed only if the VM acknowledges the offer
+ * within GL_CODEC_HANDSHAKE_TIMEOUT_MS.
+ *
+ * The render libs are reached on 127.0.0.1:OPENGL_DATA_PORT, unless
+ * gl_set_render_socket() was called first.
  */
 int manage_socket_gl(void* arg);
 
+/** \brief Reach the render libs through a Unix domain socket
+ * \param path Path of the socket the render libs listen on (STREAM_MODE_UNIX)
+ *
+ * The local leg of the GL connections then skips the TCP/IP stack. Must be
+ * called before manage_socket_gl().
+ */
+void gl_set_render_socket(const char* path);
+
 #endif
@@ -0,0 +1,93 @@
+/**
+ * \file jitter_buffer.h
+ * \brief Adaptive jitter buffer between the PCM socket of the VM and the encoder.
+ *
+ * The network delivers the PCM stream in bursts, the encoder takes it at the
+ * pace of a clock: jitter_buffer_write() queues whatever arrived and
+ * jitter_buffer_read() hands out one period at a time.
+ *
+ * Playback starts once the buffer holds the target latency. When a period
+ * is late (underrun), the missing samples are replaced by silence and the
+ * target grows by one step, up to half the max latency; it shrinks back one
+ * step after every JITTER_DECAY_MS of playback without underrun. When the
+ * buffer exceeds the max latency (overrun), the oldest samples are dropped
+ * down to the target. After JITTER_IDLE_MS of silence, the VM is considered
+ * silent: reads return nothing until the target is buffered again.
+ *
+ * A jitter buffer is used by a single thread.
+ */
+#ifndef __JITTER_BUFFER_H_
+#define __JITTER_BUFFER_H_
+
+#include <stdint.h>  // for uint8_t, uint64_t
+
+/** \brief Default target latency, in ms */
+#define JITTER_TARGET_MS 60
+/** \brief Default max latency, in ms */
+#define JITTER_MAX_MS 250
+/** \brief Change of the target after an underrun or a stable period, in ms */
+#define JITTER_STEP_MS 10
+/** \brief Playback without underrun before the target shrinks, in ms */
+#define JITTER_DECAY_MS 5000
+/** \brief Silence concealed before the VM is considered silent, in ms */
+#define JITTER_IDLE_MS 200
+
+/** \brief Counters of a jitter buffer */
+struct jitter_stats
+{
+    /** Reads completed with silence, and the bytes of silence inserted */
+    uint64_t underruns;
+    uint64_t concealed_bytes;
+    /** Writes beyond the max latency, and the bytes dropped */
+    uint64_t overruns;
+    uint64_t trimmed_bytes;
+    /** Current and target latency, in ms */
+    int level_ms;
+    int target_ms;
+};
+
+struct jitter_buffer;
+
+/** \brief Allocate a jitter buffer
+ * \param rate Samples per second
+ * \param block_align Bytes of a sample of every channel
+ * \param target_ms Target latency, the minimum of the adaptive target
+ * \param max_ms Max latency, above which the oldest samples are dropped
+ * \param max_write Max size of a write, in bytes
+ * \returns The buffer, NULL on failure
+ */
+struct jitter_buffer* jitter_buffer_new(int rate, int block_align, int target_ms, int max_ms,
+                                        int max_write);
+
+/** \brief Queue the samples received from the VM
+ *
+ * The writes do not need to hold whole samples, an incomplete one is read
+ * once its last bytes are written.
+ * \param size At most the max_write bytes given to jitter_buffer_new()
+ */
+void jitter_buffer_write(struct jitter_buffer* jb, const uint8_t* data, int size);
+
+/** \brief Take one period of samples
+ * \param out Filled with size bytes, completed with silence on underrun
+ * \param size Bytes of the period, whole samples only
+ * \returns size, or 0 while the buffer is filling up and there is nothing to play
+ */
+int jitter_buffer_read(struct jitter_buffer* jb, uint8_t* out, int size);
+
+/** \brief Take the samples left at the end of the stream
+ *
+ * Unlike jitter_buffer_read(), the samples are taken even below the target,
+ * and nothing is completed with silence.
+ * \param out Filled with up to size bytes
+ * \param size Max bytes to take, whole samples only
+ * \returns The bytes taken, 0 once the buffer holds no whole sample
+ */
+int jitter_buffer_drain(struct jitter_buffer* jb, uint8_t* out, int size);
+
+/** \brief Get the counters of a jitter buffer */
+void jitter_buffer_stats(const struct jitter_buffer* jb, struct jitter_stats* stats);
+
+/** \brief Free a jitter buffer */
+void jitter_buffer_free(struct jitter_buffer* jb);
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * \file muxer.h
+ * \brief Output of the encoded video of a recording to a file.
+ *
+ * The encoder of a recording is independent from the output it feeds: the
+ * muxer gets a copy of the encoder parameters (and of its global headers)
+ * when it is opened, so the same encoded packets can be written to a file
+ * long after they were produced.
+ */
+#ifndef __MUXER_H_
+#define __MUXER_H_
+
+#include <libavcodec/avcodec.h>    // for AVCodecContext, AVPacket
+#include <libavformat/avformat.h>  // for AVFormatContext, AVOutputFormat, AVStream
+#include <libavutil/dict.h>        // for AVDictionary
+#include <libavutil/rational.h>    // for AVRational
+
+/** \brief An output file with a single video stream */
+struct muxer
+{
+    AVFormatContext* oc;
+    AVStream* st;
+    /** Time base of the packets given to muxer_write() */
+    AVRational time_base;
+};
+
+/** \brief Output format of a file
+ * \param filename Name of the file, its extension gives the format
+ * \param format Short name of the format, overrides the extension if not NULL
+ * \returns The format, MPEG if none matches
+ */
+AVOutputFormat* muxer_guess_format(const char* filename, const char* format);
+
+/** \brief Create a file and write its header
+ * \param mux The muxer to open
+ * \param filename Name of the file
+ * \param fmt Output format, see muxer_guess_format()
+ * \param enc Opened encoder of the packets
+ * \param opt Options of the format, may be NULL
+ * \returns 0 on success, -1 on failure
+ */
+int muxer_open(struct muxer* mux, const char* filename, AVOutputFormat* fmt,
+               const AVCodecContext* enc, AVDictionary** opt);
+
+/** \brief Write a packet, with timestamps in the time base of the encoder
+ *
+ * The muxer takes ownership of the data of the packet.
+ * \returns 0 on success, a negative AVERROR on failure
+ */
+int muxer_write(struct muxer* mux, AVPacket* pkt);
+
+/** \brief Write the trailer of the file and close it */
+void muxer_close(struct muxer* mux);
+
+#endif
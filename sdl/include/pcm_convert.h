@@ -0,0 +1,49 @@
+/**
+ * \file pcm_convert.h
+ * \brief Conversion of the S16 samples of the VM to the float formats of the encoders.
+ *
+ * A sample s becomes s / 32768.0f, exactly: the SSE2 kernel gives the same
+ * floats as the scalar one. The best kernel supported by the CPU is picked
+ * at the first conversion.
+ */
+#ifndef __PCM_CONVERT_H_
+#define __PCM_CONVERT_H_
+
+#include <stdint.h>  // for int16_t
+
+/** \brief Conversion kernels */
+enum pcm_impl
+{
+    /** Plain C, always available */
+    PCM_IMPL_SCALAR,
+    /** 8 values per iteration */
+    PCM_IMPL_SSE2
+};
+
+/** \brief Convert interleaved S16 samples to interleaved floats (AV_SAMPLE_FMT_FLT)
+ * \param src Samples
+ * \param dst Floats, count of them
+ * \param count Number of values, of every channel
+ */
+void pcm_s16_to_flt(const int16_t* src, float* dst, int count);
+
+/** \brief Convert interleaved stereo S16 samples to planar floats (AV_SAMPLE_FMT_FLTP)
+ * \param src Samples, left then right
+ * \param left Floats of the left channel
+ * \param right Floats of the right channel
+ * \param count Number of samples of each channel
+ */
+void pcm_s16_to_fltp_stereo(const int16_t* src, float* left, float* right, int count);
+
+/** \brief Force the kernel used by the conversions, for tests and benchmarks
+ * \returns 0 on success, -1 if the CPU does not support \p impl
+ */
+int pcm_convert_set_impl(int impl);
+
+/** \brief Kernel used by the conversions (enum pcm_impl) */
+int pcm_convert_get_impl(void);
+
+/** \brief Name of a kernel, for logging */
+const char* pcm_convert_impl_name(int impl);
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * \file record_profile.h
+ * \brief Encoder settings of the recordings
+ *
+ * A profile trades CPU against quality: the codec, its preset and tune, a
+ * constant quality (CRF) or a bitrate, the keyframe interval and the threads
+ * of the encoder. The defaults come from the AIC_PLAYER_RECORD_* settings,
+ * and each recordingPayload message may override them for its recording.
+ */
+#ifndef __RECORD_PROFILE_H_
+#define __RECORD_PROFILE_H_
+
+#include <libavcodec/avcodec.h>    // for AVCodec, AVCodecContext
+#include <libavformat/avformat.h>  // for AVOutputFormat
+#include <libavutil/dict.h>        // for AVDictionary
+
+#include "recording.pb-c.h"
+
+/** \brief Default bitrate of the recordings, in kb/s */
+#define RECORD_BITRATE 400
+/** \brief Default interval between two keyframes, in frames */
+#define RECORD_KEYINT 12
+/** \brief Max CRF of a recording message, the one of libvpx (51 for libx264) */
+#define RECORD_CRF_MAX 63
+/** \brief Max bitrate of a recording message, in kb/s */
+#define RECORD_BITRATE_MAX 100000
+/** \brief Max keyframe interval of a recording message, in frames */
+#define RECORD_KEYINT_MAX 600
+/** \brief Max number of encoder threads of a recording message */
+#define RECORD_THREADS_MAX 64
+/** \brief Max length of the names of a profile */
+#define RECORD_NAME_SIZE 32
+
+/** \brief Encoder settings of a recording */
+struct record_profile
+{
+    /** Name of the encoder, empty for the default codec of the container */
+    char codec[RECORD_NAME_SIZE];
+    /** Speed preset of the encoder (x264: ultrafast to veryslow), empty for its default */
+    char preset[RECORD_NAME_SIZE];
+    /** Tuning of the encoder (x264: zerolatency, animation...), empty for none */
+    char tune[RECORD_NAME_SIZE];
+    /** Constant quality, lower is better, -1 to encode at bit_rate */
+    int crf;
+    /** Bitrate, in kb/s */
+    int bit_rate;
+    /** Max number of frames between two keyframes */
+    int keyint;
+    /** Threads of the encoder, 0 to use every core */
+    int threads;
+    /** FF_THREAD_SLICE and/or FF_THREAD_FRAME */
+    int thread_type;
+    /** Encode for live streams: no B-frames, slice threads, zerolatency tune by default */
+    int low_latency;
+};
+
+/** \brief Load the default profile from the AIC_PLAYER_RECORD_* settings */
+void record_profile_from_config(struct record_profile* profile);
+
+/** \brief Override a profile with the fields set in a recording message
+ *
+ * The message comes from the network: the numbers beyond the RECORD_*_MAX
+ * limits, and the presets and tunes that libx264 and libx265 do not know,
+ * are logged and ignored.
+ */
+void record_profile_from_payload(struct record_profile* profile, const RecordingPayload* payload);
+
+/** \brief Find the encoder of a profile
+ * \param fmt Container of the recording, its default codec is used if the
+ * profile has none or if the container does not support it
+ * \returns The encoder, NULL if there is none
+ */
+AVCodec* record_profile_encoder(const struct record_profile* profile, AVOutputFormat* fmt);
+
+/** \brief Configure an encoder before it is opened
+ *
+ * The settings private to the encoder (preset, tune, crf) are added to opt,
+ * which is given to avcodec_open2().
+ */
+void record_profile_apply(const struct record_profile* profile, AVCodecContext* c,
+                          AVDictionary** opt);
+
+#endif
@@ -6,6 +6,7 @@
 #define __RENDER_API_H__
 
 #define STREAM_MODE_TCP 1
+#define STREAM_MODE_UNIX 2
 
 /* our custom functions */
 /** Define a callback to be executed locally on screen rotation */
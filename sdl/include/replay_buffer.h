@@ -0,0 +1,43 @@
+/**
+ * \file replay_buffer.h
+ * \brief Rolling buffer of the last seconds of encoded video, for instant replays.
+ *
+ * The buffer keeps references to the packets of an encoder which runs all the
+ * time. It always starts on a keyframe: when it exceeds its duration or its
+ * size, whole groups of pictures are dropped from its head. Saving the buffer
+ * muxes the packets to a file, without decoding nor encoding them again.
+ */
+#ifndef __REPLAY_BUFFER_H_
+#define __REPLAY_BUFFER_H_
+
+#include <libavcodec/avcodec.h>  // for AVCodecContext, AVPacket
+#include <stddef.h>              // for size_t
+
+struct replay_buffer;
+
+/** \brief Allocate an empty buffer
+ * \param seconds Duration of video to keep
+ * \param max_bytes Max size of the packets kept, the oldest are dropped beyond it
+ * \returns The buffer, NULL on failure
+ */
+struct replay_buffer* replay_buffer_new(int seconds, size_t max_bytes);
+
+/** \brief Set the encoder of the packets, once it is opened
+ *
+ * Drops the packets of the previous encoder, if any.
+ * \returns 0 on success, -1 on failure
+ */
+int replay_buffer_set_encoder(struct replay_buffer* rb, const AVCodecContext* enc);
+
+/** \brief Add a reference to a packet of the encoder to the buffer */
+void replay_buffer_push(struct replay_buffer* rb, const AVPacket* pkt);
+
+/** \brief Write the content of the buffer to an mp4 file
+ *
+ * The buffer is only locked to reference its packets: the encoder keeps
+ * filling it while the file is written.
+ * \returns 0 on success, -1 on failure
+ */
+int replay_buffer_save(struct replay_buffer* rb, const char* filename);
+
+#endif
@@ -0,0 +1,50 @@
+/**
+ * \file segmenter.h
+ * \brief Output of a long recording to a series of bounded files.
+ *
+ * The recording is split on keyframes, every few seconds or megabytes, into
+ * files named after the recording: video.mp4 gives video-000.mp4,
+ * video-001.mp4... Each segment starts at timestamp 0 and is playable on its
+ * own. The trailers of the finished segments are written by a background
+ * thread, so that a rotation never stalls the encoder, and a crash only
+ * loses the current segment.
+ *
+ * An optional ffconcat index lists the finished segments, so that
+ * `ffmpeg -f concat -i video.ffconcat -c copy video.mp4` joins them.
+ */
+#ifndef __SEGMENTER_H_
+#define __SEGMENTER_H_
+
+#include <libavcodec/avcodec.h>    // for AVCodecContext, AVPacket
+#include <libavformat/avformat.h>  // for AVOutputFormat
+#include <libavutil/dict.h>        // for AVDictionary
+#include <stddef.h>                // for size_t
+
+struct segmenter;
+
+/** \brief Open the first segment of a recording
+ * \param filename Name of the recording, the segments are named after it
+ * \param fmt Output format of the segments
+ * \param enc Opened encoder of the packets
+ * \param opt Options of the format, copied for each segment, may be NULL
+ * \param seconds Duration of the segments, 0 for no limit
+ * \param max_bytes Size of the segments, 0 for no limit
+ * \param with_index Write the name of the finished segments to an ffconcat file
+ * \returns The segmenter, NULL on failure
+ */
+struct segmenter* segmenter_open(const char* filename, AVOutputFormat* fmt,
+                                 const AVCodecContext* enc, AVDictionary* opt, int seconds,
+                                 size_t max_bytes, int with_index);
+
+/** \brief Write a packet, with timestamps in the time base of the encoder
+ *
+ * Starts a new segment first if the packet is a keyframe and the current
+ * segment is full. Takes ownership of the data of the packet.
+ * \returns 0 on success, a negative AVERROR on failure
+ */
+int segmenter_write(struct segmenter* seg, AVPacket* pkt);
+
+/** \brief Finalize the last segment, wait for the others and free the segmenter */
+void segmenter_close(struct segmenter* seg);
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * \file snapshot.h
+ * \brief Snapshots of the window, encoded and written off the requesting thread.
+ *
+ * A request only queues the names of the files to write, so that the AMQP
+ * consumer or the SDL event thread never waits for a capture or an encoder.
+ * A capture thread grabs the window into the frames of a pool allocated
+ * once, at the times of the request: a burst takes several snapshots at a
+ * fixed interval. An encoder thread compresses the frames to PNG or JPEG
+ * (or writes a BMP) and writes each file at once. When the window is
+ * resized, the pool hands out frames of the new size and the encoders are
+ * reopened, without stopping the worker.
+ */
+#ifndef __SNAPSHOT_H_
+#define __SNAPSHOT_H_
+
+#include <libavutil/frame.h>  // for AVFrame
+
+/** \brief Default number of frames in the pool of the snapshots */
+#define SNAPSHOT_POOL_SIZE 4
+/** \brief Default compression level of the PNG snapshots, 0 (fastest) to 9 (smallest) */
+#define SNAPSHOT_PNG_LEVEL 3
+/** \brief Default quality of the JPEG snapshots, 1 to 100 */
+#define SNAPSHOT_JPEG_QUALITY 90
+/** \brief Default time between two snapshots of a burst, in ms */
+#define SNAPSHOT_BURST_INTERVAL_MS 100
+/** \brief Max number of snapshots of a burst */
+#define SNAPSHOT_BURST_MAX 100
+/** \brief Max time between two snapshots of a burst, in ms */
+#define SNAPSHOT_BURST_INTERVAL_MAX_MS 1000
+
+/** \brief File format of a snapshot */
+enum snapshot_format
+{
+    SNAPSHOT_BMP,
+    SNAPSHOT_PNG,
+    SNAPSHOT_JPEG,
+};
+
+/** \brief Capture the window into a BGR0 frame of the pool
+ * \returns 0 on success, -1 on failure
+ */
+typedef int (*snapshot_grab_fn)(AVFrame* frame);
+
+struct snapshot_worker;
+
+/** \brief Parse a format name (bmp, png, jpeg or jpg), -1 if unknown */
+int snapshot_format_from_name(const char* name);
+
+/** \brief File extension of a format, with its dot */
+const char* snapshot_format_ext(int format);
+
+/** \brief Start the capture and encoder threads of the snapshots
+ * \param grab Capture of the window, called by the capture thread
+ * \param width Width of the snapshots
+ * \param height Height of the snapshots
+ * \param pool_size Number of frames allocated for the captures waiting for the encoder
+ * \param format Format of the files without a known extension
+ * \param png_level Compression level of the PNG files, 0 to 9
+ * \param jpeg_quality Quality of the JPEG files, 1 to 100
+ * \returns The worker, NULL on failure
+ */
+struct snapshot_worker* snapshot_worker_new(snapshot_grab_fn grab, int width, int height,
+                                            int pool_size, int format, int png_level,
+                                            int jpeg_quality);
+
+/** \brief Queue snapshots of the window
+ *
+ * The extension of filename gives the format, the default format of the
+ * worker and its extension are used if there is none. A burst of count
+ * snapshots writes name-000.ext, name-001.ext...
+ * \param filename Name of the snapshot
+ * \param count Number of snapshots, 1 for a single one, at most SNAPSHOT_BURST_MAX
+ * \param interval_ms Time between two snapshots of a burst, at most
+ * SNAPSHOT_BURST_INTERVAL_MAX_MS
+ * \returns 0 if the request is queued, -1 otherwise
+ */
+int snapshot_worker_request(struct snapshot_worker* w, const char* filename, int count,
+                            int interval_ms);
+
+/** \brief Take the next snapshots at a new size, after a rotation of the window */
+void snapshot_worker_resize(struct snapshot_worker* w, int width, int height);
+
+#endif
@@ -4,6 +4,7 @@
  */
 #ifndef __SOCKET_H_
 #define __SOCKET_H_
+#include <netinet/in.h>  // for sockaddr_in
 #include <sys/socket.h>  // for recv, send
 
 /** \brief Alias for the recv() return value in case of error */
@@ -24,4 +25,27 @@ socket_t open_socket_nodelay(const char* ip, short port);
 
 /** \brief Open a socket with SO_REUSEADDR */
 socket_t open_socket_reuseaddr(const char* ip, short port);
+
+/** \brief Resolve a host:port couple once, to connect to it repeatedly
+ * \param ip IP address or hostname to resolve
+ * \param port TCP port
+ * \param addr The resolved address
+ * \returns 0 on success, -1 on failure
+ */
+int resolve_socket_address(const char* ip, short port, struct sockaddr_in* addr);
+
+/** \brief Open a socket with TCP_NODELAY to an address from resolve_socket_address() */
+socket_t open_socket_nodelay_addr(const struct sockaddr_in* addr);
+
+/** \brief Connect to a Unix domain stream socket
+ * \param path Path of the socket
+ * \returns The open socket, SOCKET_ERROR on failure
+ */
+socket_t open_socket_unix(const char* path);
+
+/** \brief Listen on a TCP port of every interface
+ * \param port TCP port to listen on
+ * \returns The listening socket, SOCKET_ERROR on failure
+ */
+socket_t open_server_socket(short port);
 #endif
@@ -0,0 +1,76 @@
+/**
+ * \file x_capture.h
+ * \brief Reusable capture of the contents of an X window.
+ *
+ * With the MIT-SHM extension, the X server writes the window contents
+ * straight into a shared memory segment created once: a capture is a single
+ * request, with no allocation and no image data going through the X socket.
+ * When MIT-SHM is not usable (remote X server, separate IPC namespace), the
+ * capture falls back to XGetSubImage() into an image allocated once.
+ */
+#ifndef __X_CAPTURE_H_
+#define __X_CAPTURE_H_
+
+#include <X11/Xlib.h>             // for Display, Drawable, XImage
+#include <X11/Xutil.h>            // for XGetPixel
+#include <X11/extensions/XShm.h>  // for XShmSegmentInfo
+#include <stdint.h>               // for uint32_t
+
+/** \brief State of the capture of a window */
+struct x_capture
+{
+    /** Connection to the X server */
+    Display* display;
+    /** Captured window */
+    Drawable drawable;
+    /** Size of the captured area, from the top left corner of the window */
+    int width;
+    int height;
+    /** Image holding the last capture */
+    XImage* image;
+    /** Shared memory segment of the image, if use_shm */
+    XShmSegmentInfo shminfo;
+    /** Set if the image lives in shared memory */
+    int use_shm;
+};
+
+/** \brief Allocate the image of a capture
+ * \param cap The capture to initialize
+ * \param display Connection to the X server
+ * \param drawable Window to capture
+ * \param width Width of the captured area
+ * \param height Height of the captured area
+ * \returns 0 on success, -1 on failure
+ */
+int x_capture_init(struct x_capture* cap, Display* display, Drawable drawable, int width,
+                   int height);
+
+/** \brief Capture the window
+ * \returns The image, valid until the next capture, NULL on failure, as when the
+ * window is smaller than the capture
+ */
+XImage* x_capture_grab(struct x_capture* cap);
+
+/** \brief Capture the window when it may be smaller than the capture
+ *
+ * Only the top left width x height of the capture is read from the window,
+ * through XGetSubImage(), and the rest of the image is black. This is a
+ * plain x_capture_grab() when the window covers the whole capture.
+ * \param width Width of the window
+ * \param height Height of the window
+ * \returns The image, valid until the next capture, NULL on failure
+ */
+XImage* x_capture_grab_area(struct x_capture* cap, int width, int height);
+
+/** \brief Release the image and the shared memory segment of a capture */
+void x_capture_destroy(struct x_capture* cap);
+
+/** \brief Read a pixel of a captured image, in place for 32 bpp images */
+static inline unsigned long x_capture_pixel(XImage* image, int x, int y)
+{
+    if (image->bits_per_pixel == 32 && image->byte_order == LSBFirst)
+        return ((const uint32_t*) (image->data + y * image->bytes_per_line))[x];
+    return XGetPixel(image, x, y);
+}
+
+#endif
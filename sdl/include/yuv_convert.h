@@ -0,0 +1,72 @@
+/**
+ * \file yuv_convert.h
+ * \brief Conversion of captured BGRX images to I420 (YUV420P), and downscaling.
+ *
+ * Luma is computed per pixel with RGB2Y, chroma per 2x2 block with RGB2U and
+ * RGB2V applied to the rounded average of the four pixels. On odd sizes, the
+ * last column and row are repeated to complete the blocks.
+ *
+ * The SSE2 and AVX2 kernels give the same bytes as the scalar one; the best
+ * kernel supported by the CPU is picked at the first conversion.
+ */
+#ifndef __YUV_CONVERT_H_
+#define __YUV_CONVERT_H_
+
+#include <stdint.h>  // for uint8_t
+
+//// ################################################################################
+#define CLIP(X) ((X) > 255 ? 255 : (X) < 0 ? 0 : X)
+
+// RGB -> YUV
+#define RGB2Y(R, G, B) CLIP(((66 * (R) + 129 * (G) + 25 * (B) + 128) >> 8) + 16)
+#define RGB2U(R, G, B) CLIP(((-38 * (R) -74 * (G) + 112 * (B) + 128) >> 8) + 128)
+#define RGB2V(R, G, B) CLIP(((112 * (R) -94 * (G) -18 * (B) + 128) >> 8) + 128)
+
+//// ################################################################################
+
+/** \brief Conversion kernels */
+enum yuv_impl
+{
+    /** Plain C, always available */
+    YUV_IMPL_SCALAR,
+    /** 8 pixels per iteration */
+    YUV_IMPL_SSE2,
+    /** 16 pixels per iteration */
+    YUV_IMPL_AVX2
+};
+
+/** \brief Convert a BGRX image (32 bpp, 0x00RRGGBB in little endian) to I420
+ * \param src First row of the image
+ * \param src_stride Bytes between two rows of the image
+ * \param dst Y, U and V planes
+ * \param dst_stride Bytes between two rows of each plane
+ * \param width Width of the image, in pixels
+ * \param height Height of the image, in pixels
+ */
+void bgrx_to_i420(const uint8_t* src, int src_stride, uint8_t* const dst[3],
+                  const int dst_stride[3], int width, int height);
+
+/** \brief Shrink a plane by a power of two, each pixel being the rounded average of a block
+ * \param src First row of the plane
+ * \param src_stride Bytes between two rows of the plane
+ * \param dst First row of the shrunk plane
+ * \param dst_stride Bytes between two rows of the shrunk plane
+ * \param dst_width Width of the shrunk plane, at most the source width >> shift
+ * \param dst_height Height of the shrunk plane, at most the source height >> shift
+ * \param shift Log2 of the factor, from 1 (half size) to 3
+ */
+void yuv_downscale_plane(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride,
+                         int dst_width, int dst_height, int shift);
+
+/** \brief Force the kernel used by bgrx_to_i420(), for tests and benchmarks
+ * \returns 0 on success, -1 if the CPU does not support \p impl
+ */
+int yuv_convert_set_impl(int impl);
+
+/** \brief Kernel used by bgrx_to_i420() (enum yuv_impl) */
+int yuv_convert_get_impl(void);
+
+/** \brief Name of a kernel, for logging */
+const char* yuv_convert_impl_name(int impl);
+
+#endif
@@ -0,0 +1,378 @@
+/**
+ * \file audio_pipeline.c
+ * \brief Conversion and encoding of the PCM stream of the VM.
+ */
+#include <errno.h>                     // for ENOMEM
+#include <libavcodec/avcodec.h>        // for avcodec_encode_audio2, CODEC_CAP_VARIABLE_FRAME_SIZE
+#include <libavutil/buffer.h>          // for av_buffer_create, AV_BUFFER_FLAG_READONLY
+#include <libavutil/channel_layout.h>  // for AV_CH_LAYOUT_STEREO
+#include <libavutil/common.h>          // for FFMIN
+#include <libavutil/error.h>           // for AVERROR, av_err2str
+#include <libavutil/frame.h>           // for AVFrame, av_frame_alloc, av_frame_get_buffer
+#include <libavutil/mathematics.h>     // for av_rescale_rnd
+#include <libavutil/mem.h>             // for av_freep
+#include <libavutil/samplefmt.h>       // for av_samples_alloc_array_and_samples, av_samples_copy
+#include <libswresample/swresample.h>  // for SwrContext, swr_convert
+#include <stdint.h>                    // for uint8_t, int64_t
+#include <stdlib.h>                    // for calloc, free
+#include <string.h>                    // for memcpy
+
+#include "audio_pipeline.h"
+#include "logger.h"
+#include "pcm_convert.h"
+
+#define LOG_TAG "audio_pipeline"
+
+/** \brief Extra samples of the conversion buffer, for the delay of the resampler */
+#define AUDIO_SWR_MARGIN 256
+
+/** \brief How the samples of the VM reach the encoder */
+enum audio_path
+{
+    /** Resampled or remixed by swr */
+    AUDIO_PATH_SWR,
+    /** Copied as is, the encoder takes S16 at the rate of the VM */
+    AUDIO_PATH_S16,
+    /** Encoded in place, the encoder also takes frames of any size */
+    AUDIO_PATH_WRAP,
+    /** Converted to interleaved floats */
+    AUDIO_PATH_FLT,
+    /** Converted to planar floats */
+    AUDIO_PATH_FLTP,
+};
+
+static const char* const s_path_names[] = {"swr", "s16", "in place", "flt", "fltp"};
+
+struct audio_pipeline
+{
+    /* Output of the encoded packets */
+    AVFormatContext* oc;
+    AVStream* st;
+    AVCodecContext* enc;
+    int path;
+
+    /* The bytes of a sample split between two chunks */
+    uint8_t carry[AUDIO_BLOCK_ALIGN];
+    int carry_size;
+
+    /* Resampling to the format and rate of the encoder */
+    SwrContext* swr;
+    uint8_t** converted;
+    int converted_samples;
+
+    /* Frame of the encoder being filled, and its number of samples so far */
+    AVFrame* frame;
+    int frame_size;
+    int filled;
+    /** Frame referencing the samples of the caller, for AUDIO_PATH_WRAP */
+    AVFrame* wrapped;
+    /** Timestamp of the next frame, in samples */
+    int64_t pts;
+};
+
+/* Encode a frame, NULL flushes the encoder, and write its packet. */
+static int encode(struct audio_pipeline* p, AVFrame* frame, int* got_packet)
+{
+    AVPacket pkt;
+    int ret;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    ret = avcodec_encode_audio2(p->enc, &pkt, frame, got_packet);
+    if (ret < 0)
+    {
+        LOGW("Could not encode a frame: %s", av_err2str(ret));
+        return ret;
+    }
+    if (!*got_packet)
+        return 0;
+
+    pkt.stream_index = p->st->index;
+    av_packet_rescale_ts(&pkt, (AVRational){1, p->enc->sample_rate}, p->st->time_base);
+    ret = av_write_frame(p->oc, &pkt);
+    av_free_packet(&pkt);
+    if (ret < 0)
+        LOGW("Could not write a frame: %s", av_err2str(ret));
+    return ret;
+}
+
+/* Encode the samples of the frame being filled, and start the next frame. */
+static int encode_filled(struct audio_pipeline* p)
+{
+    int got_packet;
+    int ret;
+
+    p->frame->nb_samples = p->filled;
+    p->frame->pts = p->pts;
+    p->pts += p->filled;
+    p->filled = 0;
+    ret = encode(p, p->frame, &got_packet);
+    if (ret < 0)
+        return ret;
+
+    /* The encoder does not keep the frame, this does not copy it */
+    return av_frame_make_writable(p->frame);
+}
+
+/* Write n samples of the VM, from the offset-th one, at the end of the frame being filled.
+ * The resampled samples are read from p->converted instead. */
+static void fill_frame(struct audio_pipeline* p, const uint8_t* samples, int offset, int n)
+{
+    const int16_t* s16 = (const int16_t*) samples + offset * AUDIO_IN_CHANNELS;
+    uint8_t** dst = p->frame->extended_data;
+
+    switch (p->path)
+    {
+    case AUDIO_PATH_S16:
+        memcpy(dst[0] + p->filled * AUDIO_BLOCK_ALIGN, s16, n * AUDIO_BLOCK_ALIGN);
+        break;
+    case AUDIO_PATH_FLT:
+        pcm_s16_to_flt(s16, (float*) dst[0] + p->filled * AUDIO_IN_CHANNELS,
+                       n * AUDIO_IN_CHANNELS);
+        break;
+    case AUDIO_PATH_FLTP:
+        pcm_s16_to_fltp_stereo(s16, (float*) dst[0] + p->filled, (float*) dst[1] + p->filled, n);
+        break;
+    default:
+        av_samples_copy(dst, p->converted, p->filled, offset, n, p->enc->channels,
+                        p->enc->sample_fmt);
+        break;
+    }
+}
+
+/* The samples of the caller are not freed with the frames wrapping them. */
+static void keep_samples(void* opaque, uint8_t* data)
+{
+    (void) opaque;
+    (void) data;
+}
+
+/* Encode samples of the caller as a frame, without copying them. */
+static int encode_in_place(struct audio_pipeline* p, const uint8_t* samples, int count)
+{
+    AVFrame* f = p->wrapped;
+    int got_packet;
+    int ret;
+
+    f->buf[0] = av_buffer_create((uint8_t*) samples, count * AUDIO_BLOCK_ALIGN, keep_samples,
+                                 NULL, AV_BUFFER_FLAG_READONLY);
+    if (!f->buf[0])
+        return AVERROR(ENOMEM);
+    f->data[0] = (uint8_t*) samples;
+    f->extended_data = f->data;
+    f->linesize[0] = count * AUDIO_BLOCK_ALIGN;
+    f->nb_samples = count;
+    f->format = AV_SAMPLE_FMT_S16;
+    f->channel_layout = AV_CH_LAYOUT_STEREO;
+    av_frame_set_channels(f, AUDIO_IN_CHANNELS);
+    f->sample_rate = AUDIO_IN_RATE;
+    f->pts = p->pts;
+    p->pts += count;
+
+    /* The encoder does not keep the frame, the reference is dropped right away */
+    ret = encode(p, f, &got_packet);
+    av_frame_unref(f);
+    return ret;
+}
+
+/* Bring whole samples of the VM to the encoder format, and encode the full frames.
+ *
+ * The samples are converted straight into the frame of the encoder, at the end of
+ * the samples it already holds; only swr goes through p->converted. The samples
+ * which do not fill a frame wait in it for the next chunk. */
+static int convert(struct audio_pipeline* p, const uint8_t* samples, int count)
+{
+    int done, n;
+    int ret;
+
+    if (p->path == AUDIO_PATH_WRAP)
+        return encode_in_place(p, samples, count);
+
+    if (p->path == AUDIO_PATH_SWR)
+    {
+        count = swr_convert(p->swr, p->converted, p->converted_samples, &samples, count);
+        if (count < 0)
+        {
+            LOGW("Could not convert the samples: %s", av_err2str(count));
+            return count;
+        }
+    }
+
+    for (done = 0; done < count; done += n)
+    {
+        n = FFMIN(count - done, p->frame_size - p->filled);
+        fill_frame(p, samples, done, n);
+        p->filled += n;
+        if (p->filled == p->frame_size)
+        {
+            ret = encode_filled(p);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+/* Path of the samples to an encoder, the shortest one its format allows. */
+static int pick_path(const AVCodecContext* enc, uint64_t layout)
+{
+    if (enc->sample_rate != AUDIO_IN_RATE || layout != AV_CH_LAYOUT_STEREO)
+        return AUDIO_PATH_SWR;
+
+    switch (enc->sample_fmt)
+    {
+    case AV_SAMPLE_FMT_S16:
+        if (enc->codec->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE)
+            return AUDIO_PATH_WRAP;
+        return AUDIO_PATH_S16;
+    case AV_SAMPLE_FMT_FLT:
+        return AUDIO_PATH_FLT;
+    case AV_SAMPLE_FMT_FLTP:
+        return AUDIO_PATH_FLTP;
+    default:
+        return AUDIO_PATH_SWR;
+    }
+}
+
+/* Allocate the resampler, its buffer and the frame of a pipeline. */
+static int alloc_conversion(struct audio_pipeline* p, uint64_t layout)
+{
+    AVCodecContext* enc = p->enc;
+    int max_samples;
+
+    if (p->path == AUDIO_PATH_SWR)
+    {
+        p->swr = swr_alloc_set_opts(NULL, layout, enc->sample_fmt, enc->sample_rate,
+                                    AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, AUDIO_IN_RATE, 0,
+                                    NULL);
+        if (!p->swr || swr_init(p->swr) < 0)
+            return -1;
+
+        /* Room for the largest chunk, at the rate of the encoder */
+        max_samples = AUDIO_CHUNK_SIZE / AUDIO_BLOCK_ALIGN + 1;
+        p->converted_samples =
+            av_rescale_rnd(max_samples, enc->sample_rate, AUDIO_IN_RATE, AV_ROUND_UP) +
+            AUDIO_SWR_MARGIN;
+        if (av_samples_alloc_array_and_samples(&p->converted, NULL, enc->channels,
+                                               p->converted_samples, enc->sample_fmt, 0) < 0)
+            return -1;
+    }
+
+    p->frame = av_frame_alloc();
+    if (!p->frame)
+        return -1;
+    p->frame->format = enc->sample_fmt;
+    p->frame->channel_layout = layout;
+    p->frame->sample_rate = enc->sample_rate;
+    p->frame->nb_samples = p->frame_size;
+    return av_frame_get_buffer(p->frame, 0) < 0 ? -1 : 0;
+}
+
+struct audio_pipeline* audio_pipeline_new(AVFormatContext* oc, AVStream* st,
+                                          AVCodecContext* enc, int frame_samples)
+{
+    struct audio_pipeline* p = calloc(1, sizeof(*p));
+    uint64_t layout = enc->channel_layout ? enc->channel_layout
+                                          : av_get_default_channel_layout(enc->channels);
+
+    if (!p)
+        return NULL;
+    p->oc = oc;
+    p->st = st;
+    p->enc = enc;
+    if (!frame_samples)
+        frame_samples = AUDIO_FRAME_SAMPLES;
+    p->frame_size = enc->frame_size ? enc->frame_size : frame_samples;
+    p->path = pick_path(enc, layout);
+
+    if (p->path == AUDIO_PATH_WRAP)
+    {
+        /* Every chunk is a frame: no frame to fill */
+        p->frame_size = 0;
+        p->wrapped = av_frame_alloc();
+        if (!p->wrapped)
+            goto fail;
+    }
+    else if (alloc_conversion(p, layout) < 0)
+        goto fail;
+
+    LOGI("Audio pipeline: %d Hz S16 to %d Hz %s (%s), frames of %d samples", AUDIO_IN_RATE,
+         enc->sample_rate, av_get_sample_fmt_name(enc->sample_fmt), s_path_names[p->path],
+         p->frame_size);
+    return p;
+
+fail:
+    LOGW("Unable to allocate the audio pipeline");
+    audio_pipeline_free(p);
+    return NULL;
+}
+
+int audio_pipeline_push(struct audio_pipeline* p, const uint8_t* data, int size)
+{
+    int n;
+    int ret;
+
+    /* Complete the sample split by the previous chunk */
+    if (p->carry_size)
+    {
+        n = FFMIN(AUDIO_BLOCK_ALIGN - p->carry_size, size);
+        memcpy(p->carry + p->carry_size, data, n);
+        p->carry_size += n;
+        data += n;
+        size -= n;
+        if (p->carry_size < AUDIO_BLOCK_ALIGN)
+            return 0;
+
+        p->carry_size = 0;
+        ret = convert(p, p->carry, 1);
+        if (ret < 0)
+            return ret;
+    }
+
+    n = size - size % AUDIO_BLOCK_ALIGN;
+    if (n)
+    {
+        ret = convert(p, data, n / AUDIO_BLOCK_ALIGN);
+        if (ret < 0)
+            return ret;
+    }
+
+    memcpy(p->carry, data + n, size - n);
+    p->carry_size = size - n;
+    return 0;
+}
+
+int audio_pipeline_flush(struct audio_pipeline* p)
+{
+    int got_packet = 1;
+    int ret;
+
+    ret = p->filled ? encode_filled(p) : 0;
+    if (ret < 0)
+        return ret;
+
+    /* get the packets delayed by the encoder */
+    while (got_packet && (p->enc->codec->capabilities & CODEC_CAP_DELAY))
+    {
+        ret = encode(p, NULL, &got_packet);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+void audio_pipeline_free(struct audio_pipeline* p)
+{
+    if (!p)
+        return;
+
+    swr_free(&p->swr);
+    if (p->converted)
+        av_freep(&p->converted[0]);
+    av_freep(&p->converted);
+    av_frame_free(&p->frame);
+    av_frame_free(&p->wrapped);
+    free(p);
+}
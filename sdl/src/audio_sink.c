@@ -0,0 +1,429 @@
+/**
+ * \file audio_sink.c
+ * \brief Outputs of the PCM stream of the VM, encoded or raw.
+ */
+#include <errno.h>                     // for errno, EAGAIN, EWOULDBLOCK
+#include <libavcodec/avcodec.h>        // for AVCodec, AVCodecContext, avcodec_open2
+#include <libavformat/avformat.h>      // for AVFormatContext, av_sdp_create
+#include <libavformat/avio.h>          // for avio_open, avio_closep
+#include <libavutil/channel_layout.h>  // for AV_CH_LAYOUT_STEREO
+#include <libavutil/dict.h>            // for AVDictionary, av_dict_set
+#include <libavutil/error.h>           // for AVERROR, av_err2str
+#include <libavutil/samplefmt.h>       // for AV_SAMPLE_FMT_FLT
+#include <stdint.h>                    // for uint8_t, int64_t, uint64_t
+#include <stdio.h>                     // for FILE, fopen, fputs, snprintf
+#include <stdlib.h>                    // for calloc, free
+#include <string.h>                    // for strerror
+#include <strings.h>                   // for strcasecmp
+#include <sys/socket.h>                // for send, MSG_DONTWAIT, MSG_NOSIGNAL
+#include <time.h>                      // for clock_gettime, timespec
+#include <unistd.h>                    // for close
+
+#include "audio_pipeline.h"
+#include "audio_sink.h"
+#include "logger.h"
+#include "socket.h"
+
+#define LOG_TAG "audio_sink"
+
+/** \brief Max size of the SDP of an RTP sink */
+#define AUDIO_SINK_SDP_SIZE 2048
+
+static const char* const s_names[] = {"ffm", "ogg", "rtp", "pcm", "file"};
+
+static const char* const s_default_urls[] = {
+    "http://ffserver:8090/audio.ffm", "udp://127.0.0.1:5002", "rtp://127.0.0.1:5004",
+    "/tmp/player_audio.sock",         "audio.wav",
+};
+
+struct audio_sink
+{
+    int type;
+    const char* url;
+
+    /* Encoded sinks */
+    AVFormatContext* oc;
+    AVStream* st;
+    struct audio_pipeline* pipeline;
+
+    /* PCM sink: the socket, and when to connect it again */
+    socket_t fd;
+    int64_t retry_ms;
+    /* Last bytes of the sample the reader got the start of, sent before the next samples */
+    uint8_t partial[AUDIO_BLOCK_ALIGN];
+    int partial_size;
+    uint64_t sent_bytes;
+    uint64_t dropped_bytes;
+};
+
+int audio_sink_from_name(const char* name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(s_names) / sizeof(s_names[0])); i++)
+    {
+        if (!strcasecmp(name, s_names[i]))
+            return i;
+    }
+    return -1;
+}
+
+const char* audio_sink_name(int type)
+{
+    return s_names[type];
+}
+
+const char* audio_sink_default_url(int type)
+{
+    return s_default_urls[type];
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Connect the socket of a PCM sink, at most once every AUDIO_SINK_RETRY_MS. */
+static int pcm_connect(struct audio_sink* sink)
+{
+    int64_t now = now_ms();
+
+    if (now < sink->retry_ms)
+        return -1;
+    sink->fd = open_socket_unix(sink->url);
+    if (sink->fd == SOCKET_ERROR)
+    {
+        sink->retry_ms = now + AUDIO_SINK_RETRY_MS;
+        return -1;
+    }
+    LOGI("PCM stream connected to %s", sink->url);
+    return 0;
+}
+
+/* Send bytes to the reader of a PCM sink without waiting for it. Returns the
+ * number of bytes sent, 0 if the reader is late, -1 if it left. */
+static ssize_t pcm_send(struct audio_sink* sink, const uint8_t* data, int size)
+{
+    ssize_t n = send(sink->fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (n < 0)
+    {
+        LOGI("The reader of %s left: %s", sink->url, strerror(errno));
+        close(sink->fd);
+        sink->fd = SOCKET_ERROR;
+        sink->retry_ms = now_ms() + AUDIO_SINK_RETRY_MS;
+        /* The next reader starts on a whole sample */
+        sink->partial_size = 0;
+    }
+    return n;
+}
+
+/* Send samples to the reader of a PCM sink, never waiting for it. */
+static int pcm_write(struct audio_sink* sink, const uint8_t* data, int size)
+{
+    ssize_t n;
+    int rest;
+
+    if (sink->fd == SOCKET_ERROR && pcm_connect(sink) < 0)
+    {
+        sink->dropped_bytes += size;
+        return 0;
+    }
+
+    /* The reader must get the end of the sample it got the start of first */
+    if (sink->partial_size > 0)
+    {
+        n = pcm_send(sink, sink->partial + AUDIO_BLOCK_ALIGN - sink->partial_size,
+                     sink->partial_size);
+        if (n > 0)
+        {
+            sink->partial_size -= n;
+            sink->sent_bytes += n;
+        }
+        if (n < 0 || sink->partial_size > 0)
+        {
+            sink->dropped_bytes += size;
+            return 0;
+        }
+    }
+
+    n = pcm_send(sink, data, size);
+    if (n < 0)
+    {
+        sink->dropped_bytes += size;
+        return 0;
+    }
+
+    /* The reader is late: keep the end of the sample it got the start of for
+     * the next write, and drop the others */
+    rest = (AUDIO_BLOCK_ALIGN - n % AUDIO_BLOCK_ALIGN) % AUDIO_BLOCK_ALIGN;
+    memcpy(sink->partial + AUDIO_BLOCK_ALIGN - rest, data + n, rest);
+    sink->partial_size = rest;
+    sink->sent_bytes += n;
+    sink->dropped_bytes += size - n - rest;
+    return 0;
+}
+
+/* Encoder of a sink: the one named in the config, or the default one of the type. */
+static AVCodec* find_encoder(const struct audio_sink_config* config, AVOutputFormat* fmt)
+{
+    AVCodec* codec;
+    enum AVCodecID id;
+
+    if (config->codec && config->codec[0])
+    {
+        codec = avcodec_find_encoder_by_name(config->codec);
+        if (codec && codec->type == AVMEDIA_TYPE_AUDIO)
+            return codec;
+        LOGW("Unknown audio encoder %s, using the default one", config->codec);
+    }
+
+    switch (config->type)
+    {
+    case AUDIO_SINK_FFM:
+        id = AV_CODEC_ID_VORBIS;
+        break;
+    case AUDIO_SINK_OGG:
+    case AUDIO_SINK_RTP:
+        id = AV_CODEC_ID_OPUS;
+        break;
+    default:
+        id = fmt->audio_codec;
+        break;
+    }
+    codec = avcodec_find_encoder(id);
+    if (!codec)
+        LOGW("Could not find encoder for '%s'", avcodec_get_name(id));
+    return codec;
+}
+
+/* Opus frames are 2.5, 5, 10, 20, 40 or 60 ms long. */
+static const char* opus_frame_duration(int frame_ms)
+{
+    if (frame_ms <= 5)
+        return "5";
+    if (frame_ms <= 10)
+        return "10";
+    if (frame_ms <= 20)
+        return "20";
+    if (frame_ms <= 40)
+        return "40";
+    return "60";
+}
+
+/* Add the audio stream of an encoded sink, and open its encoder. */
+static int open_encoder(struct audio_sink* sink, const struct audio_sink_config* config,
+                        AVCodec* codec)
+{
+    AVCodecContext* c;
+    AVDictionary* opt = NULL;
+    int i;
+    int ret;
+
+    sink->st = avformat_new_stream(sink->oc, codec);
+    if (!sink->st)
+    {
+        LOGW("Could not allocate stream");
+        return AVERROR(ENOMEM);
+    }
+    sink->st->id = sink->oc->nb_streams - 1;
+    c = sink->st->codec;
+
+    c->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLT;
+    c->bit_rate = config->bitrate * 1000;
+    c->sample_rate = AUDIO_IN_RATE;
+    if (codec->supported_samplerates)
+    {
+        c->sample_rate = codec->supported_samplerates[0];
+        for (i = 0; codec->supported_samplerates[i]; i++)
+        {
+            if (codec->supported_samplerates[i] == AUDIO_IN_RATE)
+                c->sample_rate = AUDIO_IN_RATE;
+        }
+    }
+    c->channel_layout = AV_CH_LAYOUT_STEREO;
+    if (codec->channel_layouts)
+    {
+        c->channel_layout = codec->channel_layouts[0];
+        for (i = 0; codec->channel_layouts[i]; i++)
+        {
+            if (codec->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
+                c->channel_layout = AV_CH_LAYOUT_STEREO;
+        }
+    }
+    c->channels = av_get_channel_layout_nb_channels(c->channel_layout);
+    c->time_base = (AVRational){1, c->sample_rate};
+    sink->st->time_base = c->time_base;
+
+    /* The Ogg and Matroska muxers need the headers of Vorbis and Opus */
+    c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+    /* Small frames, and no look-ahead beyond the frame for libopus */
+    av_dict_set(&opt, "application", "lowdelay", 0);
+    av_dict_set(&opt, "frame_duration", opus_frame_duration(config->frame_ms), 0);
+    ret = avcodec_open2(c, codec, &opt);
+    av_dict_free(&opt);
+    if (ret < 0)
+        LOGW("Could not open audio codec: %s", av_err2str(ret));
+    return ret;
+}
+
+/* Log the SDP of an RTP sink, and write it to the file of the config. */
+static void write_sdp(struct audio_sink* sink, const char* sdp_file)
+{
+    char sdp[AUDIO_SINK_SDP_SIZE];
+    FILE* f;
+
+    if (av_sdp_create(&sink->oc, 1, sdp, sizeof(sdp)) < 0)
+    {
+        LOGW("Could not create the SDP of %s", sink->url);
+        return;
+    }
+    LOGI("SDP of %s:\n%s", sink->url, sdp);
+
+    if (!sdp_file || !sdp_file[0])
+        return;
+    f = fopen(sdp_file, "w");
+    if (!f)
+    {
+        LOGW("Could not write the SDP to %s: %s", sdp_file, strerror(errno));
+        return;
+    }
+    fputs(sdp, f);
+    fputs("\n", f);
+    fclose(f);
+}
+
+/* Open the output, the encoder and the pipeline of an encoded sink. */
+static int open_encoded(struct audio_sink* sink, const struct audio_sink_config* config)
+{
+    static const char* const formats[] = {"ffm", "ogg", "rtp", NULL, NULL};
+    AVDictionary* opt = NULL;
+    AVCodec* codec;
+    char page_us[16];
+    int frame_samples;
+    int ret;
+
+    ret = avformat_alloc_output_context2(&sink->oc, NULL, formats[config->type], sink->url);
+    if (!sink->oc)
+    {
+        LOGW("Could not allocate the output of %s: %s", sink->url, av_err2str(ret));
+        return ret;
+    }
+
+    codec = find_encoder(config, sink->oc->oformat);
+    if (!codec)
+        return AVERROR_ENCODER_NOT_FOUND;
+    ret = open_encoder(sink, config, codec);
+    if (ret < 0)
+        return ret;
+
+    /* open the output file, if needed */
+    if (!(sink->oc->oformat->flags & AVFMT_NOFILE))
+    {
+        ret = avio_open(&sink->oc->pb, sink->url, AVIO_FLAG_WRITE);
+        if (ret < 0)
+        {
+            LOGW("Could not open '%s': %s", sink->url, av_err2str(ret));
+            return ret;
+        }
+    }
+
+    /* Write every packet at once, and every Ogg page after a single frame */
+    sink->oc->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    snprintf(page_us, sizeof(page_us), "%d", config->frame_ms * 1000);
+    av_dict_set(&opt, "page_duration", page_us, 0);
+    ret = avformat_write_header(sink->oc, &opt);
+    av_dict_free(&opt);
+    if (ret < 0)
+    {
+        LOGW("Error occurred when opening output file: %s", av_err2str(ret));
+        return ret;
+    }
+    av_dump_format(sink->oc, 0, sink->url, 1);
+    if (config->type == AUDIO_SINK_RTP)
+        write_sdp(sink, config->sdp_file);
+
+    frame_samples = sink->st->codec->sample_rate * config->frame_ms / 1000;
+    sink->pipeline = audio_pipeline_new(sink->oc, sink->st, sink->st->codec, frame_samples);
+    if (!sink->pipeline)
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+/* Close the output and the encoder of an encoded sink, and free the sink. */
+static void free_sink(struct audio_sink* sink)
+{
+    audio_pipeline_free(sink->pipeline);
+    if (sink->st)
+        avcodec_close(sink->st->codec);
+    if (sink->oc && !(sink->oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&sink->oc->pb);
+    avformat_free_context(sink->oc);
+    if (sink->fd != SOCKET_ERROR)
+        close(sink->fd);
+    free(sink);
+}
+
+struct audio_sink* audio_sink_open(const struct audio_sink_config* config)
+{
+    struct audio_sink* sink = calloc(1, sizeof(*sink));
+
+    if (!sink)
+        return NULL;
+    sink->type = config->type;
+    sink->url = config->url && config->url[0] ? config->url : s_default_urls[config->type];
+    sink->fd = SOCKET_ERROR;
+
+    LOGI("Audio sink: %s to %s, frames of %d ms", s_names[sink->type], sink->url,
+         config->frame_ms);
+    if (sink->type == AUDIO_SINK_PCM)
+    {
+        /* Whether someone listens or not, the samples of the VM are consumed */
+        pcm_connect(sink);
+        return sink;
+    }
+
+    if (open_encoded(sink, config) < 0)
+    {
+        free_sink(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+int audio_sink_write(struct audio_sink* sink, const uint8_t* data, int size)
+{
+    if (sink->type == AUDIO_SINK_PCM)
+        return pcm_write(sink, data, size);
+    return audio_pipeline_push(sink->pipeline, data, size);
+}
+
+int audio_sink_close(struct audio_sink* sink)
+{
+    int ret = 0;
+
+    if (!sink)
+        return 0;
+
+    if (sink->type == AUDIO_SINK_PCM)
+    {
+        LOGI("PCM stream: %llu bytes sent, %llu bytes dropped",
+             (unsigned long long) sink->sent_bytes, (unsigned long long) sink->dropped_bytes);
+    }
+    else
+    {
+        ret = audio_pipeline_flush(sink->pipeline);
+        /* The trailer must be written before the encoder is closed */
+        if (av_write_trailer(sink->oc) < 0)
+            LOGW("Could not write the trailer of %s", sink->url);
+    }
+
+    free_sink(sink);
+    return ret;
+}
@@ -0,0 +1,182 @@
+/**
+ * \file band_pool.c
+ * \brief Small pool of threads processing the horizontal bands of an image.
+ */
+#include <pthread.h>  // for pthread_create, pthread_cond_wait
+#include <stdlib.h>   // for calloc, free
+#include <unistd.h>   // for sysconf, _SC_NPROCESSORS_ONLN
+
+#include "band_pool.h"
+#include "logger.h"
+
+#define LOG_TAG "band_pool"
+
+struct band_pool
+{
+    int threads;
+    pthread_t workers[BAND_POOL_MAX];
+
+    pthread_mutex_t mtx;
+    /** Signaled when a new job starts, or when the pool stops */
+    pthread_cond_t start;
+    /** Signaled when the last band of a job is done */
+    pthread_cond_t done;
+    /** Incremented for each job, so that a worker runs each job once */
+    unsigned generation;
+    /** Bands of the current job not processed yet */
+    int remaining;
+    int stop;
+
+    /* Current job */
+    band_fn fn;
+    void* arg;
+    int rows;
+    int align;
+};
+
+/* Rows of the band i of the current job. */
+static void band_rows(const struct band_pool* pool, int i, int* y0, int* y1)
+{
+    int bands = pool->threads;
+    int step = (pool->rows + bands - 1) / bands;
+
+    step = (step + pool->align - 1) / pool->align * pool->align;
+    *y0 = i * step < pool->rows ? i * step : pool->rows;
+    *y1 = *y0 + step < pool->rows ? *y0 + step : pool->rows;
+}
+
+static void run_band(struct band_pool* pool, int i)
+{
+    int y0, y1;
+
+    band_rows(pool, i, &y0, &y1);
+    if (y0 < y1)
+        pool->fn(pool->arg, y0, y1);
+}
+
+/* Argument of a worker thread: its band, the caller runs band 0. */
+struct worker_arg
+{
+    struct band_pool* pool;
+    int band;
+};
+
+static void* worker(void* arg)
+{
+    struct worker_arg* wa = arg;
+    struct band_pool* pool = wa->pool;
+    int band = wa->band;
+    unsigned seen = 0;
+
+    free(wa);
+
+    pthread_mutex_lock(&pool->mtx);
+    while (1)
+    {
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->start, &pool->mtx);
+        if (pool->stop)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->mtx);
+
+        run_band(pool, band);
+
+        pthread_mutex_lock(&pool->mtx);
+        if (--pool->remaining == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mtx);
+    return NULL;
+}
+
+struct band_pool* band_pool_new(int threads)
+{
+    struct band_pool* pool;
+    struct worker_arg* wa;
+    int i;
+
+    if (threads <= 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads > BAND_POOL_DEFAULT_MAX)
+            threads = BAND_POOL_DEFAULT_MAX;
+        if (threads < 1)
+            threads = 1;
+    }
+    if (threads > BAND_POOL_MAX)
+        threads = BAND_POOL_MAX;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->threads = threads;
+    pthread_mutex_init(&pool->mtx, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 1; i < threads; i++)
+    {
+        wa = malloc(sizeof(*wa));
+        if (!wa)
+            LOGE("band_pool_new(): out of memory");
+        wa->pool = pool;
+        wa->band = i;
+        if (pthread_create(&pool->workers[i], NULL, worker, wa))
+            LOGE("Unable to start the band workers");
+    }
+    return pool;
+}
+
+int band_pool_threads(const struct band_pool* pool)
+{
+    return pool->threads;
+}
+
+void band_pool_run(struct band_pool* pool, band_fn fn, void* arg, int rows, int align)
+{
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->rows = rows;
+    pool->align = align > 0 ? align : 1;
+
+    if (pool->threads == 1)
+    {
+        run_band(pool, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mtx);
+    pool->remaining = pool->threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mtx);
+
+    run_band(pool, 0);
+
+    pthread_mutex_lock(&pool->mtx);
+    while (pool->remaining)
+        pthread_cond_wait(&pool->done, &pool->mtx);
+    pthread_mutex_unlock(&pool->mtx);
+}
+
+void band_pool_free(struct band_pool* pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mtx);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mtx);
+
+    for (i = 1; i < pool->threads; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    pthread_mutex_destroy(&pool->mtx);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
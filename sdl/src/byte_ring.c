@@ -0,0 +1,123 @@
+/**
+ * \file byte_ring.c
+ * \brief Lock-free single-producer single-consumer ring of bytes.
+ */
+#include <stdint.h>  // for uint8_t, uint64_t
+#include <stdlib.h>  // for calloc, malloc, free
+#include <string.h>  // for memcpy
+
+#include "byte_ring.h"
+#include "logger.h"
+
+#define LOG_TAG "byte_ring"
+
+struct byte_ring
+{
+    uint8_t* data;
+    int capacity;
+
+    /** Bytes ever written, advanced by the producer only */
+    uint64_t head __attribute__((aligned(64)));
+    int closed;
+    /* Counters of the producer */
+    int high_water;
+    uint64_t written_bytes;
+    uint64_t drops;
+    uint64_t dropped_bytes;
+
+    /** Bytes ever read, advanced by the consumer only */
+    uint64_t tail __attribute__((aligned(64)));
+};
+
+struct byte_ring* byte_ring_new(int capacity)
+{
+    struct byte_ring* ring = calloc(1, sizeof(*ring));
+
+    if (!ring)
+        return NULL;
+    ring->capacity = capacity;
+    ring->data = malloc(capacity);
+    if (!ring->data)
+    {
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+int byte_ring_write(struct byte_ring* ring, const uint8_t* data, int size)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    int level = (int) (head - tail);
+    int pos = (int) (head % ring->capacity);
+    int n;
+
+    if (size > ring->capacity - level)
+    {
+        __atomic_store_n(&ring->drops, ring->drops + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->dropped_bytes, ring->dropped_bytes + size, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    n = size < ring->capacity - pos ? size : ring->capacity - pos;
+    memcpy(ring->data + pos, data, n);
+    memcpy(ring->data, data + n, size - n);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+
+    if (level + size > ring->high_water)
+        __atomic_store_n(&ring->high_water, level + size, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->written_bytes, ring->written_bytes + size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void byte_ring_close(struct byte_ring* ring)
+{
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+int byte_ring_read(struct byte_ring* ring, uint8_t* out, int size)
+{
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    int level = (int) (head - tail);
+    int pos = (int) (tail % ring->capacity);
+    int n;
+
+    if (size > level)
+        size = level;
+    n = size < ring->capacity - pos ? size : ring->capacity - pos;
+    memcpy(out, ring->data + pos, n);
+    memcpy(out + n, ring->data, size - n);
+    __atomic_store_n(&ring->tail, tail + size, __ATOMIC_RELEASE);
+    return size;
+}
+
+int byte_ring_eof(struct byte_ring* ring)
+{
+    /* The last write is visible once the close is */
+    if (!__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+        return 0;
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+void byte_ring_stats(struct byte_ring* ring, struct byte_ring_stats* stats)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    stats->capacity = ring->capacity;
+    stats->level = head > tail ? (int) (head - tail) : 0;
+    stats->high_water = __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED);
+    stats->written_bytes = __atomic_load_n(&ring->written_bytes, __ATOMIC_RELAXED);
+    stats->drops = __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+    stats->dropped_bytes = __atomic_load_n(&ring->dropped_bytes, __ATOMIC_RELAXED);
+}
+
+void byte_ring_free(struct byte_ring* ring)
+{
+    if (!ring)
+        return;
+    free(ring->data);
+    free(ring);
+}
@@ -0,0 +1,224 @@
+/**
+ * \file change_detect.c
+ * \brief Detection of the changes of a window between two captures of a recording.
+ */
+#include <X11/Xlib.h>  // for XImage, XCheckIfEvent
+#include <stdint.h>    // for uint64_t, uint8_t
+#include <stdlib.h>    // for calloc, free
+#include <string.h>    // for memcpy, strcmp
+
+#include "change_detect.h"
+#include "logger.h"
+
+#define LOG_TAG "change_detect"
+
+#define HASH_PRIME 0x9E3779B97F4A7C15ULL
+
+static inline uint64_t mix(uint64_t h, uint64_t v)
+{
+    h = (h ^ v) * HASH_PRIME;
+    return h ^ (h >> 29);
+}
+
+static inline uint64_t load64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Hash len bytes into h. Not a cryptographic hash: collisions only need
+ * to be unlikely between two successive captures of the same tile. */
+static uint64_t hash_bytes(uint64_t h, const uint8_t* p, int len)
+{
+    uint64_t a = h, b = h + 1, c = h + 2, d = h + 3;
+    uint64_t tail = 0;
+
+    // Four independent chains keep the multiplier busy
+    for (; len >= 32; p += 32, len -= 32)
+    {
+        a = mix(a, load64(p));
+        b = mix(b, load64(p + 8));
+        c = mix(c, load64(p + 16));
+        d = mix(d, load64(p + 24));
+    }
+    for (; len >= 8; p += 8, len -= 8)
+        a = mix(a, load64(p));
+    if (len)
+    {
+        memcpy(&tail, p, len);
+        b = mix(b, tail);
+    }
+
+    return mix(mix(mix(a, b), c), d);
+}
+
+int change_mode_from_name(const char* name)
+{
+    if (!strcmp(name, "none"))
+        return CHANGE_NONE;
+    if (!strcmp(name, "hash"))
+        return CHANGE_HASH;
+    if (!strcmp(name, "damage"))
+        return CHANGE_DAMAGE;
+    return -1;
+}
+
+const char* change_mode_name(int mode)
+{
+    switch (mode)
+    {
+    case CHANGE_HASH:
+        return "hash";
+    case CHANGE_DAMAGE:
+        return "damage";
+    default:
+        return "none";
+    }
+}
+
+int change_detect_init(struct change_detect* cd, int mode, Display* display, Drawable drawable,
+                       int width, int height)
+{
+    memset(cd, 0, sizeof(*cd));
+    cd->display = display;
+    cd->drawable = drawable;
+    cd->first = 1;
+
+    if (mode == CHANGE_DAMAGE)
+    {
+#ifdef HAVE_XDAMAGE
+        int event_base, error_base;
+
+        if (XDamageQueryExtension(display, &event_base, &error_base))
+        {
+            cd->damage = XDamageCreate(display, drawable, XDamageReportNonEmpty);
+            cd->damage_event = event_base + XDamageNotify;
+        }
+        else
+        {
+            LOGW("The X server does not support XDamage, hashing the captures instead");
+            mode = CHANGE_HASH;
+        }
+#else
+        LOGW("Built without XDamage, hashing the captures instead");
+        mode = CHANGE_HASH;
+#endif
+    }
+
+    if (mode == CHANGE_HASH)
+    {
+        cd->tiles_x = (width + CHANGE_TILE - 1) / CHANGE_TILE;
+        cd->tiles_y = (height + CHANGE_TILE - 1) / CHANGE_TILE;
+        cd->hashes = calloc(cd->tiles_x * cd->tiles_y, sizeof(*cd->hashes));
+        cd->row = calloc(cd->tiles_x, sizeof(*cd->row));
+        if (!cd->hashes || !cd->row)
+        {
+            change_detect_destroy(cd);
+            return -1;
+        }
+    }
+
+    cd->mode = mode;
+    LOGI("Detecting the changes of the window with method %s", change_mode_name(mode));
+    return 0;
+}
+
+#ifdef HAVE_XDAMAGE
+/* Match the notifications of the damage of one recording only: the recordings share the
+ * Display of the grabber, and each of them must subtract its own damage to be notified again */
+static Bool is_own_damage(Display* display, XEvent* event, XPointer arg)
+{
+    struct change_detect* cd = (struct change_detect*) arg;
+
+    (void) display;
+    return event->type == cd->damage_event
+           && ((XDamageNotifyEvent*) event)->damage == cd->damage;
+}
+#endif
+
+int change_detect_pending(struct change_detect* cd)
+{
+#ifdef HAVE_XDAMAGE
+    if (cd->mode == CHANGE_DAMAGE)
+    {
+        XEvent event;
+        int damaged = cd->first;
+
+        // With XDamageReportNonEmpty, one event is sent each time the damage becomes non empty
+        while (XCheckIfEvent(cd->display, &event, is_own_damage, (XPointer) cd))
+            damaged = 1;
+        if (damaged)
+            XDamageSubtract(cd->display, cd->damage, None, None);
+
+        cd->first = 0;
+        return damaged;
+    }
+#else
+    (void) cd;
+#endif
+    return 1;
+}
+
+int change_detect_image(struct change_detect* cd, XImage* image)
+{
+    int bytes_per_pixel = (image->bits_per_pixel + 7) / 8;
+    int tile_bytes = CHANGE_TILE * bytes_per_pixel;
+    int row_bytes = image->width * bytes_per_pixel;
+    int tx, ty, y;
+
+    if (cd->mode != CHANGE_HASH)
+        return 1;
+
+    cd->changed_tiles = 0;
+    for (ty = 0; ty < cd->tiles_y; ty++)
+    {
+        int y_end = (ty + 1) * CHANGE_TILE;
+        if (y_end > image->height)
+            y_end = image->height;
+
+        for (tx = 0; tx < cd->tiles_x; tx++)
+            cd->row[tx] = ty * cd->tiles_x + tx;
+
+        for (y = ty * CHANGE_TILE; y < y_end; y++)
+        {
+            const uint8_t* line = (const uint8_t*) image->data + y * image->bytes_per_line;
+            for (tx = 0; tx < cd->tiles_x; tx++)
+            {
+                int offset = tx * tile_bytes;
+                int len = row_bytes - offset < tile_bytes ? row_bytes - offset : tile_bytes;
+                cd->row[tx] = hash_bytes(cd->row[tx], line + offset, len);
+            }
+        }
+
+        uint64_t* hashes = cd->hashes + ty * cd->tiles_x;
+        for (tx = 0; tx < cd->tiles_x; tx++)
+        {
+            if (hashes[tx] != cd->row[tx])
+            {
+                hashes[tx] = cd->row[tx];
+                cd->changed_tiles++;
+            }
+        }
+    }
+
+    if (cd->first)
+    {
+        cd->first = 0;
+        return 1;
+    }
+    return cd->changed_tiles > 0;
+}
+
+void change_detect_destroy(struct change_detect* cd)
+{
+#ifdef HAVE_XDAMAGE
+    if (cd->damage)
+        XDamageDestroy(cd->display, cd->damage);
+    cd->damage = 0;
+#endif
+    free(cd->hashes);
+    free(cd->row);
+    cd->hashes = NULL;
+    cd->row = NULL;
+}
@@ -33,6 +33,15 @@ char* configvar_string(char* varname)
     return val;
 }
 
+char* configvar_string_default(char* varname, char* def)
+{
+    char* val = getenv(varname);
+    if (val == NULL || strlen(val) == 0)
+        val = def;
+    LOGD("%s: %s", varname, val);
+    return val;
+}
+
 int configvar_int(char* varname)
 {
     int ret;
@@ -59,3 +68,13 @@ int configvar_bool(char* varname)
     LOGD("%s: %d", varname, ret);
     return ret;
 }
+
+int configvar_int_default(char* varname, int def)
+{
+    int ret = def;
+    char* val = getenv(varname);
+    if (val != NULL && strlen(val) != 0)
+        ret = atoi(val);
+    LOGD("%s: %d", varname, ret);
+    return ret;
+}
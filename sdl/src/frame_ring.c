@@ -0,0 +1,398 @@
+/**
+ * \file frame_ring.c
+ * \brief Bounded queue of pre-allocated AVFrames between two stages of the recorder.
+ *
+ * Each queue is an array of cells tagged with sequence numbers: a thread
+ * claims a cell by advancing the head or tail index with a compare and swap,
+ * and the sequence number tells it whether the cell was already filled or
+ * emptied by the other side. Both queues have room for every frame of the
+ * ring, so a push never fails. A semaphore counts the frames of each queue,
+ * and a token of the semaphore guarantees that a pop finds a frame; closing
+ * the ring posts one token without a frame.
+ *
+ * The buffer of a frame holds all its planes, so that a single pool serves
+ * any pixel format.
+ */
+#include <errno.h>               // for EINTR, ENOMEM
+#include <libavutil/buffer.h>    // for AVBufferPool, av_buffer_pool_get
+#include <libavutil/error.h>     // for AVERROR
+#include <libavutil/frame.h>     // for av_frame_alloc, av_frame_is_writable
+#include <libavutil/imgutils.h>  // for av_image_get_buffer_size, av_image_fill_arrays
+#include <semaphore.h>           // for sem_t, sem_wait, sem_post
+#include <stdint.h>              // for uint64_t, int64_t
+#include <stdio.h>               // for snprintf
+#include <stdlib.h>              // for calloc, free
+#include <string.h>              // for strcmp
+
+#include "frame_ring.h"
+#include "logger.h"
+
+#define LOG_TAG "frame_ring"
+
+/** \brief Number of cells of a queue, a power of two >= FRAME_RING_MAX */
+#define QUEUE_CELLS 64
+#define QUEUE_MASK (QUEUE_CELLS - 1)
+
+/** \brief Alignment of the rows of the frames, for the SIMD kernels */
+#define FRAME_ALIGN 32
+/** \brief Bytes after the last plane, which the encoders may read past its end */
+#define FRAME_PADDING 64
+
+struct queue_cell
+{
+    /** Position of the next push (if equal) or pop (if one above) of this cell */
+    uint64_t seq;
+    AVFrame* frame;
+};
+
+struct frame_queue
+{
+    struct queue_cell cells[QUEUE_CELLS];
+    /** Position of the next push, owned by the producers */
+    uint64_t head __attribute__((aligned(64)));
+    /** Position of the next pop, owned by the consumers */
+    uint64_t tail __attribute__((aligned(64)));
+    /** Number of frames in the queue */
+    sem_t count;
+};
+
+struct frame_ring
+{
+    char name[32];
+    int size;
+    int policy;
+    int closed;
+    AVFrame* frames[FRAME_RING_MAX];
+    /** Size and format of the frames, and pool of their buffers */
+    enum AVPixelFormat format;
+    int width;
+    int height;
+    AVBufferPool* pool;
+    uint64_t allocations;
+    /** Frames the producer can fill */
+    struct frame_queue free;
+    /** Frames published to the consumer, oldest first */
+    struct frame_queue ready;
+    uint64_t dropped;
+    uint64_t waits;
+};
+
+/** \brief Buffers allocated by every pool, and by the pools of the current thread */
+static uint64_t s_allocations;
+static __thread uint64_t t_allocations;
+
+/* Allocator of the pools, counting the buffers actually allocated. */
+static AVBufferRef* alloc_buffer(int size)
+{
+    __atomic_add_fetch(&s_allocations, 1, __ATOMIC_RELAXED);
+    t_allocations++;
+    return av_buffer_alloc(size);
+}
+
+/* Pool of the buffers of width x height frames. */
+static AVBufferPool* new_pool(enum AVPixelFormat format, int width, int height)
+{
+    int size = av_image_get_buffer_size(format, width, height, FRAME_ALIGN);
+
+    if (size < 0)
+        return NULL;
+    return av_buffer_pool_init(size + FRAME_PADDING, alloc_buffer);
+}
+
+/* Replace the buffer of a frame by a buffer of the pool. */
+static int attach_buffer(struct frame_ring* ring, AVFrame* frame)
+{
+    uint64_t allocated = t_allocations;
+    AVBufferRef* buf = av_buffer_pool_get(ring->pool);
+
+    if (!buf)
+        return AVERROR(ENOMEM);
+    if (t_allocations != allocated)
+        __atomic_add_fetch(&ring->allocations, t_allocations - allocated, __ATOMIC_RELAXED);
+
+    av_frame_unref(frame);
+    frame->format = ring->format;
+    frame->width = ring->width;
+    frame->height = ring->height;
+    frame->buf[0] = buf;
+    av_image_fill_arrays(frame->data, frame->linesize, buf->data, ring->format, ring->width,
+                         ring->height, FRAME_ALIGN);
+    return 0;
+}
+
+static void queue_init(struct frame_queue* q)
+{
+    uint64_t i;
+
+    for (i = 0; i < QUEUE_CELLS; i++)
+        q->cells[i].seq = i;
+    q->head = 0;
+    q->tail = 0;
+    sem_init(&q->count, 0, 0);
+}
+
+static void queue_push(struct frame_queue* q, AVFrame* frame)
+{
+    uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct queue_cell* cell;
+
+    for (;;)
+    {
+        cell = &q->cells[pos & QUEUE_MASK];
+        int64_t diff = (int64_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t) pos;
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // More frames than cells, cannot happen with FRAME_RING_MAX <= QUEUE_CELLS
+            LOGE("frame queue overflow");
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->frame = frame;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&q->count);
+}
+
+/* Take the oldest frame of a queue, the caller must own a token of q->count. */
+static AVFrame* queue_pop(struct frame_queue* q)
+{
+    uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct queue_cell* cell;
+    AVFrame* frame;
+
+    for (;;)
+    {
+        cell = &q->cells[pos & QUEUE_MASK];
+        int64_t diff = (int64_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t)(pos + 1);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // Only the token posted by frame_ring_close() has no frame
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    frame = cell->frame;
+    __atomic_store_n(&cell->seq, pos + QUEUE_CELLS, __ATOMIC_RELEASE);
+    return frame;
+}
+
+static void queue_wait(struct frame_queue* q)
+{
+    while (sem_wait(&q->count) < 0 && errno == EINTR)
+        ;
+}
+
+int frame_ring_policy_from_name(const char* name)
+{
+    if (!strcmp(name, "block"))
+        return FRAME_RING_BLOCK;
+    if (!strcmp(name, "drop"))
+        return FRAME_RING_DROP_OLDEST;
+    return -1;
+}
+
+const char* frame_ring_policy_name(int policy)
+{
+    return policy == FRAME_RING_BLOCK ? "block" : "drop";
+}
+
+struct frame_ring* frame_ring_new(const char* name, int size, int policy,
+                                  enum AVPixelFormat format, int width, int height)
+{
+    struct frame_ring* ring;
+    int i;
+
+    if (size < 2 || size > FRAME_RING_MAX)
+    {
+        LOGW("Invalid size %d for the %s ring", size, name);
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    ring->size = size;
+    ring->policy = policy;
+    ring->format = format;
+    ring->width = width;
+    ring->height = height;
+    queue_init(&ring->free);
+    queue_init(&ring->ready);
+
+    ring->pool = new_pool(format, width, height);
+    if (!ring->pool)
+        goto fail;
+
+    for (i = 0; i < size; i++)
+    {
+        AVFrame* frame = av_frame_alloc();
+        ring->frames[i] = frame;
+        if (!frame || attach_buffer(ring, frame) < 0)
+            goto fail;
+
+        queue_push(&ring->free, frame);
+    }
+
+    LOGI("%s ring: %d frames of %dx%d, policy %s", name, size, width, height,
+         frame_ring_policy_name(policy));
+    return ring;
+
+fail:
+    LOGW("Unable to allocate the frames of the %s ring", name);
+    frame_ring_free(ring);
+    return NULL;
+}
+
+AVFrame* frame_ring_acquire(struct frame_ring* ring)
+{
+    AVFrame* frame;
+
+    if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    if (sem_trywait(&ring->free.count) == 0)
+        return queue_pop(&ring->free);
+
+    if (ring->policy == FRAME_RING_DROP_OLDEST && sem_trywait(&ring->ready.count) == 0)
+    {
+        frame = queue_pop(&ring->ready);
+        if (frame)
+        {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return frame;
+        }
+        // The ring was closed meanwhile, leave the token to the consumer
+        sem_post(&ring->ready.count);
+    }
+
+    // The consumer holds every frame
+    __atomic_add_fetch(&ring->waits, 1, __ATOMIC_RELAXED);
+    queue_wait(&ring->free);
+    frame = queue_pop(&ring->free);
+    if (!frame)
+        sem_post(&ring->free.count);
+    return frame;
+}
+
+int frame_ring_make_writable(struct frame_ring* ring, AVFrame* frame)
+{
+    if (frame->width == ring->width && frame->height == ring->height &&
+        av_frame_is_writable(frame))
+        return 0;
+
+    /* The encoder still holds the buffer: take another one rather than copy it */
+    return attach_buffer(ring, frame);
+}
+
+int frame_ring_resize(struct frame_ring* ring, int width, int height)
+{
+    AVBufferPool* pool;
+
+    if (width == ring->width && height == ring->height)
+        return 0;
+
+    pool = new_pool(ring->format, width, height);
+    if (!pool)
+        return -1;
+
+    /* The old pool is freed once its last buffer is unreferenced */
+    av_buffer_pool_uninit(&ring->pool);
+    ring->pool = pool;
+    ring->width = width;
+    ring->height = height;
+    LOGI("%s ring: frames resized to %dx%d", ring->name, width, height);
+    return 0;
+}
+
+void frame_ring_publish(struct frame_ring* ring, AVFrame* frame)
+{
+    queue_push(&ring->ready, frame);
+}
+
+AVFrame* frame_ring_pop(struct frame_ring* ring)
+{
+    AVFrame* frame;
+
+    queue_wait(&ring->ready);
+    frame = queue_pop(&ring->ready);
+    if (!frame)
+        // Closed and empty: keep the token for the next call
+        sem_post(&ring->ready.count);
+    return frame;
+}
+
+void frame_ring_release(struct frame_ring* ring, AVFrame* frame)
+{
+    queue_push(&ring->free, frame);
+}
+
+void frame_ring_close(struct frame_ring* ring)
+{
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+    sem_post(&ring->ready.count);
+    sem_post(&ring->free.count);
+}
+
+uint64_t frame_ring_dropped(const struct frame_ring* ring)
+{
+    return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
+
+uint64_t frame_ring_waits(const struct frame_ring* ring)
+{
+    return __atomic_load_n(&ring->waits, __ATOMIC_RELAXED);
+}
+
+uint64_t frame_ring_allocations(const struct frame_ring* ring)
+{
+    return __atomic_load_n(&ring->allocations, __ATOMIC_RELAXED);
+}
+
+uint64_t frame_ring_total_allocations(void)
+{
+    return __atomic_load_n(&s_allocations, __ATOMIC_RELAXED);
+}
+
+void frame_ring_free(struct frame_ring* ring)
+{
+    int i;
+
+    if (!ring)
+        return;
+
+    LOGI("%s ring: %llu frames dropped, %llu waits for a free frame, %llu buffers allocated for "
+         "%d frames",
+         ring->name, (unsigned long long) frame_ring_dropped(ring),
+         (unsigned long long) frame_ring_waits(ring),
+         (unsigned long long) frame_ring_allocations(ring), ring->size);
+
+    for (i = 0; i < ring->size; i++)
+        av_frame_free(&ring->frames[i]);
+    av_buffer_pool_uninit(&ring->pool);
+    sem_destroy(&ring->free.count);
+    sem_destroy(&ring->ready.count);
+    free(ring);
+}
@@ -0,0 +1,80 @@
+/**
+ * \file gl_capture.c
+ * \brief Capture files of the OpenGL streams
+ */
+#include <errno.h>   // for errno
+#include <stdio.h>   // for fopen, fwrite, setvbuf
+#include <string.h>  // for memcpy, memcmp, strerror
+#include <unistd.h>  // for getpid
+
+#include "buffer_sizes.h"
+#include "logger.h"
+
+#include "gl_capture.h"
+
+#define LOG_TAG "gl_capture"
+
+FILE* gl_capture_open(const char* dir, int reactor, unsigned int conn)
+{
+    char filename[BIG_BUF_SIZE];
+    struct gl_capture_header header;
+    FILE* f;
+
+    snprintf(filename, sizeof(filename), "%s/gl_%d_%d_%u.glcap", dir, (int) getpid(), reactor,
+             conn);
+    f = fopen(filename, "wb");
+    if (!f)
+    {
+        LOGW("Unable to open capture file %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, GL_CAPTURE_BUFFER_SIZE);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GL_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = GL_CAPTURE_VERSION;
+    if (fwrite(&header, sizeof(header), 1, f) != 1)
+    {
+        LOGW("Unable to write capture file %s: %s", filename, strerror(errno));
+        fclose(f);
+        return NULL;
+    }
+
+    LOGI("Capturing connection %u of relay thread %d to %s", conn, reactor, filename);
+    return f;
+}
+
+int gl_capture_write(FILE* f, int direction, const char* data, size_t len, uint64_t timestamp_ns)
+{
+    struct gl_capture_record record;
+
+    record.timestamp_ns = timestamp_ns;
+    record.direction = direction;
+    record.length = len;
+
+    if (fwrite(&record, sizeof(record), 1, f) != 1 || fwrite(data, 1, len, f) != len)
+        return -1;
+    return 0;
+}
+
+int gl_capture_check(FILE* f)
+{
+    struct gl_capture_header header;
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, GL_CAPTURE_MAGIC, sizeof(header.magic)))
+        return -1;
+    if (header.version != GL_CAPTURE_VERSION)
+    {
+        LOGW("Unsupported capture version %u", header.version);
+        return -1;
+    }
+    return 0;
+}
+
+int gl_capture_next(FILE* f, struct gl_capture_record* record)
+{
+    if (fread(record, sizeof(*record), 1, f) != 1)
+        return feof(f) ? 0 : -1;
+    return 1;
+}
@@ -0,0 +1,190 @@
+/**
+ * \file gl_codec.c
+ * \brief Framed compression of the OpenGL streams
+ *
+ * Without HAVE_LZ4, frames are only ever stored, and compressed frames are
+ * rejected as corrupted: gl_codec_available() tells the callers not to offer
+ * the codec in the first place.
+ */
+#include <arpa/inet.h>  // for htonl, ntohl
+#include <stdlib.h>     // for calloc
+#include <string.h>     // for memcpy, strcmp
+
+#ifdef HAVE_LZ4
+#include <lz4.h>  // for LZ4_compress_default, LZ4_decompress_safe
+#endif
+
+#include "logger.h"
+
+#include "gl_codec.h"
+
+#define LOG_TAG "gl_codec"
+
+#define HEADER_SIZE sizeof(struct gl_codec_header)
+
+int gl_codec_from_name(const char* name)
+{
+    if (!strcmp(name, "lz4"))
+        return GL_CODEC_LZ4;
+    if (strcmp(name, "none"))
+        LOGW("Unknown codec %s, the OpenGL streams will not be compressed", name);
+    return GL_CODEC_NONE;
+}
+
+const char* gl_codec_name(int codec)
+{
+    return codec == GL_CODEC_LZ4 ? "lz4" : "none";
+}
+
+int gl_codec_available(int codec)
+{
+#ifdef HAVE_LZ4
+    return codec == GL_CODEC_NONE || codec == GL_CODEC_LZ4;
+#else
+    return codec == GL_CODEC_NONE;
+#endif
+}
+
+size_t gl_codec_encode_bound(size_t len)
+{
+    // Frames that do not shrink are stored, only the headers can add bytes
+    return len + (len / GL_CODEC_FRAME_SIZE + 1) * HEADER_SIZE;
+}
+
+size_t gl_codec_encode(const char* in, size_t len, char* out)
+{
+    size_t out_len = 0;
+
+    while (len > 0)
+    {
+        struct gl_codec_header header;
+        int raw_len = len < GL_CODEC_FRAME_SIZE ? len : GL_CODEC_FRAME_SIZE;
+        int comp_len = 0;
+
+#ifdef HAVE_LZ4
+        // Leave no room for a frame as big as the input: it is stored instead
+        comp_len = LZ4_compress_default(in, out + out_len + HEADER_SIZE, raw_len, raw_len - 1);
+#endif
+        if (comp_len <= 0)
+        {
+            memcpy(out + out_len + HEADER_SIZE, in, raw_len);
+            comp_len = raw_len;
+        }
+
+        header.raw_len = htonl(raw_len);
+        header.comp_len = htonl(comp_len);
+        memcpy(out + out_len, &header, HEADER_SIZE);
+
+        out_len += HEADER_SIZE + comp_len;
+        in += raw_len;
+        len -= raw_len;
+    }
+    return out_len;
+}
+
+struct gl_decoder* gl_decoder_new(void)
+{
+    return (struct gl_decoder*) calloc(1, sizeof(struct gl_decoder));
+}
+
+/** Read and check a frame header
+ * \returns 0 if the header is valid, -1 otherwise
+ */
+static int parse_header(const char* data, uint32_t* raw_len, uint32_t* comp_len)
+{
+    struct gl_codec_header header;
+
+    memcpy(&header, data, HEADER_SIZE);
+    *raw_len = ntohl(header.raw_len);
+    *comp_len = ntohl(header.comp_len);
+
+    if (*raw_len == 0 || *raw_len > GL_CODEC_FRAME_SIZE || *comp_len == 0 ||
+        *comp_len > *raw_len)
+    {
+        LOGW("Invalid frame header: %u bytes in %u", *raw_len, *comp_len);
+        return -1;
+    }
+    return 0;
+}
+
+/** Decode the payload of one frame
+ * \returns 0 on success, -1 if the payload is corrupted
+ */
+static int decode_frame(const char* data, uint32_t comp_len, char* out, uint32_t raw_len)
+{
+    if (comp_len == raw_len)
+    {
+        memcpy(out, data, raw_len);
+        return 0;
+    }
+
+#ifdef HAVE_LZ4
+    if (LZ4_decompress_safe(data, out, comp_len, raw_len) == (int) raw_len)
+        return 0;
+#endif
+    LOGW("Unable to decompress a frame of %u bytes", comp_len);
+    return -1;
+}
+
+ssize_t gl_decode(struct gl_decoder* d, char* out, size_t out_cap)
+{
+    size_t produced = 0;
+    uint32_t raw_len, comp_len;
+
+    while (1)
+    {
+        size_t avail = d->in_len - d->in_off;
+        size_t n;
+
+        // Fast path: the whole frame is in the input buffer
+        if (d->frame_len == 0 && avail >= HEADER_SIZE)
+        {
+            const char* frame = d->in + d->in_off;
+            if (parse_header(frame, &raw_len, &comp_len) < 0)
+                return -1;
+            if (avail >= HEADER_SIZE + comp_len)
+            {
+                if (out_cap - produced < raw_len)
+                    break;
+                if (decode_frame(frame + HEADER_SIZE, comp_len, out + produced, raw_len) < 0)
+                    return -1;
+                d->in_off += HEADER_SIZE + comp_len;
+                produced += raw_len;
+                continue;
+            }
+        }
+
+        // Slow path: reassemble the frame split across reads
+        if (d->frame_len < HEADER_SIZE)
+        {
+            n = HEADER_SIZE - d->frame_len;
+            if (n > avail)
+                n = avail;
+            memcpy(d->frame + d->frame_len, d->in + d->in_off, n);
+            d->frame_len += n;
+            d->in_off += n;
+            avail -= n;
+            if (d->frame_len < HEADER_SIZE)
+                break;
+        }
+
+        if (parse_header(d->frame, &raw_len, &comp_len) < 0)
+            return -1;
+
+        n = HEADER_SIZE + comp_len - d->frame_len;
+        if (n > avail)
+            n = avail;
+        memcpy(d->frame + d->frame_len, d->in + d->in_off, n);
+        d->frame_len += n;
+        d->in_off += n;
+
+        if (d->frame_len < HEADER_SIZE + comp_len || out_cap - produced < raw_len)
+            break;
+        if (decode_frame(d->frame + HEADER_SIZE, comp_len, out + produced, raw_len) < 0)
+            return -1;
+        d->frame_len = 0;
+        produced += raw_len;
+    }
+
+    return produced;
+}
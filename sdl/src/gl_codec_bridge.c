@@ -0,0 +1,222 @@
+/**
+ * \file gl_codec_bridge.c
+ * \brief Stand-in for the VM end of the OpenGL streams compression
+ *
+ * gl_codec_bridge listens on the OpenGL ports in place of the VM and relays
+ * everything to a VM which does not support compression:
+ *
+ *     player <-- compressed --> gl_codec_bridge <-- plain --> VM
+ *
+ * It answers the OPENGL_CODEC_OFFER of the player itself, then relays the
+ * main connection untouched, and decodes/encodes the frames of the data
+ * connections with the same relay threads as the player (the VM plays the
+ * role of the render libs, the player the role of the VM).
+ *
+ * Run it next to the VM and point the player to it, to measure the bandwidth
+ * saved across hosts, or on the player host to test the codec end to end.
+ *
+ * Usage: gl_codec_bridge [-m main_port] [-d data_port] [-t threads] [-s interval] vm_ip
+ *
+ * - main_port and data_port are the ports to listen on (MAIN_PORT and
+ *   OPENGL_DATA_PORT by default, the VM is always reached on those).
+ * - threads is the number of relay threads (default 1).
+ * - interval is the number of seconds between two logs of the counters.
+ */
+#include <errno.h>        // for errno
+#include <getopt.h>       // for getopt, optarg, optind
+#include <netinet/tcp.h>  // for TCP_NODELAY
+#include <pthread.h>      // for pthread_create, pthread_mutex_lock
+#include <signal.h>       // for SIGPIPE, SIG_IGN, signal
+#include <stdio.h>        // for fprintf
+#include <stdlib.h>       // for atoi
+#include <string.h>       // for strerror
+#include <sys/socket.h>   // for accept, recv, setsockopt
+#include <sys/time.h>     // for timeval
+#include <unistd.h>       // for write, close
+
+#include "gl_codec.h"
+#include "gl_relay.h"
+#include "host_gl.h"
+#include "logger.h"
+#include "socket.h"
+
+#define LOG_TAG "gl_bridge"
+
+static const char* s_vmip;
+static struct sockaddr_in s_vm_data_addr;
+static pthread_mutex_t s_mtx = PTHREAD_MUTEX_INITIALIZER;
+/** Codec negotiated by the last player session */
+static int s_codec = GL_CODEC_NONE;
+
+/** Answer the codec offer of the player, if any
+ * \returns The codec of the data connections
+ */
+static int answer_offer(socket_t player_socket)
+{
+    struct timeval timeout = {GL_CODEC_HANDSHAKE_TIMEOUT_MS / 1000,
+                              (GL_CODEC_HANDSHAKE_TIMEOUT_MS % 1000) * 1000};
+    struct timeval no_timeout = {0, 0};
+    unsigned int offer[2];
+    unsigned int ack[2] = {OPENGL_CODEC_ACK, GL_CODEC_NONE};
+
+    // A player which does not compress sends nothing until the VM pings it
+    setsockopt(player_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(player_socket, offer, sizeof(offer), MSG_WAITALL) == sizeof(offer) &&
+        offer[0] == OPENGL_CODEC_OFFER)
+    {
+        if (gl_codec_available(offer[1]))
+            ack[1] = offer[1];
+        if (write(player_socket, ack, sizeof(ack)) != sizeof(ack))
+            LOGW("Unable to answer the codec offer: %s", strerror(errno));
+    }
+    setsockopt(player_socket, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+
+    return ack[1];
+}
+
+/** Connect a new player session to the VM and relay its main connection */
+static void handle_session(socket_t player_socket)
+{
+    unsigned int cmd;
+    socket_t vm_socket;
+    int codec;
+
+    if (recv(player_socket, &cmd, sizeof(cmd), MSG_WAITALL) != sizeof(cmd) ||
+        cmd != OPENGL_START_COMMAND)
+    {
+        LOGW("Unexpected start of session, closing it");
+        close(player_socket);
+        return;
+    }
+
+    vm_socket = open_socket_reuseaddr(s_vmip, MAIN_PORT);
+    if (vm_socket == SOCKET_ERROR)
+    {
+        close(player_socket);
+        return;
+    }
+    if (write(vm_socket, &cmd, sizeof(cmd)) != sizeof(cmd))
+        LOGW("Unable to start the session with the VM: %s", strerror(errno));
+
+    codec = answer_offer(player_socket);
+    LOGI("New player session, codec %s", gl_codec_name(codec));
+
+    pthread_mutex_lock(&s_mtx);
+    s_codec = codec;
+    pthread_mutex_unlock(&s_mtx);
+
+    if (gl_relay_add(vm_socket, player_socket, GL_CODEC_NONE) < 0)
+        LOGW("Unable to relay the main connection");
+}
+
+static void* data_thread(void* arg)
+{
+    socket_t server = *((socket_t*) arg);
+    int yes = 1;
+
+    while (1)
+    {
+        socket_t player_socket, vm_socket;
+        int codec;
+
+        player_socket = accept(server, NULL, NULL);
+        if (player_socket < 0)
+        {
+            LOGW("accept() error: %s", strerror(errno));
+            continue;
+        }
+        setsockopt(player_socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+
+        vm_socket = open_socket_nodelay_addr(&s_vm_data_addr);
+        if (vm_socket == SOCKET_ERROR)
+        {
+            close(player_socket);
+            continue;
+        }
+
+        pthread_mutex_lock(&s_mtx);
+        codec = s_codec;
+        pthread_mutex_unlock(&s_mtx);
+
+        if (gl_relay_add(vm_socket, player_socket, codec) < 0)
+            LOGW("Unable to relay the new gl connection");
+    }
+
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    int main_port = MAIN_PORT;
+    int data_port = OPENGL_DATA_PORT;
+    int threads = GL_RELAY_THREADS;
+    int stats_interval = 0;
+    socket_t main_server, data_server;
+    pthread_t data_thread_id;
+    int opt, rc;
+
+    init_logger();
+    // A peer closing its socket fails the write instead of killing every session
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "m:d:t:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            main_port = atoi(optarg);
+            break;
+        case 'd':
+            data_port = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        fprintf(stderr,
+                "Usage: %s [-m main_port] [-d data_port] [-t threads] [-s interval] vm_ip\n",
+                argv[0]);
+        return 1;
+    }
+    s_vmip = argv[optind];
+
+    if (resolve_socket_address(s_vmip, OPENGL_DATA_PORT, &s_vm_data_addr) < 0)
+        LOGE("Unable to resolve %s", s_vmip);
+
+    main_server = open_server_socket(main_port);
+    data_server = open_server_socket(data_port);
+    if (main_server == SOCKET_ERROR || data_server == SOCKET_ERROR)
+        LOGE("Unable to listen for the player");
+
+    if (gl_relay_start(threads, GL_RELAY_COPY, stats_interval) < 0)
+        LOGE("Unable to start the OpenGL relay");
+
+    rc = pthread_create(&data_thread_id, NULL, data_thread, &data_server);
+    if (rc)
+        LOGE("pthread_create returned %d", rc);
+
+    LOGI("Bridging ports %d and %d to %s", main_port, data_port, s_vmip);
+
+    while (1)
+    {
+        socket_t player_socket = accept(main_server, NULL, NULL);
+        if (player_socket < 0)
+        {
+            LOGW("accept() error: %s", strerror(errno));
+            continue;
+        }
+        handle_session(player_socket);
+    }
+
+    return 0;
+}
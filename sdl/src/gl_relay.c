@@ -0,0 +1,880 @@
+/**
+ * \file gl_relay.c
+ * \brief Event-driven relay of the OpenGL streams
+ *
+ * Each relay thread (a "reactor") owns an epoll set holding both ends of all
+ * its connections, registered in edge-triggered mode. When one end becomes
+ * readable, everything available is read into the reactor buffer and written
+ * to the peer. If the peer does not accept all of it, the remainder is kept
+ * in the pending buffer of the peer and reads from that end are paused until
+ * the peer becomes writable again and the pending bytes are flushed. This
+ * gives per-direction backpressure without ever buffering more than one read
+ * per direction.
+ *
+ * In splice mode, the bytes go from one socket to a pipe and from the pipe to
+ * the other socket without being copied to userspace; the pipe then plays
+ * the role of the pending buffer.
+ *
+ * On compressed connections (see gl_codec.h), the bytes read from the render
+ * libs are encoded into frames before being written to the VM, and the frames
+ * read from the VM are decoded into the reactor buffer. The decoder keeps the
+ * compressed bytes it could not decode yet, so a stalled render socket pauses
+ * the decoding just like it pauses plain reads.
+ *
+ * New connections are handed to a reactor through a pipe, so that the state
+ * of a connection is only ever touched by the thread owning it. This also
+ * holds for the counters: each reactor logs its own, either periodically or
+ * when SIGUSR1 pokes its eventfd.
+ */
+#define _GNU_SOURCE       // for splice, pipe2, F_SETPIPE_SZ
+#include <errno.h>        // for errno, EINTR, EAGAIN
+#include <fcntl.h>        // for fcntl, splice, O_NONBLOCK, SPLICE_F_MOVE
+#include <pthread.h>      // for pthread_create, pthread_t
+#include <signal.h>       // for sigaction, SIGUSR1
+#include <stdio.h>        // for snprintf
+#include <stdlib.h>       // for malloc, calloc, free
+#include <string.h>       // for memcpy, strerror
+#include <sys/epoll.h>    // for epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h>  // for eventfd
+#include <unistd.h>       // for read, write, close, pipe
+
+#include "buffer_sizes.h"
+#include "gl_capture.h"
+#include "host_gl.h"
+#include "logger.h"
+
+#include "gl_relay.h"
+
+#define LOG_TAG "gl_relay"
+
+/** \brief State of a relay thread */
+struct gl_reactor
+{
+    /** Index of the reactor, for logging */
+    int id;
+    /** The thread running the event loop */
+    pthread_t thread;
+    /** The epoll set of all the connection ends */
+    int epfd;
+    /** Pipe used to hand new connections to the thread */
+    int handoff[2];
+    /** Read buffer shared by all the connections of the thread */
+    char* buff;
+    /** Frames encoded from the read buffer, allocated with the first compressed connection */
+    char* zbuff;
+    /** Connections closed during the current event batch */
+    struct conn_duo* closed;
+    /** Open connections */
+    struct conn_duo* conns;
+    /** Number of open connections */
+    unsigned int nconns;
+    /** Number of connections handled since the start */
+    unsigned int total_conns;
+    /** eventfd written by the SIGUSR1 handler */
+    int dump_fd;
+    /** Time of the next periodic log of the counters */
+    uint64_t next_dump_ns;
+    /** Counters of the closed connections, from the render libs to the VM */
+    struct gl_dir_stats to_vm;
+    /** Counters of the closed connections, from the VM to the render libs */
+    struct gl_dir_stats to_render;
+};
+
+static struct gl_reactor s_reactors[GL_RELAY_MAX_THREADS];
+static int s_nreactors = 0;
+static unsigned int s_next_reactor = 0;
+static int s_mode = GL_RELAY_COPY;
+static uint64_t s_stats_interval_ns = 0;
+static const char* s_capture_dir = NULL;
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void close_pipe(struct conn_end* end)
+{
+    if (end->pipe[0] >= 0)
+        close(end->pipe[0]);
+    if (end->pipe[1] >= 0)
+        close(end->pipe[1]);
+    end->pipe[0] = -1;
+    end->pipe[1] = -1;
+    end->pipe_len = 0;
+}
+
+static int open_pipe(struct conn_end* end)
+{
+    if (pipe2(end->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        end->pipe[0] = -1;
+        end->pipe[1] = -1;
+        return -1;
+    }
+    // Best effort: the default capacity (64 KiB) only means more syscalls
+    fcntl(end->pipe[1], F_SETPIPE_SZ, GL_RELAY_PIPE_SIZE);
+    end->pipe_len = 0;
+    return 0;
+}
+
+static int has_pending(const struct conn_end* end)
+{
+    return end->pending != NULL || end->pipe_len > 0;
+}
+
+static void close_duo(struct conn_duo* cd)
+{
+    if (cd->closed)
+        return;
+
+    struct gl_reactor* r = cd->reactor;
+    char prefix[BUF_SIZE];
+
+    LOGI("Relay thread %d: closing connection %u (local %d, host %d)", r->id, cd->id,
+         cd->local.fd, cd->host.fd);
+    snprintf(prefix, sizeof(prefix), "Connection %u render->VM", cd->id);
+    gl_stats_log(prefix, &cd->local.stats);
+    snprintf(prefix, sizeof(prefix), "Connection %u VM->render", cd->id);
+    gl_stats_log(prefix, &cd->host.stats);
+    gl_stats_merge(&r->to_vm, &cd->local.stats);
+    gl_stats_merge(&r->to_render, &cd->host.stats);
+
+    if (cd->prev)
+        cd->prev->next = cd->next;
+    else
+        r->conns = cd->next;
+    if (cd->next)
+        cd->next->prev = cd->prev;
+    r->nconns--;
+
+    close(cd->local.fd);
+    close(cd->host.fd);
+    free(cd->local.pending);
+    free(cd->host.pending);
+    cd->local.pending = NULL;
+    cd->host.pending = NULL;
+    close_pipe(&cd->local);
+    close_pipe(&cd->host);
+    free(cd->host.decoder);
+    cd->host.decoder = NULL;
+    if (cd->capture)
+        fclose(cd->capture);
+    cd->capture = NULL;
+
+    // Other events of the current batch may still point to this connection
+    cd->closed = 1;
+    cd->next_closed = r->closed;
+    r->closed = cd;
+}
+
+/** Write as much of the pending buffer of an end as possible
+ * \returns 1 if everything was written, 0 if some bytes remain, -1 on error
+ */
+static int flush_buffer(struct conn_end* end)
+{
+    while (end->pending_off < end->pending_len)
+    {
+        ssize_t wsize = write(end->fd, end->pending + end->pending_off,
+                              end->pending_len - end->pending_off);
+        if (wsize < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        end->pending_off += wsize;
+    }
+
+    free(end->pending);
+    end->pending = NULL;
+    end->pending_len = 0;
+    end->pending_off = 0;
+    return 1;
+}
+
+/** Keep bytes the peer did not accept until it becomes writable again */
+static int queue_pending(struct conn_end* end, const char* data, size_t len)
+{
+    end->pending = (char*) malloc(len);
+    if (!end->pending)
+    {
+        LOGW("Unable to alloc %zu pending bytes", len);
+        return -1;
+    }
+    memcpy(end->pending, data, len);
+    end->pending_len = len;
+    end->pending_off = 0;
+    return 0;
+}
+
+/** Pause reads from \p src until the bytes read at \p read_ns are accepted by its peer */
+static void stall(struct conn_end* src, uint64_t read_ns)
+{
+    struct conn_end* dst = src->peer;
+
+    dst->pending_read_ns = read_ns;
+    dst->stall_since_ns = gl_stats_now_ns();
+    src->stats.stalls++;
+    src->stalled = 1;
+}
+
+/** Append bytes read from \p src to the capture file of its connection */
+static void capture(struct conn_end* src, const char* data, size_t len, uint64_t read_ns)
+{
+    struct conn_duo* cd = src->duo;
+
+    if (gl_capture_write(cd->capture, src == &cd->host ? GL_CAPTURE_TO_RENDER : GL_CAPTURE_TO_VM,
+                         data, len, read_ns) < 0)
+    {
+        LOGW("Relay thread %d: capture of connection %u failed, stopping it", cd->reactor->id,
+             cd->id);
+        fclose(cd->capture);
+        cd->capture = NULL;
+    }
+}
+
+/** Write bytes read from \p src at \p read_ns to its peer, keeping what it refuses
+ * \returns 1 if everything was written, 0 if the peer is full, -1 on error
+ */
+static int forward(struct conn_end* src, const char* data, size_t len, uint64_t read_ns)
+{
+    struct conn_end* dst = src->peer;
+    size_t written = 0;
+
+    while (written < len)
+    {
+        ssize_t wsize = write(dst->fd, data + written, len - written);
+        if (wsize < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        written += wsize;
+    }
+
+    if (written < len)
+    {
+        if (queue_pending(dst, data + written, len - written) < 0)
+            return -1;
+        stall(src, read_ns);
+        return 0;
+    }
+    gl_stats_delivered(&src->stats, read_ns, gl_stats_now_ns());
+    return 1;
+}
+
+/** Copy everything readable on \p src to its peer through the reactor buffer
+ * \returns 0 if the socket is drained or the peer is full, -1 if the connection is over
+ */
+static int pump_copy(struct gl_reactor* r, struct conn_end* src)
+{
+    struct conn_duo* cd = src->duo;
+    int encode = cd->codec != GL_CODEC_NONE && src->peer == &cd->host;
+
+    while (1)
+    {
+        int rc;
+        uint64_t read_ns;
+        const char* data = r->buff;
+        size_t len;
+        ssize_t rsize = read(src->fd, r->buff, BUFF_SIZE);
+        if (rsize == 0)
+            return -1;
+        if (rsize < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        read_ns = gl_stats_now_ns();
+        gl_stats_read(&src->stats, rsize);
+        len = rsize;
+
+        if (cd->capture)
+            capture(src, r->buff, rsize, read_ns);
+
+        if (encode)
+        {
+            len = gl_codec_encode(r->buff, rsize, r->zbuff);
+            data = r->zbuff;
+            src->stats.coded_bytes += len;
+        }
+
+        rc = forward(src, data, len, read_ns);
+        if (rc <= 0)
+            return rc;
+    }
+}
+
+/** Decode the frames readable on \p src to its peer through the reactor buffer
+ * \returns 0 if the socket is drained or the peer is full, -1 if the connection is over
+ */
+static int pump_decode(struct gl_reactor* r, struct conn_end* src)
+{
+    struct gl_decoder* d = src->decoder;
+
+    while (1)
+    {
+        int rc;
+        ssize_t len;
+
+        // Bytes left by a stall are decoded before reading more
+        if (d->in_off == d->in_len)
+        {
+            ssize_t rsize = read(src->fd, d->in, GL_CODEC_INPUT_SIZE);
+            if (rsize == 0)
+                return -1;
+            if (rsize < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                return -1;
+            }
+            d->in_len = rsize;
+            d->in_off = 0;
+            d->read_ns = gl_stats_now_ns();
+            gl_stats_read(&src->stats, rsize);
+        }
+
+        // The reactor buffer holds many frames: the input is always consumed
+        len = gl_decode(d, r->buff, BUFF_SIZE);
+        if (len < 0)
+        {
+            LOGW("Relay thread %d: corrupted stream on connection %u", r->id, src->duo->id);
+            return -1;
+        }
+        if (len == 0)
+            continue;
+        src->stats.coded_bytes += len;
+
+        if (src->duo->capture)
+            capture(src, r->buff, len, d->read_ns);
+
+        rc = forward(src, r->buff, len, d->read_ns);
+        if (rc <= 0)
+            return rc;
+    }
+}
+
+/** Switch a connection from splice to copy mode, keeping the bytes of its pipes */
+static int fallback_to_copy(struct conn_duo* cd)
+{
+    struct conn_end* ends[2] = {&cd->local, &cd->host};
+    int i;
+
+    LOGI("Relay thread %d: splice() not supported, falling back to copy (local %d, host %d)",
+         cd->reactor->id, cd->local.fd, cd->host.fd);
+
+    cd->mode = GL_RELAY_COPY;
+    for (i = 0; i < 2; i++)
+    {
+        struct conn_end* end = ends[i];
+        if (end->pipe_len > 0)
+        {
+            // Only one read per direction is in flight, it fits in the reactor buffer
+            ssize_t rsize = read(end->pipe[0], cd->reactor->buff, end->pipe_len);
+            if (rsize != (ssize_t) end->pipe_len ||
+                queue_pending(end, cd->reactor->buff, end->pipe_len) < 0)
+                return -1;
+        }
+        close_pipe(end);
+    }
+    return 0;
+}
+
+/** Write as much of the pipe of an end as possible
+ * \returns 1 if everything was written, 0 if some bytes remain, -1 on error
+ */
+static int flush_pipe(struct conn_end* end)
+{
+    while (end->pipe_len > 0)
+    {
+        ssize_t wsize = splice(end->pipe[0], NULL, end->fd, NULL, end->pipe_len,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (wsize < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINVAL && fallback_to_copy(end->duo) == 0)
+                return flush_buffer(end);
+            return -1;
+        }
+        end->pipe_len -= wsize;
+    }
+    return 1;
+}
+
+/** Write the bytes refused by an end so far, accounting for the time they waited */
+static int flush_pending(struct conn_end* end)
+{
+    int rc;
+    uint64_t now;
+    struct gl_dir_stats* stats = &end->peer->stats;
+
+    if (end->pipe_len > 0)
+        rc = flush_pipe(end);
+    else
+        rc = flush_buffer(end);
+
+    if (rc > 0)
+    {
+        now = gl_stats_now_ns();
+        stats->stall_ns += now - end->stall_since_ns;
+        gl_stats_delivered(stats, end->pending_read_ns, now);
+    }
+    return rc;
+}
+
+/** Move everything readable on \p src to the pipe of its peer, and on to the peer
+ * \returns 0 if the socket is drained or the peer is full, -1 if the connection is over
+ */
+static int pump_splice(struct gl_reactor* r, struct conn_end* src)
+{
+    struct conn_end* dst = src->peer;
+
+    while (1)
+    {
+        int rc;
+        uint64_t read_ns;
+        // The pipe is empty here, EAGAIN can only mean the socket is drained
+        ssize_t rsize = splice(src->fd, NULL, dst->pipe[1], NULL, GL_RELAY_PIPE_SIZE,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (rsize == 0)
+            return -1;
+        if (rsize < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINVAL && fallback_to_copy(src->duo) == 0)
+                return pump_copy(r, src);
+            return -1;
+        }
+
+        read_ns = gl_stats_now_ns();
+        gl_stats_read(&src->stats, rsize);
+
+        dst->pipe_len = rsize;
+        rc = flush_pipe(dst);
+        if (rc < 0)
+            return -1;
+        if (rc == 0)
+        {
+            stall(src, read_ns);
+            return 0;
+        }
+        gl_stats_delivered(&src->stats, read_ns, gl_stats_now_ns());
+    }
+}
+
+/** Relay everything readable on \p src to its peer, unless the peer is full */
+static int pump(struct gl_reactor* r, struct conn_end* src)
+{
+    if (has_pending(src->peer))
+    {
+        src->stalled = 1;
+        return 0;
+    }
+
+    if (src->decoder)
+        return pump_decode(r, src);
+    if (src->duo->mode == GL_RELAY_SPLICE)
+        return pump_splice(r, src);
+    return pump_copy(r, src);
+}
+
+static void handle_event(struct gl_reactor* r, struct conn_end* end, uint32_t events)
+{
+    struct conn_duo* cd = end->duo;
+
+    if (cd->closed)
+        return;
+
+    if ((events & EPOLLOUT) && has_pending(end))
+    {
+        int rc = flush_pending(end);
+        if (rc < 0)
+        {
+            close_duo(cd);
+            return;
+        }
+        // The peer may have data waiting since the last edge: read it now
+        if (rc > 0 && end->peer->stalled)
+        {
+            end->peer->stalled = 0;
+            if (pump(r, end->peer) < 0)
+            {
+                close_duo(cd);
+                return;
+            }
+        }
+    }
+
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && pump(r, end) < 0)
+        close_duo(cd);
+}
+
+static void register_duo(struct gl_reactor* r, struct conn_duo* cd)
+{
+    struct epoll_event ev;
+
+    cd->reactor = r;
+    cd->id = r->total_conns++;
+    cd->next = r->conns;
+    if (r->conns)
+        r->conns->prev = cd;
+    r->conns = cd;
+    r->nconns++;
+
+    if (s_capture_dir)
+    {
+        cd->capture = gl_capture_open(s_capture_dir, r->id, cd->id);
+        if (cd->capture)
+            cd->mode = GL_RELAY_COPY;
+    }
+
+    if (cd->codec != GL_CODEC_NONE)
+    {
+        cd->mode = GL_RELAY_COPY;
+        if (!r->zbuff)
+            r->zbuff = (char*) malloc(gl_codec_encode_bound(BUFF_SIZE));
+        cd->host.decoder = gl_decoder_new();
+        if (!r->zbuff || !cd->host.decoder)
+        {
+            LOGW("Relay thread %d: unable to alloc the codec buffers", r->id);
+            close_duo(cd);
+            return;
+        }
+    }
+
+    if (cd->mode == GL_RELAY_SPLICE && (open_pipe(&cd->local) < 0 || open_pipe(&cd->host) < 0))
+    {
+        LOGW("Relay thread %d: pipe() error: %s, falling back to copy", r->id, strerror(errno));
+        close_pipe(&cd->local);
+        close_pipe(&cd->host);
+        cd->mode = GL_RELAY_COPY;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &cd->local;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, cd->local.fd, &ev) < 0)
+    {
+        LOGW("Relay thread %d: epoll_ctl() error: %s", r->id, strerror(errno));
+        close_duo(cd);
+        return;
+    }
+
+    ev.data.ptr = &cd->host;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, cd->host.fd, &ev) < 0)
+    {
+        LOGW("Relay thread %d: epoll_ctl() error: %s", r->id, strerror(errno));
+        close_duo(cd);
+        return;
+    }
+
+    LOGI("Relay thread %d: new connection %u (local %d, host %d, codec %s)", r->id, cd->id,
+         cd->local.fd, cd->host.fd, gl_codec_name(cd->codec));
+}
+
+static void accept_handoffs(struct gl_reactor* r)
+{
+    struct conn_duo* cd;
+    ssize_t rsize;
+
+    while ((rsize = read(r->handoff[0], &cd, sizeof(cd))) == sizeof(cd))
+        register_duo(r, cd);
+
+    if (rsize < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        LOGW("Relay thread %d: handoff read() error: %s", r->id, strerror(errno));
+}
+
+/** Log the counters of the reactor, and of each open connection if \p verbose */
+static void dump_stats(struct gl_reactor* r, int verbose)
+{
+    struct gl_dir_stats to_vm = r->to_vm;
+    struct gl_dir_stats to_render = r->to_render;
+    struct conn_duo* cd;
+    char prefix[BUF_SIZE];
+
+    for (cd = r->conns; cd; cd = cd->next)
+    {
+        gl_stats_merge(&to_vm, &cd->local.stats);
+        gl_stats_merge(&to_render, &cd->host.stats);
+    }
+
+    LOGI("Relay thread %d: %u open connection(s), %u since start", r->id, r->nconns,
+         r->total_conns);
+    snprintf(prefix, sizeof(prefix), "Relay thread %d render->VM", r->id);
+    gl_stats_log(prefix, &to_vm);
+    snprintf(prefix, sizeof(prefix), "Relay thread %d VM->render", r->id);
+    gl_stats_log(prefix, &to_render);
+
+    if (!verbose)
+        return;
+
+    for (cd = r->conns; cd; cd = cd->next)
+    {
+        snprintf(prefix, sizeof(prefix), "Connection %u render->VM", cd->id);
+        gl_stats_log(prefix, &cd->local.stats);
+        snprintf(prefix, sizeof(prefix), "Connection %u VM->render", cd->id);
+        gl_stats_log(prefix, &cd->host.stats);
+    }
+}
+
+/** Milliseconds until the next periodic log, -1 if disabled */
+static int dump_timeout(struct gl_reactor* r)
+{
+    uint64_t now;
+
+    if (!s_stats_interval_ns)
+        return -1;
+
+    now = gl_stats_now_ns();
+    if (now >= r->next_dump_ns)
+    {
+        dump_stats(r, 0);
+        r->next_dump_ns = now + s_stats_interval_ns;
+    }
+    return (r->next_dump_ns - now + 999999) / 1000000;
+}
+
+static void* reactor_thread(void* arg)
+{
+    struct gl_reactor* r = (struct gl_reactor*) arg;
+    struct epoll_event events[GL_RELAY_MAX_EVENTS];
+
+    LOGI("Relay thread %d: started", r->id);
+    r->next_dump_ns = gl_stats_now_ns() + s_stats_interval_ns;
+
+    while (1)
+    {
+        int i;
+        int n = epoll_wait(r->epfd, events, GL_RELAY_MAX_EVENTS, dump_timeout(r));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOGW("Relay thread %d: epoll_wait() error: %s", r->id, strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                accept_handoffs(r);
+            else if (events[i].data.ptr == &r->dump_fd)
+            {
+                uint64_t count;
+                if (read(r->dump_fd, &count, sizeof(count)) == sizeof(count))
+                    dump_stats(r, 1);
+            }
+            else
+                handle_event(r, (struct conn_end*) events[i].data.ptr, events[i].events);
+        }
+
+        while (r->closed)
+        {
+            struct conn_duo* cd = r->closed;
+            r->closed = cd->next_closed;
+            free(cd);
+        }
+    }
+
+    LOGI("Relay thread %d: stopping", r->id);
+    return NULL;
+}
+
+static int reactor_init(struct gl_reactor* r, int id)
+{
+    struct epoll_event ev;
+
+    r->id = id;
+    r->closed = NULL;
+    r->buff = (char*) malloc(BUFF_SIZE);
+    if (!r->buff)
+    {
+        LOGW("Relay thread %d: unable to alloc %d bytes", id, BUFF_SIZE);
+        return -1;
+    }
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0)
+    {
+        LOGW("epoll_create1() error: %s", strerror(errno));
+        free(r->buff);
+        return -1;
+    }
+
+    if (pipe(r->handoff) < 0 || set_nonblocking(r->handoff[0]) < 0)
+    {
+        LOGW("pipe() error: %s", strerror(errno));
+        close(r->epfd);
+        free(r->buff);
+        return -1;
+    }
+
+    r->dump_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->dump_fd < 0)
+    {
+        LOGW("eventfd() error: %s", strerror(errno));
+        goto error;
+    }
+
+    // Level-triggered: a NULL pointer marks the handoff pipe
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->handoff[0], &ev) < 0)
+    {
+        LOGW("epoll_ctl() error: %s", strerror(errno));
+        goto error;
+    }
+
+    ev.data.ptr = &r->dump_fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->dump_fd, &ev) < 0)
+    {
+        LOGW("epoll_ctl() error: %s", strerror(errno));
+        goto error;
+    }
+
+    return 0;
+
+error:
+    if (r->dump_fd >= 0)
+        close(r->dump_fd);
+    close(r->handoff[0]);
+    close(r->handoff[1]);
+    close(r->epfd);
+    free(r->buff);
+    return -1;
+}
+
+void gl_relay_set_capture_dir(const char* dir)
+{
+    s_capture_dir = dir;
+}
+
+int gl_relay_mode_from_name(const char* name)
+{
+    if (!strcmp(name, "splice"))
+        return GL_RELAY_SPLICE;
+    if (strcmp(name, "copy"))
+        LOGW("Unknown relay mode %s, using copy", name);
+    return GL_RELAY_COPY;
+}
+
+/** SIGUSR1 handler: only async-signal-safe calls here */
+static void request_dump(int sig)
+{
+    uint64_t one = 1;
+    int i;
+    int saved_errno = errno;
+
+    (void) sig;
+    for (i = 0; i < s_nreactors; i++)
+        if (write(s_reactors[i].dump_fd, &one, sizeof(one)) < 0)
+            continue;
+    errno = saved_errno;
+}
+
+int gl_relay_start(int nthreads, int mode, int stats_interval)
+{
+    int i, rc;
+    struct sigaction sa;
+
+    s_mode = mode;
+    if (stats_interval > 0)
+        s_stats_interval_ns = (uint64_t) stats_interval * 1000000000ULL;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > GL_RELAY_MAX_THREADS)
+        nthreads = GL_RELAY_MAX_THREADS;
+
+    for (i = 0; i < nthreads; i++)
+    {
+        struct gl_reactor* r = &s_reactors[s_nreactors];
+        if (reactor_init(r, i) < 0)
+            break;
+
+        rc = pthread_create(&r->thread, NULL, reactor_thread, r);
+        if (rc)
+        {
+            LOGW("pthread_create returned %d", rc);
+            break;
+        }
+        s_nreactors++;
+    }
+
+    LOGI("%d relay thread(s) started, %s mode", s_nreactors,
+         s_mode == GL_RELAY_SPLICE ? "splice" : "copy");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_dump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) < 0)
+        LOGW("sigaction() error: %s", strerror(errno));
+
+    return s_nreactors ? 0 : -1;
+}
+
+int gl_relay_add(int local_socket, int host_socket, int codec)
+{
+    struct conn_duo* cd;
+    struct gl_reactor* r;
+
+    if (!s_nreactors || local_socket < 0 || host_socket < 0 ||
+        set_nonblocking(local_socket) < 0 || set_nonblocking(host_socket) < 0)
+        goto error;
+
+    cd = (struct conn_duo*) calloc(1, sizeof(struct conn_duo));
+    if (!cd)
+    {
+        LOGW("Cannot allocate memory");
+        goto error;
+    }
+
+    cd->mode = s_mode;
+    cd->codec = codec;
+    cd->local.fd = local_socket;
+    cd->local.pipe[0] = cd->local.pipe[1] = -1;
+    cd->local.peer = &cd->host;
+    cd->local.duo = cd;
+    cd->host.fd = host_socket;
+    cd->host.pipe[0] = cd->host.pipe[1] = -1;
+    cd->host.peer = &cd->local;
+    cd->host.duo = cd;
+
+    // Only the GL management thread adds connections
+    r = &s_reactors[s_next_reactor++ % s_nreactors];
+    if (write(r->handoff[1], &cd, sizeof(cd)) != sizeof(cd))
+    {
+        LOGW("Relay thread %d: handoff write() error: %s", r->id, strerror(errno));
+        free(cd);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    if (local_socket >= 0)
+        close(local_socket);
+    if (host_socket >= 0)
+        close(host_socket);
+    return -1;
+}
@@ -0,0 +1,309 @@
+/**
+ * \file gl_replay.c
+ * \brief Replay OpenGL captures into the local render libs
+ *
+ * gl_replay stands in for the VM: it starts the AOSP render libs like the
+ * player does, opens one connection per capture file (see gl_capture.h) and
+ * writes the bytes the VM sent, while draining the replies of the render
+ * libs. This gives repeatable render and relay benchmarks on a plain Linux
+ * host with an X display, without any Android guest.
+ *
+ * Usage: gl_replay [-u] [-s speed] [-W width] [-H height] capture.glcap...
+ *
+ * - speed is a multiplier of the captured timing (default 1); 0 replays as
+ *   fast as possible, which is only safe with a single capture file as the
+ *   ordering between the connections is lost.
+ * - width and height are the size of the framebuffer (default 720x1280).
+ * - -u reaches the render libs through a Unix domain socket instead of TCP.
+ *
+ * All the captures given on the command line must come from the same session
+ * since their timestamps are aligned on the earliest one.
+ */
+#include <errno.h>    // for errno
+#include <getopt.h>   // for getopt, optarg, optind
+#include <pthread.h>  // for pthread_create, pthread_join
+#include <signal.h>   // for SIGPIPE, SIG_IGN, signal
+#include <stdio.h>    // for FILE, fopen, fread, fseek
+#include <stdlib.h>   // for atof, atoi, calloc, malloc, realloc
+#include <string.h>   // for strerror
+#include <time.h>     // for clock_nanosleep, CLOCK_MONOTONIC
+#include <unistd.h>   // for read, write, close
+
+#include "gl_capture.h"
+#include "gl_stats.h"
+#include "host_gl.h"
+#include "logger.h"
+#include "render_api.h"
+#include "socket.h"
+
+#define LOG_TAG "gl_replay"
+
+/** \brief One capture file replayed on its own connection */
+struct replay_stream
+{
+    const char* filename;
+    FILE* f;
+    socket_t sock;
+    pthread_t writer;
+    pthread_t reader;
+    /** Timestamp of the first record */
+    uint64_t first_ns;
+    /** Bytes written to the render libs */
+    uint64_t sent;
+    /** Bytes the render libs replied during the capture */
+    uint64_t expected;
+    /** Bytes the render libs replied during the replay */
+    uint64_t received;
+    /** Time the render libs closed the connection */
+    uint64_t end_ns;
+    int error;
+};
+
+static double s_speed = 1.0;
+static uint64_t s_start_ns;
+static uint64_t s_first_ns;
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts = {deadline_ns / 1000000000ULL, deadline_ns % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        continue;
+}
+
+static int write_all(socket_t sock, const char* buff, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t wsize = write(sock, buff, len);
+        if (wsize < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buff += wsize;
+        len -= wsize;
+    }
+    return 0;
+}
+
+static void* replay_writer(void* arg)
+{
+    struct replay_stream* rs = (struct replay_stream*) arg;
+    struct gl_capture_record record;
+    char* buff = NULL;
+    size_t buff_len = 0;
+    int rc;
+
+    while ((rc = gl_capture_next(rs->f, &record)) > 0)
+    {
+        if (record.direction != GL_CAPTURE_TO_RENDER)
+        {
+            rs->expected += record.length;
+            if (fseek(rs->f, record.length, SEEK_CUR) < 0)
+                break;
+            continue;
+        }
+
+        if (record.length > buff_len)
+        {
+            char* tmp = (char*) realloc(buff, record.length);
+            if (!tmp)
+            {
+                LOGW("%s: unable to alloc %u bytes", rs->filename, record.length);
+                break;
+            }
+            buff = tmp;
+            buff_len = record.length;
+        }
+        if (fread(buff, 1, record.length, rs->f) != record.length)
+        {
+            rc = -1;
+            break;
+        }
+
+        if (s_speed > 0)
+            sleep_until(s_start_ns + (record.timestamp_ns - s_first_ns) / s_speed);
+
+        if (write_all(rs->sock, buff, record.length) < 0)
+        {
+            LOGW("%s: write() error: %s", rs->filename, strerror(errno));
+            rc = -1;
+            break;
+        }
+        rs->sent += record.length;
+    }
+
+    if (rc < 0)
+    {
+        LOGW("%s: truncated or unreadable capture", rs->filename);
+        rs->error = 1;
+    }
+
+    // Let the render thread finish the commands and close its side
+    shutdown(rs->sock, SHUT_WR);
+    free(buff);
+    return NULL;
+}
+
+static void* replay_reader(void* arg)
+{
+    struct replay_stream* rs = (struct replay_stream*) arg;
+    char* buff = (char*) malloc(BUFF_SIZE);
+    ssize_t rsize;
+
+    if (!buff)
+        LOGE("Unable to alloc %d bytes", BUFF_SIZE);
+
+    while ((rsize = read(rs->sock, buff, BUFF_SIZE)) != 0)
+    {
+        if (rsize < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        rs->received += rsize;
+    }
+    rs->end_ns = gl_stats_now_ns();
+
+    free(buff);
+    return NULL;
+}
+
+/** Open a capture file and read the timestamp of its first record */
+static int open_stream(struct replay_stream* rs)
+{
+    struct gl_capture_record record;
+
+    rs->f = fopen(rs->filename, "rb");
+    if (!rs->f)
+    {
+        LOGW("Unable to open %s: %s", rs->filename, strerror(errno));
+        return -1;
+    }
+    setvbuf(rs->f, NULL, _IOFBF, GL_CAPTURE_BUFFER_SIZE);
+
+    if (gl_capture_check(rs->f) < 0)
+    {
+        LOGW("%s is not a capture file", rs->filename);
+        return -1;
+    }
+
+    rs->first_ns = UINT64_MAX;
+    if (gl_capture_next(rs->f, &record) > 0)
+        rs->first_ns = record.timestamp_ns;
+    return fseek(rs->f, sizeof(struct gl_capture_header), SEEK_SET);
+}
+
+int main(int argc, char** argv)
+{
+    static char port_gl[] = "22468";
+    static char addr_gl[GL_RENDER_ADDR_SIZE] = "";
+    struct replay_stream* streams;
+    int width = 720;
+    int height = 1280;
+    int nstreams, i, opt;
+    int failed = 0;
+    int unix_gl = 0;
+
+    init_logger();
+    // A render lib closing its socket fails the write instead of killing the replay
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "us:W:H:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            unix_gl = 1;
+            break;
+        case 's':
+            s_speed = atof(optarg);
+            break;
+        case 'W':
+            width = atoi(optarg);
+            break;
+        case 'H':
+            height = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-u] [-s speed] [-W width] [-H height] capture.glcap...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    nstreams = argc - optind;
+    if (nstreams < 1)
+    {
+        fprintf(stderr, "Usage: %s [-u] [-s speed] [-W width] [-H height] capture.glcap...\n",
+                argv[0]);
+        return 1;
+    }
+    if (s_speed <= 0 && nstreams > 1)
+        LOGW("Replaying several captures as fast as possible, they may not render properly");
+
+    streams = (struct replay_stream*) calloc(nstreams, sizeof(struct replay_stream));
+    if (!streams)
+        LOGE("Cannot allocate memory");
+
+    s_first_ns = UINT64_MAX;
+    for (i = 0; i < nstreams; i++)
+    {
+        streams[i].filename = argv[optind + i];
+        if (open_stream(&streams[i]) < 0)
+            return 1;
+        if (streams[i].first_ns < s_first_ns)
+            s_first_ns = streams[i].first_ns;
+    }
+
+    if (!initLibrary())
+        LOGE("Unable to initialize Library");
+    if (!setStreamMode(unix_gl ? STREAM_MODE_UNIX : STREAM_MODE_TCP))
+        LOGE("invalid stream mode for setStreamMode()");
+    if (!initOpenGLRenderer(width, height, unix_gl ? addr_gl : port_gl,
+                            unix_gl ? sizeof(addr_gl) : 6))
+        LOGE("initOpenGLRenderer failed");
+
+    for (i = 0; i < nstreams; i++)
+    {
+        if (unix_gl)
+            streams[i].sock = open_socket_unix(addr_gl);
+        else
+            streams[i].sock = open_socket_nodelay("127.0.0.1", OPENGL_DATA_PORT);
+        if (streams[i].sock == SOCKET_ERROR)
+            LOGE("Unable to connect to the render libs");
+    }
+
+    s_start_ns = gl_stats_now_ns();
+    for (i = 0; i < nstreams; i++)
+    {
+        if (pthread_create(&streams[i].reader, NULL, replay_reader, &streams[i]) ||
+            pthread_create(&streams[i].writer, NULL, replay_writer, &streams[i]))
+            LOGE("Error creating thread");
+    }
+
+    for (i = 0; i < nstreams; i++)
+    {
+        struct replay_stream* rs = &streams[i];
+        double elapsed;
+
+        pthread_join(rs->writer, NULL);
+        pthread_join(rs->reader, NULL);
+        close(rs->sock);
+        fclose(rs->f);
+
+        elapsed = (rs->end_ns - s_start_ns) / 1e9;
+        LOGI("%s: %llu bytes sent, %llu/%llu reply bytes in %.3f s (%.1f MB/s)", rs->filename,
+             (unsigned long long) rs->sent, (unsigned long long) rs->received,
+             (unsigned long long) rs->expected, elapsed,
+             elapsed > 0 ? rs->sent / elapsed / 1e6 : 0.0);
+        if (rs->error || rs->received != rs->expected)
+            failed = 1;
+    }
+
+    LOGI("Replay done in %.3f s", (gl_stats_now_ns() - s_start_ns) / 1e9);
+    free(streams);
+    return failed;
+}
@@ -0,0 +1,55 @@
+/**
+ * \file gl_stats.c
+ * \brief Throughput and latency counters of the OpenGL relay
+ */
+#include <stdio.h>   // for snprintf
+#include <string.h>  // for strlen
+
+#include "buffer_sizes.h"
+#include "logger.h"
+
+#include "gl_stats.h"
+
+#define LOG_TAG "gl_stats"
+
+void gl_stats_merge(struct gl_dir_stats* to, const struct gl_dir_stats* from)
+{
+    int i;
+
+    to->bytes += from->bytes;
+    to->reads += from->reads;
+    for (i = 0; i < GL_STATS_BUCKETS; i++)
+        to->read_sizes[i] += from->read_sizes[i];
+    to->stalls += from->stalls;
+    to->stall_ns += from->stall_ns;
+    to->delivered += from->delivered;
+    to->latency_ns += from->latency_ns;
+    if (from->latency_max_ns > to->latency_max_ns)
+        to->latency_max_ns = from->latency_max_ns;
+    to->coded_bytes += from->coded_bytes;
+}
+
+void gl_stats_log(const char* prefix, const struct gl_dir_stats* stats)
+{
+    char histogram[BIG_BUF_SIZE] = "";
+    int i;
+
+    for (i = 0; i < GL_STATS_BUCKETS; i++)
+    {
+        size_t len = strlen(histogram);
+        if (!stats->read_sizes[i])
+            continue;
+        snprintf(histogram + len, sizeof(histogram) - len, " %uB:%llu", 1u << i,
+                 (unsigned long long) stats->read_sizes[i]);
+    }
+
+    LOGI("%s: %llu bytes in %llu reads, %llu stalls (%.3f ms), latency avg %.1f us max %.1f us",
+         prefix, (unsigned long long) stats->bytes, (unsigned long long) stats->reads,
+         (unsigned long long) stats->stalls, stats->stall_ns / 1e6,
+         stats->delivered ? stats->latency_ns / 1e3 / stats->delivered : 0.0,
+         stats->latency_max_ns / 1e3);
+    if (stats->reads)
+        LOGI("%s: read sizes%s", prefix, histogram);
+    if (stats->coded_bytes)
+        LOGI("%s: %llu bytes after the codec", prefix, (unsigned long long) stats->coded_bytes);
+}
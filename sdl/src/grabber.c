@@ -3,17 +3,18 @@
  * \brief Screen recording/snapshots
  */
 #include <X11/X.h>                     // for Drawable, ZPixmap
-#include <X11/Xlib.h>                  // for XImage, XGetImage, AllPlanes, XCre..
-#include <X11/Xutil.h>                 // for XDestroyImage, XGetPixel
-#include <errno.h>                     // for EBUSY
+#include <X11/Xlib.h>                  // for XImage, XMapWindow, XCreateGC, XDra..
+#include <X11/Xutil.h>                 // for XImage masks
+#include <errno.h>                     // for EBUSY, EINTR
 #include <libavcodec/avcodec.h>        // for AVCodecContext, AVPacket, AVCodec
 #include <libswresample/swresample.h>  // swr_free
 #include <libavformat/avformat.h>      // for AVFormatContext, AVOutputFormat
-#include <libavformat/avio.h>          // for avio_closep, avio_open, AVIO_FLAG_..
 #include <libavutil/avutil.h>          // for AVMediaType::AVMEDIA_TYPE_VIDEO
+#include <libavutil/buffer.h>          // for av_buffer_create, av_buffer_get_ref_count
 #include <libavutil/dict.h>            // for AVDictionary, av_dict_copy, av_dic..
 #include <libavutil/error.h>           // for av_err2str
 #include <libavutil/frame.h>           // for AVFrame, av_frame_alloc, av_frame_..
+#include <libavutil/imgutils.h>        // for av_image_copy_plane
 #include <libavutil/pixfmt.h>          // for AVPixelFormat::AV_PIX_FMT_YUV420P
 #include <libavutil/rational.h>        // for AVRational
 #include <pthread.h>                   // for pthread_join, pthread_t, pthread_m..
@@ -24,15 +25,25 @@
 #include <sys/select.h>                // for FD_ISSET, FD_SET, FD_ZERO, fd_set
 #include <sys/stat.h>                  // for stat
 #include <sys/time.h>                  // for timeval, gettimeofday
-#include <time.h>                      // for timespec, time_t
-#include <unistd.h>                    // for sleep, usleep
+#include <time.h>                      // for timespec, time_t, clock_nanosleep
+#include <unistd.h>                    // for sleep, usleep, dup, dup2
 
 #include "amqp_listen.h"
+#include "band_pool.h"
 #include "buffer_sizes.h"
+#include "change_detect.h"
+#include "config_env.h"
+#include "frame_ring.h"
 #include "logger.h"
+#include "muxer.h"
 #include "recording.pb-c.h"
+#include "replay_buffer.h"
+#include "segmenter.h"
+#include "snapshot.h"
 #include "sensors.h"
 #include "socket.h"
+#include "x_capture.h"
+#include "yuv_convert.h"
 
 #include "grabber.h"
 
@@ -40,6 +51,121 @@
 
 #define READ_BUFFER_SIZE 1024
 
+/** \brief Default max size of the replay buffer, in MiB */
+#define REPLAY_MAX_MB 64
+
+/** \brief Default number of frames between two stages of a recording */
+#define RECORD_QUEUE_SIZE 4
+
+/** \brief Max number of scaled-down recordings fed by a recording */
+#define RECORD_SCALED_MAX 2
+
+/** \brief Default max duration of the fragments of a live mp4 stream, in ms */
+#define STREAM_FRAGMENT_MS 200
+/** \brief Delay before reopening a live stream after its reader left, in s */
+#define STREAM_RETRY_S 2
+
+/** \brief Outcome of a recording */
+enum record_status
+{
+    /** Stopped by its requester */
+    RECORD_DONE,
+    /** Could not start, or its live stream failed */
+    RECORD_FAILED,
+    /** Stopped by a rotation, to restart at the new size of the window */
+    RECORD_RESIZED,
+};
+
+/** \brief Capture of the window whose image may be the buffer of frames of the capture ring */
+struct capture_slot
+{
+    struct x_capture capture;
+    /** Reference held by the recorder, the capture is free when it is the only one */
+    AVBufferRef* buf;
+};
+
+/** \brief Output of a recording */
+struct record_output
+{
+    /** Short name of the format, deduced from the file name if NULL */
+    const char* format;
+    /** Low latency stream to a pipe or a socket, which its reader may close */
+    int live;
+    /** Replay buffer fed instead of a file, if not NULL */
+    struct replay_buffer* replay;
+    /** Split the file every segment_seconds or segment_mb MiB, if not 0 */
+    int segment_seconds;
+    int segment_mb;
+    /** List the segments in an ffconcat file */
+    int segment_index;
+    /** Also record the preview and the thumbnail, at 1/(1 << shift) of the size, if not 0 */
+    int preview_shift;
+    int thumbnail_shift;
+    /** Stop when the window is resized, for a restart at its new size */
+    int restart_on_resize;
+};
+
+/** \brief State shared by the capture, conversion and encoder threads of a recording */
+struct recorder
+{
+    OutputStream* ost;
+    /** Unlocked by the requester to stop the recording */
+    pthread_mutex_t* quit;
+    /** BGR0 captures, from the capture to the conversion */
+    struct frame_ring* captured;
+    /** Captures of the window. When their images are BGR0, there is one per frame of
+     * the captured ring and one more to grab into, and the frames hold the images;
+     * otherwise the single capture is copied to the frames. */
+    struct capture_slot* captures;
+    int nb_captures;
+    int in_place;
+    /** Encoder input, from the conversion to the encoder */
+    struct frame_ring* converted;
+    /** Detection of the captures identical to the previous frame */
+    struct change_detect changes;
+    /** Output format of the recording */
+    AVOutputFormat* fmt;
+    /** Output file of the encoder */
+    struct muxer mux;
+    /** Segments fed by the encoder instead of the output file, if not NULL */
+    struct segmenter* segments;
+    /** Replay buffer fed by the encoder instead of the output file, if not NULL */
+    struct replay_buffer* replay;
+    /** The output is a live stream, whose errors stop the recording instead of the player */
+    int live;
+    /** Set by the encoder when the live stream failed, stops the other stages */
+    int failed;
+    /** The frames of a scaled recording are 1/(1 << shift) of the size of the captures */
+    int shift;
+    /** Scaled-down recordings of the same captures, fed by the conversion */
+    struct recorder* scaled[RECORD_SCALED_MAX];
+    int nb_scaled;
+    /** Threads converting and downscaling the bands of each capture */
+    struct band_pool* bands;
+    /** Size of the window the capture knows of, which may be smaller than the recording */
+    int window_width;
+    int window_height;
+    /** Number of resizes of the window, when window_width and window_height were read */
+    unsigned resizes;
+    /** Stop the capture when the window is resized */
+    int restart_on_resize;
+    /** Set by the capture when it stopped for a resize */
+    int resized;
+};
+
+/** \brief Rows converted or downscaled by the threads of a band_pool */
+struct band_job
+{
+    /** BGR0 capture, or I420 frame to downscale */
+    const AVFrame* src;
+    /** I420 destination */
+    uint8_t* const* data;
+    const int* linesize;
+    /** Size of the destination */
+    int width;
+    int shift;
+};
+
 /** \var extern int    g_width
     \brief Global variable for the window width
 */
@@ -65,6 +191,34 @@ static Display* s_display;
 */
 static char* s_path_results;
 
+/** \var struct replay_buffer* s_replay;
+    \brief Replay buffer fed by the background recording, NULL if disabled
+*/
+static struct replay_buffer* s_replay;
+
+/** \var struct x_capture s_snap_capture;
+    \brief Capture reused by the snapshots, protected by s_snap_mtx
+*/
+static struct x_capture s_snap_capture;
+static pthread_mutex_t s_snap_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/** \var struct snapshot_worker* s_snapshots;
+    \brief Capture and encoder threads of the snapshots, started by the first one
+*/
+static struct snapshot_worker* s_snapshots;
+
+/** \var int s_width, s_height;
+    \brief Size of the window after its last rotation, 0 before any, protected by s_size_mtx
+*/
+static int s_width;
+static int s_height;
+static pthread_mutex_t s_size_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/** \var unsigned s_resizes;
+    \brief Number of resizes of the window, read without s_size_mtx by the recordings
+*/
+static unsigned s_resizes;
+
 void grabber_set_display(Display* display)
 {
     s_display = display;
@@ -75,6 +229,41 @@ void grabber_set_path_results(char* results)
     s_path_results = results;
 }
 
+/* Size of the window, s_size_mtx must be held. */
+static void window_size_locked(int* width, int* height)
+{
+    *width = s_width ? s_width : g_width;
+    *height = s_height ? s_height : g_height;
+}
+
+/* Current size of the window, which rotations swap. Returns the number of
+ * resizes of the window so far. */
+static unsigned window_size(int* width, int* height)
+{
+    unsigned resizes;
+
+    pthread_mutex_lock(&s_size_mtx);
+    window_size_locked(width, height);
+    resizes = s_resizes;
+    pthread_mutex_unlock(&s_size_mtx);
+    return resizes;
+}
+
+void grabber_resize(int width, int height)
+{
+    pthread_mutex_lock(&s_size_mtx);
+    s_width = width;
+    s_height = height;
+    /* The recordings notice it on their next capture. Their rings keep the
+     * size of the encoder: the replay recording and the live stream restart
+     * with new rings and encoders, the others capture what fits in them. */
+    __atomic_add_fetch(&s_resizes, 1, __ATOMIC_RELEASE);
+    /* The next snapshots get frames of the new size from the pool */
+    if (s_snapshots)
+        snapshot_worker_resize(s_snapshots, width, height);
+    pthread_mutex_unlock(&s_size_mtx);
+}
+
 /*
     \brief To stop video recording \a fd.
     \param mtx mutex to stop video recording
@@ -93,72 +282,45 @@ int needQuit(pthread_mutex_t* mtx)
     return 1;
 }
 
-static void log_packet(const AVFormatContext* fmt_ctx, const AVPacket* pkt)
-{
-    (void) fmt_ctx;
-    (void) pkt;
-    /*
-    AVRational* time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
-
-    printf("pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
-           av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
-           av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
-           av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
-           pkt->stream_index);*/
-}
-
-static int write_frame(AVFormatContext* fmt_ctx, const AVRational* time_base, AVStream* st,
-                       AVPacket* pkt)
-{
-    /* rescale output packet timestamp values from codec to stream timebase */
-    av_packet_rescale_ts(pkt, *time_base, st->time_base);
-    pkt->stream_index = st->index;
-
-    /* Write the compressed frame to the media file. */
-    log_packet(fmt_ctx, pkt);
-    return av_interleaved_write_frame(fmt_ctx, pkt);
-}
-
-/* Add an output stream. */
-static void add_stream(OutputStream* ost, AVFormatContext* oc, AVCodec** codec,
-                       enum AVCodecID codec_id)
+/* Allocate the encoder of a recording, for the output format fmt. The
+ * options private to the encoder are added to opt. Returns 0 on success, -1
+ * if there is no encoder for fmt. */
+static int add_encoder(OutputStream* ost, AVOutputFormat* fmt, AVCodec** codec,
+                        const struct record_profile* profile, int width, int height,
+                        AVDictionary** opt)
 {
     AVCodecContext* c;
 
     /* find the encoder */
-    *codec = avcodec_find_encoder(codec_id);
+    *codec = record_profile_encoder(profile, fmt);
     if (!(*codec))
     {
-        fprintf(stderr, "Could not find encoder for '%s'\n", avcodec_get_name(codec_id));
-        exit(1);
+        LOGW("Could not find encoder for '%s'", avcodec_get_name(fmt->video_codec));
+        return -1;
     }
 
-    ost->st = avformat_new_stream(oc, *codec);
-    if (!ost->st)
+    ost->enc = avcodec_alloc_context3(*codec);
+    if (!ost->enc)
     {
-        fprintf(stderr, "Could not allocate stream\n");
+        fprintf(stderr, "Could not allocate the encoder\n");
         exit(1);
     }
-    ost->st->id = oc->nb_streams - 1;
-    c = ost->st->codec;
+    c = ost->enc;
 
     switch ((*codec)->type)
     {
     case AVMEDIA_TYPE_VIDEO:
-        c->codec_id = codec_id;
+        c->codec_id = (*codec)->id;
 
-        c->bit_rate = 400000;
         /* Resolution must be a multiple of two. */
-        c->width = g_width;
-        c->height = g_height;
+        c->width = width;
+        c->height = height;
         /* timebase: This is the fundamental unit of time (in seconds) in terms
          * of which frame timestamps are represented. For fixed-fps content,
          * timebase should be 1/framerate and timestamp increments should be
          * identical to 1. */
-        ost->st->time_base = (AVRational){1, STREAM_FRAME_RATE};
-        c->time_base = ost->st->time_base;
+        c->time_base = (AVRational){1, ost->frame_rate};
 
-        c->gop_size = 12; /* emit one intra frame every twelve frames at most */
         c->pix_fmt = STREAM_PIX_FMT;
         if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO)
         {
@@ -172,6 +334,9 @@ static void add_stream(OutputStream* ost, AVFormatContext* oc, AVCodec** codec,
              * the motion of the chroma plane does not match the luma plane. */
             c->mb_decision = 2;
         }
+
+        /* bitrate or quality, keyframe interval and threads */
+        record_profile_apply(profile, c, opt);
         break;
 
     default:
@@ -179,8 +344,9 @@ static void add_stream(OutputStream* ost, AVFormatContext* oc, AVCodec** codec,
     }
 
     /* Some formats want stream headers to be separate. */
-    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+    if (fmt->flags & AVFMT_GLOBALHEADER)
         c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    return 0;
 }
 
 /**************************************************************/
@@ -210,10 +376,12 @@ static AVFrame* alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
     return picture;
 }
 
-static void open_video(AVCodec* codec, OutputStream* ost, AVDictionary* opt_arg)
+/* Open the encoder of ost. Returns 0 on success, -1 if the encoder rejects
+ * its settings, which may come from a recording message. */
+static int open_video(AVCodec* codec, OutputStream* ost, AVDictionary* opt_arg)
 {
     int ret;
-    AVCodecContext* c = ost->st->codec;
+    AVCodecContext* c = ost->enc;
     AVDictionary* opt = NULL;
 
     av_dict_copy(&opt, opt_arg, 0);
@@ -223,19 +391,12 @@ static void open_video(AVCodec* codec, OutputStream* ost, AVDictionary* opt_arg)
     av_dict_free(&opt);
     if (ret < 0)
     {
-        fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
-        exit(1);
-    }
-
-    /* allocate and init a re-usable frame */
-    ost->frame = alloc_picture(c->pix_fmt, c->width, c->height);
-    if (!ost->frame)
-    {
-        fprintf(stderr, "Could not allocate video frame\n");
-        exit(1);
+        LOGW("Could not open the %s encoder: %s", codec->name, av_err2str(ret));
+        return -1;
     }
 
-    /* If the output format is not YUV420P, then a temporary YUV420P
+    /* The frames given to the encoder are allocated by the recorder rings.
+     * If the output format is not YUV420P, then a temporary YUV420P
      * picture is needed too. It is then converted to the required
      * output format. */
     ost->tmp_frame = NULL;
@@ -247,114 +408,442 @@ static void open_video(AVCodec* codec, OutputStream* ost, AVDictionary* opt_arg)
             fprintf(stderr, "Could not allocate temporary picture\n");
             exit(1);
         }
+
+        ost->sws_ctx = sws_getContext(c->width, c->height, AV_PIX_FMT_YUV420P, c->width, c->height,
+                                      c->pix_fmt, SCALE_FLAGS, NULL, NULL, NULL);
+        if (!ost->sws_ctx)
+        {
+            fprintf(stderr, "Could not initialize the conversion context\n");
+            exit(1);
+        }
     }
+    return 0;
 }
 
-/* Prepare a dummy image. */
-static void fill_yuv_image(AVFrame* pict, int width, int height)
+/* Whether the rows of a captured image are already BGR0, the usual layout of a
+ * 24/32 bits visual. */
+static int image_is_bgrx(const XImage* image)
 {
-    int x, y, ret;
+    return image->bits_per_pixel == 32 && image->byte_order == LSBFirst &&
+           image->red_mask == 0xff0000 && image->green_mask == 0xff00 && image->blue_mask == 0xff;
+}
 
-    /* when we pass a frame to the encoder, it may keep a reference to it
-     * internally;
-     * make sure we do not overwrite it here
-     */
-    ret = av_frame_make_writable(pict);
-    if (ret < 0)
-        exit(1);
+/* Copy a captured image to a BGR0 frame. */
+static void image_to_bgrx(XImage* image, AVFrame* frame, int width, int height)
+{
+    int x, y;
 
-    /////////////////////////////////////////////////////
-    XImage* image =
-        XGetImage(s_display, (Drawable) g_window_id, 0, 0, width, height, AllPlanes, ZPixmap);
+    if (image_is_bgrx(image))
+    {
+        av_image_copy_plane(frame->data[0], frame->linesize[0], (const uint8_t*) image->data,
+                            image->bytes_per_line, 4 * width, height);
+        return;
+    }
 
-    // unsigned char *array = new unsigned char[width * height * 3];
     unsigned long red_mask = image->red_mask;
     unsigned long green_mask = image->green_mask;
     unsigned long blue_mask = image->blue_mask;
 
-    unsigned long pixel;
-
-    unsigned char blue;   //= pixel & blue_mask;
-    unsigned char green;  //= (pixel & green_mask) >> 8;
-    unsigned char red;    //= (pixel & red_mask) >> 16;
-
-    // Y
     for (y = 0; y < height; y++)
     {
+        uint8_t* row = frame->data[0] + y * frame->linesize[0];
         for (x = 0; x < width; x++)
         {
-            pixel = XGetPixel(image, x, y);
-            blue = pixel & blue_mask;
-            green = (pixel & green_mask) >> 8;
-            red = (pixel & red_mask) >> 16;
-            pict->data[0][y * pict->linesize[0] + x] =
-                RGB2Y(red, green, blue);  // *(img+ x + y + i * 3);
-            pict->data[1][(y / 2) * pict->linesize[1] + (x / 2)] = RGB2U(red, green, blue);
-            pict->data[2][(y / 2) * pict->linesize[2] + (x / 2)] = RGB2V(red, green, blue);
+            unsigned long pixel = x_capture_pixel(image, x, y);
+
+            row[4 * x + 0] = pixel & blue_mask;
+            row[4 * x + 1] = (pixel & green_mask) >> 8;
+            row[4 * x + 2] = (pixel & red_mask) >> 16;
+            row[4 * x + 3] = 0;
         }
     }
+}
+
+/* Capture the window for a one-shot grab, s_snap_mtx must be held. */
+static XImage* grab_once(int width, int height)
+{
+    if (s_snap_capture.image && (s_snap_capture.width != width || s_snap_capture.height != height))
+        x_capture_destroy(&s_snap_capture);
 
-    XDestroyImage(image);
+    if (!s_snap_capture.image &&
+        x_capture_init(&s_snap_capture, s_display, (Drawable) g_window_id, width, height) < 0)
+        return NULL;
+
+    return x_capture_grab(&s_snap_capture);
 }
 
-static AVFrame* get_video_frame(OutputStream* ost, void* arg)
+/* Copy a captured image to a BGR24 buffer. */
+static void image_to_bgr(XImage* image, unsigned char* img, int w, int h)
 {
-    AVCodecContext* c = ost->st->codec;
+    unsigned long red_mask = image->red_mask;
+    unsigned long green_mask = image->green_mask;
+    unsigned long blue_mask = image->blue_mask;
+
+    int x, y;
 
-    /* check if we want to generate more frames
-    if (av_compare_ts(ost->next_pts, ost->st->codec->time_base,
-                      STREAM_DURATION, (AVRational){ 1, 1 }) >= 0)
-        return NULL;*/
-    pthread_mutex_t* mx = arg;
-    while (needQuit(mx))
+    for (y = 0; y < h; y++)
     {
-        return NULL;
+        for (x = 0; x < w; x++)
+        {
+            unsigned long pixel = x_capture_pixel(image, x, y);
+
+            img[(x + w * y) * 3 + 0] = pixel & blue_mask;
+            img[(x + w * y) * 3 + 1] = (pixel & green_mask) >> 8;
+            img[(x + w * y) * 3 + 2] = (pixel & red_mask) >> 16;
+        }
     }
+}
 
-    if (c->pix_fmt != AV_PIX_FMT_YUV420P)
+/* Monotonic timestamp in nanoseconds. */
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Sleep until the monotonic time \a deadline_ns. */
+static void sleep_until(int64_t deadline_ns)
+{
+    struct timespec ts = {deadline_ns / 1000000000LL, deadline_ns % 1000000000LL};
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* The captures belong to the recorder, not to the buffers of the frames. */
+static void keep_capture(void* opaque, uint8_t* data)
+{
+    (void) opaque;
+    (void) data;
+}
+
+/* Create the captures of a recording, see struct recorder.
+ * Returns 0 on success, -1 on failure. */
+static int init_captures(struct recorder* rec, int queue_size)
+{
+    AVCodecContext* c = rec->ost->enc;
+    int count = 1;
+    int i;
+
+    rec->captures = calloc(queue_size + 1, sizeof(*rec->captures));
+    if (!rec->captures)
+        return -1;
+
+    for (i = 0; i < count; i++)
     {
-        /* as we only generate a YUV420P picture, we must convert it
-         * to the codec pixel format if needed */
-        if (!ost->sws_ctx)
+        struct capture_slot* slot = &rec->captures[i];
+        XImage* image;
+
+        rec->nb_captures = i + 1;
+        if (x_capture_init(&slot->capture, s_display, (Drawable) g_window_id, c->width,
+                           c->height) < 0)
+            return -1;
+
+        image = slot->capture.image;
+        if (i == 0 && image_is_bgrx(image))
+            count = queue_size + 1;
+        slot->buf = av_buffer_create((uint8_t*) image->data, image->bytes_per_line * image->height,
+                                     keep_capture, NULL, 0);
+        if (!slot->buf)
+            return -1;
+    }
+
+    rec->in_place = count > 1;
+    if (!rec->in_place)
+        LOGI("The captures are not BGR0, they are copied to the frames");
+    return 0;
+}
+
+/* Destroy the captures of a recording, once its captured ring is freed. */
+static void free_captures(struct recorder* rec)
+{
+    int i;
+
+    for (i = 0; i < rec->nb_captures; i++)
+    {
+        av_buffer_unref(&rec->captures[i].buf);
+        x_capture_destroy(&rec->captures[i].capture);
+    }
+    free(rec->captures);
+    rec->captures = NULL;
+    rec->nb_captures = 0;
+}
+
+/* A capture which no frame of the captured ring holds, to grab the next frame into.
+ * The frames only change hands in the capture thread, so there is always one. */
+static struct capture_slot* free_capture(struct recorder* rec)
+{
+    int i;
+
+    for (i = 0; i < rec->nb_captures; i++)
+        if (av_buffer_get_ref_count(rec->captures[i].buf) == 1)
+            return &rec->captures[i];
+    return NULL;
+}
+
+/* Make the image of a capture the buffer of a BGR0 frame of the captured ring. */
+static void attach_capture(struct capture_slot* slot, AVFrame* frame)
+{
+    XImage* image = slot->capture.image;
+
+    av_buffer_unref(&frame->buf[0]);
+    frame->buf[0] = av_buffer_ref(slot->buf);
+    if (!frame->buf[0])
+        LOGE("attach_capture(): out of memory");
+    frame->data[0] = (uint8_t*) image->data;
+    frame->linesize[0] = image->bytes_per_line;
+}
+
+/* Read the size of the window again if it was resized since the last call.
+ * Returns 1 if the window is no longer the size of the recording. */
+static int window_resized(struct recorder* rec)
+{
+    AVCodecContext* c = rec->ost->enc;
+
+    if (__atomic_load_n(&s_resizes, __ATOMIC_ACQUIRE) != rec->resizes)
+        rec->resizes = window_size(&rec->window_width, &rec->window_height);
+
+    return rec->window_width != c->width || rec->window_height != c->height;
+}
+
+/* First stage of a recording: capture the window on the ticks of the frame rate.
+ *
+ * Each frame is stamped with the tick closest to the time it was captured,
+ * counted from the start of the recording, so that the recording lasts as
+ * long as the session even when captures are late: a late capture leaves a
+ * gap in the timestamps (the previous frame is shown longer), and a capture
+ * landing on the tick of the previous one is dropped.
+ *
+ * Captures identical to the previous frame are dropped the same way, so that
+ * a static screen costs neither conversion nor encoding. A frame is still
+ * sent every second, and on the tick of the stop request, to bound the
+ * duration of the last frame.
+ *
+ * After a rotation, the captures only read the part of the window that is
+ * still inside the recording, or the capture stops if the recording
+ * restarts at the new size.
+ *
+ * The window is grabbed into a capture no frame holds. When its image is
+ * BGR0, it becomes the buffer of the frame, and the conversion reads the
+ * pixels where the X server wrote them.
+ */
+static void* capture_stage(void* arg)
+{
+    struct recorder* rec = arg;
+    OutputStream* ost = rec->ost;
+    AVCodecContext* c = ost->enc;
+    AVFrame* frame;
+    int64_t period_ns = 1000000000LL / ost->frame_rate;
+    int64_t start_ns = monotonic_ns();
+    int64_t next_ns = start_ns;
+    int64_t pts = 0;
+    uint64_t captured = 0;
+    uint64_t same_tick = 0;
+    uint64_t unchanged = 0;
+    int stop = 0;
+
+    while (!stop)
+    {
+        sleep_until(next_ns);
+        stop = needQuit(rec->quit) || __atomic_load_n(&rec->failed, __ATOMIC_ACQUIRE);
+        if (window_resized(rec) && rec->restart_on_resize)
+            stop = rec->resized = 1;
+
+        pts = (monotonic_ns() - start_ns + period_ns / 2) / period_ns;
+        // After a stall, wait for the next tick instead of catching up on the missed ones
+        next_ns = start_ns + (pts + 1) * period_ns;
+        if (pts < ost->next_pts)
         {
-            ost->sws_ctx = sws_getContext(c->width, c->height, AV_PIX_FMT_YUV420P, c->width,
-                                          c->height, c->pix_fmt, SCALE_FLAGS, NULL, NULL, NULL);
-            if (!ost->sws_ctx)
-            {
-                fprintf(stderr, "Could not initialize the conversion context\n");
-                exit(1);
-            }
+            same_tick++;
+            continue;
         }
-        fill_yuv_image(ost->tmp_frame, c->width, c->height);
-        sws_scale(ost->sws_ctx, (const uint8_t* const*) ost->tmp_frame->data,
-                  ost->tmp_frame->linesize, 0, c->height, ost->frame->data, ost->frame->linesize);
+
+        int force = stop || pts - (ost->next_pts - 1) >= ost->frame_rate;
+        if (!change_detect_pending(&rec->changes) && !force)
+        {
+            unchanged++;
+            continue;
+        }
+
+        struct capture_slot* slot = free_capture(rec);
+        XImage* image = slot ? x_capture_grab_area(&slot->capture, rec->window_width,
+                                                   rec->window_height)
+                             : NULL;
+        if (!image)
+        {
+            LOGW("Unable to capture the window, skipping a frame");
+            continue;
+        }
+
+        if (!change_detect_image(&rec->changes, image) && !force)
+        {
+            unchanged++;
+            continue;
+        }
+
+        frame = frame_ring_acquire(rec->captured);
+        if (!frame)
+            break;
+
+        if (rec->in_place)
+            attach_capture(slot, frame);
+        else
+            image_to_bgrx(image, frame, c->width, c->height);
+        frame->pts = pts;
+        ost->next_pts = pts + 1;
+        captured++;
+        frame_ring_publish(rec->captured, frame);
     }
-    else
+
+    LOGI("Captured %llu frames in %.2f s (%d fps), skipped %llu unchanged and %llu on a "
+         "repeated tick",
+         (unsigned long long) captured, (double) (pts + 1) / ost->frame_rate, ost->frame_rate,
+         (unsigned long long) unchanged, (unsigned long long) same_tick);
+
+    frame_ring_close(rec->captured);
+    return NULL;
+}
+
+/* Convert the rows [y0, y1) of a BGR0 capture to I420, y0 is even. */
+static void convert_band(void* arg, int y0, int y1)
+{
+    const struct band_job* job = arg;
+    uint8_t* const dst[3] = {job->data[0] + y0 * job->linesize[0],
+                             job->data[1] + y0 / 2 * job->linesize[1],
+                             job->data[2] + y0 / 2 * job->linesize[2]};
+
+    bgrx_to_i420(job->src->data[0] + y0 * job->src->linesize[0], job->src->linesize[0], dst,
+                 job->linesize, job->width, y1 - y0);
+}
+
+/* Downscale the rows [y0, y1) of a scaled I420 frame, y0 and y1 are even. */
+static void downscale_band(void* arg, int y0, int y1)
+{
+    const struct band_job* job = arg;
+    int p;
+
+    for (p = 0; p < 3; p++)
     {
-        fill_yuv_image(ost->frame, c->width, c->height);
+        /* the chroma planes have half the rows */
+        int r0 = p ? y0 / 2 : y0;
+        int r1 = p ? y1 / 2 : y1;
+
+        yuv_downscale_plane(job->src->data[p] + (r0 << job->shift) * job->src->linesize[p],
+                            job->src->linesize[p], job->data[p] + r0 * job->linesize[p],
+                            job->linesize[p], p ? job->width / 2 : job->width, r1 - r0,
+                            job->shift);
     }
+}
 
-    ost->frame->pts = ost->next_pts++;
+/* Downscale the I420 frame yuv into the next frame of the scaled recording s. */
+static void downscale_frame(struct band_pool* bands, struct recorder* s, const AVFrame* yuv)
+{
+    OutputStream* ost = s->ost;
+    AVCodecContext* c = ost->enc;
+    AVFrame* out;
+    AVFrame* dst;
+    struct band_job job;
+
+    out = frame_ring_acquire(s->converted);
+    if (!out)
+        return;
+    if (frame_ring_make_writable(s->converted, out) < 0)
+        exit(1);
 
-    return ost->frame;
+    dst = ost->tmp_frame ? ost->tmp_frame : out;
+    job = (struct band_job){yuv, dst->data, dst->linesize, c->width, s->shift};
+    band_pool_run(bands, downscale_band, &job, c->height, 2);
+    if (ost->tmp_frame)
+        sws_scale(ost->sws_ctx, (const uint8_t* const*) ost->tmp_frame->data,
+                  ost->tmp_frame->linesize, 0, c->height, out->data, out->linesize);
+    out->pts = yuv->pts;
+
+    frame_ring_publish(s->converted, out);
+}
+
+/* Second stage of a recording: convert the captures to the encoder pixel format.
+ *
+ * The conversion of each capture is split in horizontal bands, processed by
+ * the threads of rec->bands. The scaled recordings are downscaled from the
+ * I420 frame the same way, so that a single capture feeds every resolution.
+ */
+static void* convert_stage(void* arg)
+{
+    struct recorder* rec = arg;
+    OutputStream* ost = rec->ost;
+    AVCodecContext* c = ost->enc;
+    AVFrame* in;
+    AVFrame* out;
+    AVFrame* yuv;
+    struct band_job job;
+    int i;
+
+    while ((in = frame_ring_pop(rec->captured)))
+    {
+        out = frame_ring_acquire(rec->converted);
+        if (!out)
+        {
+            frame_ring_release(rec->captured, in);
+            break;
+        }
+
+        /* when we pass a frame to the encoder, it may keep a reference to it
+         * internally;
+         * make sure we do not overwrite it here, without copying it
+         */
+        if (frame_ring_make_writable(rec->converted, out) < 0)
+            exit(1);
+
+        /* as we only generate a YUV420P picture, we must convert it
+         * to the codec pixel format if needed */
+        yuv = ost->tmp_frame ? ost->tmp_frame : out;
+        job = (struct band_job){in, yuv->data, yuv->linesize, c->width, 0};
+        band_pool_run(rec->bands, convert_band, &job, c->height, 2);
+        yuv->pts = in->pts;
+        frame_ring_release(rec->captured, in);
+
+        for (i = 0; i < rec->nb_scaled; i++)
+            downscale_frame(rec->bands, rec->scaled[i], yuv);
+
+        if (ost->tmp_frame)
+            sws_scale(ost->sws_ctx, (const uint8_t* const*) ost->tmp_frame->data,
+                      ost->tmp_frame->linesize, 0, c->height, out->data, out->linesize);
+        out->pts = yuv->pts;
+        frame_ring_publish(rec->converted, out);
+    }
+
+    frame_ring_close(rec->converted);
+    for (i = 0; i < rec->nb_scaled; i++)
+        frame_ring_close(rec->scaled[i]->converted);
+    return NULL;
+}
+
+/* Write an encoded packet to the output file or to its current segment. */
+static int write_packet(struct recorder* rec, AVPacket* pkt)
+{
+    if (rec->segments)
+        return segmenter_write(rec->segments, pkt);
+    return muxer_write(&rec->mux, pkt);
 }
 
 /*
- * encode one video frame and send it to the muxer
+ * encode one video frame and send it to the muxer, NULL flushes the encoder
  * return 1 when encoding is finished, 0 otherwise
  */
-static int write_video_frame(AVFormatContext* oc, OutputStream* ost, void* arg)
+static int write_video_frame(struct recorder* rec, AVFrame* frame)
 {
     int ret;
     AVCodecContext* c;
-    AVFrame* frame;
     int got_packet = 0;
 
-    c = ost->st->codec;
+    c = rec->ost->enc;
 
-    frame = get_video_frame(ost, arg);
+    /* the reader of the live stream left, the recording is stopping */
+    if (__atomic_load_n(&rec->failed, __ATOMIC_ACQUIRE))
+        return 1;
 
-    if (oc->oformat->flags & AVFMT_RAWPICTURE)
+    if (!rec->replay && (rec->fmt->flags & AVFMT_RAWPICTURE))
     {
         /* a hack to avoid data copy with some raw video muxers */
         AVPacket pkt;
@@ -364,14 +853,12 @@ static int write_video_frame(AVFormatContext* oc, OutputStream* ost, void* arg)
             return 1;
 
         pkt.flags |= AV_PKT_FLAG_KEY;
-        pkt.stream_index = ost->st->index;
         pkt.data = (uint8_t*) frame;
         pkt.size = sizeof(AVPicture);
 
         pkt.pts = pkt.dts = frame->pts;
-        av_packet_rescale_ts(&pkt, c->time_base, ost->st->time_base);
 
-        ret = av_interleaved_write_frame(oc, &pkt);
+        ret = write_packet(rec, &pkt);
     }
     else
     {
@@ -386,9 +873,14 @@ static int write_video_frame(AVFormatContext* oc, OutputStream* ost, void* arg)
             exit(1);
         }
 
-        if (got_packet)
+        if (got_packet && rec->replay)
+        {
+            replay_buffer_push(rec->replay, &pkt);
+            av_free_packet(&pkt);
+        }
+        else if (got_packet)
         {
-            ret = write_frame(oc, &c->time_base, ost->st, &pkt);
+            ret = write_packet(rec, &pkt);
         }
         else
         {
@@ -396,6 +888,12 @@ static int write_video_frame(AVFormatContext* oc, OutputStream* ost, void* arg)
         }
     }
 
+    if (ret < 0 && rec->live)
+    {
+        LOGW("Stopping the live stream: %s", av_err2str(ret));
+        __atomic_store_n(&rec->failed, 1, __ATOMIC_RELEASE);
+        return 1;
+    }
     if (ret < 0)
     {
         fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
@@ -405,10 +903,45 @@ static int write_video_frame(AVFormatContext* oc, OutputStream* ost, void* arg)
     return (frame || got_packet) ? 0 : 1;
 }
 
+/* Close the output of the encoder of rec, once it got its last packet. */
+static void close_output(struct recorder* rec)
+{
+    /* The trailer must be written before the encoder is closed */
+    if (rec->segments)
+        segmenter_close(rec->segments);
+    else if (!rec->replay)
+        muxer_close(&rec->mux);
+}
+
+/* Flush the encoder of rec, and close its output. */
+static void finish_output(struct recorder* rec)
+{
+    /* get the frames delayed by the encoder */
+    while (!write_video_frame(rec, NULL))
+        ;
+
+    close_output(rec);
+}
+
+/* Last stage of a recording: encode the converted frames, then close the output. */
+static void* encoder_stage(void* arg)
+{
+    struct recorder* rec = arg;
+    AVFrame* frame;
+
+    while ((frame = frame_ring_pop(rec->converted)))
+    {
+        write_video_frame(rec, frame);
+        frame_ring_release(rec->converted, frame);
+    }
+
+    finish_output(rec);
+    return NULL;
+}
+
 static void close_stream(OutputStream* ost)
 {
-    avcodec_close(ost->st->codec);
-    av_frame_free(&ost->frame);
+    avcodec_free_context(&ost->enc);
     av_frame_free(&ost->tmp_frame);
     sws_freeContext(ost->sws_ctx);
     swr_free(&ost->swr_ctx);
@@ -417,94 +950,401 @@ static void close_stream(OutputStream* ost)
 /**************************************************************/
 /* media file output */
 
-int ffmpeg_grabber(void* arg)
+/* Options of the muxer of a live stream: small fragments, written to the
+ * reader as soon as they are complete. */
+static void stream_options(AVOutputFormat* fmt, AVDictionary** opt)
+{
+    int fragment_ms = configvar_int_default("AIC_PLAYER_STREAM_FRAGMENT_MS", STREAM_FRAGMENT_MS);
+
+    av_dict_set(opt, "flush_packets", "1", 0);
+    if (!strcmp(fmt->name, "mp4") || !strcmp(fmt->name, "mov"))
+    {
+        /* fragmented mp4: the moov atom comes first, each fragment stands alone */
+        av_dict_set(opt, "movflags", "empty_moov+default_base_moof+frag_keyframe", 0);
+        av_dict_set_int(opt, "frag_duration", fragment_ms * 1000LL, 0);
+    }
+}
+
+/* Open the output of the encoder of rec: the replay buffer, segments or a single file. */
+static int open_output(struct recorder* rec, const char* filename, AVDictionary* opt,
+                       const struct record_output* out)
+{
+    AVCodecContext* c = rec->ost->enc;
+    AVDictionary* mux_opt = NULL;
+    int ret;
+
+    if (rec->replay)
+        return replay_buffer_set_encoder(rec->replay, c);
+
+    if (out->segment_seconds > 0 || out->segment_mb > 0)
+    {
+        /* Bounded files, finalized in the background */
+        rec->segments = segmenter_open(filename, rec->fmt, c, opt, out->segment_seconds,
+                                       (size_t) out->segment_mb << 20, out->segment_index);
+        return rec->segments ? 0 : -1;
+    }
+
+    av_dict_copy(&mux_opt, opt, 0);
+    ret = muxer_open(&rec->mux, filename, rec->fmt, c, &mux_opt);
+    av_dict_free(&mux_opt);
+    return ret;
+}
+
+/* Add a recording of the captures of rec at 1/(1 << shift) of their size, to
+ * the file name of rec with suffix inserted before its extension:
+ * video.mp4 gives video-preview.mp4. */
+static void add_scaled(struct recorder* rec, const struct thread_args* args, int shift,
+                       const char* suffix, AVDictionary* opt, const struct record_output* out,
+                       int queue_size, int policy)
+{
+    char filename[BUF_SIZE];
+    const char* name = args->record_filename;
+    const char* slash = strrchr(name, '/');
+    const char* dot = strrchr(name, '.');
+    /* Resolution must be a multiple of two. */
+    int width = (rec->ost->enc->width >> shift) & ~1;
+    int height = (rec->ost->enc->height >> shift) & ~1;
+    AVDictionary* enc_opt = NULL;
+    AVCodec* codec;
+    struct recorder* s;
+
+    if (shift <= 0)
+        return;
+    if (rec->nb_scaled == RECORD_SCALED_MAX || width < 2 || height < 2)
+    {
+        LOGW("Cannot record the %s at 1/%d of %dx%d", suffix, 1 << shift, rec->ost->enc->width,
+             rec->ost->enc->height);
+        return;
+    }
+
+    if (!dot || (slash && dot < slash))
+        dot = name + strlen(name);
+    snprintf(filename, sizeof(filename), "%.*s-%s%s", (int) (dot - name), name, suffix, dot);
+
+    s = calloc(1, sizeof(*s));
+    if (!s || !(s->ost = calloc(1, sizeof(*s->ost))))
+        LOGE("add_scaled(): out of memory");
+    s->ost->frame_rate = rec->ost->frame_rate;
+    s->quit = rec->quit;
+    s->fmt = rec->fmt;
+    s->shift = shift;
+
+    if (add_encoder(s->ost, s->fmt, &codec, &args->profile, width, height, &enc_opt) < 0 ||
+        open_video(codec, s->ost, enc_opt) < 0 || open_output(s, filename, opt, out) < 0)
+    {
+        LOGW("Could not open %s, recording without the %s", filename, suffix);
+        av_dict_free(&enc_opt);
+        close_stream(s->ost);
+        free(s->ost);
+        free(s);
+        return;
+    }
+    av_dict_free(&enc_opt);
+
+    s->converted = frame_ring_new(suffix, queue_size, policy, s->ost->enc->pix_fmt, width, height);
+    if (!s->converted)
+        LOGE("add_scaled(): out of memory");
+
+    LOGI("Recording the %s to %s at %dx%d", suffix, filename, width, height);
+    rec->scaled[rec->nb_scaled++] = s;
+}
+
+/* Record the window to args->record_filename, or to the output out, until
+ * args->mtx is unlocked. Returns an enum record_status. */
+static int record(struct thread_args* args, const struct record_output* out)
 {
     OutputStream video_st = {0};
     const char* filename;
     AVOutputFormat* fmt;
-    AVFormatContext* oc;
     AVCodec* video_codec;
-    int ret;
-    int have_video = 0;
-    int encode_video = 0;
     AVDictionary* opt = NULL;
+    AVDictionary* enc_opt = NULL;
+    int ret;
+    struct recorder rec = {0};
+    pthread_t capture_thread;
+    pthread_t convert_thread;
+    pthread_t scaled_threads[RECORD_SCALED_MAX];
+    int width, height;
+    int i;
+
+    video_st.frame_rate = configvar_int_default("AIC_PLAYER_RECORD_FPS", STREAM_FRAME_RATE);
+    if (video_st.frame_rate < 1 || video_st.frame_rate > STREAM_FRAME_RATE_MAX)
+    {
+        LOGW("Invalid AIC_PLAYER_RECORD_FPS %d, recording at %d fps", video_st.frame_rate,
+             STREAM_FRAME_RATE);
+        video_st.frame_rate = STREAM_FRAME_RATE;
+    }
 
-    struct thread_args* args = (struct thread_args*) arg;
+    int queue_size = configvar_int_default("AIC_PLAYER_RECORD_QUEUE_SIZE", RECORD_QUEUE_SIZE);
+    int policy =
+        frame_ring_policy_from_name(configvar_string_default("AIC_PLAYER_RECORD_QUEUE_POLICY",
+                                                             "drop"));
+    if (policy < 0)
+    {
+        LOGW("Unknown AIC_PLAYER_RECORD_QUEUE_POLICY, dropping the oldest frames");
+        policy = FRAME_RING_DROP_OLDEST;
+    }
+    int changes =
+        change_mode_from_name(configvar_string_default("AIC_PLAYER_RECORD_CHANGES", "hash"));
+    if (changes < 0)
+    {
+        LOGW("Unknown AIC_PLAYER_RECORD_CHANGES, hashing the captures");
+        changes = CHANGE_HASH;
+    }
 
     filename = args->record_filename;
     av_dict_set(&opt, "author", "aic", 0);
 
-    /* allocate the output media context */
-    avformat_alloc_output_context2(&oc, NULL, NULL, filename);
-    if (!oc)
+    fmt = muxer_guess_format(filename, out->format);
+    if (out->live)
+        stream_options(fmt, &opt);
+    if (fmt->video_codec == AV_CODEC_ID_NONE)
     {
-        LOGM("Could not deduce output format from file extension: using MPEG. %s",
-             args->record_filename);
-        avformat_alloc_output_context2(&oc, NULL, "mpeg", filename);
+        LOGW("No video codec for the format of %s", filename);
+        av_dict_free(&opt);
+        return RECORD_FAILED;
     }
-    if (!oc)
-        return 1;
 
-    fmt = oc->oformat;
+    /* Allocate the encoder of the profile, open it and allocate the
+     * necessary encode buffers. */
+    /* The size of a recording is the size of the window when it starts */
+    rec.resizes = window_size(&width, &height);
+    rec.window_width = width;
+    rec.window_height = height;
+    if (add_encoder(&video_st, fmt, &video_codec, &args->profile, width, height, &enc_opt) < 0 ||
+        open_video(video_codec, &video_st, enc_opt) < 0)
+    {
+        LOGW("Unable to encode %s, the recording is skipped", filename);
+        close_stream(&video_st);
+        av_dict_free(&enc_opt);
+        av_dict_free(&opt);
+        return RECORD_FAILED;
+    }
+    av_dict_free(&enc_opt);
+
+    AVCodecContext* c = video_st.enc;
+    rec.ost = &video_st;
+    rec.quit = &args->mtx;
+    rec.fmt = fmt;
+    rec.replay = out->replay;
+    rec.live = out->live;
+    rec.restart_on_resize = out->restart_on_resize;
+    ret = open_output(&rec, filename, opt, out);
+    if (ret < 0)
+    {
+        close_stream(&video_st);
+        av_dict_free(&opt);
+        return RECORD_FAILED;
+    }
 
-    /* Add the audio and video streams using the default format codecs
-    * and initialize the codecs. */
-    if (fmt->video_codec != AV_CODEC_ID_NONE)
+    /* The shared images are reused for every frame of the recording. */
+    if (init_captures(&rec, queue_size) < 0)
+        goto fail;
+
+    rec.captured =
+        frame_ring_new("capture", queue_size, policy, AV_PIX_FMT_BGR0, c->width, c->height);
+    rec.converted =
+        frame_ring_new("encoder", queue_size, policy, c->pix_fmt, c->width, c->height);
+    if (!rec.captured || !rec.converted)
+        goto fail;
+    if (change_detect_init(&rec.changes, changes, s_display, (Drawable) g_window_id, c->width,
+                           c->height) < 0)
+        goto fail;
+
+    /* The scaled recordings reuse the captures and the encoder profile. They
+     * and the band threads only start once nothing else can fail. */
+    if (!rec.replay && !rec.live)
+    {
+        add_scaled(&rec, args, out->preview_shift, "preview", opt, out, queue_size, policy);
+        add_scaled(&rec, args, out->thumbnail_shift, "thumbnail", opt, out, queue_size, policy);
+    }
+    rec.bands = band_pool_new(configvar_int_default("AIC_PLAYER_RECORD_CONVERT_THREADS", 0));
+    if (!rec.bands)
+        LOGE("record(): out of memory");
+
+    /* Capture, conversion and encoding run in their own threads, so that a
+     * slow frame in one stage does not delay the others. Each scaled
+     * recording has its own encoder thread. */
+    if (pthread_create(&capture_thread, NULL, capture_stage, &rec) ||
+        pthread_create(&convert_thread, NULL, convert_stage, &rec))
+        LOGE("Unable to start the recording threads");
+    for (i = 0; i < rec.nb_scaled; i++)
+        if (pthread_create(&scaled_threads[i], NULL, encoder_stage, rec.scaled[i]))
+            LOGE("Unable to start the recording threads");
+
+    encoder_stage(&rec);
+
+    pthread_join(capture_thread, NULL);
+    pthread_join(convert_thread, NULL);
+    for (i = 0; i < rec.nb_scaled; i++)
     {
-        add_stream(&video_st, oc, &video_codec, fmt->video_codec);
-        have_video = 1;
-        encode_video = 1;
+        pthread_join(scaled_threads[i], NULL);
+        close_stream(rec.scaled[i]->ost);
+        frame_ring_free(rec.scaled[i]->converted);
+        free(rec.scaled[i]->ost);
+        free(rec.scaled[i]);
     }
 
-    /* Now that all the parameters are set, we can open
-    * video codecs and allocate the necessary encode buffers. */
-    if (have_video)
-        open_video(video_codec, &video_st, opt);
+    close_stream(&video_st);
+    frame_ring_free(rec.captured);
+    frame_ring_free(rec.converted);
+    free_captures(&rec);
+    change_detect_destroy(&rec.changes);
+    band_pool_free(rec.bands);
+    av_dict_free(&opt);
 
-    av_dump_format(oc, 0, filename, 1);
+    if (rec.failed)
+        return RECORD_FAILED;
+    return rec.resized ? RECORD_RESIZED : RECORD_DONE;
+
+fail:
+    /* The header is written: close the output properly, with nothing in it */
+    close_output(&rec);
+    close_stream(&video_st);
+    frame_ring_free(rec.captured);
+    frame_ring_free(rec.converted);
+    free_captures(&rec);
+    av_dict_free(&opt);
+    return RECORD_FAILED;
+}
 
-    /* open the output file, if needed */
-    if (!(fmt->flags & AVFMT_NOFILE))
-    {
-        ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE);
-        if (ret < 0)
-        {
-            fprintf(stderr, "Could not open '%s': %s\n", filename, av_err2str(ret));
-            return 1;
-        }
-    }
+/* Shift of the size of a scaled recording from the setting name, which
+ * divides the size by 2, 4 or 8; 0 if it is disabled. */
+static int scale_shift(char* name)
+{
+    int scale = configvar_int_default(name, 0);
 
-    /* Write the stream header, if any. */
-    ret = avformat_write_header(oc, &opt);
-    if (ret < 0)
+    switch (scale)
     {
-        fprintf(stderr, "Error occurred when opening output file: %s\n", av_err2str(ret));
+    case 0:
+    case 1:
+        return 0;
+    case 2:
         return 1;
+    case 4:
+        return 2;
+    case 8:
+        return 3;
     }
+    LOGW("Invalid %s %d, expected 2, 4 or 8", name, scale);
+    return 0;
+}
 
-    while (encode_video)
+int ffmpeg_grabber(void* arg)
+{
+    struct record_output out = {0};
+
+    out.segment_seconds = configvar_int_default("AIC_PLAYER_RECORD_SEGMENT_SECONDS", 0);
+    out.segment_mb = configvar_int_default("AIC_PLAYER_RECORD_SEGMENT_MB", 0);
+    out.segment_index = configvar_int_default("AIC_PLAYER_RECORD_SEGMENT_INDEX", 0);
+    out.preview_shift = scale_shift("AIC_PLAYER_RECORD_PREVIEW_SCALE");
+    out.thumbnail_shift = scale_shift("AIC_PLAYER_RECORD_THUMBNAIL_SCALE");
+    return record((struct thread_args*) arg, &out);
+}
+
+static void* replay_thread(void* arg)
+{
+    /* The replay buffer is saved to mp4 files */
+    struct record_output out = {.format = "mp4", .replay = s_replay, .restart_on_resize = 1};
+
+    /* After a rotation, the encoder restarts at the new size of the window:
+     * replay_buffer_set_encoder() drops the packets of the previous size */
+    while (record(arg, &out) == RECORD_RESIZED)
+        LOGI("Restarting the replay recording at the new size of the window");
+    return NULL;
+}
+
+void grabber_start_replay(void)
+{
+    static s_thread_args replay_args;
+    pthread_t thread;
+
+    int seconds = configvar_int_default("AIC_PLAYER_REPLAY_SECONDS", 0);
+    int max_mb = configvar_int_default("AIC_PLAYER_REPLAY_MAX_MB", REPLAY_MAX_MB);
+    if (seconds <= 0)
+        return;
+
+    s_replay = replay_buffer_new(seconds, (size_t) max_mb << 20);
+    if (!s_replay)
+        LOGE("grabber_start_replay(): out of memory");
+
+    /* The replay recording never stops: its mutex stays locked */
+    snprintf(replay_args.record_filename, sizeof(replay_args.record_filename), "replay buffer");
+    record_profile_from_config(&replay_args.profile);
+    pthread_mutex_init(&replay_args.mtx, NULL);
+    pthread_mutex_lock(&replay_args.mtx);
+
+    if (pthread_create(&thread, NULL, replay_thread, &replay_args))
+        LOGE("Unable to start the replay recording");
+    pthread_detach(thread);
+}
+
+/* Stream the window until the end of the player, restarting the stream
+ * whenever its reader leaves, and at once at the new size of the window
+ * after a rotation. */
+static void* stream_thread(void* arg)
+{
+    struct record_output out = {.live = 1, .restart_on_resize = 1};
+    int status;
+
+    out.format = configvar_string_default("AIC_PLAYER_STREAM_FORMAT", "mpegts");
+    while ((status = record(arg, &out)) != RECORD_DONE)
     {
-        encode_video = !write_video_frame(oc, &video_st, (void*) &args->mtx);
+        if (status == RECORD_RESIZED)
+            LOGI("Restarting the live stream at the new size of the window");
+        else
+            sleep(STREAM_RETRY_S);
     }
+    return NULL;
+}
 
-    /* Write the trailer, if any. The trailer must be written before you
-     * close the CodecContexts open when you wrote the header; otherwise
-     * av_write_trailer() may try to use memory that was freed on
-     * av_codec_close(). */
-    av_write_trailer(oc);
+void grabber_start_stream(void)
+{
+    static s_thread_args stream_args;
+    pthread_t thread;
 
-    /* Close each codec. */
-    if (have_video)
-        close_stream(&video_st);
+    const char* url = configvar_string_default("AIC_PLAYER_STREAM_URL", "");
+    if (!url[0])
+        return;
 
-    if (!(fmt->flags & AVFMT_NOFILE))
-        /* Close the output file. */
-        avio_closep(&oc->pb);
+    if (!strcmp(url, "-") || !strcmp(url, "pipe:1"))
+    {
+        /* The logs go to stdout too: keep stdout for the stream, and send
+         * the logs to stderr instead */
+        int fd = dup(STDOUT_FILENO);
+        if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+            LOGE("Unable to redirect the logs to stderr");
+        snprintf(stream_args.record_filename, sizeof(stream_args.record_filename), "pipe:%d",
+                 fd);
+    }
+    else
+    {
+        g_strlcpy(stream_args.record_filename, url, sizeof(stream_args.record_filename));
+    }
 
-    /* free the stream */
-    avformat_free_context(oc);
+    /* Low latency encoding: no B-frames, slice threads and zerolatency tune */
+    record_profile_from_config(&stream_args.profile);
+    stream_args.profile.low_latency = 1;
 
-    return 0;
+    /* The stream never stops: its mutex stays locked */
+    pthread_mutex_init(&stream_args.mtx, NULL);
+    pthread_mutex_lock(&stream_args.mtx);
+
+    LOGI("Streaming the window to %s", stream_args.record_filename);
+    if (pthread_create(&thread, NULL, stream_thread, &stream_args))
+        LOGE("Unable to start the live stream");
+    pthread_detach(thread);
+}
+
+/* Save the replay buffer to path. */
+static void save_replay(const char* path)
+{
+    if (!s_replay)
+    {
+        LOGW("Instant replay is disabled (AIC_PLAYER_REPLAY_SECONDS), cannot save %s", path);
+        return;
+    }
+    replay_buffer_save(s_replay, path);
 }
 
 unsigned char* xgrabber()
@@ -521,17 +1361,21 @@ unsigned char* xgrabber()
 
     snprintf(usec, 4, "%ld", tv.tv_usec);
 
-    unsigned char* img = NULL;
+    /* The image is only reallocated when the size of the window changes */
+    static unsigned char* img = NULL;
+    static int img_size = 0;
     int w, h;
-    w = g_width;
-    h = g_height;
+    window_size(&w, &h);
 
-    if (img)
+    if (img_size != 3 * w * h)
+    {
         free(img);
-    img = (unsigned char*) malloc(3 * w * h);
-    if (!img)
-        LOGE("xgrabber(): out of memory");
-    memset(img, 0, sizeof(*img));
+        img_size = 3 * w * h;
+        img = (unsigned char*) malloc(img_size);
+        if (!img)
+            LOGE("xgrabber(): out of memory");
+    }
+    memset(img, 0, img_size);
 
     char string1[BUF_SIZE];
     snprintf(string1, sizeof(string1), "%s%s", T, usec);
@@ -539,37 +1383,16 @@ unsigned char* xgrabber()
     XMapWindow(s_display, (Drawable) g_window_id);
     GC gc = XCreateGC(s_display, (Drawable) g_window_id, 0, 0);
 
-    XFillRectangle(s_display, (Drawable) g_window_id, gc, 0, g_height, g_width, g_height + 100);
+    XFillRectangle(s_display, (Drawable) g_window_id, gc, 0, h, w, h + 100);
 
-    XDrawString(s_display, (Drawable) g_window_id, gc, 5, g_height - 100 + 15, string1,
+    XDrawString(s_display, (Drawable) g_window_id, gc, 5, h - 100 + 15, string1,
                 strlen(string1));
 
-    XImage* image = XGetImage(s_display, (Drawable) g_window_id, 0, 0, w, h, AllPlanes, ZPixmap);
-
-    // unsigned char *array = new unsigned char[width * height * 3];
-    unsigned long red_mask = image->red_mask;
-    unsigned long green_mask = image->green_mask;
-    unsigned long blue_mask = image->blue_mask;
-
-    int x, y = 0;
-
-    for (x = 0; x < w; x++)
-    {
-        for (y = 0; y < h; y++)
-        {
-            unsigned long pixel = XGetPixel(image, x, y);
-
-            unsigned char blue = pixel & blue_mask;
-            unsigned char green = (pixel & green_mask) >> 8;
-            unsigned char red = (pixel & red_mask) >> 16;
-
-            img[(x + w * y) * 3 + 0] = blue;
-            img[(x + w * y) * 3 + 1] = green;
-            img[(x + w * y) * 3 + 2] = red;
-        }
-    }
-
-    XDestroyImage(image);
+    pthread_mutex_lock(&s_snap_mtx);
+    XImage* image = grab_once(w, h);
+    if (image)
+        image_to_bgr(image, img, w, h);
+    pthread_mutex_unlock(&s_snap_mtx);
 
     /*FILE *avconv = NULL;
 
@@ -581,79 +1404,70 @@ unsigned char* xgrabber()
     return img;
 }
 
-void grab_snapshot(char* snap_filename)
+/* Capture the window into a BGR0 frame, for the snapshot worker. */
+static int grab_frame(AVFrame* frame)
 {
-    FILE* f;
-    unsigned char* img = NULL;
-    int w, h;
-    w = g_width;
-    h = g_height;
+    pthread_mutex_lock(&s_snap_mtx);
+    XImage* image = grab_once(frame->width, frame->height);
+    if (image)
+        image_to_bgrx(image, frame, frame->width, frame->height);
+    pthread_mutex_unlock(&s_snap_mtx);
 
-    if (img)
-        free(img);
-    img = (unsigned char*) malloc(3 * w * h);
-    if (!img)
-        LOGE("grab_snapshot(): out of memory");
-    memset(img, 0, sizeof(*img));
-
-    XImage* image = XGetImage(s_display, (Drawable) g_window_id, 0, 0, w, h, AllPlanes, ZPixmap);
-
-    // unsigned char *array = new unsigned char[width * height * 3];
-    unsigned long red_mask = image->red_mask;
-    unsigned long green_mask = image->green_mask;
-    unsigned long blue_mask = image->blue_mask;
-
-    int x, y = 0;
+    return image ? 0 : -1;
+}
 
-    for (x = 0; x < w; x++)
+/* Start the snapshot worker, on the first snapshot. */
+static void start_snapshots(void)
+{
+    int width, height;
+    int pool_size = configvar_int_default("AIC_PLAYER_SNAP_POOL_SIZE", SNAPSHOT_POOL_SIZE);
+    int png_level = configvar_int_default("AIC_PLAYER_SNAP_PNG_LEVEL", SNAPSHOT_PNG_LEVEL);
+    int jpeg_quality =
+        configvar_int_default("AIC_PLAYER_SNAP_JPEG_QUALITY", SNAPSHOT_JPEG_QUALITY);
+    int format =
+        snapshot_format_from_name(configvar_string_default("AIC_PLAYER_SNAP_FORMAT", "png"));
+    if (format < 0)
     {
-        for (y = 0; y < h; y++)
-        {
-            unsigned long pixel = XGetPixel(image, x, y);
-
-            unsigned char blue = pixel & blue_mask;
-            unsigned char green = (pixel & green_mask) >> 8;
-            unsigned char red = (pixel & red_mask) >> 16;
-
-            img[(x + w * y) * 3 + 0] = blue;
-            img[(x + w * y) * 3 + 1] = green;
-            img[(x + w * y) * 3 + 2] = red;
-        }
+        LOGW("Unknown AIC_PLAYER_SNAP_FORMAT, writing PNG snapshots");
+        format = SNAPSHOT_PNG;
+    }
+    if (pool_size < 2 || pool_size > FRAME_RING_MAX)
+    {
+        LOGW("Invalid AIC_PLAYER_SNAP_POOL_SIZE %d, using %d", pool_size, SNAPSHOT_POOL_SIZE);
+        pool_size = SNAPSHOT_POOL_SIZE;
     }
 
-    int filesize = 54 + 3 * g_width * g_height;
-    unsigned char bmpfileheader[14] = {'B', 'M', 0, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0};
-    unsigned char bmpinfoheader[40] = {40, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 24, 0};
-    unsigned char bmppad[3] = {0, 0, 0};
+    pthread_mutex_lock(&s_size_mtx);
+    window_size_locked(&width, &height);
+    s_snapshots = snapshot_worker_new(grab_frame, width, height, pool_size, format, png_level,
+                                      jpeg_quality);
+    pthread_mutex_unlock(&s_size_mtx);
+    if (!s_snapshots)
+        LOGE("Unable to start the snapshot worker");
+}
 
-    bmpfileheader[2] = (unsigned char) (filesize);
-    bmpfileheader[3] = (unsigned char) (filesize >> 8);
-    bmpfileheader[4] = (unsigned char) (filesize >> 16);
-    bmpfileheader[5] = (unsigned char) (filesize >> 24);
+void grab_snapshot_burst(const char* snap_filename, int count, int interval_ms)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
 
-    bmpinfoheader[4] = (unsigned char) (w);
-    bmpinfoheader[5] = (unsigned char) (w >> 8);
-    bmpinfoheader[6] = (unsigned char) (w >> 16);
-    bmpinfoheader[7] = (unsigned char) (w >> 24);
-    bmpinfoheader[8] = (unsigned char) (h);
-    bmpinfoheader[9] = (unsigned char) (h >> 8);
-    bmpinfoheader[10] = (unsigned char) (h >> 16);
-    bmpinfoheader[11] = (unsigned char) (h >> 24);
+    pthread_once(&once, start_snapshots);
+    if (snapshot_worker_request(s_snapshots, snap_filename, count, interval_ms) < 0)
+        LOGW("Unable to queue the snapshot %s", snap_filename);
+}
 
-    f = fopen(snap_filename, "wb");
-    fwrite(bmpfileheader, 1, 14, f);
-    fwrite(bmpinfoheader, 1, 40, f);
+void grab_snapshot(char* snap_filename)
+{
+    grab_snapshot_burst(snap_filename, 1, 0);
+}
 
-    int ii = 0;
+/* Queue the snapshots of a recording message, a burst if it has a count. */
+static void snapshot_payload(const char* path, const RecordingPayload* recData)
+{
+    int count = recData->has_burstcount ? (int) recData->burstcount : 1;
+    int interval_ms =
+        recData->has_burstintervalms ? (int) recData->burstintervalms : SNAPSHOT_BURST_INTERVAL_MS;
 
-    for (ii = 0; ii < g_height; ii++)
-    {
-        fwrite(img + (g_width * (g_height - ii - 1) * 3), 3, g_width, f);
-        fwrite(bmppad, 1, (4 - (g_width * 3) % 4) % 4, f);
-    }
-    fclose(f);
-    XDestroyImage(image);
-    free(img);
+    grab_snapshot_burst(path, count, interval_ms);
 }
 
 int precv(void* arg)
@@ -736,6 +1550,8 @@ void* pgrab(void* arg)
 
                 if (recData->startstop && !args->flagRecording)
                 {
+                    record_profile_from_config(&grab_args.profile);
+                    record_profile_from_payload(&grab_args.profile, recData);
                     pthread_mutex_init(&grab_args.mtx, NULL);
                     pthread_mutex_lock(&grab_args.mtx);
                     pthread_create(&pgrab_Thread, NULL, (void*) &ffmpeg_grabber, &grab_args);
@@ -751,8 +1567,13 @@ void* pgrab(void* arg)
             else if (!strncmp("snap", recData->recfilename, 4) && recData->startstop == 2)
             {
                 snprintf(str_path, sizeof(str_path), "%s%s", base_path, recData->recfilename);
-                grab_snapshot(str_path);
-            }  // end video/snap
+                snapshot_payload(str_path, recData);
+            }
+            else if (!strncmp("replay", recData->recfilename, 6))
+            {
+                snprintf(str_path, sizeof(str_path), "%s%s", base_path, recData->recfilename);
+                save_replay(str_path);
+            }  // end video/snap/replay
         }
     }
     pthread_mutex_unlock(&args->mtx);
@@ -840,6 +1661,8 @@ void* grab_handler_amqp(void* args)
 
                     if (recData->startstop && !data->flagRecording)
                     {
+                        record_profile_from_config(&grab_args.profile);
+                        record_profile_from_payload(&grab_args.profile, recData);
                         pthread_mutex_init(&grab_args.mtx, NULL);
                         pthread_mutex_lock(&grab_args.mtx);
                         pthread_create(&pgrab_Thread, NULL, (void*) &ffmpeg_grabber, &grab_args);
@@ -856,8 +1679,14 @@ void* grab_handler_amqp(void* args)
                 {
                     char str_path[BUF_SIZE];
                     snprintf(str_path, sizeof(str_path), "%s%s", base_path, recData->recfilename);
-                    grab_snapshot(str_path);
-                }  // end video/snap
+                    snapshot_payload(str_path, recData);
+                }
+                else if (!strncmp("replay", recData->recfilename, 6))
+                {
+                    char str_path[BUF_SIZE];
+                    snprintf(str_path, sizeof(str_path), "%s%s", base_path, recData->recfilename);
+                    save_replay(str_path);
+                }  // end video/snap/replay
             }      // end ifenvelope
         }          // end if err_amqlisten
         sleep(1);
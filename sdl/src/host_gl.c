@@ -1,13 +1,16 @@
 #include <errno.h>    // for errno, EINTR
 #include <pthread.h>  // for pthread_mutex_lock, pthread_mutex_unlock
-#include <stdint.h>   // for uint8_t
 #include <stdio.h>    // for NULL
 #include <stdlib.h>   // for free
 #include <string.h>
-#include <sys/select.h>  // for FD_ISSET, FD_SET, select, FD_ZERO, fd_set
-#include <sys/socket.h>  // for MSG_WAITALL
+#include <sys/socket.h>  // for MSG_WAITALL, setsockopt, SO_RCVTIMEO
+#include <sys/time.h>    // for timeval
+#include <time.h>        // for nanosleep
 #include <unistd.h>      // for close, usleep
 
+#include "config_env.h"
+#include "gl_codec.h"
+#include "gl_relay.h"
 #include "socket.h"
 #include "logger.h"
 
@@ -15,80 +18,81 @@
 
 #define LOG_TAG "gl"
 
-static pthread_mutex_t mtx;
-static uint8_t start_conn_thread = 0;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_taken = PTHREAD_COND_INITIALIZER;
+/** Number of connections dialled (or being dialled) the VM did not take yet */
+static int conn_ready = 0;
+/** Unix domain socket of the render libs, NULL to reach them over TCP */
+static const char* render_path = NULL;
 
-static int copy_socket(int fd_read, int fd_write, char* buff)
+/** Connect to a TCP address, or to a Unix socket if \p path is set,
+ * retrying with an exponential backoff */
+static socket_t dial(const struct sockaddr_in* addr, const char* path, const char* name)
 {
-    int rsize, towrite, wsize;
+    unsigned int backoff_ms = GL_DIAL_MIN_BACKOFF_MS;
+    socket_t sock;
 
-    rsize = read(fd_read, buff, BUFF_SIZE);
-    if (rsize <= 0)
+    while ((sock = path ? open_socket_unix(path) : open_socket_nodelay_addr(addr)) ==
+           SOCKET_ERROR)
     {
-        close(fd_read);
-        close(fd_write);
-        return -1;
+        struct timespec duration = {backoff_ms / 1000, (backoff_ms % 1000) * 1000000};
+        LOGW("Unable to connect to %s, retrying in %u ms", name, backoff_ms);
+        nanosleep(&duration, NULL);
+        backoff_ms *= 2;
+        if (backoff_ms > GL_DIAL_MAX_BACKOFF_MS)
+            backoff_ms = GL_DIAL_MAX_BACKOFF_MS;
     }
-
-    towrite = rsize;
-
-    while ((wsize = write(fd_write, buff, towrite)) > 0)
-        towrite -= wsize;
-    if (towrite > 0)
-    {
-        close(fd_read);
-        close(fd_write);
-        return -1;
-    }
-
-    return 0;
+    return sock;
 }
 
-static void* conn_thread(void* arg)
+/** Resolve an address once, retrying until the name can be resolved */
+static void resolve(const char* ip, short port, struct sockaddr_in* addr)
 {
-    struct conn_duo* cd = (struct conn_duo*) arg;
-    char* buff = (char*) calloc(BUFF_SIZE, sizeof(char));
-    if (!buff)
-        LOGE("Socket copy thread %u: Unable to alloc %d bytes", pthread_self(), BUFF_SIZE);
+    while (resolve_socket_address(ip, port, addr) < 0)
+        sleep(5);
+}
 
-    while (1)
+/** Offer a codec to the VM, before the sync thread starts reading the main connection
+ * \returns The codec acknowledged by the VM, GL_CODEC_NONE if it refused or did not answer
+ */
+static int negotiate_codec(socket_t main_socket, int codec)
+{
+    struct timeval timeout = {GL_CODEC_HANDSHAKE_TIMEOUT_MS / 1000,
+                              (GL_CODEC_HANDSHAKE_TIMEOUT_MS % 1000) * 1000};
+    struct timeval no_timeout = {0, 0};
+    unsigned int offer[2] = {OPENGL_CODEC_OFFER, codec};
+    int accepted = GL_CODEC_NONE;
+    int reply, cmd;
+
+    if (write(main_socket, offer, sizeof(offer)) != sizeof(offer))
     {
-        fd_set set_read;
-        int nfds;
-
-        FD_ZERO(&set_read);
-        FD_SET(cd->local_socket, &set_read);
-        FD_SET(cd->host_socket, &set_read);
-
-        if (cd->local_socket > cd->host_socket)
-            nfds = cd->local_socket + 1;
-        else
-            nfds = cd->host_socket + 1;
+        LOGW("Unable to offer compression to the VM: %s", strerror(errno));
+        return GL_CODEC_NONE;
+    }
 
-        if (select(nfds + 1, &set_read, NULL, NULL, NULL) < 0)
+    setsockopt(main_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (recv(main_socket, &reply, sizeof(reply), MSG_WAITALL) == sizeof(reply))
+    {
+        if (reply == OPENGL_PING)
         {
-            if (errno == EINTR)
-                continue;
-            break;
+            cmd = OPENGL_PONG;
+            if (write(main_socket, &cmd, sizeof(cmd)) != sizeof(cmd))
+                LOGW("Unable to answer a PING: %s", strerror(errno));
+            continue;
         }
 
-        if ((FD_ISSET(cd->local_socket, &set_read)) &&
-            (copy_socket(cd->local_socket, cd->host_socket, buff) < 0))
-            break;
-
-        if ((FD_ISSET(cd->host_socket, &set_read)) &&
-            (copy_socket(cd->host_socket, cd->local_socket, buff) < 0))
-            break;
+        if (reply == OPENGL_CODEC_ACK &&
+            recv(main_socket, &reply, sizeof(reply), MSG_WAITALL) == sizeof(reply) &&
+            reply == codec)
+            accepted = codec;
+        else
+            LOGW("The VM refused the %s compression", gl_codec_name(codec));
+        break;
     }
+    setsockopt(main_socket, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
 
-    LOGI("Socket copy thread %u: Stopping", pthread_self());
-
-    free(buff);
-    close(cd->local_socket);
-    close(cd->host_socket);
-    free(cd);
-
-    return NULL;
+    LOGI("OpenGL streams compression: %s", gl_codec_name(accepted));
+    return accepted;
 }
 
 static void* sync_conn_thread(void* arg)
@@ -99,13 +103,20 @@ static void* sync_conn_thread(void* arg)
 
     do
     {
-        recv(main_socket, &nop, sizeof(nop), MSG_WAITALL);
+        if (recv(main_socket, &nop, sizeof(nop), MSG_WAITALL) != sizeof(nop))
+        {
+            LOGW("sync thread: main connection lost: %s", strerror(errno));
+            break;
+        }
+
         switch (nop)
         {
         case 1:
-            // 1: start a new copy_socket thread
+            // 1: a pre-dialled connection was taken, refill the pool
             pthread_mutex_lock(&mtx);
-            start_conn_thread = 1;
+            if (conn_ready > 0)
+                conn_ready--;
+            pthread_cond_signal(&conn_taken);
             pthread_mutex_unlock(&mtx);
             break;
         case OPENGL_PING:
@@ -125,17 +136,47 @@ static void* sync_conn_thread(void* arg)
     return NULL;
 }
 
+void gl_set_render_socket(const char* path)
+{
+    render_path = path;
+}
+
 int manage_socket_gl(void* arg)
 {
-    pthread_mutex_init(&mtx, NULL);
     char* vmip = arg;
 
     socket_t hw_socket;
+    socket_t render_socket;
     socket_t main_socket;
+    struct sockaddr_in vm_addr;
+    struct sockaddr_in render_addr;
 
     int rc;
     pthread_t sync_thread_id;
-    pthread_t new_thread_id;
+
+    int relay_threads = configvar_int_default("AIC_PLAYER_GL_RELAY_THREADS", GL_RELAY_THREADS);
+    int relay_mode =
+        gl_relay_mode_from_name(configvar_string_default("AIC_PLAYER_GL_RELAY_MODE", "copy"));
+    int stats_interval = configvar_int_default("AIC_PLAYER_GL_STATS_INTERVAL", 0);
+    char* capture_dir = configvar_string_default("AIC_PLAYER_GL_CAPTURE_DIR", "");
+    if (capture_dir[0])
+        gl_relay_set_capture_dir(capture_dir);
+    if (gl_relay_start(relay_threads, relay_mode, stats_interval) < 0)
+        LOGE("Unable to start the OpenGL relay");
+
+    int codec = gl_codec_from_name(configvar_string_default("AIC_PLAYER_GL_COMPRESSION", "none"));
+    if (!gl_codec_available(codec))
+    {
+        LOGW("The player was built without %s, the OpenGL streams will not be compressed",
+             gl_codec_name(codec));
+        codec = GL_CODEC_NONE;
+    }
+
+    int pool_size = configvar_int_default("AIC_PLAYER_GL_POOL_SIZE", GL_POOL_SIZE);
+    if (pool_size < 1)
+        pool_size = 1;
+    if (pool_size > GL_POOL_MAX_SIZE)
+        pool_size = GL_POOL_MAX_SIZE;
 
     do
     {
@@ -154,60 +195,46 @@ int manage_socket_gl(void* arg)
         LOGW("Unable to write data port to main connection - error %d (%s)", errno,
              strerror(errno));
 
+    if (codec != GL_CODEC_NONE)
+        codec = negotiate_codec(main_socket, codec);
+
     // Create the opengl socket monitoring thread
     rc = pthread_create(&sync_thread_id, NULL, sync_conn_thread, &main_socket);
 
     if (rc)
         LOGE("pthread_create returned %d", rc);
 
+    // Resolve once, the pool is refilled without going through getaddrinfo()
+    resolve(vmip, OPENGL_DATA_PORT, &vm_addr);
+    if (render_path)
+        LOGI("Reaching the render libs through %s", render_path);
+    else
+        resolve("127.0.0.1", OPENGL_DATA_PORT, &render_addr);
+
     while (1)
     {
-        // connect for hw_socket connection
-        do
-        {
-            hw_socket = open_socket_nodelay(vmip, 22468);
-
-            if (hw_socket == SOCKET_ERROR)
-            {
-                LOGW("connect() error: %s", strerror(errno));
-                sleep(5);
-            }
-        } while (hw_socket == SOCKET_ERROR);
-        LOGI(" Connected to the VM with socket %d", hw_socket);
-
-        socket_t render_socket = open_socket_nodelay("127.0.0.1", 22468);
-
-        struct conn_duo* new_cd = (struct conn_duo*) malloc(sizeof(struct conn_duo));
-        if (!new_cd)
-        {
-            LOGE("Cannot allocate memory");
-            return 0;
-        }
-
-        new_cd->host_socket = hw_socket;
-        new_cd->local_socket = render_socket;
-
-        rc = pthread_create(&new_thread_id, NULL, conn_thread, (void*) new_cd);
-
-        if (rc)
-        {
-            close(new_cd->local_socket);
-            close(new_cd->host_socket);
-            free(new_cd);
-            LOGE("pthread_create returned %d", rc);
-        }
+        // Sleep until the VM takes one of the pre-dialled connections. The slot
+        // is counted before dialling, as the VM may take it right away.
+        pthread_mutex_lock(&mtx);
+        while (conn_ready >= pool_size)
+            pthread_cond_wait(&conn_taken, &mtx);
+        conn_ready++;
+        pthread_mutex_unlock(&mtx);
 
-        LOGI("New gl thread created");
+        hw_socket = dial(&vm_addr, NULL, "the VM");
+        render_socket = dial(&render_addr, render_path, "the render libs");
+        LOGI("Connected to the VM with socket %d", hw_socket);
 
-        while (!start_conn_thread)
+        if (gl_relay_add(render_socket, hw_socket, codec) < 0)
         {
-            struct timespec duration = {0, 100000};
-            nanosleep(&duration, NULL);
+            LOGW("Unable to relay the new gl connection");
+            pthread_mutex_lock(&mtx);
+            conn_ready--;
+            pthread_mutex_unlock(&mtx);
+            continue;
         }
 
-        pthread_mutex_lock(&mtx);
-        start_conn_thread = 0;
-        pthread_mutex_unlock(&mtx);
+        LOGI("New gl connection relayed (pool of %d)", pool_size);
     }
 
     return 0;
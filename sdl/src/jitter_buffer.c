@@ -0,0 +1,203 @@
+/**
+ * \file jitter_buffer.c
+ * \brief Adaptive jitter buffer between the PCM socket of the VM and the encoder.
+ */
+#include <stdint.h>  // for uint8_t, uint64_t
+#include <stdlib.h>  // for calloc, malloc, free
+#include <string.h>  // for memcpy, memset
+
+#include "jitter_buffer.h"
+#include "logger.h"
+
+#define LOG_TAG "jitter_buffer"
+
+struct jitter_buffer
+{
+    int rate;
+    int block_align;
+    /** Ring of queued bytes, the last sample may be incomplete */
+    uint8_t* data;
+    int capacity;
+    int max_write;
+    int head;
+    int level;
+    /** Limits, in bytes */
+    int min_target;
+    int target;
+    int max_target;
+    int max_level;
+    int step;
+    /** Playing, or filling up to the target */
+    int playing;
+    /** Bytes played since the last underrun, and silence concealed since the last sample */
+    int64_t stable;
+    int idle;
+    struct jitter_stats stats;
+};
+
+/* Bytes of ms milliseconds of samples. */
+static int ms_to_bytes(const struct jitter_buffer* jb, int ms)
+{
+    return (int) ((int64_t) jb->rate * ms / 1000) * jb->block_align;
+}
+
+static int bytes_to_ms(const struct jitter_buffer* jb, int bytes)
+{
+    return (int) ((int64_t) bytes / jb->block_align * 1000 / jb->rate);
+}
+
+/* Bytes of the whole samples queued. */
+static int whole_level(const struct jitter_buffer* jb)
+{
+    return jb->level - jb->level % jb->block_align;
+}
+
+/* Drop the size oldest bytes, whole samples only. */
+static void drop(struct jitter_buffer* jb, int size)
+{
+    jb->head = (jb->head + size) % jb->capacity;
+    jb->level -= size;
+}
+
+/* Copy the size oldest bytes to out and drop them, whole samples only. */
+static void take(struct jitter_buffer* jb, uint8_t* out, int size)
+{
+    int first = size < jb->capacity - jb->head ? size : jb->capacity - jb->head;
+
+    memcpy(out, jb->data + jb->head, first);
+    memcpy(out + first, jb->data, size - first);
+    drop(jb, size);
+}
+
+struct jitter_buffer* jitter_buffer_new(int rate, int block_align, int target_ms, int max_ms,
+                                        int max_write)
+{
+    struct jitter_buffer* jb = calloc(1, sizeof(*jb));
+
+    if (!jb)
+        return NULL;
+    jb->rate = rate;
+    jb->block_align = block_align;
+    if (max_ms < 2 * target_ms)
+    {
+        LOGW("Max latency %d ms below twice the target of %d ms, using %d ms", max_ms, target_ms,
+             2 * target_ms);
+        max_ms = 2 * target_ms;
+    }
+    jb->min_target = ms_to_bytes(jb, target_ms);
+    jb->target = jb->min_target;
+    jb->max_level = ms_to_bytes(jb, max_ms);
+    jb->max_target = jb->max_level / 2 / block_align * block_align;
+    jb->step = ms_to_bytes(jb, JITTER_STEP_MS);
+
+    /* A write never waits for a read: room for the max latency and a write */
+    jb->max_write = max_write;
+    jb->capacity = jb->max_level + max_write + block_align;
+    jb->data = malloc(jb->capacity);
+    if (!jb->data)
+    {
+        free(jb);
+        return NULL;
+    }
+
+    LOGI("Jitter buffer: target latency %d ms, max %d ms", target_ms, max_ms);
+    return jb;
+}
+
+void jitter_buffer_write(struct jitter_buffer* jb, const uint8_t* data, int size)
+{
+    int tail;
+    int n;
+
+    if (size > jb->max_write)
+        LOGE("jitter_buffer_write(): %d bytes, max %d", size, jb->max_write);
+
+    tail = (jb->head + jb->level) % jb->capacity;
+    n = size < jb->capacity - tail ? size : jb->capacity - tail;
+    memcpy(jb->data + tail, data, n);
+    memcpy(jb->data, data + n, size - n);
+    jb->level += size;
+    jb->idle = 0;
+
+    /* Overrun: the samples arrive faster than they are played, catch up */
+    if (whole_level(jb) > jb->max_level)
+    {
+        n = whole_level(jb) - jb->target;
+        drop(jb, n);
+        jb->stats.overruns++;
+        jb->stats.trimmed_bytes += n;
+    }
+}
+
+int jitter_buffer_read(struct jitter_buffer* jb, uint8_t* out, int size)
+{
+    int n;
+
+    if (!jb->playing)
+    {
+        if (whole_level(jb) < jb->target || !whole_level(jb))
+            return 0;
+        jb->playing = 1;
+    }
+
+    n = size < whole_level(jb) ? size : whole_level(jb);
+    take(jb, out, n);
+
+    if (n == size)
+    {
+        /* Shrink the target after a stable period */
+        jb->stable += size;
+        if (jb->stable >= ms_to_bytes(jb, JITTER_DECAY_MS) && jb->target > jb->min_target)
+        {
+            jb->target -= jb->step;
+            if (jb->target < jb->min_target)
+                jb->target = jb->min_target;
+            jb->stable = 0;
+        }
+        return size;
+    }
+
+    /* The VM stopped sending: pause until the target is buffered again */
+    if (!n && jb->idle >= ms_to_bytes(jb, JITTER_IDLE_MS))
+    {
+        jb->playing = 0;
+        return 0;
+    }
+
+    /* Underrun: conceal the late samples with silence, and buffer more */
+    memset(out + n, 0, size - n);
+    if (!jb->idle)
+    {
+        jb->stats.underruns++;
+        jb->target += jb->step;
+        if (jb->target > jb->max_target)
+            jb->target = jb->max_target;
+    }
+    jb->stats.concealed_bytes += size - n;
+    jb->idle += size - n;
+    jb->stable = 0;
+    return size;
+}
+
+int jitter_buffer_drain(struct jitter_buffer* jb, uint8_t* out, int size)
+{
+    int n = size < whole_level(jb) ? size : whole_level(jb);
+
+    take(jb, out, n);
+    return n;
+}
+
+void jitter_buffer_stats(const struct jitter_buffer* jb, struct jitter_stats* stats)
+{
+    *stats = jb->stats;
+    stats->level_ms = bytes_to_ms(jb, whole_level(jb));
+    stats->target_ms = bytes_to_ms(jb, jb->target);
+}
+
+void jitter_buffer_free(struct jitter_buffer* jb)
+{
+    if (!jb)
+        return;
+    free(jb->data);
+    free(jb);
+}
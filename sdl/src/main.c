@@ -52,7 +52,7 @@
 #include <stdint.h>             // for int32_t
 #include <stdio.h>              // for NULL, snprintf
 #include <stdlib.h>             // for atexit, exit, free, malloc
-#include <string.h>             // for strncmp
+#include <string.h>             // for strncmp, strcmp
 #include <unistd.h>             // for close
 
 #include "buffer_sizes.h"
@@ -173,6 +173,7 @@ static void recreate_subwindow(int width, int height, float rotation)
     g_window_id = get_window_id(s_window);
     createOpenGLSubwindow(g_window_id, 0, 0, width, height, rotation);
     SDL_SetWindowSize(s_window, width, height);
+    grabber_resize(width, height);
 }
 
 /** Rotate the window to the appropriate angle */
@@ -315,8 +316,10 @@ int main()
     int enable_record;
     int height;
     int width;
+    int unix_gl;
 
     static char port_gl[] = "22468";
+    static char addr_gl[GL_RENDER_ADDR_SIZE] = "";
 
     pthread_t gl_thread;
     pthread_t input_thread;
@@ -343,6 +346,8 @@ int main()
     g_width = width;
     g_height = height;
 
+    unix_gl = !strcmp(configvar_string_default("AIC_PLAYER_GL_LOCAL_TRANSPORT", "tcp"), "unix");
+
     grabber_set_path_results(path_results);
 
     XInitThreads();
@@ -354,10 +359,17 @@ int main()
     if (!initLibrary())
         LOGE("Unable to initialize Library");
 
-    if (!setStreamMode(STREAM_MODE_TCP))
+    if (!setStreamMode(unix_gl ? STREAM_MODE_UNIX : STREAM_MODE_TCP))
         LOGE("invalid stream mode for setStreamMode()");
 
-    if (!initOpenGLRenderer(width, height, port_gl, 6))
+    if (unix_gl)
+    {
+        // The render libs choose the path of their socket and return it in the address
+        if (!initOpenGLRenderer(width, height, addr_gl, sizeof(addr_gl)))
+            LOGE("initOpenGLRenderer failed");
+        gl_set_render_socket(addr_gl);
+    }
+    else if (!initOpenGLRenderer(width, height, port_gl, 6))
         LOGE("initOpenGLRenderer failed");
 
     if (pthread_create(&gl_thread, NULL, (void*) &manage_socket_gl, s_vmip))
@@ -387,6 +399,9 @@ int main()
             LOGI("Working without AMQP");
 
         pthread_create(&socket_grabber_thread, 0, &grab_handler_sock, &param_listener);
+
+        grabber_start_replay();
+        grabber_start_stream();
     }
 
     if (pthread_create(&input_thread, NULL, connect_input, NULL) != 0)
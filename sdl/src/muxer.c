@@ -0,0 +1,118 @@
+/**
+ * \file muxer.c
+ * \brief Output of the encoded video of a recording to a file.
+ */
+#include <libavcodec/avcodec.h>    // for avcodec_copy_context, AVPacket
+#include <libavformat/avformat.h>  // for avformat_alloc_output_context2, av_guess_format
+#include <libavformat/avio.h>      // for avio_open, avio_closep, AVIO_FLAG_WRITE
+#include <libavutil/error.h>       // for av_err2str
+#include <string.h>                // for memset
+
+#include "logger.h"
+#include "muxer.h"
+
+#define LOG_TAG "muxer"
+
+AVOutputFormat* muxer_guess_format(const char* filename, const char* format)
+{
+    AVOutputFormat* fmt = av_guess_format(format, filename, NULL);
+
+    if (!fmt)
+    {
+        LOGM("Could not deduce output format from file extension: using MPEG. %s", filename);
+        fmt = av_guess_format("mpeg", NULL, NULL);
+    }
+    return fmt;
+}
+
+int muxer_open(struct muxer* mux, const char* filename, AVOutputFormat* fmt,
+               const AVCodecContext* enc, AVDictionary** opt)
+{
+    int ret;
+
+    memset(mux, 0, sizeof(*mux));
+
+    ret = avformat_alloc_output_context2(&mux->oc, fmt, NULL, filename);
+    if (!mux->oc)
+    {
+        LOGW("Could not allocate the output of %s: %s", filename, av_err2str(ret));
+        return -1;
+    }
+
+    mux->st = avformat_new_stream(mux->oc, enc->codec);
+    if (!mux->st)
+    {
+        LOGW("Could not allocate the stream of %s", filename);
+        goto fail;
+    }
+
+    /* the stream gets the parameters and the global headers of the encoder */
+    ret = avcodec_copy_context(mux->st->codec, enc);
+    if (ret < 0)
+    {
+        LOGW("Could not copy the encoder parameters: %s", av_err2str(ret));
+        goto fail;
+    }
+    mux->st->time_base = enc->time_base;
+    mux->time_base = enc->time_base;
+
+    av_dump_format(mux->oc, 0, filename, 1);
+
+    /* open the output file, if needed */
+    if (!(fmt->flags & AVFMT_NOFILE))
+    {
+        ret = avio_open(&mux->oc->pb, filename, AVIO_FLAG_WRITE);
+        if (ret < 0)
+        {
+            LOGW("Could not open '%s': %s", filename, av_err2str(ret));
+            goto fail;
+        }
+    }
+
+    /* Write the stream header, if any. */
+    ret = avformat_write_header(mux->oc, opt);
+    if (ret < 0)
+    {
+        LOGW("Error occurred when opening output file: %s", av_err2str(ret));
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    if (!(fmt->flags & AVFMT_NOFILE))
+        avio_closep(&mux->oc->pb);
+    avformat_free_context(mux->oc);
+    mux->oc = NULL;
+    return -1;
+}
+
+int muxer_write(struct muxer* mux, AVPacket* pkt)
+{
+    /* rescale output packet timestamp values from codec to stream timebase */
+    av_packet_rescale_ts(pkt, mux->time_base, mux->st->time_base);
+    pkt->stream_index = mux->st->index;
+
+    /* Write the compressed frame to the media file. */
+    return av_interleaved_write_frame(mux->oc, pkt);
+}
+
+void muxer_close(struct muxer* mux)
+{
+    if (!mux->oc)
+        return;
+
+    /* Write the trailer, if any. The trailer must be written before you
+     * close the CodecContexts open when you wrote the header; otherwise
+     * av_write_trailer() may try to use memory that was freed on
+     * av_codec_close(). */
+    av_write_trailer(mux->oc);
+
+    if (!(mux->oc->oformat->flags & AVFMT_NOFILE))
+        /* Close the output file. */
+        avio_closep(&mux->oc->pb);
+
+    /* free the stream */
+    avformat_free_context(mux->oc);
+    mux->oc = NULL;
+}
@@ -0,0 +1,176 @@
+/**
+ * \file pcm_convert.c
+ * \brief S16 to float conversion kernels
+ *
+ * The SSE2 kernels handle the largest multiple of 8 values (4 stereo
+ * samples) and leave the others to the scalar kernels. They sign-extend the
+ * samples to 32 bits, convert them to floats and multiply them by 2^-15,
+ * which is exact like the division of the scalar kernels.
+ */
+#include <pthread.h>  // for pthread_once
+#include <stdint.h>   // for int16_t
+
+#if defined(__x86_64__)
+#include <emmintrin.h>  // for __m128i, __m128, _mm_cvtepi32_ps, _mm_shuffle_ps
+#define HAVE_X86_KERNELS
+#endif
+
+#include "logger.h"
+
+#include "pcm_convert.h"
+
+#define LOG_TAG "pcm_convert"
+
+/** Convert the values [i0, count) */
+typedef void (*to_flt_fn)(const int16_t* src, float* dst, int i0, int count);
+/** Convert the samples [i0, count) */
+typedef void (*to_fltp_fn)(const int16_t* src, float* left, float* right, int i0, int count);
+
+static void to_flt_scalar(const int16_t* src, float* dst, int i0, int count)
+{
+    int i;
+
+    for (i = i0; i < count; i++)
+        dst[i] = src[i] / 32768.0f;
+}
+
+static void to_fltp_scalar(const int16_t* src, float* left, float* right, int i0, int count)
+{
+    int i;
+
+    for (i = i0; i < count; i++)
+    {
+        left[i] = src[2 * i] / 32768.0f;
+        right[i] = src[2 * i + 1] / 32768.0f;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Sign-extend 8 samples and convert them to 2 x 4 floats. */
+static inline void sse2_widen(const int16_t* src, __m128* lo, __m128* hi)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    __m128i s = _mm_loadu_si128((const __m128i*) src);
+
+    *lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16)), scale);
+    *hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16)), scale);
+}
+
+static void to_flt_sse2(const int16_t* src, float* dst, int i0, int count)
+{
+    __m128 lo, hi;
+    int i;
+
+    for (i = i0; i + 8 <= count; i += 8)
+    {
+        sse2_widen(src + i, &lo, &hi);
+        _mm_storeu_ps(dst + i, lo);
+        _mm_storeu_ps(dst + i + 4, hi);
+    }
+    to_flt_scalar(src, dst, i, count);
+}
+
+static void to_fltp_sse2(const int16_t* src, float* left, float* right, int i0, int count)
+{
+    __m128 lo, hi;
+    int i;
+
+    for (i = i0; i + 4 <= count; i += 4)
+    {
+        // lo = L0 R0 L1 R1, hi = L2 R2 L3 R3
+        sse2_widen(src + 2 * i, &lo, &hi);
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i, _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    to_fltp_scalar(src, left, right, i, count);
+}
+
+#endif
+
+static int s_impl = PCM_IMPL_SCALAR;
+static to_flt_fn s_to_flt = to_flt_scalar;
+static to_fltp_fn s_to_fltp = to_fltp_scalar;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+
+static int impl_supported(int impl)
+{
+    switch (impl)
+    {
+    case PCM_IMPL_SCALAR:
+        return 1;
+#ifdef HAVE_X86_KERNELS
+    case PCM_IMPL_SSE2:
+        return __builtin_cpu_supports("sse2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void use_impl(int impl)
+{
+    s_impl = impl;
+    switch (impl)
+    {
+#ifdef HAVE_X86_KERNELS
+    case PCM_IMPL_SSE2:
+        s_to_flt = to_flt_sse2;
+        s_to_fltp = to_fltp_sse2;
+        break;
+#endif
+    default:
+        s_to_flt = to_flt_scalar;
+        s_to_fltp = to_fltp_scalar;
+        break;
+    }
+}
+
+static void pick_impl(void)
+{
+    int impl = PCM_IMPL_SSE2;
+
+    __builtin_cpu_init();
+    while (!impl_supported(impl))
+        impl--;
+    use_impl(impl);
+    LOGI("Converting the samples with the %s kernel", pcm_convert_impl_name(impl));
+}
+
+void pcm_s16_to_flt(const int16_t* src, float* dst, int count)
+{
+    pthread_once(&s_once, pick_impl);
+    s_to_flt(src, dst, 0, count);
+}
+
+void pcm_s16_to_fltp_stereo(const int16_t* src, float* left, float* right, int count)
+{
+    pthread_once(&s_once, pick_impl);
+    s_to_fltp(src, left, right, 0, count);
+}
+
+int pcm_convert_set_impl(int impl)
+{
+    pthread_once(&s_once, pick_impl);
+    if (!impl_supported(impl))
+        return -1;
+    use_impl(impl);
+    return 0;
+}
+
+int pcm_convert_get_impl(void)
+{
+    pthread_once(&s_once, pick_impl);
+    return s_impl;
+}
+
+const char* pcm_convert_impl_name(int impl)
+{
+    switch (impl)
+    {
+    case PCM_IMPL_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
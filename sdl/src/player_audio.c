@@ -1,34 +1,24 @@
 /**
  * \file player_audio.c
  * \brief AiC audio player, reads an audio stream from the vm and transfers
- *  it to ffmpeg.
+ *  it to an audio sink.
  *
  *  Based on ffmpeg API examples..
  */
-#include <errno.h>                     // for ENOMEM
-#include <libavcodec/avcodec.h>        // for AVCodecContext, AVPacket, AVCodec
-#include <libavutil/avassert.h>        // for av_assert0
-#include <libavutil/avutil.h>          // for AVMediaType::AVMEDIA_TYPE_AUDIO
-#include <libavutil/channel_layout.h>  // for AV_CH_LAYOUT_STEREO, av_get_ch...
-#include <libavutil/common.h>          // for FFMIN
-#include <libavutil/dict.h>            // for AVDictionary, av_dict_copy
-#include <libavutil/error.h>           // for AVERROR_EXIT, AVERROR, av_err2str
-#include <libavutil/mem.h>             // for av_free, av_freep
-#include <libavutil/rational.h>        // for AVRational
-#include <libavutil/samplefmt.h>       // for AVSampleFormat::AV_SAMPLE_FMT_FLT
-#include <libswresample/swresample.h>  // for swr_free, swr_init, SwrContext
-#include <libswscale/swscale.h>        // for sws_freeContext
-#include <stdint.h>                    // for uint8_t, uint64_t
-#include <stdio.h>                     // for printf, NULL, fprintf, stderr
-#include <stdlib.h>                    // for exit, calloc, free, malloc
-#include <string.h>                    // for memcpy, memmove
-#include <unistd.h>                    // sleep, close
-#include <libavformat/avformat.h>      // for AVFormatContext, AVStream, AVO...
-#include <libavformat/avio.h>          // for avio_closep, avio_open, AVIO_F...
-#include <libavutil/audio_fifo.h>      // for av_audio_fifo_size, AVAudioFifo
-#include <libavutil/frame.h>           // for AVFrame, av_frame_free, av_fra...
-#include <libavutil/opt.h>             // for av_opt_set_int, av_opt_set_sam...
-
+#include <errno.h>                 // for ENOMEM
+#include <libavformat/avformat.h>  // for av_register_all, avformat_network_init
+#include <libavutil/error.h>       // for AVERROR
+#include <pthread.h>               // for pthread_create, pthread_join
+#include <stdint.h>                // for int64_t
+#include <stdlib.h>                // for free, malloc
+#include <string.h>                // for memmove
+#include <time.h>                  // for clock_gettime, clock_nanosleep, timespec
+#include <unistd.h>                // sleep, close
+
+#include "audio_pipeline.h"
+#include "audio_sink.h"
+#include "byte_ring.h"
+#include "jitter_buffer.h"
 #include "socket.h"
 #include "logger.h"
 #include "config_env.h"
@@ -37,816 +27,230 @@
 
 /** Port open on the VM */
 #define ANDROIDINCLOUD_PCM_CLIENT_PORT 24296
+/** Default duration of the periods taken from the jitter buffer, in ms */
+#define AUDIO_PERIOD_MS 10
+/** Default duration of the ring between the reader of the socket and the encoder, in ms */
+#define AUDIO_RING_MS 2000
 
-const char* get_error_text(const int error)
-{
-    static char error_buffer[255];
-    av_strerror(error, error_buffer, sizeof(error_buffer));
-    return error_buffer;
-}
-
-/** Initialize one data packet for reading or writing. */
-void init_packet(AVPacket* packet)
-{
-    av_init_packet(packet);
-    /** Set the packet data and size so that it is recognized as being empty. */
-    packet->data = NULL;
-    packet->size = 0;
-}
-
-/** Initialize one audio frame for reading from the input file */
-int init_input_frame(AVFrame** frame)
-{
-    if (!(*frame = av_frame_alloc()))
-    {
-        printf("Could not allocate input frame\n");
-        return AVERROR(ENOMEM);
-    }
-    return 0;
-}
-
-/**
- * Initialize the audio resampler based on the input and output codec settings.
- * If the input and output sample formats differ, a conversion is required
- * libswresample takes care of this, but requires initialization.
- */
-int init_resampler(AVCodecContext* input_codec_context, AVCodecContext* output_codec_context,
-                   SwrContext** resample_context)
-{
-    int error;
-
-    /**
-     * Create a resampler context for the conversion.
-     * Set the conversion parameters.
-     * Default channel layouts based on the number of channels
-     * are assumed for simplicity (they are sometimes not detected
-     * properly by the demuxer and/or decoder).
-     */
-    *resample_context = swr_alloc_set_opts(
-        NULL, av_get_default_channel_layout(output_codec_context->channels),
-        output_codec_context->sample_fmt, output_codec_context->sample_rate,
-        av_get_default_channel_layout(input_codec_context->channels),
-        input_codec_context->sample_fmt, input_codec_context->sample_rate, 0, NULL);
-    if (!*resample_context)
-    {
-        printf("Could not allocate resample context\n");
-        return AVERROR(ENOMEM);
-    }
-    /**
-    * Perform a sanity check so that the number of converted samples is
-    * not greater than the number of samples to be converted.
-    * If the sample rates differ, this case has to be handled differently
-    */
-    av_assert0(output_codec_context->sample_rate == input_codec_context->sample_rate);
-
-    /** Open the resampler with the specified parameters. */
-    if ((error = swr_init(*resample_context)) < 0)
-    {
-        printf("Could not open resample context\n");
-        swr_free(resample_context);
-        return error;
-    }
-    return 0;
-}
-
-/** Initialize a FIFO buffer for the audio samples to be encoded. */
-int init_fifo(AVAudioFifo** fifo, AVCodecContext* output_codec_context)
-{
-    /** Create the FIFO buffer based on the specified output sample format. */
-    if (!(*fifo = av_audio_fifo_alloc(output_codec_context->sample_fmt,
-                                      output_codec_context->channels, 1)))
-    {
-        printf("Could not allocate FIFO\n");
-        return AVERROR(ENOMEM);
-    }
-    return 0;
-}
-
-/** Decode one audio frame from the input file. */
-int decode_audio_frame(AVFrame* frame, AVFormatContext* input_format_context,
-                       AVCodecContext* input_codec_context, int* data_present, int* finished)
+/* Milliseconds from now to t, negative if t is past. */
+static int64_t ms_until(const struct timespec* t)
 {
-    /** Packet used for temporary storage. */
-    AVPacket input_packet;
-    int error;
-    init_packet(&input_packet);
-
-    /** Read one audio frame from the input file into a temporary packet. */
-    if ((error = av_read_frame(input_format_context, &input_packet)) < 0)
-    {
-        /** If we are at the end of the file, flush the decoder below. */
-        if (error == AVERROR_EOF)
-            *finished = 1;
-        else
-        {
-            printf("Could not read frame (error '%s')\n", get_error_text(error));
-            return error;
-        }
-    }
-
-    /**
-     * Decode the audio frame stored in the temporary packet.
-     * The input audio stream decoder is used to do this.
-     * If we are at the end of the file, pass an empty packet to the decoder
-     * to flush it.
-     */
-    if ((error = avcodec_decode_audio4(input_codec_context, frame, data_present, &input_packet)) <
-        0)
-    {
-        printf("Could not decode frame (error '%s')\n", get_error_text(error));
-        av_free_packet(&input_packet);
-        return error;
-    }
+    struct timespec now;
 
-    /**
-     * If the decoder has not been flushed completely, we are not finished,
-     * so that this function has to be called again.
-     */
-    if (*finished && *data_present)
-        *finished = 0;
-    av_free_packet(&input_packet);
-    return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) (t->tv_sec - now.tv_sec) * 1000 + (t->tv_nsec - now.tv_nsec) / 1000000;
 }
 
-/**
- * Initialize a temporary storage for the specified number of audio samples.
- * The conversion requires temporary storage due to the different format.
- * The number of audio samples to be allocated is specified in frame_size.
- */
-int init_converted_samples(uint8_t*** converted_input_samples, AVCodecContext* output_codec_context,
-                           int frame_size)
+static void add_ms(struct timespec* t, int ms)
 {
-    int error;
-
-    /**
-     * Allocate as many pointers as there are audio channels.
-     * Each pointer will later point to the audio samples of the corresponding
-     * channels (although it may be NULL for interleaved formats).
-     */
-    if (!(*converted_input_samples =
-              calloc(output_codec_context->channels, sizeof(**converted_input_samples))))
-    {
-        printf("Could not allocate converted input sample pointers\n");
-        return AVERROR(ENOMEM);
-    }
-
-    /**
-     * Allocate memory for the samples of all channels in one consecutive
-     * block for convenience.
-     */
-    if ((error = av_samples_alloc(*converted_input_samples, NULL, output_codec_context->channels,
-                                  frame_size, output_codec_context->sample_fmt, 0)) < 0)
+    t->tv_sec += ms / 1000;
+    t->tv_nsec += (ms % 1000) * 1000000L;
+    if (t->tv_nsec >= 1000000000L)
     {
-        fprintf(stderr, "Could not allocate converted input samples (error '%s')\n",
-                get_error_text(error));
-        av_freep(&(*converted_input_samples)[0]);
-        free(*converted_input_samples);
-        return error;
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
     }
-    return 0;
 }
 
-/**
- * Convert the input audio samples into the output sample format.
- * The conversion happens on a per-frame basis, the size of which is specified
- * by frame_size.
- */
-int convert_samples(const uint8_t** input_data, uint8_t** converted_data, const int frame_size,
-                    SwrContext* resample_context)
+static void log_jitter_stats(const struct jitter_buffer* jb, struct byte_ring* ring)
 {
-    int error;
-
-    /** Convert the samples using the resampler. */
-    if ((error =
-             swr_convert(resample_context, converted_data, frame_size, input_data, frame_size)) < 0)
-    {
-        printf("Could not convert input samples (error '%s')\n", get_error_text(error));
-        return error;
-    }
-
-    return 0;
+    struct jitter_stats stats;
+    struct byte_ring_stats ring_stats;
+
+    jitter_buffer_stats(jb, &stats);
+    LOGI("Jitter buffer: latency %d ms (target %d ms), %llu underruns (%llu bytes of silence), "
+         "%llu overruns (%llu bytes dropped)",
+         stats.level_ms, stats.target_ms, (unsigned long long) stats.underruns,
+         (unsigned long long) stats.concealed_bytes, (unsigned long long) stats.overruns,
+         (unsigned long long) stats.trimmed_bytes);
+
+    byte_ring_stats(ring, &ring_stats);
+    LOGI("PCM ring: high water %d of %d bytes, %llu bytes read, %llu reads dropped (%llu bytes)",
+         ring_stats.high_water, ring_stats.capacity, (unsigned long long) ring_stats.written_bytes,
+         (unsigned long long) ring_stats.drops, (unsigned long long) ring_stats.dropped_bytes);
 }
 
-/** Add converted input audio samples to the FIFO buffer for later processing. */
-int add_samples_to_fifo(AVAudioFifo* fifo, uint8_t** converted_input_samples, const int frame_size)
+/** Reader of the PCM socket */
+struct pcm_reader
 {
-    int error;
-
-    /**
-     * Make the FIFO as large as it needs to be to hold both,
-     * the old and the new samples.
-     */
-    if ((error = av_audio_fifo_realloc(fifo, av_audio_fifo_size(fifo) + frame_size)) < 0)
-    {
-        printf("Could not reallocate FIFO\n");
-        return error;
-    }
-
-    /** Store the new samples in the FIFO buffer. */
-    if (av_audio_fifo_write(fifo, (void**) converted_input_samples, frame_size) < frame_size)
-    {
-        printf("Could not write data to FIFO\n");
-        return AVERROR_EXIT;
-    }
-    return 0;
-}
+    socket_t socket;
+    struct byte_ring* ring;
+    unsigned char* buffer;
+};
 
-/**
- * Initialize one input frame for writing to the output file.
- * The frame will be exactly frame_size samples large.
+/*
+ * read the PCM stream as soon as the VM sends it, into the ring, until the VM
+ * closes it. Only whole samples are queued, and they are dropped when the
+ * ring is full: the VM never waits for the encoder or the sink.
  */
-int init_output_frame(AVFrame** frame, AVCodecContext* output_codec_context, int frame_size)
-{
-    int error;
-
-    /** Create a new frame to store the audio samples. */
-    if (!(*frame = av_frame_alloc()))
-    {
-        printf("Could not allocate output frame\n");
-        return AVERROR_EXIT;
-    }
-
-    /**
-     * Set the frame's parameters, especially its size and format.
-     * av_frame_get_buffer needs this to allocate memory for the
-     * audio samples of the frame.
-     * Default channel layouts based on the number of channels
-     * are assumed for simplicity.
-     */
-    (*frame)->nb_samples = frame_size;
-    (*frame)->channel_layout = output_codec_context->channel_layout;
-    (*frame)->format = output_codec_context->sample_fmt;
-    (*frame)->sample_rate = output_codec_context->sample_rate;
-
-    /**
-     * Allocate the samples of the created frame. This call will make
-     * sure that the audio frame can hold as many samples as specified.
-     */
-    if ((error = av_frame_get_buffer(*frame, 0)) < 0)
-    {
-        printf("Could allocate output frame samples (error '%s')\n", get_error_text(error));
-        av_frame_free(frame);
-        return error;
-    }
-
-    return 0;
-}
-
-/** Global timestamp for the audio frames */
-static int64_t pts = 0;
-
-/** Encode one frame worth of audio to the output file. */
-int encode_audio_frame(AVFrame* frame, AVFormatContext* output_format_context,
-                       AVCodecContext* output_codec_context, int* data_present)
+static void* pcm_reader_thread(void* arg)
 {
-    /** Packet used for temporary storage. */
-    AVPacket output_packet;
-    int error;
-    init_packet(&output_packet);
-
-    /** Set a timestamp based on the sample rate for the container. */
-    if (frame)
-    {
-        frame->pts = pts;
-        pts += frame->nb_samples;
-    }
+    struct pcm_reader* r = arg;
+    int carry = 0;
+    int whole;
+    int n;
 
-    /**
-     * Encode the audio frame and store it in the temporary packet.
-     * The output audio stream encoder is used to do this.
-     */
-    if ((error = avcodec_encode_audio2(output_codec_context, &output_packet, frame, data_present)) <
-        0)
+    while ((n = recv(r->socket, r->buffer + carry, AUDIO_CHUNK_SIZE - carry, 0)) > 0)
     {
-        printf("Could not encode frame (error '%s')\n", get_error_text(error));
-        av_free_packet(&output_packet);
-        return error;
+        n += carry;
+        whole = n - n % AUDIO_BLOCK_ALIGN;
+        byte_ring_write(r->ring, r->buffer, whole);
+        carry = n - whole;
+        memmove(r->buffer, r->buffer + whole, carry);
     }
-
-    /** Write one audio frame from the temporary packet to the output file. */
-    if (*data_present)
-    {
-        if ((error = av_write_frame(output_format_context, &output_packet)) < 0)
-        {
-            printf("Could not write frame (error '%s')\n", get_error_text(error));
-            av_free_packet(&output_packet);
-            return error;
-        }
-
-        av_free_packet(&output_packet);
-    }
-
-    return 0;
+    byte_ring_close(r->ring);
+    return NULL;
 }
 
-/**
- * Load one audio frame from the FIFO buffer, encode and write it to the
- * output file.
+/*
+ * read the PCM stream until the VM closes it, and write it to the sink
+ * A thread reads the socket into a ring, and at each tick of the clock the
+ * bytes of the ring go to the jitter buffer, and one period of the jitter
+ * buffer to the sink. At the end of the stream, the jitter buffer is drained
+ * to the sink.
+ * return 0 when the stream is over, a negative AVERROR on failure
  */
-int load_encode_and_write(AVAudioFifo* fifo, AVFormatContext* output_format_context,
-                          AVCodecContext* output_codec_context)
-{
-    /** Temporary storage of the output samples of the frame written to the file. */
-    AVFrame* output_frame;
-    /**
-     * Use the maximum number of possible samples per frame.
-     * If there is less than the maximum possible frame size in the FIFO
-     * buffer use this number. Otherwise, use the maximum possible frame size
-     */
-    const int frame_size = FFMIN(av_audio_fifo_size(fifo), output_codec_context->frame_size);
-    int data_written;
-
-    /** Initialize temporary storage for one output frame. */
-    if (init_output_frame(&output_frame, output_codec_context, frame_size))
-        return AVERROR_EXIT;
-
-    /**
-     * Read as many samples from the FIFO buffer as required to fill the frame.
-     * The samples are stored in the frame temporarily.
-     */
-    if (av_audio_fifo_read(fifo, (void**) output_frame->data, frame_size) < frame_size)
-    {
-        printf("Could not read data from FIFO\n");
-        av_frame_free(&output_frame);
-        return AVERROR_EXIT;
-    }
-
-    /** Encode one frame worth of audio samples. */
-    if (encode_audio_frame(output_frame, output_format_context, output_codec_context,
-                           &data_written))
-    {
-        av_frame_free(&output_frame);
-        return AVERROR_EXIT;
-    }
-    av_frame_free(&output_frame);
-    return 0;
-}
-
-/** Write the trailer of the output file container. */
-int write_output_file_trailer(AVFormatContext* output_format_context)
-{
-    int error;
-    if ((error = av_write_trailer(output_format_context)) < 0)
-    {
-        printf("Could not write output file trailer (error '%s')\n", get_error_text(error));
-        return error;
-    }
-    return 0;
-}
-
-// a wrapper around a single output AVStream
-typedef struct OutputStream
-{
-    AVStream* st;
-
-    /* pts of the next frame that will be generated */
-    int64_t next_pts;
-    int samples_count;
-
-    AVFrame* frame;
-    AVFrame* tmp_frame;
-
-    float t, tincr, tincr2;
-
-    struct SwsContext* sws_ctx;
-    struct SwrContext* swr_ctx;
-} OutputStream;
-
-#if 0
-static void log_packet(const AVFormatContext* fmt_ctx, const AVPacket* pkt)
+static int read_audio_frame(struct audio_sink* sink, socket_t outsocket)
 {
-    AVRational* time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
-
-    printf("pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
-           av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base), av_ts2str(pkt->dts),
-           av_ts2timestr(pkt->dts, time_base), av_ts2str(pkt->duration),
-           av_ts2timestr(pkt->duration, time_base), pkt->stream_index);
-}
-#endif
-
-/* Add an output stream. */
-static void add_stream(OutputStream* ost, AVFormatContext* oc, AVCodec** codec,
-                       enum AVCodecID codec_id)
-{
-    AVCodecContext* c;
-    int i;
-
-    /* find the encoder */
-    *codec = avcodec_find_encoder(codec_id);
-    if (!(*codec))
-    {
-        printf("Could not find encoder for '%s'\n", avcodec_get_name(codec_id));
-        exit(1);
-    }
-
-    ost->st = avformat_new_stream(oc, *codec);
-    if (!ost->st)
-    {
-        printf("Could not allocate stream\n");
-        exit(1);
-    }
-    ost->st->id = oc->nb_streams - 1;
-    c = ost->st->codec;
-    switch ((*codec)->type)
-    {
-    case AVMEDIA_TYPE_AUDIO:
-        c->sample_fmt = (*codec)->sample_fmts ? (*codec)->sample_fmts[0] : AV_SAMPLE_FMT_FLT;
-        c->bit_rate = 64000;
-        c->sample_rate = 44100;
-        if ((*codec)->supported_samplerates)
-        {
-            c->sample_rate = (*codec)->supported_samplerates[0];
-            for (i = 0; (*codec)->supported_samplerates[i]; i++)
-            {
-                if ((*codec)->supported_samplerates[i] == 44100)
-                    c->sample_rate = 44100;
-            }
-        }
-        c->channels = av_get_channel_layout_nb_channels(c->channel_layout);
-        c->channel_layout = AV_CH_LAYOUT_STEREO;
-        if ((*codec)->channel_layouts)
+    struct pcm_reader reader = {.socket = outsocket};
+    pthread_t reader_thread;
+    struct jitter_buffer* jb;
+    unsigned char* buffer;
+    unsigned char* period;
+    struct timespec next_tick, next_stats;
+    int64_t wait;
+    int num_read;
+    int ret = 0;
+
+    int latency = configvar_int_default("AIC_PLAYER_AUDIO_LATENCY_MS", JITTER_TARGET_MS);
+    int max_latency = configvar_int_default("AIC_PLAYER_AUDIO_MAX_LATENCY_MS", JITTER_MAX_MS);
+    int period_ms = configvar_int_default("AIC_PLAYER_AUDIO_PERIOD_MS", AUDIO_PERIOD_MS);
+    int ring_ms = configvar_int_default("AIC_PLAYER_AUDIO_RING_MS", AUDIO_RING_MS);
+    int stats_interval = configvar_int_default("AIC_PLAYER_AUDIO_STATS_INTERVAL", 0);
+    if (period_ms < 1)
+        period_ms = 1;
+    if (period_ms > 100)
+        period_ms = 100;
+    if (latency < period_ms)
+        latency = period_ms;
+    int period_size = AUDIO_IN_RATE * period_ms / 1000 * AUDIO_BLOCK_ALIGN;
+    /* A read of the socket always fits in an empty ring */
+    int ring_size = (int) ((int64_t) AUDIO_IN_RATE * ring_ms / 1000) * AUDIO_BLOCK_ALIGN;
+    if (ring_size < AUDIO_CHUNK_SIZE)
+        ring_size = AUDIO_CHUNK_SIZE;
+
+    /* The buffers are allocated once for the session */
+    reader.ring = byte_ring_new(ring_size);
+    reader.buffer = malloc(AUDIO_CHUNK_SIZE);
+    jb = jitter_buffer_new(AUDIO_IN_RATE, AUDIO_BLOCK_ALIGN, latency, max_latency,
+                           AUDIO_CHUNK_SIZE);
+    buffer = malloc(AUDIO_CHUNK_SIZE);
+    period = malloc(period_size);
+    if (!reader.ring || !reader.buffer || !jb || !buffer || !period)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (pthread_create(&reader_thread, NULL, pcm_reader_thread, &reader))
+        LOGE("Unable to start the PCM reader thread");
+
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
+    next_stats = next_tick;
+    add_ms(&next_stats, stats_interval * 1000);
+    while (1)
+    {
+        wait = ms_until(&next_tick);
+        if (wait > 0)
         {
-            c->channel_layout = (*codec)->channel_layouts[0];
-            for (i = 0; (*codec)->channel_layouts[i]; i++)
-            {
-                if ((*codec)->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
-                    c->channel_layout = AV_CH_LAYOUT_STEREO;
-            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL);
+            continue;
         }
-        ost->st->time_base = (AVRational){1, c->sample_rate};
-        break;
-
-    default:
-        break;
-    }
-
-    /* Some formats want stream headers to be separate. */
-    // if (oc->oformat->flags & AVFMT_GLOBALHEADER)
-    c->flags |= CODEC_FLAG_GLOBAL_HEADER;
-}
-
-/**************************************************************/
-/* audio output */
 
-static AVFrame* alloc_audio_frame(enum AVSampleFormat sample_fmt, uint64_t channel_layout,
-                                  int sample_rate, int nb_samples)
-{
-    AVFrame* frame = av_frame_alloc();
-
-    if (!frame)
-    {
-        printf("Error allocating an audio frame\n");
-        exit(1);
-    }
-
-    frame->format = sample_fmt;
-    frame->channel_layout = channel_layout;
-    frame->sample_rate = sample_rate;
-    frame->nb_samples = nb_samples;
-
-    if (nb_samples)
-    {
-        int ret;
-        ret = av_frame_get_buffer(frame, 0);
-        if (ret < 0)
+        /* Take whatever the VM sent since the last tick */
+        while ((num_read = byte_ring_read(reader.ring, buffer, AUDIO_CHUNK_SIZE)) > 0)
+            jitter_buffer_write(jb, buffer, num_read);
+        if (byte_ring_eof(reader.ring))
         {
-            printf("Error allocating an audio buffer\n");
-            exit(1);
-        }
-    }
-
-    return frame;
-}
-
-static void open_audio(AVCodec* codec, OutputStream* ost, AVDictionary* opt_arg)
-{
-    AVCodecContext* c;
-    int nb_samples;
-    int ret;
-    AVDictionary* opt = NULL;
-
-    c = ost->st->codec;
-
-    /* open it */
-    av_dict_copy(&opt, opt_arg, 0);
-    ret = avcodec_open2(c, codec, &opt);
-    av_dict_free(&opt);
-    if (ret < 0)
-    {
-        printf("Could not open audio codec: %s\n", av_err2str(ret));
-        exit(1);
-    }
-
-    /* init signal generator */
-    // ost->t     = 0;
-    // ost->tincr = 2 * M_PI * 550.0 / c->sample_rate;
-    /* increment frequency by 110 Hz per second */
-    // ost->tincr2 = 2 * M_PI * 550.0 / c->sample_rate / c->sample_rate;
-
-    nb_samples = c->frame_size;
-
-    ost->frame = alloc_audio_frame(c->sample_fmt, c->channel_layout, c->sample_rate, nb_samples);
-    ost->tmp_frame =
-        alloc_audio_frame(AV_SAMPLE_FMT_FLT, c->channel_layout, c->sample_rate, nb_samples);
-
-    /* create resampler context */
-    ost->swr_ctx = swr_alloc();
-    if (!ost->swr_ctx)
-    {
-        printf("Could not allocate resampler context\n");
-        exit(1);
-    }
-
-    /* set options */
-    av_opt_set_int(ost->swr_ctx, "in_channel_count", c->channels, 0);
-    av_opt_set_int(ost->swr_ctx, "in_sample_rate", c->sample_rate, 0);
-    av_opt_set_sample_fmt(ost->swr_ctx, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
-    av_opt_set_int(ost->swr_ctx, "out_channel_count", c->channels, 0);
-    av_opt_set_int(ost->swr_ctx, "out_sample_rate", c->sample_rate, 0);
-    av_opt_set_sample_fmt(ost->swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
-
-    /* initialize the resampling context */
-    if (swr_init(ost->swr_ctx) < 0)
-    {
-        printf("Failed to initialize the resampling context\n");
-        exit(1);
-    }
-}
-
-void audiolive_decode_encode(AVFormatContext* oc, OutputStream* ost, unsigned char* inbuf,
-                             int num_read, int size)
-{
-    avcodec_register_all();
-
-    AVCodec* codec;
-    AVCodecContext* codecContext = NULL;
-
-    uint8_t memBuffer[size + FF_INPUT_BUFFER_PADDING_SIZE];
-    AVPacket memPkt;
-    AVFrame* decoded_frame_mem = NULL;
-
-    av_init_packet(&memPkt);
-
-    // printf("Audio decoding \n");
-
-    /* find the mpeg audio decoder */
-    codec = avcodec_find_decoder(AV_CODEC_ID_PCM_S16LE);
-    if (!codec)
-    {
-        printf("codec not found\n");
-        exit(1);
-    }
-
-    codecContext = avcodec_alloc_context3(codec);
-
-    codecContext->bit_rate = 64000;
-    codecContext->sample_fmt = AV_SAMPLE_FMT_S16;
-    codecContext->sample_rate = 44100;  // select_sample_rate(codec);
-    codecContext->channel_layout = AV_CH_LAYOUT_STEREO;
-    codecContext->channels = av_get_channel_layout_nb_channels(codecContext->channel_layout);
-
-    /* open it */
-    if (avcodec_open2(codecContext, codec, NULL) < 0)
-    {
-        printf("could not open codec\n");
-        exit(1);
-    }
-
-    /* decode until eof */
-    memPkt.data = memBuffer;
-    memPkt.size = num_read;
-    memcpy(memBuffer, inbuf, num_read);
-
-    AVCodecContext* output_codec_context = NULL;
-    SwrContext* resample_context = NULL;
-    uint8_t** converted_input_samples = NULL;
-    AVAudioFifo* fifo = NULL;
-
-    output_codec_context = ost->st->codec;
-    init_fifo(&fifo, output_codec_context);
-    init_resampler(codecContext, output_codec_context, &resample_context);
-
-    while (memPkt.size > 0)
-    {
-        int got_frame_mem = 0;
-        int length;
-
-        if (!decoded_frame_mem)
-        {
-            if (!(decoded_frame_mem = av_frame_alloc()))
+            /* Play the last samples buffered, without silence for those which will not come */
+            while ((num_read = jitter_buffer_drain(jb, period, period_size)) > 0)
             {
-                printf("out of memory\n");
-                exit(1);
+                ret = audio_sink_write(sink, period, num_read);
+                if (ret < 0)
+                    break;
             }
+            break;
         }
-        else
-        {
-            av_frame_unref(decoded_frame_mem);
-        }
-
-        length = avcodec_decode_audio4(codecContext, decoded_frame_mem, &got_frame_mem, &memPkt);
 
-        if (length < 0)
-        {
-            printf("Error while decoding\n");
-            exit(1);
-        }
-        if (got_frame_mem)
+        if (jitter_buffer_read(jb, period, period_size))
         {
-            av_samples_get_buffer_size(NULL, codecContext->channels, decoded_frame_mem->nb_samples,
-                                       codecContext->sample_fmt, 1);
-
-            output_codec_context->frame_size = decoded_frame_mem->nb_samples;
-
-            /** Use the encoder's desired frame size for processing. */
-            const int output_frame_size = output_codec_context->frame_size;
-            int finished = 0;
-
-            /**
-             * Make sure that there is one frame worth of samples in the FIFO
-             * buffer so that the encoder can do its work.
-             * Since the decoder's and the encoder's frame size may differ, we
-             * need to FIFO buffer to store as many frames worth of input samples
-             * that they make up at least one frame worth of output samples.
-             */
-            while (av_audio_fifo_size(fifo) < output_frame_size)
-            {
-                // printf("Audio decoding  output_frame_size %d %d %d\n", output_frame_size,
-                // av_audio_fifo_size(fifo) , finished);
-                /**
-                 * Decode one frame worth of audio samples, convert it to the
-                 * output sample format and put it into the FIFO buffer.
-                 */
-
-                if (init_converted_samples(&converted_input_samples, output_codec_context,
-                                           decoded_frame_mem->nb_samples))
-                    printf("Audio decoding A\n");
-
-                /**
-                 * Convert the input samples to the desired output sample format.
-                 * This requires a temporary storage provided by converted_input_samples.
-                 */
-
-                if (convert_samples((const uint8_t**) decoded_frame_mem->extended_data,
-                                    converted_input_samples, decoded_frame_mem->nb_samples,
-                                    resample_context))
-                    printf("Audio decoding B\n");
-
-                /** Add the converted input samples to the FIFO buffer for later processing. */
-                if (add_samples_to_fifo(fifo, converted_input_samples,
-                                        decoded_frame_mem->nb_samples))
-                    printf("Audio decoding C\n");
-
-                /**
-                 * If we are at the end of the input file, we continue
-                 * encoding the remaining audio samples to the output file.
-                 */
-                if (finished)
-                    break;
-            }
-
-            /**
-             * If we have enough samples for the encoder, we encode them.
-             * At the end of the file, we pass the remaining samples to
-             * the encoder.
-             */
-
-            while (av_audio_fifo_size(fifo) >= output_frame_size ||
-                   (finished && av_audio_fifo_size(fifo) > 0))
-                /**
-                 * Take one frame worth of audio samples from the FIFO buffer,
-                 * encode it and write it to the output file.
-                 */
-                // printf("Audio decoding  output_frame_size %d %d %d\n", output_frame_size,
-                // av_audio_fifo_size(fifo) , finished);
-                if (load_encode_and_write(fifo, oc, output_codec_context))
-                    printf("Audio decoding D\n");
+            ret = audio_sink_write(sink, period, period_size);
+            if (ret < 0)
+                break;
         }
 
-        // write_output_file_trailer(oc);
-
-        memPkt.size -= length;
-        memPkt.data += length;
+        /* After a stall of the player, restart the clock instead of catching up */
+        add_ms(&next_tick, period_ms);
+        if (wait < -1000)
+            clock_gettime(CLOCK_MONOTONIC, &next_tick);
 
-        if (memPkt.size < 4090)
+        if (stats_interval > 0 && ms_until(&next_stats) <= 0)
         {
-            /* Refill the input buffer, to avoid trying to decode
-             * incomplete frames. Instead of this, one could also use
-             * a parser, or use a proper container format through
-             * libavformat. */
-            memmove(inbuf, memPkt.data, memPkt.size);
-            memPkt.data = inbuf;
-            length = 0;  // size - memPkt.size;
-            if (length > 0)
-                memPkt.size += length;
+            log_jitter_stats(jb, reader.ring);
+            add_ms(&next_stats, stats_interval * 1000);
         }
     }
 
-    avcodec_close(codecContext);
-    av_free(codecContext);
-    // avcodec_free_frame(&decoded_frame_mem);
-}
+    /* Wake the reader up if the sink failed before the end of the stream */
+    shutdown(outsocket, SHUT_RD);
+    pthread_join(reader_thread, NULL);
+    log_jitter_stats(jb, reader.ring);
 
-/*
- * encode one audio frame and send it to the muxer
- * return 1 when encoding is finished, 0 otherwise
- */
-static int read_audio_frame(AVFormatContext* oc, OutputStream* ost, socket_t outsocket)
-{
-    unsigned char* buffer;
-    int size = 65535;
-    int num_read = 1;
-
-    buffer = malloc(size);
-
-    ///    FILE*   memoutfile = fopen("ffplay-f_s16le-ar_44100-ac_2.wav", "wb");
-    do
-    {
-        num_read = recv(outsocket, buffer, size, 0);
-        audiolive_decode_encode(oc, ost, buffer, num_read, size);
-    } while (num_read > 0);
-    ///    fclose(memoutfile);
-
-    return 0;
+end:
+    byte_ring_free(reader.ring);
+    free(reader.buffer);
+    jitter_buffer_free(jb);
+    free(buffer);
+    free(period);
+    return ret;
 }
 
-static void close_stream(OutputStream* ost)
+/* Open the sink of the settings, the ffserver feed by default. */
+static struct audio_sink* open_sink(void)
 {
-    avcodec_close(ost->st->codec);
-    av_frame_free(&ost->frame);
-    av_frame_free(&ost->tmp_frame);
-    sws_freeContext(ost->sws_ctx);
-    swr_free(&ost->swr_ctx);
+    struct audio_sink_config config;
+
+    config.type = audio_sink_from_name(configvar_string_default("AIC_PLAYER_AUDIO_SINK", "ffm"));
+    if (config.type < 0)
+    {
+        LOGW("Unknown audio sink, using ffm");
+        config.type = AUDIO_SINK_FFM;
+    }
+    config.url = configvar_string_default("AIC_PLAYER_AUDIO_URL", "");
+    config.codec = configvar_string_default("AIC_PLAYER_AUDIO_CODEC", "");
+    config.bitrate = configvar_int_default("AIC_PLAYER_AUDIO_BITRATE", AUDIO_SINK_BITRATE);
+    config.frame_ms = configvar_int_default("AIC_PLAYER_AUDIO_FRAME_MS", AUDIO_SINK_FRAME_MS);
+    config.sdp_file = configvar_string_default("AIC_PLAYER_AUDIO_SDP", "");
+    if (config.frame_ms < 5)
+        config.frame_ms = 5;
+    if (config.frame_ms > 60)
+        config.frame_ms = 60;
+    return audio_sink_open(&config);
 }
 
 /**************************************************************/
 /* media file output */
 void* aic_audioplayer(char* vmip)
 {
-    OutputStream audio_st = {0};
-    const char* filename;
-    AVOutputFormat* fmt;
-    AVFormatContext* oc;
-    AVCodec* audio_codec;
-    int ret;
-    int have_audio = 0;
-    AVDictionary* opt = NULL;
+    struct audio_sink* sink;
 
     LOGI("avcodec - register all formats and codecs");
     av_register_all();
     avformat_network_init();
 
-    filename = "http://ffserver:8090/audio.ffm";
-
-    /* allocate the output media context */
-    avformat_alloc_output_context2(&oc, NULL, "ffm", filename);
-
-    if (!oc)
-    {
-        printf("Could not deduce output format from file extension: using OGG.\n");
-        avformat_alloc_output_context2(&oc, NULL, "ogg", filename);
-    }
-    if (!oc)
+    sink = open_sink();
+    if (!sink)
         return NULL;
 
-    fmt = oc->oformat;
-
-    /* Add the audio and video streams using the default format codecs
-     * and initialize the codecs. */
-    if (fmt->audio_codec != AV_CODEC_ID_NONE)
-    {
-        add_stream(&audio_st, oc, &audio_codec, AV_CODEC_ID_VORBIS);
-        have_audio = 1;
-        LOGW("No audio stream");
-    }
-
-    /* Now that all the parameters are set, we can open the audio and
-     * video codecs and allocate the necessary encode buffers. */
-    if (have_audio)
-        open_audio(audio_codec, &audio_st, opt);
-    else
-        return NULL;
-
-    /* open the output file, if needed */
-    if (!(fmt->flags & AVFMT_NOFILE))
-    {
-        ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE);
-        if (ret < 0)
-        {
-            printf("Could not open '%s': %s\n", filename, av_err2str(ret));
-            return NULL;
-        }
-    }
-
-    /* Write the stream header, if any. */
-    ret = avformat_write_header(oc, &opt);
-    if (ret < 0)
-    {
-        printf("Error occurred when opening output file: %s\n", av_err2str(ret));
-        return NULL;
-    }
-    av_dump_format(oc, 0, filename, 1);
-
     socket_t outsocket = open_socket(vmip, ANDROIDINCLOUD_PCM_CLIENT_PORT);
 
     while (outsocket == -1)
@@ -857,25 +261,11 @@ void* aic_audioplayer(char* vmip)
         outsocket = open_socket(vmip, ANDROIDINCLOUD_PCM_CLIENT_PORT);
     }
 
-    read_audio_frame(oc, &audio_st, outsocket);
+    read_audio_frame(sink, outsocket);
     close(outsocket);
 
-    /* Write the trailer, if any. The trailer must be written before you
-     * close the CodecContexts open when you wrote the header; otherwise
-     * av_write_trailer() may try to use memory that was freed on
-     * av_codec_close(). */
-    write_output_file_trailer(oc);
-
-    /* Close each codec. */
-    if (have_audio)
-        close_stream(&audio_st);
-
-    if (!(fmt->flags & AVFMT_NOFILE))
-        /* Close the output file. */
-        avio_closep(&oc->pb);
-
-    /* free the stream */
-    avformat_free_context(oc);
+    /* Write the samples left in the encoder and the trailer, if any */
+    audio_sink_close(sink);
 
     return NULL;
 }
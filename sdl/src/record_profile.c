@@ -0,0 +1,194 @@
+/**
+ * \file record_profile.c
+ * \brief Encoder settings of the recordings
+ */
+#include <glib.h>                  // for g_strlcpy
+#include <libavformat/avformat.h>  // for avformat_query_codec
+#include <libavutil/dict.h>        // for av_dict_set
+#include <libavutil/opt.h>         // for av_opt_find, AV_OPT_SEARCH_FAKE_OBJ
+#include <stdint.h>                // for uint32_t
+#include <stdio.h>                 // for snprintf
+#include <string.h>                // for strcmp, memset
+
+#include "config_env.h"
+#include "logger.h"
+#include "record_profile.h"
+
+#define LOG_TAG "record_profile"
+
+/** Presets of libx264 and libx265, the only ones a recording message may ask for */
+static const char* const s_presets[] = {
+    "ultrafast", "superfast", "veryfast", "faster",   "fast",
+    "medium",    "slow",      "slower",   "veryslow", "placebo", NULL,
+};
+/** Tunes of libx264 and libx265 */
+static const char* const s_tunes[] = {
+    "film", "animation", "grain", "stillimage", "psnr", "ssim", "fastdecode", "zerolatency", NULL,
+};
+
+/* Copy the name value of a recording message to dst if it is in names. */
+static void set_known_name(char* dst, size_t size, const char* what, const char* value,
+                           const char* const* names)
+{
+    const char* const* name;
+
+    for (name = names; *name; name++)
+        if (!strcmp(value, *name))
+        {
+            g_strlcpy(dst, value, size);
+            return;
+        }
+    LOGW("Unknown %s %s in the recording message, keeping %s", what, value,
+         dst[0] ? dst : "the default one");
+}
+
+/* Set *dst to the field of a recording message if it is within [min, max]. */
+static void set_in_range(int* dst, const char* what, uint32_t value, int min, int max)
+{
+    if (value < (uint32_t) min || value > (uint32_t) max)
+    {
+        LOGW("Invalid %s %u in the recording message (%d to %d), keeping %d", what, value, min,
+             max, *dst);
+        return;
+    }
+    *dst = value;
+}
+
+/* FF_THREAD_* flags of a thread type name, -1 if unknown. */
+static int thread_type_from_name(const char* name)
+{
+    if (!strcmp(name, "auto"))
+        return FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (!strcmp(name, "frame"))
+        return FF_THREAD_FRAME;
+    if (!strcmp(name, "slice"))
+        return FF_THREAD_SLICE;
+    return -1;
+}
+
+static void set_thread_type(struct record_profile* profile, const char* name)
+{
+    int type = thread_type_from_name(name);
+
+    if (type < 0)
+        LOGW("Unknown thread type %s, keeping the previous one", name);
+    else
+        profile->thread_type = type;
+}
+
+void record_profile_from_config(struct record_profile* profile)
+{
+    memset(profile, 0, sizeof(*profile));
+
+    g_strlcpy(profile->codec, configvar_string_default("AIC_PLAYER_RECORD_CODEC", ""),
+              sizeof(profile->codec));
+    g_strlcpy(profile->preset, configvar_string_default("AIC_PLAYER_RECORD_PRESET", ""),
+              sizeof(profile->preset));
+    g_strlcpy(profile->tune, configvar_string_default("AIC_PLAYER_RECORD_TUNE", ""),
+              sizeof(profile->tune));
+    profile->crf = configvar_int_default("AIC_PLAYER_RECORD_CRF", -1);
+    profile->bit_rate = configvar_int_default("AIC_PLAYER_RECORD_BITRATE", RECORD_BITRATE);
+    profile->keyint = configvar_int_default("AIC_PLAYER_RECORD_KEYINT", RECORD_KEYINT);
+    profile->threads = configvar_int_default("AIC_PLAYER_RECORD_THREADS", 0);
+    profile->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    set_thread_type(profile, configvar_string_default("AIC_PLAYER_RECORD_THREAD_TYPE", "auto"));
+}
+
+void record_profile_from_payload(struct record_profile* profile, const RecordingPayload* payload)
+{
+    // An unknown codec falls back to the default one of the container
+    if (payload->codec)
+        g_strlcpy(profile->codec, payload->codec, sizeof(profile->codec));
+    if (payload->preset)
+        set_known_name(profile->preset, sizeof(profile->preset), "preset", payload->preset,
+                       s_presets);
+    if (payload->tune)
+        set_known_name(profile->tune, sizeof(profile->tune), "tune", payload->tune, s_tunes);
+    if (payload->has_crf)
+        set_in_range(&profile->crf, "crf", payload->crf, 0, RECORD_CRF_MAX);
+    if (payload->has_bitrate)
+    {
+        // An explicit bitrate disables the constant quality of the defaults
+        set_in_range(&profile->bit_rate, "bitrate", payload->bitrate, 1, RECORD_BITRATE_MAX);
+        if (!payload->has_crf)
+            profile->crf = -1;
+    }
+    if (payload->has_keyint)
+        set_in_range(&profile->keyint, "keyInt", payload->keyint, 1, RECORD_KEYINT_MAX);
+    if (payload->has_threads)
+        set_in_range(&profile->threads, "threads", payload->threads, 0, RECORD_THREADS_MAX);
+    if (payload->threadtype)
+        set_thread_type(profile, payload->threadtype);
+}
+
+AVCodec* record_profile_encoder(const struct record_profile* profile, AVOutputFormat* fmt)
+{
+    AVCodec* codec;
+
+    if (profile->codec[0])
+    {
+        codec = avcodec_find_encoder_by_name(profile->codec);
+        if (!codec || codec->type != AVMEDIA_TYPE_VIDEO)
+            LOGW("Unknown video encoder %s, using the default one of %s", profile->codec,
+                 fmt->name);
+        else if (!avformat_query_codec(fmt, codec->id, FF_COMPLIANCE_NORMAL))
+            LOGW("%s does not support %s, using its default encoder", fmt->name, profile->codec);
+        else
+            return codec;
+    }
+    return avcodec_find_encoder(fmt->video_codec);
+}
+
+static int has_private_option(AVCodecContext* c, const char* name)
+{
+    return c->codec->priv_class &&
+           av_opt_find((void*) &c->codec->priv_class, name, NULL, 0, AV_OPT_SEARCH_FAKE_OBJ);
+}
+
+/* Add a private option of the encoder to opt, if the encoder has it. */
+static void set_private_option(AVCodecContext* c, AVDictionary** opt, const char* name,
+                               const char* value)
+{
+    if (!has_private_option(c, name))
+    {
+        LOGW("The %s encoder has no %s option, ignoring %s", c->codec->name, name, value);
+        return;
+    }
+    av_dict_set(opt, name, value, 0);
+}
+
+void record_profile_apply(const struct record_profile* profile, AVCodecContext* c,
+                          AVDictionary** opt)
+{
+    char crf[16];
+
+    c->bit_rate = profile->bit_rate * 1000LL;
+    if (profile->keyint > 0)
+        c->gop_size = profile->keyint;
+    c->thread_count = profile->threads > 0 ? profile->threads : 0;
+    c->thread_type = profile->thread_type;
+
+    if (profile->low_latency)
+    {
+        /* Frame threads and B-frames delay each frame by several others */
+        c->thread_type = FF_THREAD_SLICE;
+        c->max_b_frames = 0;
+        if (!profile->tune[0] && has_private_option(c, "tune"))
+            av_dict_set(opt, "tune", "zerolatency", 0);
+    }
+
+    if (profile->preset[0])
+        set_private_option(c, opt, "preset", profile->preset);
+    if (profile->tune[0])
+        set_private_option(c, opt, "tune", profile->tune);
+    if (profile->crf >= 0)
+    {
+        snprintf(crf, sizeof(crf), "%d", profile->crf);
+        set_private_option(c, opt, "crf", crf);
+    }
+
+    LOGI("Recording with %s: preset %s, tune %s, %s %d, keyframe every %d frames, %d threads",
+         c->codec->name, profile->preset[0] ? profile->preset : "default",
+         profile->tune[0] ? profile->tune : "none", profile->crf >= 0 ? "crf" : "kb/s",
+         profile->crf >= 0 ? profile->crf : profile->bit_rate, c->gop_size, c->thread_count);
+}
@@ -0,0 +1,215 @@
+/**
+ * \file replay_buffer.c
+ * \brief Rolling buffer of the last seconds of encoded video, for instant replays.
+ */
+#include <libavcodec/avcodec.h>     // for AVPacket, av_copy_packet, av_free_packet
+#include <libavformat/avformat.h>   // for AVPacketList
+#include <libavutil/mathematics.h>  // for av_rescale_q
+#include <libavutil/mem.h>          // for av_mallocz, av_malloc_array, av_free
+#include <libavutil/rational.h>     // for av_q2d
+#include <pthread.h>                // for pthread_mutex_t, pthread_mutex_lock
+#include <stdint.h>                 // for int64_t
+#include <stdlib.h>                 // for calloc
+
+#include "logger.h"
+#include "muxer.h"
+#include "replay_buffer.h"
+
+#define LOG_TAG "replay_buffer"
+
+struct replay_buffer
+{
+    pthread_mutex_t mtx;
+    /** Copy of the parameters of the encoder of the packets */
+    AVCodecContext* enc;
+    int seconds;
+    size_t max_bytes;
+    /** Duration to keep, in the time base of the encoder */
+    int64_t max_duration;
+    /** Packets, oldest first, the head is always a keyframe */
+    AVPacketList* head;
+    AVPacketList* tail;
+    int count;
+    size_t bytes;
+};
+
+static void drop_head(struct replay_buffer* rb)
+{
+    AVPacketList* node = rb->head;
+
+    rb->head = node->next;
+    if (!rb->head)
+        rb->tail = NULL;
+    rb->count--;
+    rb->bytes -= node->pkt.size;
+    av_free_packet(&node->pkt);
+    av_free(node);
+}
+
+/* Drop the group of pictures at the head of the buffer. */
+static void drop_gop(struct replay_buffer* rb)
+{
+    drop_head(rb);
+    while (rb->head && !(rb->head->pkt.flags & AV_PKT_FLAG_KEY))
+        drop_head(rb);
+}
+
+/* Start of the second group of pictures of the buffer, NULL if there is only one. */
+static AVPacketList* next_keyframe(struct replay_buffer* rb)
+{
+    AVPacketList* node;
+
+    for (node = rb->head ? rb->head->next : NULL; node; node = node->next)
+        if (node->pkt.flags & AV_PKT_FLAG_KEY)
+            return node;
+    return NULL;
+}
+
+/* Drop the oldest groups of pictures while the next ones still cover the
+ * duration of the buffer, or while the buffer is too big. The last group of
+ * pictures is always kept. */
+static void trim(struct replay_buffer* rb)
+{
+    AVPacketList* next;
+
+    while ((next = next_keyframe(rb)) &&
+           (rb->bytes > rb->max_bytes || rb->tail->pkt.pts - next->pkt.pts >= rb->max_duration))
+        drop_gop(rb);
+}
+
+struct replay_buffer* replay_buffer_new(int seconds, size_t max_bytes)
+{
+    struct replay_buffer* rb = calloc(1, sizeof(*rb));
+    if (!rb)
+        return NULL;
+
+    pthread_mutex_init(&rb->mtx, NULL);
+    rb->seconds = seconds;
+    rb->max_bytes = max_bytes;
+    return rb;
+}
+
+int replay_buffer_set_encoder(struct replay_buffer* rb, const AVCodecContext* enc)
+{
+    AVCodecContext* copy = avcodec_alloc_context3(NULL);
+
+    if (!copy || avcodec_copy_context(copy, enc) < 0)
+    {
+        LOGW("Could not copy the encoder parameters of the replay buffer");
+        avcodec_free_context(&copy);
+        return -1;
+    }
+
+    pthread_mutex_lock(&rb->mtx);
+    while (rb->head)
+        drop_head(rb);
+    avcodec_free_context(&rb->enc);
+    rb->enc = copy;
+    rb->max_duration = av_rescale_q(rb->seconds, (AVRational){1, 1}, enc->time_base);
+    pthread_mutex_unlock(&rb->mtx);
+
+    LOGI("Keeping the last %d s of video (max %zu bytes) for instant replays", rb->seconds,
+         rb->max_bytes);
+    return 0;
+}
+
+void replay_buffer_push(struct replay_buffer* rb, const AVPacket* pkt)
+{
+    AVPacketList* node;
+
+    pthread_mutex_lock(&rb->mtx);
+
+    // Packets which do not follow a keyframe could not be decoded
+    if (!rb->head && !(pkt->flags & AV_PKT_FLAG_KEY))
+        goto out;
+
+    node = av_mallocz(sizeof(*node));
+    if (!node)
+        goto out;
+    if (av_copy_packet(&node->pkt, pkt) < 0)
+    {
+        av_free(node);
+        goto out;
+    }
+
+    if (rb->tail)
+        rb->tail->next = node;
+    else
+        rb->head = node;
+    rb->tail = node;
+    rb->count++;
+    rb->bytes += node->pkt.size;
+
+    trim(rb);
+
+out:
+    pthread_mutex_unlock(&rb->mtx);
+}
+
+int replay_buffer_save(struct replay_buffer* rb, const char* filename)
+{
+    AVCodecContext* enc = NULL;
+    AVPacket* pkts = NULL;
+    AVPacketList* node;
+    struct muxer mux;
+    int64_t offset, duration;
+    size_t bytes = 0;
+    int count = 0;
+    int ret = -1;
+    int i;
+
+    /* Reference the packets, and write them once the buffer is unlocked */
+    pthread_mutex_lock(&rb->mtx);
+    if (rb->head && rb->enc)
+    {
+        enc = avcodec_alloc_context3(NULL);
+        pkts = av_malloc_array(rb->count, sizeof(*pkts));
+        if (enc && pkts && avcodec_copy_context(enc, rb->enc) >= 0)
+        {
+            for (node = rb->head; node; node = node->next)
+                if (av_copy_packet(&pkts[count], &node->pkt) >= 0)
+                    count++;
+        }
+    }
+    pthread_mutex_unlock(&rb->mtx);
+
+    if (!count)
+    {
+        LOGW("Nothing to save to %s, the replay buffer is empty", filename);
+        goto out;
+    }
+
+    /* The file starts at the first packet of the buffer */
+    offset = pkts[0].dts != AV_NOPTS_VALUE ? pkts[0].dts : pkts[0].pts;
+    duration = pkts[count - 1].pts - pkts[0].pts;
+
+    if (muxer_open(&mux, filename, muxer_guess_format(filename, "mp4"), enc, NULL) < 0)
+        goto out;
+
+    ret = 0;
+    for (i = 0; i < count; i++)
+    {
+        bytes += pkts[i].size;
+        if (pkts[i].pts != AV_NOPTS_VALUE)
+            pkts[i].pts -= offset;
+        if (pkts[i].dts != AV_NOPTS_VALUE)
+            pkts[i].dts -= offset;
+        if (!ret && muxer_write(&mux, &pkts[i]) < 0)
+        {
+            LOGW("Error while writing the replay buffer to %s", filename);
+            ret = -1;
+        }
+    }
+    muxer_close(&mux);
+
+    if (!ret)
+        LOGI("Saved the last %.1f s of video to %s (%d packets, %zu bytes)",
+             duration * av_q2d(enc->time_base), filename, count, bytes);
+
+out:
+    for (i = 0; i < count; i++)
+        av_free_packet(&pkts[i]);
+    av_free(pkts);
+    avcodec_free_context(&enc);
+    return ret;
+}
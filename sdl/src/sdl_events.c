@@ -9,6 +9,7 @@
 #include "buffer_sizes.h"
 #include "logger.h"
 #include "grabber.h"
+#include "record_profile.h"
 #include "sdl_events.h"
 #include "sdl_translate.h"
 
@@ -79,6 +80,7 @@ int sdl_key(SDL_Event* event, socket_t input_socket)
         memset(&grab_args, 0, sizeof(struct thread_args));
         grab_time(strTime);
         snprintf(grab_args.record_filename, BUF_SIZE, "%s%s.mp4", strPrefix, strTime);
+        record_profile_from_config(&grab_args.profile);
         moreFrames = 1;
         pthread_mutex_init(&grab_args.mtx, NULL);
         pthread_mutex_lock(&grab_args.mtx);
@@ -94,7 +96,7 @@ int sdl_key(SDL_Event* event, socket_t input_socket)
     {
         char snap_filename[BUF_SIZE];
         grab_time(strTime);
-        snprintf(snap_filename, sizeof(snap_filename), "log/snap_F6_%s.bmp", strTime);
+        snprintf(snap_filename, sizeof(snap_filename), "log/snap_F6_%s", strTime);
         LOGI("Saving snapshot %s", snap_filename);
         grab_snapshot(snap_filename);
     }
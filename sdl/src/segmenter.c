@@ -0,0 +1,268 @@
+/**
+ * \file segmenter.c
+ * \brief Output of a long recording to a series of bounded files.
+ */
+#include <errno.h>                  // for EIO
+#include <glib.h>                   // for g_strlcpy
+#include <libavutil/error.h>        // for AVERROR
+#include <libavutil/mathematics.h>  // for av_rescale_q
+#include <libavutil/rational.h>     // for av_q2d
+#include <pthread.h>                // for pthread_create, pthread_cond_wait
+#include <stdint.h>                 // for int64_t
+#include <stdio.h>                  // for FILE, fopen, fprintf, snprintf
+#include <stdlib.h>                 // for calloc, free
+#include <string.h>                 // for strrchr
+
+#include "buffer_sizes.h"
+#include "logger.h"
+#include "muxer.h"
+#include "segmenter.h"
+
+#define LOG_TAG "segmenter"
+
+/** \brief Max length of the extension of the recordings */
+#define EXT_SIZE 16
+
+struct segment
+{
+    struct muxer mux;
+    char filename[BUF_SIZE];
+    /** Duration, in the time base of the encoder */
+    int64_t duration;
+    size_t bytes;
+    struct segment* next;
+};
+
+struct segmenter
+{
+    AVOutputFormat* fmt;
+    const AVCodecContext* enc;
+    AVDictionary* opt;
+    /** Name of the recording, without its extension */
+    char base[BUF_SIZE];
+    char ext[EXT_SIZE];
+    /** Limits of a segment, in the time base of the encoder and in bytes */
+    int64_t max_duration;
+    size_t max_bytes;
+    int index;
+    /** Segment being written by the encoder */
+    struct segment* cur;
+    /** pts of the first packet of the current segment */
+    int64_t start_pts;
+    int64_t last_pts;
+    /** Subtracted from the timestamps, so that each segment starts at 0 */
+    int64_t offset;
+    FILE* index_file;
+
+    /* Finalizer thread, and the segments waiting for their trailer */
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct segment* pending;
+    struct segment** pending_tail;
+    int closing;
+};
+
+static struct segment* open_segment(struct segmenter* seg)
+{
+    struct segment* s = calloc(1, sizeof(*s));
+    AVDictionary* opt = NULL;
+
+    if (!s)
+        return NULL;
+
+    snprintf(s->filename, sizeof(s->filename), "%s-%03d%s", seg->base, seg->index, seg->ext);
+    av_dict_copy(&opt, seg->opt, 0);
+    if (muxer_open(&s->mux, s->filename, seg->fmt, seg->enc, &opt) < 0)
+    {
+        av_dict_free(&opt);
+        free(s);
+        return NULL;
+    }
+    av_dict_free(&opt);
+    return s;
+}
+
+/* Write the trailer of a segment, close it and add it to the index. */
+static void finalize(struct segmenter* seg, struct segment* s)
+{
+    double duration = s->duration * av_q2d(seg->enc->time_base);
+    const char* name = strrchr(s->filename, '/');
+
+    muxer_close(&s->mux);
+    LOGI("Finalized %s: %.1f s, %zu bytes", s->filename, duration, s->bytes);
+
+    /* The index is next to the segments */
+    if (seg->index_file)
+    {
+        fprintf(seg->index_file, "file '%s'\nduration %.3f\n", name ? name + 1 : s->filename,
+                duration);
+        fflush(seg->index_file);
+    }
+    free(s);
+}
+
+static void* finalizer(void* arg)
+{
+    struct segmenter* seg = arg;
+    struct segment* s;
+
+    pthread_mutex_lock(&seg->mtx);
+    while (1)
+    {
+        while (!seg->pending && !seg->closing)
+            pthread_cond_wait(&seg->cond, &seg->mtx);
+        if (!seg->pending)
+            break;
+
+        s = seg->pending;
+        seg->pending = s->next;
+        if (!seg->pending)
+            seg->pending_tail = &seg->pending;
+
+        pthread_mutex_unlock(&seg->mtx);
+        finalize(seg, s);
+        pthread_mutex_lock(&seg->mtx);
+    }
+    pthread_mutex_unlock(&seg->mtx);
+    return NULL;
+}
+
+/* Hand a finished segment to the finalizer thread. */
+static void push_pending(struct segmenter* seg, struct segment* s)
+{
+    pthread_mutex_lock(&seg->mtx);
+    *seg->pending_tail = s;
+    seg->pending_tail = &s->next;
+    pthread_cond_signal(&seg->cond);
+    pthread_mutex_unlock(&seg->mtx);
+}
+
+struct segmenter* segmenter_open(const char* filename, AVOutputFormat* fmt,
+                                 const AVCodecContext* enc, AVDictionary* opt, int seconds,
+                                 size_t max_bytes, int with_index)
+{
+    char index_name[BUF_SIZE];
+    const char* slash = strrchr(filename, '/');
+    const char* dot = strrchr(filename, '.');
+    struct segmenter* seg = calloc(1, sizeof(*seg));
+
+    if (!seg)
+        return NULL;
+
+    /* video.mp4 is split into video-000.mp4, video-001.mp4... */
+    if (!dot || (slash && dot < slash) || strlen(dot) >= sizeof(seg->ext))
+        dot = filename + strlen(filename);
+    snprintf(seg->base, sizeof(seg->base), "%.*s", (int) (dot - filename), filename);
+    g_strlcpy(seg->ext, dot, sizeof(seg->ext));
+
+    seg->fmt = fmt;
+    seg->enc = enc;
+    av_dict_copy(&seg->opt, opt, 0);
+    seg->max_duration =
+        seconds > 0 ? av_rescale_q(seconds, (AVRational){1, 1}, enc->time_base) : 0;
+    seg->max_bytes = max_bytes;
+    seg->pending_tail = &seg->pending;
+    pthread_mutex_init(&seg->mtx, NULL);
+    pthread_cond_init(&seg->cond, NULL);
+
+    if (with_index)
+    {
+        snprintf(index_name, sizeof(index_name), "%s.ffconcat", seg->base);
+        seg->index_file = fopen(index_name, "w");
+        if (seg->index_file)
+            fprintf(seg->index_file, "ffconcat version 1.0\n");
+        else
+            LOGW("Could not create the index %s", index_name);
+    }
+
+    seg->cur = open_segment(seg);
+    if (!seg->cur)
+        goto fail;
+
+    if (pthread_create(&seg->thread, NULL, finalizer, seg))
+    {
+        LOGW("Unable to start the finalizer of %s", filename);
+        muxer_close(&seg->cur->mux);
+        free(seg->cur);
+        goto fail;
+    }
+
+    LOGI("Recording %s in segments of %d s and %zu bytes at most", filename, seconds, max_bytes);
+    return seg;
+
+fail:
+    if (seg->index_file)
+        fclose(seg->index_file);
+    av_dict_free(&seg->opt);
+    free(seg);
+    return NULL;
+}
+
+/* Start the next segment on the keyframe pkt. */
+static int rotate(struct segmenter* seg, const AVPacket* pkt)
+{
+    struct segment* s = seg->cur;
+
+    s->duration = pkt->pts - seg->start_pts;
+    push_pending(seg, s);
+
+    seg->index++;
+    seg->cur = open_segment(seg);
+    if (!seg->cur)
+        return AVERROR(EIO);
+    seg->offset = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    return 0;
+}
+
+int segmenter_write(struct segmenter* seg, AVPacket* pkt)
+{
+    int ret;
+
+    if (!seg->cur)
+        return AVERROR(EIO);
+
+    if ((pkt->flags & AV_PKT_FLAG_KEY) && seg->cur->bytes &&
+        ((seg->max_duration && pkt->pts - seg->start_pts >= seg->max_duration) ||
+         (seg->max_bytes && seg->cur->bytes >= seg->max_bytes)))
+    {
+        ret = rotate(seg, pkt);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (!seg->cur->bytes)
+        seg->start_pts = pkt->pts;
+    if (pkt->pts > seg->last_pts)
+        seg->last_pts = pkt->pts;
+    seg->cur->bytes += pkt->size;
+
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts -= seg->offset;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts -= seg->offset;
+    return muxer_write(&seg->cur->mux, pkt);
+}
+
+void segmenter_close(struct segmenter* seg)
+{
+    if (seg->cur)
+    {
+        /* The last frame lasts one tick */
+        seg->cur->duration = seg->last_pts - seg->start_pts + 1;
+        push_pending(seg, seg->cur);
+    }
+
+    pthread_mutex_lock(&seg->mtx);
+    seg->closing = 1;
+    pthread_cond_signal(&seg->cond);
+    pthread_mutex_unlock(&seg->mtx);
+    pthread_join(seg->thread, NULL);
+
+    if (seg->index_file)
+        fclose(seg->index_file);
+    av_dict_free(&seg->opt);
+    pthread_mutex_destroy(&seg->mtx);
+    pthread_cond_destroy(&seg->cond);
+    free(seg);
+}
@@ -0,0 +1,459 @@
+/**
+ * \file snapshot.c
+ * \brief Snapshots of the window, encoded and written off the requesting thread.
+ */
+#include <errno.h>               // for EINTR
+#include <glib.h>                // for g_strlcpy
+#include <libavcodec/avcodec.h>  // for avcodec_encode_video2, AVCodecContext
+#include <libavutil/error.h>     // for av_err2str
+#include <libavutil/frame.h>     // for AVFrame, av_frame_alloc
+#include <libavutil/pixfmt.h>    // for AV_PIX_FMT_BGR0, AV_PIX_FMT_RGB24
+#include <libswscale/swscale.h>  // for sws_getContext, sws_scale
+#include <pthread.h>             // for pthread_create, pthread_cond_wait
+#include <stdint.h>              // for uint8_t, int64_t
+#include <stdio.h>               // for FILE, fopen, fwrite, snprintf
+#include <stdlib.h>              // for calloc, malloc, free
+#include <string.h>              // for strlen, strrchr
+#include <strings.h>             // for strcasecmp
+#include <time.h>                // for clock_gettime, clock_nanosleep
+
+#include "buffer_sizes.h"
+#include "frame_ring.h"
+#include "logger.h"
+#include "snapshot.h"
+
+#define LOG_TAG "snapshot"
+
+/** \brief Number of formats encoded by libavcodec */
+#define SNAPSHOT_FORMATS 3
+
+/** \brief Max length of the extension of a snapshot */
+#define EXT_SIZE 16
+
+/** \brief Queued request of snapshots */
+struct snapshot_request
+{
+    /** Name of the files, without their extension */
+    char base[BUF_SIZE];
+    char ext[EXT_SIZE];
+    int format;
+    int count;
+    int interval_ms;
+    struct snapshot_request* next;
+};
+
+/** \brief File to write, attached to a captured frame */
+struct snapshot_job
+{
+    char filename[BUF_SIZE];
+    int format;
+};
+
+struct snapshot_worker
+{
+    snapshot_grab_fn grab;
+    /** Size of the next captures, protected by mtx */
+    int width;
+    int height;
+    int format;
+    int png_level;
+    int jpeg_quality;
+    /** Captured frames, from the capture thread to the encoder thread */
+    struct frame_ring* pool;
+
+    /* Requests waiting for the capture thread */
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct snapshot_request* head;
+    struct snapshot_request** tail;
+
+    /* State of the encoder thread, allocated on the first snapshot of each format */
+    AVCodecContext* enc[SNAPSHOT_FORMATS];
+    struct SwsContext* sws[SNAPSHOT_FORMATS];
+    AVFrame* converted[SNAPSHOT_FORMATS];
+    int64_t pts;
+    uint8_t* bmp_row;
+    int bmp_row_size;
+};
+
+static const char* const s_ext[SNAPSHOT_FORMATS] = {".bmp", ".png", ".jpg"};
+
+int snapshot_format_from_name(const char* name)
+{
+    if (!strcasecmp(name, "bmp"))
+        return SNAPSHOT_BMP;
+    if (!strcasecmp(name, "png"))
+        return SNAPSHOT_PNG;
+    if (!strcasecmp(name, "jpeg") || !strcasecmp(name, "jpg"))
+        return SNAPSHOT_JPEG;
+    return -1;
+}
+
+const char* snapshot_format_ext(int format)
+{
+    return s_ext[format];
+}
+
+static int64_t elapsed_us(const struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Write a BGR0 frame to a 24 bits BMP file. */
+static int write_bmp(struct snapshot_worker* w, const AVFrame* frame, FILE* f)
+{
+    int row_size = (3 * frame->width + 3) & ~3;
+    int filesize = 54 + row_size * frame->height;
+    unsigned char bmpfileheader[14] = {'B', 'M', 0, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0};
+    unsigned char bmpinfoheader[40] = {40, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 24, 0};
+    int x, y;
+
+    bmpfileheader[2] = (unsigned char) (filesize);
+    bmpfileheader[3] = (unsigned char) (filesize >> 8);
+    bmpfileheader[4] = (unsigned char) (filesize >> 16);
+    bmpfileheader[5] = (unsigned char) (filesize >> 24);
+
+    bmpinfoheader[4] = (unsigned char) (frame->width);
+    bmpinfoheader[5] = (unsigned char) (frame->width >> 8);
+    bmpinfoheader[6] = (unsigned char) (frame->width >> 16);
+    bmpinfoheader[7] = (unsigned char) (frame->width >> 24);
+    bmpinfoheader[8] = (unsigned char) (frame->height);
+    bmpinfoheader[9] = (unsigned char) (frame->height >> 8);
+    bmpinfoheader[10] = (unsigned char) (frame->height >> 16);
+    bmpinfoheader[11] = (unsigned char) (frame->height >> 24);
+
+    /* The row is only reallocated when the size of the window changes */
+    if (w->bmp_row_size != row_size)
+    {
+        free(w->bmp_row);
+        w->bmp_row = calloc(1, row_size);
+        w->bmp_row_size = w->bmp_row ? row_size : 0;
+        if (!w->bmp_row)
+            return -1;
+    }
+
+    fwrite(bmpfileheader, 1, 14, f);
+    fwrite(bmpinfoheader, 1, 40, f);
+
+    /* The rows of a BMP go from the bottom to the top */
+    for (y = frame->height - 1; y >= 0; y--)
+    {
+        const uint8_t* src = frame->data[0] + y * frame->linesize[0];
+        for (x = 0; x < frame->width; x++)
+        {
+            w->bmp_row[3 * x + 0] = src[4 * x + 0];
+            w->bmp_row[3 * x + 1] = src[4 * x + 1];
+            w->bmp_row[3 * x + 2] = src[4 * x + 2];
+        }
+        fwrite(w->bmp_row, 1, row_size, f);
+    }
+    return 0;
+}
+
+/* Close the encoder of a format, and free its conversion. */
+static void close_encoder(struct snapshot_worker* w, int format)
+{
+    avcodec_free_context(&w->enc[format]);
+    sws_freeContext(w->sws[format]);
+    w->sws[format] = NULL;
+    av_frame_free(&w->converted[format]);
+}
+
+/* Encoder of a compressed format for width x height snapshots, opened on the
+ * first snapshot of the format and reopened when the window is resized. */
+static AVCodecContext* open_encoder(struct snapshot_worker* w, int format, int width, int height)
+{
+    enum AVCodecID codec_id = format == SNAPSHOT_PNG ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG;
+    enum AVPixelFormat pix_fmt = format == SNAPSHOT_PNG ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+    AVCodec* codec;
+    AVCodecContext* c = w->enc[format];
+    int ret;
+
+    if (c && c->width == width && c->height == height)
+        return c;
+    if (c)
+        close_encoder(w, format);
+
+    codec = avcodec_find_encoder(codec_id);
+    c = codec ? avcodec_alloc_context3(codec) : NULL;
+    if (!c)
+    {
+        LOGW("No %s encoder for the snapshots", avcodec_get_name(codec_id));
+        return NULL;
+    }
+
+    c->width = width;
+    c->height = height;
+    c->pix_fmt = pix_fmt;
+    c->time_base = (AVRational){1, 25};
+    if (format == SNAPSHOT_PNG)
+    {
+        c->compression_level = w->png_level;
+    }
+    else
+    {
+        /* quality 100 is qscale 2, quality 1 is qscale 31 */
+        c->flags |= CODEC_FLAG_QSCALE;
+        c->global_quality = FF_QP2LAMBDA * (2 + (100 - w->jpeg_quality) * 29 / 99);
+    }
+
+    ret = avcodec_open2(c, codec, NULL);
+    if (ret < 0)
+    {
+        LOGW("Could not open the %s encoder of the snapshots: %s", codec->name, av_err2str(ret));
+        avcodec_free_context(&c);
+        return NULL;
+    }
+
+    w->sws[format] = sws_getContext(width, height, AV_PIX_FMT_BGR0, width, height, pix_fmt,
+                                    SWS_BICUBIC, NULL, NULL, NULL);
+    w->converted[format] = av_frame_alloc();
+    if (!w->sws[format] || !w->converted[format])
+        LOGE("open_encoder(): out of memory");
+    w->converted[format]->format = pix_fmt;
+    w->converted[format]->width = width;
+    w->converted[format]->height = height;
+    if (av_frame_get_buffer(w->converted[format], 32) < 0)
+        LOGE("open_encoder(): out of memory");
+
+    w->enc[format] = c;
+    return c;
+}
+
+/* Compress a BGR0 frame to PNG or JPEG, and write it with a single write. */
+static int write_encoded(struct snapshot_worker* w, int format, const AVFrame* frame, FILE* f)
+{
+    AVCodecContext* c = open_encoder(w, format, frame->width, frame->height);
+    AVFrame* converted = w->converted[format];
+    AVPacket pkt = {0};
+    int got_packet = 0;
+    int ret;
+
+    if (!c)
+        return -1;
+
+    sws_scale(w->sws[format], (const uint8_t* const*) frame->data, frame->linesize, 0,
+              frame->height, converted->data, converted->linesize);
+    converted->pts = w->pts++;
+    converted->quality = c->global_quality;
+
+    av_init_packet(&pkt);
+    ret = avcodec_encode_video2(c, &pkt, converted, &got_packet);
+    if (ret < 0)
+    {
+        LOGW("Error encoding a snapshot: %s", av_err2str(ret));
+        return -1;
+    }
+    if (!got_packet)
+        return -1;
+
+    ret = fwrite(pkt.data, 1, pkt.size, f) == (size_t) pkt.size ? 0 : -1;
+    av_free_packet(&pkt);
+    return ret;
+}
+
+static void* encoder_thread(void* arg)
+{
+    struct snapshot_worker* w = arg;
+    struct snapshot_job* job;
+    struct timespec start;
+    AVFrame* frame;
+    FILE* f;
+    int ret;
+
+    while ((frame = frame_ring_pop(w->pool)))
+    {
+        job = frame->opaque;
+        frame->opaque = NULL;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        f = fopen(job->filename, "wb");
+        if (!f)
+        {
+            LOGW("Could not create the snapshot %s", job->filename);
+        }
+        else
+        {
+            ret = job->format == SNAPSHOT_BMP ? write_bmp(w, frame, f)
+                                              : write_encoded(w, job->format, frame, f);
+            if (fclose(f) || ret < 0)
+                LOGW("Error while writing the snapshot %s", job->filename);
+            else
+                LOGI("Saved snapshot %s in %.1f ms", job->filename, elapsed_us(&start) / 1000.);
+        }
+
+        free(job);
+        frame_ring_release(w->pool, frame);
+    }
+    return NULL;
+}
+
+static void* capture_thread(void* arg)
+{
+    struct snapshot_worker* w = arg;
+    struct snapshot_request* req;
+    struct snapshot_job* job;
+    struct timespec next;
+    AVFrame* frame;
+    int width, height;
+    int i;
+
+    while (1)
+    {
+        pthread_mutex_lock(&w->mtx);
+        while (!w->head)
+            pthread_cond_wait(&w->cond, &w->mtx);
+        req = w->head;
+        w->head = req->next;
+        if (!w->head)
+            w->tail = &w->head;
+        width = w->width;
+        height = w->height;
+        pthread_mutex_unlock(&w->mtx);
+
+        /* The frames still queued for the encoder keep their size */
+        if (frame_ring_resize(w->pool, width, height) < 0)
+            LOGW("Unable to resize the snapshots to %dx%d", width, height);
+
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        for (i = 0; i < req->count; i++)
+        {
+            /* The snapshots of a burst are taken on a fixed schedule */
+            if (i)
+            {
+                next.tv_nsec += req->interval_ms * 1000000LL;
+                next.tv_sec += next.tv_nsec / 1000000000;
+                next.tv_nsec %= 1000000000;
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+                    ;
+            }
+
+            frame = frame_ring_acquire(w->pool);
+            if (!frame)
+                break;
+            if (frame_ring_make_writable(w->pool, frame) < 0 || w->grab(frame) < 0)
+            {
+                LOGW("Unable to capture the window for %s%s", req->base, req->ext);
+                frame_ring_release(w->pool, frame);
+                continue;
+            }
+
+            job = malloc(sizeof(*job));
+            if (!job)
+                LOGE("capture_thread(): out of memory");
+            if (req->count > 1)
+                snprintf(job->filename, sizeof(job->filename), "%s-%03d%s", req->base, i,
+                         req->ext);
+            else
+                snprintf(job->filename, sizeof(job->filename), "%s%s", req->base, req->ext);
+            job->format = req->format;
+
+            frame->opaque = job;
+            frame_ring_publish(w->pool, frame);
+        }
+        free(req);
+    }
+    return NULL;
+}
+
+struct snapshot_worker* snapshot_worker_new(snapshot_grab_fn grab, int width, int height,
+                                            int pool_size, int format, int png_level,
+                                            int jpeg_quality)
+{
+    struct snapshot_worker* w = calloc(1, sizeof(*w));
+    pthread_t thread;
+
+    if (!w)
+        return NULL;
+
+    w->grab = grab;
+    w->width = width;
+    w->height = height;
+    w->format = format;
+    w->png_level = png_level;
+    w->jpeg_quality = jpeg_quality;
+    w->tail = &w->head;
+    pthread_mutex_init(&w->mtx, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    /* A capture waits for a free frame rather than dropping a snapshot */
+    w->pool = frame_ring_new("snapshot", pool_size, FRAME_RING_BLOCK, AV_PIX_FMT_BGR0, width,
+                             height);
+    if (!w->pool)
+    {
+        free(w);
+        return NULL;
+    }
+
+    if (pthread_create(&thread, NULL, encoder_thread, w))
+        LOGE("Unable to start the snapshot encoder");
+    pthread_detach(thread);
+    if (pthread_create(&thread, NULL, capture_thread, w))
+        LOGE("Unable to start the snapshot capture");
+    pthread_detach(thread);
+
+    LOGI("Snapshots of %dx%d, %s by default, %d frames in the pool", width, height,
+         s_ext[format] + 1, pool_size);
+    return w;
+}
+
+void snapshot_worker_resize(struct snapshot_worker* w, int width, int height)
+{
+    pthread_mutex_lock(&w->mtx);
+    w->width = width;
+    w->height = height;
+    pthread_mutex_unlock(&w->mtx);
+}
+
+int snapshot_worker_request(struct snapshot_worker* w, const char* filename, int count,
+                            int interval_ms)
+{
+    const char* slash = strrchr(filename, '/');
+    const char* dot = strrchr(filename, '.');
+    struct snapshot_request* req;
+    int format = -1;
+
+    if (count < 1 || interval_ms < 0)
+    {
+        LOGW("Invalid burst of %d snapshots every %d ms for %s", count, interval_ms, filename);
+        return -1;
+    }
+    /* A burst holds the capture thread, and the requests queued after it */
+    if (count > SNAPSHOT_BURST_MAX || interval_ms > SNAPSHOT_BURST_INTERVAL_MAX_MS)
+    {
+        LOGW("Burst of %d snapshots every %d ms for %s limited to %d every %d ms", count,
+             interval_ms, filename, SNAPSHOT_BURST_MAX, SNAPSHOT_BURST_INTERVAL_MAX_MS);
+        if (count > SNAPSHOT_BURST_MAX)
+            count = SNAPSHOT_BURST_MAX;
+        if (interval_ms > SNAPSHOT_BURST_INTERVAL_MAX_MS)
+            interval_ms = SNAPSHOT_BURST_INTERVAL_MAX_MS;
+    }
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        return -1;
+
+    /* A known extension gives the format, the default one is added otherwise */
+    if (dot && (!slash || dot > slash))
+        format = snapshot_format_from_name(dot + 1);
+    if (format < 0)
+    {
+        format = w->format;
+        dot = filename + strlen(filename);
+    }
+    snprintf(req->base, sizeof(req->base), "%.*s", (int) (dot - filename), filename);
+    g_strlcpy(req->ext, *dot ? dot : s_ext[format], sizeof(req->ext));
+    req->format = format;
+    req->count = count;
+    req->interval_ms = interval_ms;
+
+    pthread_mutex_lock(&w->mtx);
+    *w->tail = req;
+    w->tail = &req->next;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mtx);
+    return 0;
+}
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>  // for AF_INET, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR
+#include <sys/un.h>      // for sockaddr_un
 
 #include "socket.h"
 #include "logger.h"
@@ -41,6 +42,112 @@ socket_t open_socket_reuseaddr(const char* ip, short port)
     return open_socket_switch(ip, port, REUSEADDR);
 }
 
+int resolve_socket_address(const char* ip, short port, struct sockaddr_in* addr)
+{
+    struct addrinfo hints, *servinfo;
+    int rv;
+    char sport[6];
+
+    snprintf(sport, 6, "%d", port);
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((rv = getaddrinfo(ip, sport, &hints, &servinfo)) != 0)
+    {
+        LOGW("Error in getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    memcpy(addr, servinfo->ai_addr, sizeof(*addr));
+    freeaddrinfo(servinfo);
+    return 0;
+}
+
+socket_t open_socket_nodelay_addr(const struct sockaddr_in* addr)
+{
+    socket_t sockfd;
+    int yes = 1;
+
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        LOGW("Socket connect error: %s", strerror(errno));
+        return SOCKET_ERROR;
+    }
+
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+
+    if (connect(sockfd, (const struct sockaddr*) addr, sizeof(*addr)) == -1)
+    {
+        LOGW("Socket connect error: %s", strerror(errno));
+        close(sockfd);
+        return SOCKET_ERROR;
+    }
+
+    return sockfd;
+}
+
+socket_t open_socket_unix(const char* path)
+{
+    struct sockaddr_un addr;
+    socket_t sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        LOGW("Socket path too long: %s", path);
+        return SOCKET_ERROR;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        LOGW("Socket connect error: %s", strerror(errno));
+        return SOCKET_ERROR;
+    }
+
+    if (connect(sockfd, (const struct sockaddr*) &addr, sizeof(addr)) == -1)
+    {
+        LOGW("Socket connect error: %s", strerror(errno));
+        close(sockfd);
+        return SOCKET_ERROR;
+    }
+
+    return sockfd;
+}
+
+socket_t open_server_socket(short port)
+{
+    struct sockaddr_in addr;
+    socket_t sockfd;
+    int yes = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        LOGW("Socket error: %s", strerror(errno));
+        return SOCKET_ERROR;
+    }
+
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+    if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        listen(sockfd, SOMAXCONN) == -1)
+    {
+        LOGW("Unable to listen on port %d: %s", port, strerror(errno));
+        close(sockfd);
+        return SOCKET_ERROR;
+    }
+
+    return sockfd;
+}
+
 static socket_t open_socket_switch(const char* ip, short port, open_type_t type)
 {
     socket_t sockfd;
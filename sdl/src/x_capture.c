@@ -0,0 +1,246 @@
+/**
+ * \file x_capture.c
+ * \brief Capture of an X window through MIT-SHM, or XGetSubImage() as a fallback
+ */
+#include <X11/Xlib.h>                  // for XGetWindowAttributes, XCreateImage
+#include <X11/Xproto.h>                // for X_GetImage
+#include <X11/Xutil.h>                 // for XDestroyImage
+#include <X11/extensions/XShm.h>       // for XShmCreateImage, XShmAttach, XShmGetImage
+#include <X11/extensions/shmproto.h>   // for X_ShmGetImage
+#include <pthread.h>                   // for pthread_mutex_lock, pthread_mutex_unlock
+#include <stdlib.h>                    // for malloc
+#include <string.h>                    // for memset
+#include <sys/ipc.h>                   // for IPC_PRIVATE, IPC_CREAT, IPC_RMID
+#include <sys/shm.h>                   // for shmget, shmat, shmdt, shmctl
+
+#include "logger.h"
+
+#include "x_capture.h"
+
+#define LOG_TAG "x_capture"
+
+/** XSetErrorHandler() is process-wide: one attach at a time */
+static pthread_mutex_t s_attach_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int s_attach_failed;
+
+/** Handler of the errors other than those of the captures, set once */
+static int (*s_next_handler)(Display*, XErrorEvent*);
+/** Major opcode of MIT-SHM, 0 if the extension is missing */
+static int s_shm_opcode;
+
+/** A window smaller than its capture, which a rotation makes for a moment,
+ * fails the capture with BadMatch: skip that capture instead of letting the
+ * default handler end the process */
+static int capture_error_handler(Display* display, XErrorEvent* event)
+{
+    if (event->error_code == BadMatch &&
+        (event->request_code == X_GetImage ||
+         (s_shm_opcode && event->request_code == s_shm_opcode &&
+          event->minor_code == X_ShmGetImage)))
+        return 0;
+
+    return s_next_handler ? s_next_handler(display, event) : 0;
+}
+
+/** Put capture_error_handler() in front of the handler of the process, once */
+static void install_error_handler(Display* display)
+{
+    int event_base, error_base;
+
+    pthread_mutex_lock(&s_attach_mtx);
+    if (!s_next_handler)
+    {
+        if (!XQueryExtension(display, "MIT-SHM", &s_shm_opcode, &event_base, &error_base))
+            s_shm_opcode = 0;
+        s_next_handler = XSetErrorHandler(capture_error_handler);
+    }
+    pthread_mutex_unlock(&s_attach_mtx);
+}
+
+static int attach_error_handler(Display* display, XErrorEvent* event)
+{
+    (void) display;
+    (void) event;
+    s_attach_failed = 1;
+    return 0;
+}
+
+/** Attach a shared segment to the X server, which fails if it cannot reach it */
+static int attach_shm(Display* display, XShmSegmentInfo* shminfo)
+{
+    int (*old_handler)(Display*, XErrorEvent*);
+    int failed;
+
+    pthread_mutex_lock(&s_attach_mtx);
+    s_attach_failed = 0;
+    XSync(display, False);
+    old_handler = XSetErrorHandler(attach_error_handler);
+    if (!XShmAttach(display, shminfo))
+        s_attach_failed = 1;
+    XSync(display, False);
+    XSetErrorHandler(old_handler);
+    failed = s_attach_failed;
+    pthread_mutex_unlock(&s_attach_mtx);
+
+    return failed ? -1 : 0;
+}
+
+static int init_shm(struct x_capture* cap, Visual* visual, int depth)
+{
+    XShmSegmentInfo* shminfo = &cap->shminfo;
+
+    if (!XShmQueryExtension(cap->display))
+    {
+        LOGI("MIT-SHM is not available");
+        return -1;
+    }
+
+    cap->image = XShmCreateImage(cap->display, visual, depth, ZPixmap, NULL, shminfo, cap->width,
+                                 cap->height);
+    if (!cap->image)
+        return -1;
+
+    shminfo->shmid =
+        shmget(IPC_PRIVATE, cap->image->bytes_per_line * cap->image->height, IPC_CREAT | 0600);
+    if (shminfo->shmid < 0)
+        goto error_image;
+
+    shminfo->shmaddr = cap->image->data = (char*) shmat(shminfo->shmid, NULL, 0);
+    if (shminfo->shmaddr == (char*) -1)
+    {
+        shmctl(shminfo->shmid, IPC_RMID, NULL);
+        goto error_image;
+    }
+    shminfo->readOnly = False;
+
+    if (attach_shm(cap->display, shminfo) < 0)
+    {
+        LOGI("MIT-SHM cannot be used with this X server");
+        shmdt(shminfo->shmaddr);
+        shmctl(shminfo->shmid, IPC_RMID, NULL);
+        goto error_image;
+    }
+
+    // The segment is destroyed as soon as both sides detach, even on a crash
+    shmctl(shminfo->shmid, IPC_RMID, NULL);
+    cap->use_shm = 1;
+    return 0;
+
+error_image:
+    cap->image->data = NULL;
+    XDestroyImage(cap->image);
+    cap->image = NULL;
+    return -1;
+}
+
+static int init_fallback(struct x_capture* cap, Visual* visual, int depth)
+{
+    char* data;
+
+    cap->image =
+        XCreateImage(cap->display, visual, depth, ZPixmap, 0, NULL, cap->width, cap->height, 32, 0);
+    if (!cap->image)
+        return -1;
+
+    data = (char*) malloc(cap->image->bytes_per_line * cap->image->height);
+    if (!data)
+    {
+        XDestroyImage(cap->image);
+        cap->image = NULL;
+        return -1;
+    }
+    cap->image->data = data;
+    return 0;
+}
+
+int x_capture_init(struct x_capture* cap, Display* display, Drawable drawable, int width,
+                   int height)
+{
+    XWindowAttributes attrs;
+
+    memset(cap, 0, sizeof(*cap));
+    cap->display = display;
+    cap->drawable = drawable;
+    cap->width = width;
+    cap->height = height;
+    install_error_handler(display);
+
+    if (!XGetWindowAttributes(display, drawable, &attrs))
+    {
+        LOGW("Unable to get the attributes of the window");
+        return -1;
+    }
+
+    if (init_shm(cap, attrs.visual, attrs.depth) == 0)
+    {
+        LOGI("Capturing %dx%d through MIT-SHM", width, height);
+        return 0;
+    }
+
+    if (init_fallback(cap, attrs.visual, attrs.depth) == 0)
+    {
+        LOGI("Capturing %dx%d through XGetSubImage", width, height);
+        return 0;
+    }
+
+    LOGW("Unable to allocate a %dx%d capture", width, height);
+    return -1;
+}
+
+XImage* x_capture_grab(struct x_capture* cap)
+{
+    if (cap->use_shm)
+    {
+        if (!XShmGetImage(cap->display, cap->drawable, cap->image, 0, 0, AllPlanes))
+            return NULL;
+        return cap->image;
+    }
+
+    if (!XGetSubImage(cap->display, cap->drawable, 0, 0, cap->width, cap->height, AllPlanes,
+                      ZPixmap, cap->image, 0, 0))
+        return NULL;
+    return cap->image;
+}
+
+XImage* x_capture_grab_area(struct x_capture* cap, int width, int height)
+{
+    XImage* image = cap->image;
+    int bytes, y;
+
+    if (width >= cap->width && height >= cap->height)
+        return x_capture_grab(cap);
+
+    width = width < cap->width ? width : cap->width;
+    height = height < cap->height ? height : cap->height;
+    if (width > 0 && height > 0 &&
+        !XGetSubImage(cap->display, cap->drawable, 0, 0, width, height, AllPlanes, ZPixmap, image,
+                      0, 0))
+        return NULL;
+
+    /* Black outside of the window */
+    bytes = width * image->bits_per_pixel / 8;
+    for (y = 0; y < image->height; y++)
+    {
+        int x0 = y < height ? bytes : 0;
+        memset(image->data + y * image->bytes_per_line + x0, 0, image->bytes_per_line - x0);
+    }
+    return image;
+}
+
+void x_capture_destroy(struct x_capture* cap)
+{
+    if (!cap->image)
+        return;
+
+    if (cap->use_shm)
+    {
+        XShmDetach(cap->display, &cap->shminfo);
+        XSync(cap->display, False);
+        shmdt(cap->shminfo.shmaddr);
+        // The data belongs to the segment, not to Xlib
+        cap->image->data = NULL;
+    }
+    XDestroyImage(cap->image);
+    cap->image = NULL;
+    cap->use_shm = 0;
+}
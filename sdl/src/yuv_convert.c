@@ -0,0 +1,373 @@
+/**
+ * \file yuv_convert.c
+ * \brief BGRX to I420 conversion kernels
+ *
+ * Each kernel converts two rows at a time: the luma of both rows, and the
+ * chroma of the blocks they form. The SIMD kernels handle the largest
+ * multiple of their step and leave the remaining columns to the scalar
+ * kernel, which also handles a lone last row by pairing it with itself.
+ *
+ * The SIMD kernels widen the pixels to 16 bits and compute the weighted sums
+ * with madd, which keeps the exact integer arithmetic of the macros: luma
+ * sums stay below 2^16 and chroma sums are signed and below 2^15.
+ */
+#include <pthread.h>  // for pthread_once
+#include <stdint.h>   // for uint8_t, uint32_t
+#include <string.h>   // for memcpy
+
+#if defined(__x86_64__)
+#include <immintrin.h>  // for __m128i, __m256i, _mm_madd_epi16, _mm256_madd_epi16
+#define HAVE_X86_KERNELS
+#endif
+
+#include "logger.h"
+
+#include "yuv_convert.h"
+
+#define LOG_TAG "yuv_convert"
+
+/** Convert the columns [x0, width) of two rows; row1 may be equal to row0 */
+typedef void (*convert_rows_fn)(const uint8_t* row0, const uint8_t* row1, uint8_t* y0,
+                                uint8_t* y1, uint8_t* u, uint8_t* v, int x0, int width);
+
+static void convert_rows_scalar(const uint8_t* row0, const uint8_t* row1, uint8_t* y0, uint8_t* y1,
+                                uint8_t* u, uint8_t* v, int x0, int width)
+{
+    int x;
+
+    for (x = x0; x < width; x += 2)
+    {
+        // The last column of an odd width is repeated
+        int x1 = x + 1 < width ? x + 1 : x;
+        const uint8_t* p00 = row0 + 4 * x;
+        const uint8_t* p01 = row0 + 4 * x1;
+        const uint8_t* p10 = row1 + 4 * x;
+        const uint8_t* p11 = row1 + 4 * x1;
+        int b, g, r;
+
+        y0[x] = RGB2Y(p00[2], p00[1], p00[0]);
+        y1[x] = RGB2Y(p10[2], p10[1], p10[0]);
+        if (x1 != x)
+        {
+            y0[x1] = RGB2Y(p01[2], p01[1], p01[0]);
+            y1[x1] = RGB2Y(p11[2], p11[1], p11[0]);
+        }
+
+        b = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+        g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+        r = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+        u[x / 2] = RGB2U(r, g, b);
+        v[x / 2] = RGB2V(r, g, b);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Coefficients of the B, G, R, X lanes of a widened pixel, for madd */
+#define COEFS_Y 25, 129, 66, 0
+#define COEFS_U 112, -74, -38, 0
+#define COEFS_V -18, -94, 112, 0
+
+/** Sum the two madd halves of each pixel: a holds pixels 0-1, b pixels 2-3 */
+static inline __m128i sse2_hsum(__m128i a, __m128i b)
+{
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+}
+
+/** Luma of 4 pixels widened in lo (pixels 0-1) and hi (pixels 2-3) */
+static inline __m128i sse2_luma(__m128i lo, __m128i hi)
+{
+    const __m128i coefs = _mm_setr_epi16(COEFS_Y, COEFS_Y);
+    __m128i sum = sse2_hsum(_mm_madd_epi16(lo, coefs), _mm_madd_epi16(hi, coefs));
+    sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+    return _mm_add_epi32(sum, _mm_set1_epi32(16));
+}
+
+/** Rounded average of the 2x2 blocks of 4 widened pixels of two rows */
+static inline __m128i sse2_blocks(__m128i lo0, __m128i hi0, __m128i lo1, __m128i hi1)
+{
+    __m128i lo = _mm_add_epi16(lo0, lo1);
+    __m128i hi = _mm_add_epi16(hi0, hi1);
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    return _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_set1_epi16(2)), 2);
+}
+
+/** Chroma of the averaged blocks a (blocks 0-1) and b (blocks 2-3) */
+static inline __m128i sse2_chroma(__m128i a, __m128i b, __m128i coefs)
+{
+    __m128i sum = sse2_hsum(_mm_madd_epi16(a, coefs), _mm_madd_epi16(b, coefs));
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+    return _mm_add_epi32(sum, _mm_set1_epi32(128));
+}
+
+static inline void store4(uint8_t* dst, __m128i packed)
+{
+    uint32_t word = _mm_cvtsi128_si32(packed);
+    memcpy(dst, &word, sizeof(word));
+}
+
+static void convert_rows_sse2(const uint8_t* row0, const uint8_t* row1, uint8_t* y0, uint8_t* y1,
+                              uint8_t* u, uint8_t* v, int x0, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i coefs_u = _mm_setr_epi16(COEFS_U, COEFS_U);
+    const __m128i coefs_v = _mm_setr_epi16(COEFS_V, COEFS_V);
+    int x;
+
+    for (x = x0; x + 8 <= width; x += 8)
+    {
+        __m128i a0 = _mm_loadu_si128((const __m128i*) (row0 + 4 * x));
+        __m128i b0 = _mm_loadu_si128((const __m128i*) (row0 + 4 * x + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i*) (row1 + 4 * x));
+        __m128i b1 = _mm_loadu_si128((const __m128i*) (row1 + 4 * x + 16));
+
+        __m128i a0l = _mm_unpacklo_epi8(a0, zero), a0h = _mm_unpackhi_epi8(a0, zero);
+        __m128i b0l = _mm_unpacklo_epi8(b0, zero), b0h = _mm_unpackhi_epi8(b0, zero);
+        __m128i a1l = _mm_unpacklo_epi8(a1, zero), a1h = _mm_unpackhi_epi8(a1, zero);
+        __m128i b1l = _mm_unpacklo_epi8(b1, zero), b1h = _mm_unpackhi_epi8(b1, zero);
+
+        __m128i l0 = _mm_packs_epi32(sse2_luma(a0l, a0h), sse2_luma(b0l, b0h));
+        __m128i l1 = _mm_packs_epi32(sse2_luma(a1l, a1h), sse2_luma(b1l, b1h));
+        _mm_storel_epi64((__m128i*) (y0 + x), _mm_packus_epi16(l0, l0));
+        _mm_storel_epi64((__m128i*) (y1 + x), _mm_packus_epi16(l1, l1));
+
+        __m128i blk_a = sse2_blocks(a0l, a0h, a1l, a1h);
+        __m128i blk_b = sse2_blocks(b0l, b0h, b1l, b1h);
+        __m128i cu = sse2_chroma(blk_a, blk_b, coefs_u);
+        __m128i cv = sse2_chroma(blk_a, blk_b, coefs_v);
+        cu = _mm_packs_epi32(cu, cu);
+        cv = _mm_packs_epi32(cv, cv);
+        store4(u + x / 2, _mm_packus_epi16(cu, cu));
+        store4(v + x / 2, _mm_packus_epi16(cv, cv));
+    }
+
+    convert_rows_scalar(row0, row1, y0, y1, u, v, x, width);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+/** Sum the two madd halves of each pixel, lane by lane */
+static inline AVX2 __m256i avx2_hsum(__m256i a, __m256i b)
+{
+    __m256 even =
+        _mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 odd =
+        _mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm256_add_epi32(_mm256_castps_si256(even), _mm256_castps_si256(odd));
+}
+
+/** Luma of 8 pixels, in order */
+static inline AVX2 __m256i avx2_luma(__m256i lo, __m256i hi)
+{
+    const __m256i coefs = _mm256_setr_epi16(COEFS_Y, COEFS_Y, COEFS_Y, COEFS_Y);
+    __m256i sum = avx2_hsum(_mm256_madd_epi16(lo, coefs), _mm256_madd_epi16(hi, coefs));
+    sum = _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8);
+    return _mm256_add_epi32(sum, _mm256_set1_epi32(16));
+}
+
+/** Rounded average of the 2x2 blocks, blocks 0-1 in the low lane and 2-3 in the high lane */
+static inline AVX2 __m256i avx2_blocks(__m256i lo0, __m256i hi0, __m256i lo1, __m256i hi1)
+{
+    __m256i lo = _mm256_add_epi16(lo0, lo1);
+    __m256i hi = _mm256_add_epi16(hi0, hi1);
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_set1_epi16(2)),
+                             2);
+}
+
+/** Chroma of 8 blocks, in order */
+static inline AVX2 __m256i avx2_chroma(__m256i a, __m256i b, __m256i coefs)
+{
+    // avx2_hsum() interleaves the lanes: blocks 0 1 4 5 | 2 3 6 7
+    const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    __m256i sum = avx2_hsum(_mm256_madd_epi16(a, coefs), _mm256_madd_epi16(b, coefs));
+    sum = _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8);
+    sum = _mm256_add_epi32(sum, _mm256_set1_epi32(128));
+    return _mm256_permutevar8x32_epi32(sum, order);
+}
+
+/** Pack 16 ordered 32-bit values, split in two vectors, to 16 bytes */
+static inline AVX2 __m128i avx2_pack16(__m256i a, __m256i b)
+{
+    // packs and packus work lane by lane: 0-3 8-11 | 4-7 12-15
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i words = _mm256_packs_epi32(a, b);
+    __m256i bytes = _mm256_packus_epi16(words, words);
+    return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bytes, order));
+}
+
+/** Pack 8 ordered 32-bit values to 8 bytes */
+static inline AVX2 __m128i avx2_pack8(__m256i a)
+{
+    __m256i words = _mm256_packs_epi32(a, a);
+    __m256i bytes = _mm256_packus_epi16(words, words);
+    return _mm_unpacklo_epi32(_mm256_castsi256_si128(bytes), _mm256_extracti128_si256(bytes, 1));
+}
+
+static AVX2 void convert_rows_avx2(const uint8_t* row0, const uint8_t* row1, uint8_t* y0,
+                                   uint8_t* y1, uint8_t* u, uint8_t* v, int x0, int width)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i coefs_u = _mm256_setr_epi16(COEFS_U, COEFS_U, COEFS_U, COEFS_U);
+    const __m256i coefs_v = _mm256_setr_epi16(COEFS_V, COEFS_V, COEFS_V, COEFS_V);
+    int x;
+
+    for (x = x0; x + 16 <= width; x += 16)
+    {
+        __m256i a0 = _mm256_loadu_si256((const __m256i*) (row0 + 4 * x));
+        __m256i b0 = _mm256_loadu_si256((const __m256i*) (row0 + 4 * x + 32));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*) (row1 + 4 * x));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*) (row1 + 4 * x + 32));
+
+        __m256i a0l = _mm256_unpacklo_epi8(a0, zero), a0h = _mm256_unpackhi_epi8(a0, zero);
+        __m256i b0l = _mm256_unpacklo_epi8(b0, zero), b0h = _mm256_unpackhi_epi8(b0, zero);
+        __m256i a1l = _mm256_unpacklo_epi8(a1, zero), a1h = _mm256_unpackhi_epi8(a1, zero);
+        __m256i b1l = _mm256_unpacklo_epi8(b1, zero), b1h = _mm256_unpackhi_epi8(b1, zero);
+
+        _mm_storeu_si128((__m128i*) (y0 + x),
+                         avx2_pack16(avx2_luma(a0l, a0h), avx2_luma(b0l, b0h)));
+        _mm_storeu_si128((__m128i*) (y1 + x),
+                         avx2_pack16(avx2_luma(a1l, a1h), avx2_luma(b1l, b1h)));
+
+        __m256i blk_a = avx2_blocks(a0l, a0h, a1l, a1h);
+        __m256i blk_b = avx2_blocks(b0l, b0h, b1l, b1h);
+        _mm_storel_epi64((__m128i*) (u + x / 2), avx2_pack8(avx2_chroma(blk_a, blk_b, coefs_u)));
+        _mm_storel_epi64((__m128i*) (v + x / 2), avx2_pack8(avx2_chroma(blk_a, blk_b, coefs_v)));
+    }
+
+    convert_rows_sse2(row0, row1, y0, y1, u, v, x, width);
+}
+
+#endif
+
+static int s_impl = YUV_IMPL_SCALAR;
+static convert_rows_fn s_convert_rows = convert_rows_scalar;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+
+static int impl_supported(int impl)
+{
+    switch (impl)
+    {
+    case YUV_IMPL_SCALAR:
+        return 1;
+#ifdef HAVE_X86_KERNELS
+    case YUV_IMPL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case YUV_IMPL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void use_impl(int impl)
+{
+    s_impl = impl;
+    switch (impl)
+    {
+#ifdef HAVE_X86_KERNELS
+    case YUV_IMPL_SSE2:
+        s_convert_rows = convert_rows_sse2;
+        break;
+    case YUV_IMPL_AVX2:
+        s_convert_rows = convert_rows_avx2;
+        break;
+#endif
+    default:
+        s_convert_rows = convert_rows_scalar;
+        break;
+    }
+}
+
+static void pick_impl(void)
+{
+    int impl = YUV_IMPL_AVX2;
+
+    __builtin_cpu_init();
+    while (!impl_supported(impl))
+        impl--;
+    use_impl(impl);
+    LOGI("Converting the frames with the %s kernel", yuv_convert_impl_name(impl));
+}
+
+void bgrx_to_i420(const uint8_t* src, int src_stride, uint8_t* const dst[3],
+                  const int dst_stride[3], int width, int height)
+{
+    int y;
+
+    pthread_once(&s_once, pick_impl);
+
+    for (y = 0; y < height; y += 2)
+    {
+        // The last row of an odd height is paired with itself
+        int y1 = y + 1 < height ? y + 1 : y;
+        s_convert_rows(src + y * src_stride, src + y1 * src_stride, dst[0] + y * dst_stride[0],
+                       dst[0] + y1 * dst_stride[0], dst[1] + (y / 2) * dst_stride[1],
+                       dst[2] + (y / 2) * dst_stride[2], 0, width);
+    }
+}
+
+void yuv_downscale_plane(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride,
+                         int dst_width, int dst_height, int shift)
+{
+    int n = 1 << shift;
+    int round = (n * n) / 2;
+    int x, y, i, j;
+
+    for (y = 0; y < dst_height; y++)
+    {
+        const uint8_t* in = src + (y << shift) * src_stride;
+        uint8_t* out = dst + y * dst_stride;
+
+        if (shift == 1)
+        {
+            // The usual half size, a plain 2x2 average the compiler vectorizes
+            for (x = 0; x < dst_width; x++)
+                out[x] = (in[2 * x] + in[2 * x + 1] + in[src_stride + 2 * x] +
+                          in[src_stride + 2 * x + 1] + 2) >> 2;
+            continue;
+        }
+
+        for (x = 0; x < dst_width; x++)
+        {
+            unsigned sum = 0;
+            for (j = 0; j < n; j++)
+                for (i = 0; i < n; i++)
+                    sum += in[j * src_stride + (x << shift) + i];
+            out[x] = (sum + round) >> (2 * shift);
+        }
+    }
+}
+
+int yuv_convert_set_impl(int impl)
+{
+    pthread_once(&s_once, pick_impl);
+    if (!impl_supported(impl))
+        return -1;
+    use_impl(impl);
+    return 0;
+}
+
+int yuv_convert_get_impl(void)
+{
+    pthread_once(&s_once, pick_impl);
+    return s_impl;
+}
+
+const char* yuv_convert_impl_name(int impl)
+{
+    switch (impl)
+    {
+    case YUV_IMPL_SSE2:
+        return "sse2";
+    case YUV_IMPL_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
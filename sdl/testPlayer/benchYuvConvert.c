@@ -0,0 +1,80 @@
+/**
+ * \file benchYuvConvert.c
+ * \brief Throughput of the BGRX to I420 kernels
+ *
+ * Usage: benchYuvConvert [width height [frames]]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+#include "yuv_convert.h"
+
+#define LOG_TAG "benchYuvConvert"
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    int width = 1920;
+    int height = 1080;
+    int frames = 200;
+    int impl, i;
+
+    init_logger();
+
+    if (argc >= 3)
+    {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        frames = atoi(argv[3]);
+
+    int stride = 4 * width;
+    int strides[3] = {width, (width + 1) / 2, (width + 1) / 2};
+    uint8_t* bgrx = malloc(stride * height);
+    uint8_t* planes[3] = {malloc(strides[0] * height), malloc(strides[1] * ((height + 1) / 2)),
+                          malloc(strides[2] * ((height + 1) / 2))};
+    if (!bgrx || !planes[0] || !planes[1] || !planes[2])
+        LOGE("Cannot allocate memory");
+
+    for (i = 0; i < stride * height; i++)
+        bgrx[i] = rand() & 0xFF;
+
+    for (impl = YUV_IMPL_SCALAR; impl <= YUV_IMPL_AVX2; impl++)
+    {
+        double start, elapsed;
+
+        if (yuv_convert_set_impl(impl) < 0)
+        {
+            LOGI("%-6s not supported", yuv_convert_impl_name(impl));
+            continue;
+        }
+
+        // Warm the caches and the page tables up
+        bgrx_to_i420(bgrx, stride, planes, strides, width, height);
+
+        start = now_s();
+        for (i = 0; i < frames; i++)
+            bgrx_to_i420(bgrx, stride, planes, strides, width, height);
+        elapsed = now_s() - start;
+
+        LOGI("%-6s %dx%d: %.3f ms/frame, %.1f Mpixels/s", yuv_convert_impl_name(impl), width,
+             height, elapsed * 1e3 / frames, (double) width * height * frames / elapsed / 1e6);
+    }
+
+    free(bgrx);
+    free(planes[0]);
+    free(planes[1]);
+    free(planes[2]);
+    return 0;
+}
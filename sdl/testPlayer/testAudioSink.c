@@ -0,0 +1,241 @@
+/**
+ * \file testAudioSink.c
+ * \brief Samples written by the raw PCM and file audio sinks
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <google/cmockery.h>
+
+#include <libavformat/avformat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "audio_pipeline.h"
+#include "audio_sink.h"
+#include "logger.h"
+
+#define LOG_TAG "testAudioSink"
+
+/** 10 ms of samples of the VM */
+#define PERIOD_SIZE (AUDIO_IN_RATE / 100 * AUDIO_BLOCK_ALIGN)
+#define PERIODS 100
+
+/** The right channel of a sample is its left one with these bits flipped */
+#define RIGHT_XOR 0x5555
+
+static uint8_t s_samples[PERIODS * PERIOD_SIZE];
+
+static void fill_samples(void)
+{
+    int16_t* s = (int16_t*) s_samples;
+    int i;
+
+    for (i = 0; i < (int) (sizeof(s_samples) / AUDIO_BLOCK_ALIGN); i++)
+    {
+        s[2 * i] = (int16_t) (i * 37);
+        s[2 * i + 1] = s[2 * i] ^ RIGHT_XOR;
+    }
+}
+
+/* Listen on a Unix domain socket of the test. */
+static int listen_pcm(struct sockaddr_un* addr)
+{
+    int server;
+
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/testAudioSink-%d.sock", getpid());
+    unlink(addr->sun_path);
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(server >= 0);
+    assert_int_equal(bind(server, (struct sockaddr*) addr, sizeof(*addr)), 0);
+    assert_int_equal(listen(server, 1), 0);
+    return server;
+}
+
+/* Read what a reader has waiting, without blocking. */
+static int drain(int reader, uint8_t* buffer, int size)
+{
+    int total = 0;
+    int n;
+
+    while (total < size && (n = recv(reader, buffer + total, size - total, MSG_DONTWAIT)) > 0)
+        total += n;
+    return total;
+}
+
+static struct audio_sink* open_sink(int type, const char* url)
+{
+    struct audio_sink_config config = {
+        .type = type,
+        .url = url,
+        .codec = NULL,
+        .bitrate = AUDIO_SINK_BITRATE,
+        .frame_ms = AUDIO_SINK_FRAME_MS,
+        .sdp_file = NULL,
+    };
+    struct audio_sink* sink = audio_sink_open(&config);
+
+    assert_true(sink != NULL);
+    return sink;
+}
+
+void test_sink_names(void** state)
+{
+    int type;
+
+    (void) state;
+    for (type = AUDIO_SINK_FFM; type <= AUDIO_SINK_FILE; type++)
+        assert_int_equal(audio_sink_from_name(audio_sink_name(type)), type);
+    assert_int_equal(audio_sink_from_name("RTP"), AUDIO_SINK_RTP);
+    assert_int_equal(audio_sink_from_name("vorbis"), -1);
+}
+
+void test_sink_pcm(void** state)
+{
+    struct sockaddr_un addr;
+    struct audio_sink* sink;
+    uint8_t* received = malloc(sizeof(s_samples));
+    int server, reader;
+    int size = 0;
+    int n;
+    int i;
+
+    (void) state;
+    server = listen_pcm(&addr);
+
+    /* The samples are sent as is, whether the reader is reading yet or not */
+    sink = open_sink(AUDIO_SINK_PCM, addr.sun_path);
+    reader = accept(server, NULL, NULL);
+    assert_true(reader >= 0);
+    for (i = 0; i < 10; i++)
+        assert_int_equal(audio_sink_write(sink, s_samples + i * PERIOD_SIZE, PERIOD_SIZE), 0);
+    while (size < 10 * PERIOD_SIZE)
+    {
+        n = recv(reader, received + size, 10 * PERIOD_SIZE - size, 0);
+        if (n <= 0)
+            break;
+        size += n;
+    }
+    assert_int_equal(size, 10 * PERIOD_SIZE);
+    assert_memory_equal(received, s_samples, size);
+
+    /* When the reader leaves, the samples are dropped */
+    close(reader);
+    for (i = 0; i < 10; i++)
+        assert_int_equal(audio_sink_write(sink, s_samples, PERIOD_SIZE), 0);
+    assert_int_equal(audio_sink_close(sink), 0);
+
+    close(server);
+    unlink(addr.sun_path);
+    free(received);
+}
+
+void test_sink_pcm_late_reader(void** state)
+{
+    struct sockaddr_un addr;
+    struct audio_sink* sink;
+    int16_t* s;
+    /* Larger than what the socket holds */
+    int capacity = 20 * sizeof(s_samples);
+    uint8_t* received = malloc(capacity);
+    int server, reader;
+    int size;
+    int i, j;
+
+    (void) state;
+    server = listen_pcm(&addr);
+    sink = open_sink(AUDIO_SINK_PCM, addr.sun_path);
+    reader = accept(server, NULL, NULL);
+    assert_true(reader >= 0);
+
+    /* The reader stops reading: the socket fills up, and the writes never wait for it */
+    for (j = 0; j < 20; j++)
+        for (i = 0; i < PERIODS; i++)
+            assert_int_equal(audio_sink_write(sink, s_samples + i * PERIOD_SIZE, PERIOD_SIZE), 0);
+
+    /* Once it reads again, it only gets whole samples, even across a partial send */
+    for (j = 0; j < 20; j++)
+    {
+        size = drain(reader, received, capacity);
+        assert_int_equal(audio_sink_write(sink, s_samples, PERIOD_SIZE), 0);
+        size += drain(reader, received + size, capacity - size);
+        assert_true(size > 0);
+        assert_int_equal(size % AUDIO_BLOCK_ALIGN, 0);
+        s = (int16_t*) received;
+        for (i = 0; i < size / AUDIO_BLOCK_ALIGN; i++)
+            assert_int_equal(s[2 * i + 1], (int16_t) (s[2 * i] ^ RIGHT_XOR));
+    }
+    assert_int_equal(audio_sink_close(sink), 0);
+
+    close(reader);
+    close(server);
+    unlink(addr.sun_path);
+    free(received);
+}
+
+void test_sink_file(void** state)
+{
+    char filename[64];
+    struct audio_sink* sink;
+    AVFormatContext* ic = NULL;
+    AVCodecContext* c;
+    AVPacket pkt;
+    uint8_t* received = malloc(sizeof(s_samples));
+    int size = 0;
+    int i;
+
+    (void) state;
+    snprintf(filename, sizeof(filename), "/tmp/testAudioSink-%d.wav", getpid());
+
+    /* 1 s in periods of 10 ms, flushed when the sink is closed */
+    sink = open_sink(AUDIO_SINK_FILE, filename);
+    for (i = 0; i < PERIODS; i++)
+        assert_int_equal(audio_sink_write(sink, s_samples + i * PERIOD_SIZE, PERIOD_SIZE), 0);
+    assert_int_equal(audio_sink_close(sink), 0);
+
+    assert_int_equal(avformat_open_input(&ic, filename, NULL, NULL), 0);
+    assert_true(avformat_find_stream_info(ic, NULL) >= 0);
+    assert_int_equal(ic->nb_streams, 1);
+    c = ic->streams[0]->codec;
+    assert_int_equal(c->codec_id, AV_CODEC_ID_PCM_S16LE);
+    assert_int_equal(c->sample_rate, AUDIO_IN_RATE);
+    assert_int_equal(c->channels, AUDIO_IN_CHANNELS);
+
+    while (av_read_frame(ic, &pkt) >= 0)
+    {
+        assert_true(size + pkt.size <= (int) sizeof(s_samples));
+        memcpy(received + size, pkt.data, pkt.size);
+        size += pkt.size;
+        av_free_packet(&pkt);
+    }
+    assert_int_equal(size, sizeof(s_samples));
+    assert_memory_equal(received, s_samples, size);
+
+    avformat_close_input(&ic);
+    unlink(filename);
+    free(received);
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+    init_logger();
+    av_register_all();
+    fill_samples();
+
+    UnitTest tests[] = {
+        unit_test(test_sink_names),
+        unit_test(test_sink_pcm),
+        unit_test(test_sink_pcm_late_reader),
+        unit_test(test_sink_file),
+    };
+
+    return run_tests(tests);
+}
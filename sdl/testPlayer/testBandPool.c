@@ -0,0 +1,113 @@
+/**
+ * \file testBandPool.c
+ * \brief Coverage and alignment of the bands processed by the band pools
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <google/cmockery.h>
+
+#include <string.h>
+
+#include "band_pool.h"
+#include "logger.h"
+
+#define LOG_TAG "testBandPool"
+
+/** Jobs run by the repeated tests */
+#define JOBS 2000
+#define MAX_ROWS 1088
+
+struct job
+{
+    /** Number of times each row was processed */
+    int hits[MAX_ROWS];
+    int align;
+    int misaligned;
+};
+
+static void count_rows(void* arg, int y0, int y1)
+{
+    struct job* job = arg;
+    int y;
+
+    if (y0 % job->align || y0 >= y1)
+        __atomic_add_fetch(&job->misaligned, 1, __ATOMIC_RELAXED);
+    for (y = y0; y < y1; y++)
+        job->hits[y]++;
+}
+
+static void check_job(struct band_pool* pool, int rows, int align)
+{
+    struct job job;
+    int y;
+
+    memset(&job, 0, sizeof(job));
+    job.align = align;
+    band_pool_run(pool, count_rows, &job, rows, align);
+
+    assert_int_equal(job.misaligned, 0);
+    for (y = 0; y < rows; y++)
+        assert_int_equal(job.hits[y], 1);
+}
+
+void test_bands_cover_rows(void** state)
+{
+    int threads;
+    struct band_pool* pool;
+
+    (void) state;
+    for (threads = 1; threads <= 8; threads++)
+    {
+        pool = band_pool_new(threads);
+        assert_true(pool != NULL);
+        assert_int_equal(band_pool_threads(pool), threads);
+
+        check_job(pool, 720, 2);
+        check_job(pool, 1080, 16);
+        check_job(pool, 7, 2);
+        check_job(pool, 1, 1);
+        check_job(pool, 0, 1);
+        band_pool_free(pool);
+    }
+}
+
+void test_bands_repeated(void** state)
+{
+    struct band_pool* pool = band_pool_new(4);
+    int i;
+
+    (void) state;
+    assert_true(pool != NULL);
+    for (i = 0; i < JOBS; i++)
+        check_job(pool, 64 + i % 64, 2);
+    band_pool_free(pool);
+}
+
+void test_bands_default(void** state)
+{
+    struct band_pool* pool = band_pool_new(0);
+
+    (void) state;
+    assert_true(pool != NULL);
+    assert_true(band_pool_threads(pool) >= 1);
+    assert_true(band_pool_threads(pool) <= BAND_POOL_DEFAULT_MAX);
+    check_job(pool, MAX_ROWS, 2);
+    band_pool_free(pool);
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+    init_logger();
+
+    UnitTest tests[] = {
+        unit_test(test_bands_cover_rows),
+        unit_test(test_bands_repeated),
+        unit_test(test_bands_default),
+    };
+
+    return run_tests(tests);
+}
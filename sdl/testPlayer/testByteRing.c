@@ -0,0 +1,172 @@
+/**
+ * \file testByteRing.c
+ * \brief Ordering, drops and counters of the byte rings, with one producer and one consumer
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <google/cmockery.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "byte_ring.h"
+#include "logger.h"
+
+#define LOG_TAG "testByteRing"
+
+/** Bytes sent through the ring by the threaded test */
+#define STREAM_BYTES (4 * 1024 * 1024)
+#define RING_SIZE 1000
+#define MAX_WRITE 97
+
+static struct byte_ring* new_ring(int capacity)
+{
+    struct byte_ring* ring = byte_ring_new(capacity);
+    assert_true(ring != NULL);
+    return ring;
+}
+
+void test_byte_ring_wrap(void** state)
+{
+    struct byte_ring* ring = new_ring(10);
+    uint8_t in[7] = {1, 2, 3, 4, 5, 6, 7};
+    uint8_t out[10];
+    int i;
+
+    (void) state;
+    assert_int_equal(byte_ring_read(ring, out, sizeof(out)), 0);
+    for (i = 0; i < 5; i++)
+    {
+        /* Every write after the first one wraps around the end of the ring */
+        assert_int_equal(byte_ring_write(ring, in, sizeof(in)), 0);
+        assert_int_equal(byte_ring_read(ring, out, 3), 3);
+        assert_memory_equal(out, in, 3);
+        assert_int_equal(byte_ring_read(ring, out, sizeof(out)), 4);
+        assert_memory_equal(out, in + 3, 4);
+    }
+    byte_ring_free(ring);
+}
+
+void test_byte_ring_full(void** state)
+{
+    struct byte_ring* ring = new_ring(10);
+    struct byte_ring_stats stats;
+    uint8_t in[6] = {1, 2, 3, 4, 5, 6};
+    uint8_t out[10];
+
+    (void) state;
+    assert_int_equal(byte_ring_write(ring, in, 6), 0);
+    /* A write that does not fit is dropped as a whole */
+    assert_int_equal(byte_ring_write(ring, in, 6), -1);
+    assert_int_equal(byte_ring_write(ring, in, 4), 0);
+    assert_int_equal(byte_ring_write(ring, in, 1), -1);
+
+    byte_ring_stats(ring, &stats);
+    assert_int_equal(stats.capacity, 10);
+    assert_int_equal(stats.level, 10);
+    assert_int_equal(stats.high_water, 10);
+    assert_int_equal(stats.written_bytes, 10);
+    assert_int_equal(stats.drops, 2);
+    assert_int_equal(stats.dropped_bytes, 7);
+
+    assert_int_equal(byte_ring_read(ring, out, sizeof(out)), 10);
+    assert_memory_equal(out, in, 6);
+    assert_memory_equal(out + 6, in, 4);
+    byte_ring_stats(ring, &stats);
+    assert_int_equal(stats.level, 0);
+    assert_int_equal(stats.high_water, 10);
+    byte_ring_free(ring);
+}
+
+void test_byte_ring_eof(void** state)
+{
+    struct byte_ring* ring = new_ring(10);
+    uint8_t in[4] = {1, 2, 3, 4};
+    uint8_t out[4];
+
+    (void) state;
+    assert_int_equal(byte_ring_eof(ring), 0);
+    byte_ring_write(ring, in, 4);
+    byte_ring_close(ring);
+    /* The bytes written before the close are still read */
+    assert_int_equal(byte_ring_eof(ring), 0);
+    assert_int_equal(byte_ring_read(ring, out, 4), 4);
+    assert_int_equal(byte_ring_eof(ring), 1);
+    byte_ring_free(ring);
+}
+
+/* Write the bytes 0, 1, 2... in chunks of every size, retrying the dropped ones. */
+static void* produce(void* arg)
+{
+    struct byte_ring* ring = arg;
+    uint8_t chunk[MAX_WRITE];
+    int sent = 0;
+    int size = 1;
+    int i;
+
+    while (sent < STREAM_BYTES)
+    {
+        if (size > STREAM_BYTES - sent)
+            size = STREAM_BYTES - sent;
+        for (i = 0; i < size; i++)
+            chunk[i] = (uint8_t) (sent + i);
+        while (byte_ring_write(ring, chunk, size) < 0)
+            sched_yield();
+        sent += size;
+        size = size % MAX_WRITE + 1;
+    }
+    byte_ring_close(ring);
+    return NULL;
+}
+
+void test_byte_ring_threads(void** state)
+{
+    struct byte_ring* ring = new_ring(RING_SIZE);
+    struct byte_ring_stats stats;
+    pthread_t producer;
+    uint8_t out[64];
+    int received = 0;
+    int errors = 0;
+    int n;
+    int i;
+
+    (void) state;
+    assert_int_equal(pthread_create(&producer, NULL, produce, ring), 0);
+    while (!byte_ring_eof(ring))
+    {
+        n = byte_ring_read(ring, out, sizeof(out));
+        if (!n)
+            sched_yield();
+        for (i = 0; i < n; i++)
+            errors += out[i] != (uint8_t) (received + i);
+        received += n;
+    }
+    pthread_join(producer, NULL);
+
+    assert_int_equal(errors, 0);
+    assert_int_equal(received, STREAM_BYTES);
+    byte_ring_stats(ring, &stats);
+    assert_int_equal(stats.written_bytes, STREAM_BYTES);
+    assert_true(stats.high_water <= RING_SIZE);
+    byte_ring_free(ring);
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+    init_logger();
+
+    UnitTest tests[] = {
+        unit_test(test_byte_ring_wrap),
+        unit_test(test_byte_ring_full),
+        unit_test(test_byte_ring_eof),
+        unit_test(test_byte_ring_threads),
+    };
+
+    return run_tests(tests);
+}
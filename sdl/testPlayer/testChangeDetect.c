@@ -0,0 +1,218 @@
+/**
+ * \file testChangeDetect.c
+ * \brief Tile hash and XDamage detection of the changes between two captures
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <google/cmockery.h>
+
+#include <X11/Xlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "change_detect.h"
+#include "logger.h"
+
+#define LOG_TAG "testChangeDetect"
+
+/** Not a multiple of CHANGE_TILE, to cover the partial tiles */
+#define WIDTH 200
+#define HEIGHT 130
+#define STRIDE (4 * WIDTH + 16)
+
+static void init_image(XImage* image, uint8_t* data)
+{
+    memset(image, 0, sizeof(*image));
+    image->width = WIDTH;
+    image->height = HEIGHT;
+    image->bits_per_pixel = 32;
+    image->bytes_per_line = STRIDE;
+    image->data = (char*) data;
+}
+
+static void set_pixel(uint8_t* data, int x, int y, uint32_t value)
+{
+    memcpy(data + y * STRIDE + 4 * x, &value, sizeof(value));
+}
+
+void test_change_hash(void** state)
+{
+    static uint8_t data[STRIDE * HEIGHT];
+    struct change_detect cd;
+    XImage image;
+
+    (void) state;
+    init_image(&image, data);
+    assert_int_equal(change_detect_init(&cd, CHANGE_HASH, NULL, 0, WIDTH, HEIGHT), 0);
+    assert_int_equal(cd.tiles_x, 4);
+    assert_int_equal(cd.tiles_y, 3);
+
+    // The first capture is always a change
+    assert_true(change_detect_image(&cd, &image));
+    assert_true(change_detect_pending(&cd));
+    assert_true(!change_detect_image(&cd, &image));
+
+    set_pixel(data, 10, 10, 0xFFFFFF);
+    assert_true(change_detect_image(&cd, &image));
+    assert_int_equal(cd.changed_tiles, 1);
+    assert_true(!change_detect_image(&cd, &image));
+
+    // Last pixel, in the partial tile of the bottom right corner
+    set_pixel(data, WIDTH - 1, HEIGHT - 1, 0x123456);
+    set_pixel(data, CHANGE_TILE, 0, 0x010000);
+    assert_true(change_detect_image(&cd, &image));
+    assert_int_equal(cd.changed_tiles, 2);
+
+    // Padding bytes after the rows are not part of the window
+    data[STRIDE - 1] ^= 0xFF;
+    assert_true(!change_detect_image(&cd, &image));
+
+    // Back to the previous contents
+    set_pixel(data, 10, 10, 0);
+    assert_true(change_detect_image(&cd, &image));
+    assert_int_equal(cd.changed_tiles, 1);
+
+    change_detect_destroy(&cd);
+}
+
+#ifdef HAVE_XDAMAGE
+#define DAMAGE_EVENT_BASE 90
+#define MAX_EVENTS 8
+
+/* Fake X server: a queue of events shared by every detector, as the Display of the grabber */
+static XEvent s_events[MAX_EVENTS];
+static int s_event_count;
+static Damage s_last_damage;
+static int s_subtracted[MAX_EVENTS];
+
+Bool XDamageQueryExtension(Display* display, int* event_base, int* error_base)
+{
+    (void) display;
+    *event_base = DAMAGE_EVENT_BASE;
+    *error_base = 0;
+    return True;
+}
+
+Damage XDamageCreate(Display* display, Drawable drawable, int level)
+{
+    (void) display;
+    (void) drawable;
+    (void) level;
+    return ++s_last_damage;
+}
+
+void XDamageSubtract(Display* display, Damage damage, XserverRegion repair, XserverRegion parts)
+{
+    (void) display;
+    (void) repair;
+    (void) parts;
+    s_subtracted[damage]++;
+}
+
+void XDamageDestroy(Display* display, Damage damage)
+{
+    (void) display;
+    (void) damage;
+}
+
+int XCheckIfEvent(Display* display, XEvent* event, Bool (*predicate)(Display*, XEvent*, XPointer),
+                  XPointer arg)
+{
+    int i;
+
+    for (i = 0; i < s_event_count; i++)
+    {
+        if (predicate(display, &s_events[i], arg))
+        {
+            *event = s_events[i];
+            memmove(&s_events[i], &s_events[i + 1], (s_event_count - i - 1) * sizeof(XEvent));
+            s_event_count--;
+            return True;
+        }
+    }
+    return False;
+}
+
+static void queue_event(int type, Damage damage)
+{
+    XDamageNotifyEvent* notify = (XDamageNotifyEvent*) &s_events[s_event_count++];
+
+    memset(notify, 0, sizeof(XEvent));
+    notify->type = type;
+    notify->damage = damage;
+}
+
+void test_change_damage(void** state)
+{
+    struct change_detect replay, stream;
+
+    (void) state;
+    assert_int_equal(change_detect_init(&replay, CHANGE_DAMAGE, NULL, 1, WIDTH, HEIGHT), 0);
+    assert_int_equal(change_detect_init(&stream, CHANGE_DAMAGE, NULL, 1, WIDTH, HEIGHT), 0);
+    assert_int_equal(replay.mode, CHANGE_DAMAGE);
+    assert_true(replay.damage != stream.damage);
+
+    // The first capture is always a change
+    assert_true(change_detect_pending(&replay));
+    assert_true(change_detect_pending(&stream));
+    assert_true(!change_detect_pending(&replay));
+
+    // Each recording only takes the notifications of its own damage
+    queue_event(DAMAGE_EVENT_BASE + XDamageNotify, stream.damage);
+    queue_event(KeyPress, replay.damage);
+    queue_event(DAMAGE_EVENT_BASE + XDamageNotify, replay.damage);
+    queue_event(DAMAGE_EVENT_BASE + XDamageNotify, replay.damage);
+    assert_true(change_detect_pending(&replay));
+    assert_int_equal(s_event_count, 2);
+    assert_int_equal(s_subtracted[replay.damage], 2);
+    assert_int_equal(s_subtracted[stream.damage], 1);
+
+    assert_true(change_detect_pending(&stream));
+    assert_int_equal(s_event_count, 1);
+    assert_int_equal(s_events[0].type, KeyPress);
+    assert_int_equal(s_subtracted[stream.damage], 2);
+
+    assert_true(!change_detect_pending(&replay));
+    assert_true(!change_detect_pending(&stream));
+
+    change_detect_destroy(&replay);
+    change_detect_destroy(&stream);
+}
+#endif
+
+void test_change_none(void** state)
+{
+    static uint8_t data[STRIDE * HEIGHT];
+    struct change_detect cd;
+    XImage image;
+
+    (void) state;
+    init_image(&image, data);
+    assert_int_equal(change_detect_init(&cd, CHANGE_NONE, NULL, 0, WIDTH, HEIGHT), 0);
+    assert_true(change_detect_pending(&cd));
+    assert_true(change_detect_image(&cd, &image));
+    assert_true(change_detect_image(&cd, &image));
+    change_detect_destroy(&cd);
+
+    assert_int_equal(change_mode_from_name("damage"), CHANGE_DAMAGE);
+    assert_int_equal(change_mode_from_name("bogus"), -1);
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+    init_logger();
+
+    UnitTest tests[] = {
+        unit_test(test_change_hash),
+#ifdef HAVE_XDAMAGE
+        unit_test(test_change_damage),
+#endif
+        unit_test(test_change_none),
+    };
+
+    return run_tests(tests);
+}
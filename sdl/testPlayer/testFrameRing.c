@@ -0,0 +1,236 @@
+/**
+ * \file testFrameRing.c
+ * \brief Ordering, drop and close semantics of the recorder frame rings, and their buffer pools
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <google/cmockery.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frame_ring.h"
+#include "logger.h"
+
+#define LOG_TAG "testFrameRing"
+
+/** Frames sent through the ring by the threaded tests */
+#define STREAM_FRAMES 20000
+/** Frames an encoder keeps a reference to, like a frame-threaded encoder */
+#define ENCODER_DELAY 3
+
+static struct frame_ring* new_ring(int size, int policy)
+{
+    struct frame_ring* ring = frame_ring_new("test", size, policy, AV_PIX_FMT_GRAY8, 16, 16);
+    assert_true(ring != NULL);
+    return ring;
+}
+
+void test_ring_order(void** state)
+{
+    struct frame_ring* ring = new_ring(4, FRAME_RING_BLOCK);
+    AVFrame* frame;
+    int i;
+
+    (void) state;
+    for (i = 0; i < 3; i++)
+    {
+        frame = frame_ring_acquire(ring);
+        assert_true(frame != NULL);
+        frame->pts = i;
+        frame_ring_publish(ring, frame);
+    }
+    for (i = 0; i < 3; i++)
+    {
+        frame = frame_ring_pop(ring);
+        assert_true(frame != NULL);
+        assert_int_equal(frame->pts, i);
+        frame_ring_release(ring, frame);
+    }
+
+    frame_ring_close(ring);
+    assert_true(frame_ring_pop(ring) == NULL);
+    assert_true(frame_ring_pop(ring) == NULL);
+    assert_true(frame_ring_acquire(ring) == NULL);
+    assert_int_equal(frame_ring_dropped(ring), 0);
+    frame_ring_free(ring);
+}
+
+void test_ring_drop_oldest(void** state)
+{
+    struct frame_ring* ring = new_ring(3, FRAME_RING_DROP_OLDEST);
+    AVFrame* frame;
+    int i;
+
+    (void) state;
+    // Nobody consumes: the producer keeps reusing the oldest frames
+    for (i = 0; i < 10; i++)
+    {
+        frame = frame_ring_acquire(ring);
+        assert_true(frame != NULL);
+        frame->pts = i;
+        frame_ring_publish(ring, frame);
+    }
+    assert_int_equal(frame_ring_dropped(ring), 7);
+
+    frame_ring_close(ring);
+    for (i = 7; i < 10; i++)
+    {
+        frame = frame_ring_pop(ring);
+        assert_true(frame != NULL);
+        assert_int_equal(frame->pts, i);
+        frame_ring_release(ring, frame);
+    }
+    assert_true(frame_ring_pop(ring) == NULL);
+    frame_ring_free(ring);
+}
+
+void test_ring_encoder_refs(void** state)
+{
+    struct frame_ring* ring = new_ring(4, FRAME_RING_BLOCK);
+    AVFrame* held[ENCODER_DELAY];
+    AVFrame* frame;
+    uint64_t warm = 0;
+    int i;
+
+    (void) state;
+    for (i = 0; i < ENCODER_DELAY; i++)
+    {
+        held[i] = av_frame_alloc();
+        assert_true(held[i] != NULL);
+    }
+    assert_int_equal(frame_ring_allocations(ring), 4);
+
+    for (i = 0; i < 1000; i++)
+    {
+        frame = frame_ring_acquire(ring);
+        assert_int_equal(frame_ring_make_writable(ring, frame), 0);
+        assert_true(av_frame_is_writable(frame));
+        frame->data[0][0] = i & 0xFF;
+        frame->pts = i;
+        frame_ring_publish(ring, frame);
+
+        // The encoder references the frame, and drops the reference of an older one
+        frame = frame_ring_pop(ring);
+        av_frame_unref(held[i % ENCODER_DELAY]);
+        assert_int_equal(av_frame_ref(held[i % ENCODER_DELAY], frame), 0);
+        frame_ring_release(ring, frame);
+
+        if (i == 2 * ENCODER_DELAY)
+            warm = frame_ring_allocations(ring);
+        // No frame overwrites a buffer the encoder still reads
+        if (i >= ENCODER_DELAY - 1)
+            assert_int_equal(held[(i + 1) % ENCODER_DELAY]->data[0][0],
+                             (i + 1 - ENCODER_DELAY) & 0xFF);
+    }
+    // Once the pool holds the buffers in flight, nothing is allocated anymore
+    assert_int_equal(frame_ring_allocations(ring), warm);
+    assert_true(warm <= 4 + ENCODER_DELAY);
+    assert_true(frame_ring_total_allocations() >= warm);
+
+    for (i = 0; i < ENCODER_DELAY; i++)
+        av_frame_free(&held[i]);
+    frame_ring_free(ring);
+}
+
+void test_ring_resize(void** state)
+{
+    struct frame_ring* ring = new_ring(2, FRAME_RING_BLOCK);
+    AVFrame* old = av_frame_alloc();
+    AVFrame* frame;
+
+    (void) state;
+    frame = frame_ring_acquire(ring);
+    assert_int_equal(frame_ring_make_writable(ring, frame), 0);
+    frame->data[0][0] = 42;
+    assert_int_equal(av_frame_ref(old, frame), 0);
+
+    // The frames get buffers of the new size, the old ones stay valid while referenced
+    assert_int_equal(frame_ring_resize(ring, 32, 8), 0);
+    assert_int_equal(frame_ring_make_writable(ring, frame), 0);
+    assert_int_equal(frame->width, 32);
+    assert_int_equal(frame->height, 8);
+    assert_true(frame->data[0] != old->data[0]);
+    memset(frame->data[0], 0, 32);
+    assert_int_equal(old->data[0][0], 42);
+    frame_ring_release(ring, frame);
+
+    av_frame_free(&old);
+    frame_ring_free(ring);
+}
+
+static void* produce(void* arg)
+{
+    struct frame_ring* ring = arg;
+    int i;
+
+    for (i = 0; i < STREAM_FRAMES; i++)
+    {
+        AVFrame* frame = frame_ring_acquire(ring);
+        frame->pts = i;
+        frame->data[0][0] = i & 0xFF;
+        frame_ring_publish(ring, frame);
+    }
+    frame_ring_close(ring);
+    return NULL;
+}
+
+static void check_stream(int policy)
+{
+    struct frame_ring* ring = new_ring(4, policy);
+    pthread_t producer;
+    AVFrame* frame;
+    int64_t last = -1;
+    int received = 0;
+
+    assert_int_equal(pthread_create(&producer, NULL, produce, ring), 0);
+    while ((frame = frame_ring_pop(ring)))
+    {
+        // Frames arrive in order, and nobody writes to a frame held by the consumer
+        assert_true(frame->pts > last);
+        assert_int_equal(frame->data[0][0], frame->pts & 0xFF);
+        last = frame->pts;
+        received++;
+        frame_ring_release(ring, frame);
+    }
+    pthread_join(producer, NULL);
+
+    assert_int_equal(last, STREAM_FRAMES - 1);
+    assert_int_equal(received + frame_ring_dropped(ring), STREAM_FRAMES);
+    if (policy == FRAME_RING_BLOCK)
+        assert_int_equal(received, STREAM_FRAMES);
+    frame_ring_free(ring);
+}
+
+void test_ring_threads_block(void** state)
+{
+    (void) state;
+    check_stream(FRAME_RING_BLOCK);
+}
+
+void test_ring_threads_drop(void** state)
+{
+    (void) state;
+    check_stream(FRAME_RING_DROP_OLDEST);
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+    init_logger();
+
+    UnitTest tests[] = {
+        unit_test(test_ring_order),
+        unit_test(test_ring_drop_oldest),
+        unit_test(test_ring_threads_block),
+        unit_test(test_ring_threads_drop),
+        unit_test(test_ring_encoder_refs),
+        unit_test(test_ring_resize),
+    };
+
+    return run_tests(tests);
+}
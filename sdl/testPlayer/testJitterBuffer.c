@@ -0,0 +1,267 @@
+/**
+ * \file testJitterBuffer.c
+ * \brief Buffering, concealment, trimming, draining and adaptive target of the jitter buffers
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <google/cmockery.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "jitter_buffer.h"
+#include "logger.h"
+
+#define LOG_TAG "testJitterBuffer"
+
+/** 1 kHz mono 16 bits: 2 bytes per ms */
+#define RATE 1000
+#define ALIGN 2
+#define MS(ms) ((ms) * 2)
+#define TARGET 60
+#define MAX 250
+#define PERIOD MS(10)
+#define MAX_WRITE MS(200)
+
+/* Write ms milliseconds of samples numbered from *seq. */
+static void write_ms(struct jitter_buffer* jb, int ms, uint16_t* seq)
+{
+    uint16_t samples[MAX_WRITE / ALIGN];
+    int i;
+
+    for (i = 0; i < ms; i++)
+        samples[i] = (*seq)++;
+    jitter_buffer_write(jb, (uint8_t*) samples, MS(ms));
+}
+
+/* Read one period, check that the samples follow *seq, return the number of real samples. */
+static int read_period(struct jitter_buffer* jb, uint16_t* seq)
+{
+    uint16_t samples[PERIOD / ALIGN];
+    int real;
+    int i;
+
+    if (!jitter_buffer_read(jb, (uint8_t*) samples, PERIOD))
+        return -1;
+    for (i = 0; i < PERIOD / ALIGN && samples[i]; i++)
+        assert_int_equal(samples[i], (*seq)++);
+    real = i;
+    for (; i < PERIOD / ALIGN; i++)
+        assert_int_equal(samples[i], 0);
+    return real;
+}
+
+static struct jitter_buffer* new_buffer(void)
+{
+    struct jitter_buffer* jb = jitter_buffer_new(RATE, ALIGN, TARGET, MAX, MAX_WRITE);
+
+    assert_true(jb != NULL);
+    return jb;
+}
+
+void test_jitter_prebuffer(void** state)
+{
+    struct jitter_buffer* jb = new_buffer();
+    struct jitter_stats stats;
+    uint16_t in = 1, out = 1;
+
+    (void) state;
+    /* Nothing is played before the target is buffered */
+    write_ms(jb, TARGET - 10, &in);
+    assert_int_equal(read_period(jb, &out), -1);
+    write_ms(jb, 10, &in);
+    assert_int_equal(read_period(jb, &out), PERIOD / ALIGN);
+
+    /* Then the samples come out in order, one period per read */
+    while (in - out >= 10)
+        assert_int_equal(read_period(jb, &out), PERIOD / ALIGN);
+    jitter_buffer_stats(jb, &stats);
+    assert_int_equal(stats.underruns, 0);
+    assert_int_equal(stats.overruns, 0);
+    assert_int_equal(stats.level_ms, 0);
+    assert_int_equal(stats.target_ms, TARGET);
+    jitter_buffer_free(jb);
+}
+
+void test_jitter_split_samples(void** state)
+{
+    struct jitter_buffer* jb = new_buffer();
+    uint16_t samples[TARGET + 10];
+    uint8_t* bytes = (uint8_t*) samples;
+    uint16_t out = 1;
+    int i;
+
+    (void) state;
+    for (i = 0; i < TARGET + 10; i++)
+        samples[i] = i + 1;
+
+    /* Chunks of an odd size split the samples in two */
+    for (i = 0; i + 3 < MS(TARGET); i += 3)
+        jitter_buffer_write(jb, bytes + i, 3);
+    assert_int_equal(read_period(jb, &out), -1);
+    jitter_buffer_write(jb, bytes + i, MS(TARGET + 10) - i);
+    while (out <= TARGET + 10)
+        assert_int_equal(read_period(jb, &out), PERIOD / ALIGN);
+    jitter_buffer_free(jb);
+}
+
+void test_jitter_drain(void** state)
+{
+    struct jitter_buffer* jb = new_buffer();
+    struct jitter_stats stats;
+    uint16_t samples[PERIOD / ALIGN];
+    uint16_t in = 1, out = 1;
+    uint8_t half = 0xFF;
+    int n, i;
+
+    (void) state;
+    /* Below the target, and with the first byte of a sample which will not come */
+    write_ms(jb, TARGET - 5, &in);
+    jitter_buffer_write(jb, &half, 1);
+    assert_int_equal(read_period(jb, &out), -1);
+
+    while ((n = jitter_buffer_drain(jb, (uint8_t*) samples, PERIOD)) > 0)
+    {
+        assert_true(n == PERIOD || out + n / ALIGN == in);
+        for (i = 0; i < n / ALIGN; i++)
+            assert_int_equal(samples[i], out++);
+    }
+    assert_int_equal(out, in);
+
+    jitter_buffer_stats(jb, &stats);
+    assert_int_equal(stats.underruns, 0);
+    assert_int_equal(stats.concealed_bytes, 0);
+    assert_int_equal(stats.level_ms, 0);
+    jitter_buffer_free(jb);
+}
+
+void test_jitter_underrun(void** state)
+{
+    struct jitter_buffer* jb = new_buffer();
+    struct jitter_stats stats;
+    uint16_t in = 1, out = 1;
+
+    (void) state;
+    write_ms(jb, TARGET + 5, &in);
+    while (in - out >= 10)
+        read_period(jb, &out);
+
+    /* The 5 ms left are completed with silence, and the target grows */
+    assert_int_equal(read_period(jb, &out), 5);
+    assert_int_equal(read_period(jb, &out), 0);
+    jitter_buffer_stats(jb, &stats);
+    assert_int_equal(stats.underruns, 1);
+    assert_int_equal(stats.concealed_bytes, MS(15));
+    assert_int_equal(stats.target_ms, TARGET + JITTER_STEP_MS);
+
+    /* Late samples resume right after the silence */
+    write_ms(jb, 20, &in);
+    assert_int_equal(read_period(jb, &out), PERIOD / ALIGN);
+    jitter_buffer_stats(jb, &stats);
+    assert_int_equal(stats.underruns, 1);
+    jitter_buffer_free(jb);
+}
+
+void test_jitter_idle(void** state)
+{
+    struct jitter_buffer* jb = new_buffer();
+    struct jitter_stats stats;
+    uint16_t in = 1, out = 1;
+    int i;
+
+    (void) state;
+    write_ms(jb, TARGET, &in);
+    while (in - out >= 10)
+        read_period(jb, &out);
+
+    /* Silence is concealed for a while, then the buffer waits for the target again */
+    for (i = 0; i < JITTER_IDLE_MS / 10; i++)
+        assert_int_equal(read_period(jb, &out), 0);
+    assert_int_equal(read_period(jb, &out), -1);
+    jitter_buffer_stats(jb, &stats);
+    assert_int_equal(stats.underruns, 1);
+    assert_int_equal(stats.concealed_bytes, MS(JITTER_IDLE_MS));
+
+    write_ms(jb, 10, &in);
+    assert_int_equal(read_period(jb, &out), -1);
+    write_ms(jb, stats.target_ms, &in);
+    assert_int_equal(read_period(jb, &out), PERIOD / ALIGN);
+    jitter_buffer_free(jb);
+}
+
+void test_jitter_overrun(void** state)
+{
+    struct jitter_buffer* jb = new_buffer();
+    struct jitter_stats stats;
+    uint16_t in = 1, out;
+    int i;
+
+    (void) state;
+    for (i = 0; i < 3; i++)
+        write_ms(jb, 100, &in);
+
+    /* Above the max, the oldest samples are dropped down to the target */
+    jitter_buffer_stats(jb, &stats);
+    assert_int_equal(stats.overruns, 1);
+    assert_int_equal(stats.trimmed_bytes, MS(300 - TARGET));
+    assert_int_equal(stats.level_ms, TARGET);
+
+    out = in - TARGET;
+    while (in - out >= 10)
+        assert_int_equal(read_period(jb, &out), PERIOD / ALIGN);
+    jitter_buffer_free(jb);
+}
+
+void test_jitter_adaptive(void** state)
+{
+    struct jitter_buffer* jb = new_buffer();
+    struct jitter_stats stats;
+    uint16_t in = 1, out = 1;
+    int i;
+
+    (void) state;
+    /* Every underrun grows the target, up to half the max latency */
+    for (i = 0; i < 20; i++)
+    {
+        jitter_buffer_stats(jb, &stats);
+        write_ms(jb, stats.target_ms, &in);
+        while (in - out >= 10)
+            read_period(jb, &out);
+        assert_true(read_period(jb, &out) < PERIOD / ALIGN);
+    }
+    jitter_buffer_stats(jb, &stats);
+    assert_int_equal(stats.underruns, 20);
+    assert_int_equal(stats.target_ms, MAX / 2);
+
+    /* A stable stream shrinks it back to the configured target */
+    for (i = 0; i < 8 * JITTER_DECAY_MS / 10; i++)
+    {
+        write_ms(jb, 10, &in);
+        assert_int_equal(read_period(jb, &out), PERIOD / ALIGN);
+    }
+    jitter_buffer_stats(jb, &stats);
+    assert_int_equal(stats.underruns, 20);
+    assert_int_equal(stats.target_ms, TARGET);
+    jitter_buffer_free(jb);
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+    init_logger();
+
+    UnitTest tests[] = {
+        unit_test(test_jitter_prebuffer),
+        unit_test(test_jitter_split_samples),
+        unit_test(test_jitter_drain),
+        unit_test(test_jitter_underrun),
+        unit_test(test_jitter_idle),
+        unit_test(test_jitter_overrun),
+        unit_test(test_jitter_adaptive),
+    };
+
+    return run_tests(tests);
+}
@@ -0,0 +1,128 @@
+/**
+ * \file testPcmConvert.c
+ * \brief Exactness of the S16 to float conversion kernels, on every sample value
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <google/cmockery.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pcm_convert.h"
+#include "logger.h"
+
+#define LOG_TAG "testPcmConvert"
+
+/** Every S16 value, and a guard after the converted ones */
+#define VALUES 65536
+#define GUARD 4
+
+static int16_t s_samples[VALUES];
+
+static void fill_samples(void)
+{
+    int i;
+
+    /* Scrambled, so that both channels get every kind of value */
+    for (i = 0; i < VALUES; i++)
+        s_samples[i] = (int16_t) (i * 40503);
+}
+
+static void check_flt(int count)
+{
+    float* dst = malloc((count + GUARD) * sizeof(float));
+    int i;
+
+    for (i = 0; i < count + GUARD; i++)
+        dst[i] = -2.0f;
+    pcm_s16_to_flt(s_samples, dst, count);
+    for (i = 0; i < count; i++)
+        assert_true(dst[i] == s_samples[i] / 32768.0f);
+    for (; i < count + GUARD; i++)
+        assert_true(dst[i] == -2.0f);
+    free(dst);
+}
+
+static void check_fltp(int count)
+{
+    float* left = malloc((count + GUARD) * sizeof(float));
+    float* right = malloc((count + GUARD) * sizeof(float));
+    int i;
+
+    for (i = 0; i < count + GUARD; i++)
+        left[i] = right[i] = -2.0f;
+    pcm_s16_to_fltp_stereo(s_samples, left, right, count);
+    for (i = 0; i < count; i++)
+    {
+        assert_true(left[i] == s_samples[2 * i] / 32768.0f);
+        assert_true(right[i] == s_samples[2 * i + 1] / 32768.0f);
+    }
+    for (; i < count + GUARD; i++)
+        assert_true(left[i] == -2.0f && right[i] == -2.0f);
+    free(left);
+    free(right);
+}
+
+static void check_all_kernels(void (*check)(int count), int max_count)
+{
+    int impl;
+    int count;
+
+    for (impl = PCM_IMPL_SCALAR; impl <= PCM_IMPL_SSE2; impl++)
+    {
+        if (pcm_convert_set_impl(impl) < 0)
+        {
+            LOGI("%s kernel not supported, skipped", pcm_convert_impl_name(impl));
+            continue;
+        }
+
+        /* Every remainder left to the scalar kernel, and the whole range */
+        for (count = 0; count < 20; count++)
+            check(count);
+        check(max_count);
+    }
+}
+
+void test_pcm_flt(void** state)
+{
+    (void) state;
+    check_all_kernels(check_flt, VALUES);
+}
+
+void test_pcm_fltp(void** state)
+{
+    (void) state;
+    check_all_kernels(check_fltp, VALUES / 2);
+}
+
+void test_pcm_extremes(void** state)
+{
+    int16_t src[8] = {-32768, 32767, 0, -1, 1, -32767, 16384, -16384};
+    float dst[8];
+
+    (void) state;
+    pcm_s16_to_flt(src, dst, 8);
+    assert_true(dst[0] == -1.0f);
+    assert_true(dst[1] < 1.0f && dst[1] > 0.9999f);
+    assert_true(dst[2] == 0.0f);
+    assert_true(dst[6] == 0.5f && dst[7] == -0.5f);
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+    init_logger();
+    fill_samples();
+
+    UnitTest tests[] = {
+        unit_test(test_pcm_flt),
+        unit_test(test_pcm_fltp),
+        unit_test(test_pcm_extremes),
+    };
+
+    return run_tests(tests);
+}
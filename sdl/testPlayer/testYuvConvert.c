@@ -0,0 +1,254 @@
+/**
+ * \file testYuvConvert.c
+ * \brief Bit-exactness of the BGRX to I420 kernels against the RGB2Y/U/V macros, and downscaling
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <google/cmockery.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "logger.h"
+#include "yuv_convert.h"
+
+#define LOG_TAG "testYuvConvert"
+
+/** Extra bytes at the end of each row, to catch stride mistakes */
+#define PADDING 12
+
+struct image
+{
+    int width;
+    int height;
+    int stride;
+    uint8_t* bgrx;
+    uint8_t* planes[3];
+    int strides[3];
+};
+
+static void image_alloc(struct image* img, int width, int height)
+{
+    int i;
+
+    img->width = width;
+    img->height = height;
+    img->stride = 4 * width + PADDING;
+    img->bgrx = malloc(img->stride * height);
+    img->strides[0] = width + PADDING;
+    img->strides[1] = img->strides[2] = (width + 1) / 2 + PADDING;
+    img->planes[0] = malloc(img->strides[0] * height);
+    img->planes[1] = malloc(img->strides[1] * ((height + 1) / 2));
+    img->planes[2] = malloc(img->strides[2] * ((height + 1) / 2));
+    assert_true(img->bgrx && img->planes[0] && img->planes[1] && img->planes[2]);
+    for (i = 0; i < 3; i++)
+        memset(img->planes[i], 0xAA, img->strides[i] * (i ? (height + 1) / 2 : height));
+}
+
+static void image_free(struct image* img)
+{
+    free(img->bgrx);
+    free(img->planes[0]);
+    free(img->planes[1]);
+    free(img->planes[2]);
+}
+
+static const uint8_t* pixel(const struct image* img, int x, int y)
+{
+    // The last column and row complete the blocks of odd sizes
+    if (x >= img->width)
+        x = img->width - 1;
+    if (y >= img->height)
+        y = img->height - 1;
+    return img->bgrx + y * img->stride + 4 * x;
+}
+
+/** Compare the planes of an image with the macros, pixel by pixel */
+static void check_reference(const struct image* img)
+{
+    int x, y, i;
+
+    for (y = 0; y < img->height; y++)
+    {
+        for (x = 0; x < img->width; x++)
+        {
+            const uint8_t* p = pixel(img, x, y);
+            assert_int_equal(img->planes[0][y * img->strides[0] + x], RGB2Y(p[2], p[1], p[0]));
+        }
+    }
+
+    for (y = 0; y < img->height; y += 2)
+    {
+        for (x = 0; x < img->width; x += 2)
+        {
+            const uint8_t* block[4] = {pixel(img, x, y), pixel(img, x + 1, y),
+                                       pixel(img, x, y + 1), pixel(img, x + 1, y + 1)};
+            int sum[3] = {2, 2, 2};
+            int b, g, r;
+
+            for (i = 0; i < 4; i++)
+            {
+                sum[0] += block[i][0];
+                sum[1] += block[i][1];
+                sum[2] += block[i][2];
+            }
+            b = sum[0] >> 2;
+            g = sum[1] >> 2;
+            r = sum[2] >> 2;
+
+            assert_int_equal(img->planes[1][(y / 2) * img->strides[1] + x / 2], RGB2U(r, g, b));
+            assert_int_equal(img->planes[2][(y / 2) * img->strides[2] + x / 2], RGB2V(r, g, b));
+        }
+    }
+}
+
+/** Check that the bytes after each row were not touched */
+static void check_padding(const struct image* img)
+{
+    int y, i;
+
+    for (i = 0; i < 3; i++)
+    {
+        int width = i ? (img->width + 1) / 2 : img->width;
+        int height = i ? (img->height + 1) / 2 : img->height;
+        for (y = 0; y < height; y++)
+            assert_int_equal(img->planes[i][y * img->strides[i] + width], 0xAA);
+    }
+}
+
+static void fill_random(struct image* img, unsigned int seed)
+{
+    int i;
+
+    srand(seed);
+    for (i = 0; i < img->stride * img->height; i++)
+        img->bgrx[i] = rand() & 0xFF;
+}
+
+static void fill_value(struct image* img, uint8_t value)
+{
+    memset(img->bgrx, value, img->stride * img->height);
+}
+
+static void check_all_kernels(int width, int height, void (*fill)(struct image*, unsigned int))
+{
+    int impl;
+
+    for (impl = YUV_IMPL_SCALAR; impl <= YUV_IMPL_AVX2; impl++)
+    {
+        struct image img;
+
+        if (yuv_convert_set_impl(impl) < 0)
+        {
+            LOGI("%s kernel not supported, skipped", yuv_convert_impl_name(impl));
+            continue;
+        }
+
+        image_alloc(&img, width, height);
+        fill(&img, width * 31 + height);
+        bgrx_to_i420(img.bgrx, img.stride, img.planes, img.strides, width, height);
+        check_reference(&img);
+        check_padding(&img);
+        image_free(&img);
+    }
+}
+
+static void fill_black(struct image* img, unsigned int seed)
+{
+    (void) seed;
+    fill_value(img, 0);
+}
+
+static void fill_white(struct image* img, unsigned int seed)
+{
+    (void) seed;
+    fill_value(img, 0xFF);
+}
+
+void test_yuv_random(void** state)
+{
+    (void) state;
+    check_all_kernels(64, 32, fill_random);
+    check_all_kernels(720, 1280, fill_random);
+}
+
+void test_yuv_odd_sizes(void** state)
+{
+    (void) state;
+    check_all_kernels(1, 1, fill_random);
+    check_all_kernels(3, 5, fill_random);
+    check_all_kernels(17, 9, fill_random);
+    check_all_kernels(33, 2, fill_random);
+    check_all_kernels(47, 31, fill_random);
+}
+
+void test_yuv_extremes(void** state)
+{
+    (void) state;
+    check_all_kernels(48, 4, fill_black);
+    check_all_kernels(48, 4, fill_white);
+}
+
+/** Each pixel of a shrunk plane is the rounded average of its block */
+static void check_downscale(int width, int height, int shift)
+{
+    int src_stride = width + PADDING;
+    int dst_width = width >> shift;
+    int dst_height = height >> shift;
+    int dst_stride = dst_width + PADDING;
+    int n = 1 << shift;
+    uint8_t* src = malloc(src_stride * height);
+    uint8_t* dst = malloc(dst_stride * dst_height);
+    int x, y, i, j;
+
+    srand(width * 7 + shift);
+    for (i = 0; i < src_stride * height; i++)
+        src[i] = rand() & 0xFF;
+    memset(dst, 0xAA, dst_stride * dst_height);
+
+    yuv_downscale_plane(src, src_stride, dst, dst_stride, dst_width, dst_height, shift);
+
+    for (y = 0; y < dst_height; y++)
+    {
+        for (x = 0; x < dst_width; x++)
+        {
+            int sum = 0;
+            for (j = 0; j < n; j++)
+                for (i = 0; i < n; i++)
+                    sum += src[(y * n + j) * src_stride + x * n + i];
+            assert_int_equal(dst[y * dst_stride + x], (sum + n * n / 2) / (n * n));
+        }
+        assert_int_equal(dst[y * dst_stride + dst_width], 0xAA);
+    }
+
+    free(src);
+    free(dst);
+}
+
+void test_yuv_downscale(void** state)
+{
+    (void) state;
+    check_downscale(64, 32, 1);
+    check_downscale(1280, 720, 1);
+    check_downscale(1280, 720, 2);
+    check_downscale(37, 19, 1);
+    check_downscale(37, 19, 3);
+}
+
+int main(int argc, char* argv[])
+{
+    (void) argc;
+    (void) argv;
+    init_logger();
+
+    UnitTest tests[] = {
+        unit_test(test_yuv_random),
+        unit_test(test_yuv_odd_sizes),
+        unit_test(test_yuv_extremes),
+        unit_test(test_yuv_downscale),
+    };
+
+    return run_tests(tests);
+}